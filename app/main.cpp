@@ -1,24 +1,71 @@
 
 #include "OS.h"
+#include "AllocationTracker.h"
 #include "ClimateMeasurement.h"
 #include "Config.h"
 #include "Dht.h"
+#include "EventLoop.h"
 #include "Mqtt.h"
 #include "Homie.h"
+#include "FileSender.h"
+#include "Gateway.h"
+#include "LatencyRecorder.h"
+#include "LineProtocolSender.h"
+#include "ResourceMonitor.h"
+#include "SenderPipeline.h"
+#include "Shutdown.h"
+#include "Trace.h"
+#include <algorithm>
 #include <cstdio>
 #include <csignal>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <sys/epoll.h>
 
 volatile bool keepGoing = true;
-int signalCount = 0;
 
-void signalHandler(sig_atomic_t s) {
-   printf("Caught signal %d\n",s);
-   signalCount++;
-   keepGoing = false;
-   if (signalCount > 10) {
-      printf("Too many signals, exiting\n");
-      exit(1);
+// Sample whenever the timer fires; the MQTT socket and shutdown requests are handled by the same thread in between.
+void runEventLoop(EventLoop& loop, queuing::Mqtt& mqtt, Dht& dht, ClimateMeasurement& climateMeasurement) {
+   mqtt.attach(&loop);
+   int sampleTimer = -1;
+   sampleTimer = loop.createTimer([&](uint32_t) {
+      if (const auto waitTime = dht.microsUntilNextRead(); waitTime > 0) {
+         loop.setTimer(sampleTimer, static_cast<uint64_t>(waitTime));
+         return;
+      }
+      keepGoing &= mqtt.verifyConnection();
+      if (!keepGoing) return;
+      const auto sample = dht.readSample();
+      climateMeasurement.processSample(sample, dht.sampleSeconds());
+      loop.setTimer(sampleTimer, static_cast<uint64_t>(std::max(dht.microsUntilNextRead(), 1)));
+   });
+   if (sampleTimer < 0) return;
+   // an interval set via the control node takes effect right away, not after the pending wait
+   loop.beforeWait([&] { if (dht.hasIntervalChanged()) loop.setTimer(sampleTimer, 0); });
+   loop.setTimer(sampleTimer, 0);
+   loop.run(keepGoing);
+}
+
+// gateway=1: no sensor, but rollups of the sibling devices per zone (zone.<name>=<device>,...) every gatewaySeconds
+int runGateway(queuing::Mqtt& mqtt, const Config& config) {
+   Gateway gateway(&mqtt, &config);
+   if (!gateway.begin()) return -1;
+   printf("Gateway (and MQTT) started\n");
+   if (!mqtt.waitForConnection()) return(keepGoing ? -3 : -4);
+   if (!gateway.sendMetadata()) return -5;
+   printf("Starting gateway loop\n");
+   while (Shutdown::sleepMicros(gateway.intervalMicros()) && keepGoing) {
+      if (mqtt.verifyConnection()) gateway.publish();
    }
+   Shutdown::request("gateway loop ended");
+   Shutdown::phase("state");
+   gateway.end();
+   Shutdown::phase("disconnect");
+   mqtt.end();
+   Shutdown::finish();
+   printf("Ingested %llu values\n", static_cast<unsigned long long>(gateway.ingested()));
+   return 0;
 }
 
 int mainHelper(const char* configFile = "/home/pi/.config/dht.conf") {
@@ -27,43 +74,170 @@ int mainHelper(const char* configFile = "/home/pi/.config/dht.conf") {
    printf("Config defined, hostname=%s\n", os.getHostName().c_str());
    config.begin(configFile, os.getHostName().c_str());
    printf("Config began, device=%s\n", config.getEntry("device", "unknown").c_str());
+   // SIGINT and SIGTERM go to the shutdown watcher; they must be blocked before any other thread starts.
+   // From the first one, the shutdown sequence has shutdownMillis to complete before the process is ended.
+   if (!Shutdown::begin(&config, &keepGoing)) return -6;
+   // eventLoop=1: a single thread handles sampling, the MQTT socket and shutdown requests (no network thread).
+   bool useEventLoop = false;
+   config.setIfExists("eventLoop", &useEventLoop);
+   EventLoop loop;
+   if (useEventLoop && !(loop.begin() && loop.watch(Shutdown::fd(), EPOLLIN, [](uint32_t) { keepGoing = false; }))) return -6;
+   // with DHT_TRACING, SIGUSR1 or creating the traceTrigger file writes the trace to traceFile
+   Trace::begin(&config);
    SensorData sensorData;
    printf("SensorData defined\n");
    queuing::Mqtt mqtt(&config, &keepGoing);
    printf("MQTT defined\n");
+   mqtt.setLatencyObserver([](const int64_t latencyMicros) { LatencyRecorder::record(LatencyStage::Ack, latencyMicros); });
+   bool useGateway = false;
+   config.setIfExists("gateway", &useGateway);
+   if (useGateway) {
+      // the gateway has no loop to drive the socket, so it needs the network thread
+      if (useEventLoop) {
+         printf("gateway=1 needs eventLoop=0\n");
+         return -7;
+      }
+      return runGateway(mqtt, config);
+   }
    Homie homie(&mqtt, &config);
    Dht dht(&sensorData, &config);
    printf("Dht declared\n");
    printf("Declared objects\n");
-   if (!homie.begin()) return -1;
-   printf("Homie (and MQTT) started\n");
+   // homie=0 leaves out MQTT, e.g. when lineProtocol sends straight to the database
+   bool useHomie = true;
+   config.setIfExists("homie", &useHomie);
+   if (useHomie) {
+      if (!homie.begin()) return -1;
+      printf("Homie (and MQTT) started\n");
+   }
    // only fails if gpioInitialise fails
    if (!dht.begin()) return -2;
-   // now gpioInitialise has succeeded. We need to ensure to shutdown before exiting
-   // This happens in the destructor of dht (hence the signal handler for break and terminate).
-   printf("Waiting to connect\n");
-   if (!mqtt.waitForConnection()) return(keepGoing ? -3 : -4);
-   printf("Connected to MQTT\n");
-   if (!homie.sendMetadata()) return -5;
-   printf("Sent metadata\n"); 
-   ClimateMeasurement climateMeasurement(&homie);
-   printf("Starting Main loop\n");
-   while (keepGoing) {
-      // ensure we don't reset the flag if break was pressed
-      keepGoing &= mqtt.verifyConnection() && dht.waitForNextMeasurement(keepGoing);
-      if (!keepGoing) break;
-      auto temperature = dht.readTemperature();
-      auto humidity = dht.readHumidity();
-      climateMeasurement.processSample(temperature, humidity);
-   }      
-   printf("Shutting down\n");
+   // now gpioInitialise has succeeded. We need to ensure to shutdown before exiting.
+   // This happens in the shutdown sequence below, or, if that misses its deadline, in the deadline hook.
+   // On the early returns, the Dht destructor does it; the hook goes out of scope before dht does.
+   const DeadlineHook sensorHook([&dht] { dht.shutdown(); });
+   if (useHomie) {
+      printf("Waiting to connect\n");
+      if (!mqtt.waitForConnection()) return(keepGoing ? -3 : -4);
+      printf("Connected to MQTT\n");
+   }
+   // With the pipeline, the sender thread does all I/O (including reconnects) so sampling keeps its pace.
+   // It is switched on by pipeline=1, or by having a sink other than homie.
+   bool usePipeline = false;
+   config.setIfExists("pipeline", &usePipeline);
+   FileSender fileSender(&config);
+   const bool useFileSink = fileSender.begin();
+   LineProtocolSender lineProtocolSender(&config);
+   const bool useLineProtocol = lineProtocolSender.begin();
+   usePipeline |= useFileSink || useLineProtocol;
+   if (!useHomie && !usePipeline) {
+      printf("No sinks: homie=0 needs fileSink or lineProtocol\n");
+      return -7;
+   }
+   // the sender thread would publish and reconnect while the loop drives the same socket
+   if (useEventLoop && usePipeline) {
+      printf("eventLoop=1 needs pipeline=0, without fileSink or lineProtocol\n");
+      return -7;
+   }
+   SenderPipeline pipeline(&config);
+   ISender* sender = &homie;
+   if (usePipeline) {
+      if (useHomie) pipeline.addSink("homie", &homie);
+      if (useFileSink) pipeline.addSink("file", &fileSender);
+      if (useLineProtocol) pipeline.addSink("lineProtocol", &lineProtocolSender);
+      pipeline.begin();
+      sender = &pipeline;
+      printf("Started sender pipeline with %zu sink(s)\n", pipeline.sinkCount());
+   }
+   ClimateMeasurement climateMeasurement(sender);
+   // windowSeconds=N aggregates over clock-aligned windows (shifted per device with phaseSpread=1)
+   if (!climateMeasurement.alignWindows(dht.phaseSchedule(), dht.intervalSeconds(), dht.isDutyCycling() ? dht.burstSamples() : 1)) {
+      printf("windowSeconds holds more than %d reads; counting samples instead\n", ClimateMeasurement::MAX_SAMPLES_PER_MEASUREMENT);
+   }
+   // dutyCycle=1: each burst of reads makes one measurement
+   if (dht.isDutyCycling() && !climateMeasurement.setSamplesPerMeasurement(dht.burstSamples())) {
+      printf("burstSamples=%d is too few to discard outliers; measurements span several bursts\n", dht.burstSamples());
+   }
+   // summaryHorizons=3600,86400: hourly and daily percentile sketches of all samples
+   int summaryAccuracy = QuantileSketch::DEFAULT_K;
+   config.setIfExists("summaryAccuracy", &summaryAccuracy);
+   std::stringstream horizons(config.getEntry("summaryHorizons"));
+   for (std::string horizon; std::getline(horizons, horizon, ',');) {
+      if (!climateMeasurement.addSummaryHorizon(atoi(horizon.c_str()), summaryAccuracy)) {
+         printf("Ignoring summary horizon '%s'\n", horizon.c_str());
+      }
+   }
+
+   // CPU time, wakeups and memory per thread, to homie/<device>/$resources (or stdout) every resourceSeconds,
+   // and on request via the resources control property. The report goes out with the next measurement, from the
+   // thread that publishes those, so the monitor's thread never reconnects or touches the socket.
+   ResourceMonitor resourceMonitor(&config);
+   if (useHomie) {
+      resourceMonitor.setPublisher([&mqtt, topic = homie.deviceTopic("$resources")](const std::string& json) {
+         mqtt.post(topic, json, queuing::MessageClass::State);
+      });
+   }
+   resourceMonitor.begin();
+
+   // settable via homie/<device>/control/<property>/set if control=1
+   homie.addSettableProperty({"interval", "integer", "s", 
+      std::to_string(Dht::MIN_INTERVAL_SECONDS) + ":" + std::to_string(Dht::MAX_INTERVAL_SECONDS),
+      [&dht] { return std::to_string(dht.intervalSeconds()); },
+      [&dht](const std::string& value) { return dht.setIntervalSeconds(std::stoi(value)); }});
+   homie.addSettableProperty({"samples", "integer", "", 
+      std::to_string(ClimateMeasurement::MIN_SAMPLES_PER_MEASUREMENT) + ":" + std::to_string(ClimateMeasurement::MAX_SAMPLES_PER_MEASUREMENT),
+      [&climateMeasurement] { return std::to_string(climateMeasurement.samplesPerMeasurement()); },
+      [&climateMeasurement](const std::string& value) { return climateMeasurement.setSamplesPerMeasurement(std::stoi(value)); }});
+   homie.addSettableProperty({"trace", "boolean", "", "",
+      [&dht] { return std::string(dht.isTracing() ? "true" : "false"); },
+      [&dht](const std::string& value) { dht.trace(value == "true"); return true; }});
+   homie.addSettableProperty({"resources", "boolean", "", "",
+      [] { return std::string("false"); },
+      [&resourceMonitor](const std::string& value) { if (value == "true") resourceMonitor.request(); return true; }});
+   if (useHomie) {
+      if (!homie.sendMetadata()) return -5;
+      printf("Sent metadata\n"); 
+   }
+
+   // trackAllocations=1 counts heap allocations per subsystem (if built with DHT_TRACK_ALLOCATIONS)
+   bool trackAllocations = false;
+   config.setIfExists("trackAllocations", &trackAllocations);
+   AllocationTracker::enable(trackAllocations);
+   if (useEventLoop) {
+      printf("Starting event loop\n");
+      runEventLoop(loop, mqtt, dht, climateMeasurement);
+   } else {
+      printf("Starting Main loop\n");
+      while (keepGoing) {
+         // ensure we don't reset the flag if break was pressed
+         keepGoing &= (usePipeline || mqtt.verifyConnection()) && dht.waitForNextMeasurement(keepGoing);
+         if (!keepGoing) break;
+         const auto sample = dht.readSample();
+         climateMeasurement.processSample(sample, dht.sampleSeconds());
+      }
+   }
+   Shutdown::request("main loop ended");
+   Shutdown::phase("flush");
+   resourceMonitor.end();
+   pipeline.end();
+   lineProtocolSender.flush();
+   Shutdown::phase("state");
+   homie.end();
+   Shutdown::phase("disconnect");
+   mqtt.end();
+   Shutdown::phase("sensor");
+   dht.shutdown();
+   Shutdown::finish();
+   if (trackAllocations) AllocationTracker::report();
+   LatencyRecorder::report();
+   resourceMonitor.report();
+   Trace::end();
    return 0;
 }
 
 int main(int argc, char** argv) {
-   (void)signal(SIGINT,signalHandler);
-   (void)signal(SIGTERM,signalHandler);
-   (void)signal(SIGSEGV, signalHandler);
+   // a file sink writing to a pipe without reader must fail, not kill us
+   (void)signal(SIGPIPE, SIG_IGN);
    if (argc > 1) return mainHelper(argv[1]);
    return mainHelper();
 }
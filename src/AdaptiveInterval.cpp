@@ -0,0 +1,55 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "AdaptiveInterval.h"
+#include <cmath>
+
+AdaptiveInterval::AdaptiveInterval(const Config* config) : _config(config) {}
+
+void AdaptiveInterval::begin() {
+    _config->setIfExists("adaptive", &_enabled);
+    int maxSeconds = 0;
+    _config->setIfExists("adaptiveMaxSeconds", &maxSeconds);
+    if (maxSeconds > 0) _maxMicros = static_cast<uint32_t>(maxSeconds) * 1000000U;
+    _temperatureDelta = std::stof(_config->getEntry("adaptiveTemperatureDelta", "0.2"));
+    _humidityDelta = std::stof(_config->getEntry("adaptiveHumidityDelta", "1.0"));
+    reset();
+}
+
+/// @brief Determine the interval until the next read, given the result of this one
+/// @param baseMicros the normal (and minimum) interval
+/// @return baseMicros if not enabled, or if the value changed; else a stretched interval
+uint32_t AdaptiveInterval::next(const bool success, const float temperature, const float humidity, const uint32_t baseMicros) {
+    if (!_enabled) return baseMicros;
+    if (!success || std::isnan(temperature) || std::isnan(humidity)) {
+        reset();
+        return baseMicros;
+    }
+    // compare against the reference rather than the previous sample, so a slow drift doesn't go unnoticed
+    if (!_hasReference || std::fabs(temperature - _referenceTemperature) > _temperatureDelta || 
+        std::fabs(humidity - _referenceHumidity) > _humidityDelta) {
+        _referenceTemperature = temperature;
+        _referenceHumidity = humidity;
+        _hasReference = true;
+        _currentMicros = baseMicros;
+        return baseMicros;
+    }
+    if (_currentMicros < baseMicros) _currentMicros = baseMicros;
+    const auto stretched = static_cast<uint64_t>(_currentMicros) * 3 / 2;
+    const auto maximum = _maxMicros > baseMicros ? _maxMicros : baseMicros;
+    _currentMicros = stretched > maximum ? maximum : static_cast<uint32_t>(stretched);
+    return _currentMicros;
+}
+
+void AdaptiveInterval::reset() {
+    _currentMicros = 0;
+    _hasReference = false;
+}
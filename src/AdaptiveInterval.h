@@ -0,0 +1,40 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef ADAPTIVE_INTERVAL_H
+#define ADAPTIVE_INTERVAL_H
+
+#include <cstdint>
+#include "Config.h"
+
+/// @brief Decides the time until the next sensor read. While samples stay within a band around a reference value,
+/// the interval grows by half each read up to a maximum; any change beyond the band, or a failed read, snaps it back.
+class AdaptiveInterval {
+public:
+    explicit AdaptiveInterval(const Config* config);
+    void begin();
+    bool isEnabled() const { return _enabled; }
+    uint32_t next(bool success, float temperature, float humidity, uint32_t baseMicros);
+    void reset();
+
+private:
+    const Config* _config;
+    bool _enabled = false;
+    uint32_t _maxMicros = 30 * 1000000U;
+    float _temperatureDelta = 0.2f;
+    float _humidityDelta = 1.0f;
+    uint32_t _currentMicros = 0;
+    float _referenceTemperature = 0.0f;
+    float _referenceHumidity = 0.0f;
+    bool _hasReference = false;
+};
+
+#endif
@@ -0,0 +1,108 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "AddressCache.h"
+#include "ResourceMonitor.h"
+
+AddressCache::AddressCache(const int refreshSeconds) : _refreshSeconds(refreshSeconds) {}
+
+AddressCache::~AddressCache() {
+    end();
+}
+
+void AddressCache::begin() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_running) return;
+    _running = true;
+    _thread = std::thread(&AddressCache::refresh, this);
+}
+
+void AddressCache::end() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_running) return;
+        _running = false;
+    }
+    _wake.notify_one();
+    if (_thread.joinable()) _thread.join();
+}
+
+/// @brief Get the cached address of a host. Resolves (and from then on refreshes) hosts it did not see before.
+/// @return the numeric address, or an empty string if the host could not be resolved
+std::string AddressCache::lookup(const std::string& host) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (const auto iterator = _addresses.find(host); iterator != _addresses.end() && !iterator->second.empty()) {
+            return iterator->second;
+        }
+    }
+    auto address = resolve(host);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _addresses[host] = address;
+    return address;
+}
+
+/// @brief Resolve a host name to its first (numeric) address. Numeric hosts resolve to themselves.
+std::string AddressCache::resolve(const std::string& host) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0 || result == nullptr) return "";
+    char buffer[INET6_ADDRSTRLEN] = {0};
+    const void* address;
+    if (result->ai_family == AF_INET6) {
+        address = &reinterpret_cast<sockaddr_in6*>(result->ai_addr)->sin6_addr;
+    } else {
+        address = &reinterpret_cast<sockaddr_in*>(result->ai_addr)->sin_addr;
+    }
+    const bool converted = inet_ntop(result->ai_family, address, buffer, sizeof(buffer)) != nullptr;
+    freeaddrinfo(result);
+    return converted ? buffer : "";
+}
+
+void AddressCache::refresh() {
+    ResourceMonitor::nameThread("dns-refresh");
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_running) {
+        _wake.wait_for(lock, std::chrono::seconds(_refreshSeconds), [this] { return !_running; });
+        if (!_running) break;
+        std::vector<std::string> hosts;
+        for (const auto& entry : _addresses) hosts.push_back(entry.first);
+        // don't block lookups while resolving
+        lock.unlock();
+        for (const auto& host : hosts) {
+            // keep the old address if resolution fails now; the name server may be the thing that's down
+            if (auto address = resolve(host); !address.empty()) {
+                std::lock_guard<std::mutex> guard(_mutex);
+                if (_addresses[host] != address) {
+                    std::cout << "Address of " << host << " changed to " << address << std::endl;
+                    _addresses[host] = address;
+                }
+            }
+        }
+        lock.lock();
+    }
+}
@@ -0,0 +1,49 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef ADDRESS_CACHE_H
+#define ADDRESS_CACHE_H
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+/// @brief Keeps resolved addresses of host names, refreshed by a background thread, so (re)connecting
+/// doesn't have to wait for name resolution.
+class AddressCache {
+public:
+    explicit AddressCache(int refreshSeconds = DEFAULT_REFRESH_SECONDS);
+    ~AddressCache();
+    AddressCache(const AddressCache&) = delete;
+    AddressCache(AddressCache&&) = delete;
+    AddressCache& operator=(const AddressCache&) = delete;
+    AddressCache& operator=(AddressCache&&) = delete;
+    void begin();
+    void end();
+    std::string lookup(const std::string& host);
+    static std::string resolve(const std::string& host);
+    void setRefreshSeconds(const int refreshSeconds) { _refreshSeconds = refreshSeconds; }
+
+private:
+    static constexpr int DEFAULT_REFRESH_SECONDS = 300;
+    int _refreshSeconds;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::unordered_map<std::string, std::string> _addresses;
+    std::thread _thread;
+    bool _running = false;
+
+    void refresh();
+};
+
+#endif
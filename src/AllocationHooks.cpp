@@ -0,0 +1,41 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+// Replaces the global operator new/delete, so AllocationTracker can count. Not part of the library: 
+// the test executable always links it in, the application only if built with DHT_TRACK_ALLOCATIONS.
+
+#include <cstdlib>
+#include <new>
+#include "AllocationTracker.h"
+
+namespace {
+    struct Installer {
+        Installer() { AllocationTracker::markInstalled(); }
+    } installer;
+}
+
+// The other forms (array, nothrow, sized delete) forward to these in the standard library
+
+void* operator new(const size_t size) {
+    AllocationTracker::record(size);
+    if (void* pointer = std::malloc(size == 0 ? 1 : size)) return pointer;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept {
+    if (pointer == nullptr) return;
+    AllocationTracker::recordRelease();
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    operator delete(pointer);
+}
@@ -0,0 +1,101 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "AllocationTracker.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace {
+    constexpr int TAGS = static_cast<int>(AllocationTag::Count);
+    // plain arrays of atomics: no constructors that could allocate, and usable before main
+    std::atomic<bool> enabled{false};
+    std::atomic<uint64_t> allocationCount[TAGS];
+    std::atomic<uint64_t> allocatedBytes[TAGS];
+    std::atomic<uint64_t> releaseCount{0};
+    std::atomic<bool> installed{false};
+    thread_local AllocationTag currentTag = AllocationTag::Other;
+}
+
+/// @brief Whether the operator new/delete of AllocationHooks.cpp are linked in, so there is something to count
+bool AllocationTracker::isAvailable() { return installed.load(std::memory_order_relaxed); }
+
+bool AllocationTracker::isEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+void AllocationTracker::enable(const bool isOn) { enabled = isOn; }
+
+uint64_t AllocationTracker::allocations(const AllocationTag tag) {
+    return allocationCount[static_cast<int>(tag)].load(std::memory_order_relaxed);
+}
+
+uint64_t AllocationTracker::allocations() {
+    uint64_t total = 0;
+    for (const auto& count : allocationCount) total += count.load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t AllocationTracker::bytes(const AllocationTag tag) {
+    return allocatedBytes[static_cast<int>(tag)].load(std::memory_order_relaxed);
+}
+
+uint64_t AllocationTracker::deallocations() { return releaseCount.load(std::memory_order_relaxed); }
+
+const char* AllocationTracker::name(const AllocationTag tag) {
+    switch (tag) {
+        case AllocationTag::Sensor: return "sensor";
+        case AllocationTag::Aggregation: return "aggregation";
+        case AllocationTag::Publish: return "publish";
+        default: return "other";
+    }
+}
+
+void AllocationTracker::markInstalled() { installed = true; }
+
+void AllocationTracker::record(const size_t size) {
+    if (!enabled.load(std::memory_order_relaxed)) return;
+    const auto tag = static_cast<int>(currentTag);
+    allocationCount[tag].fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes[tag].fetch_add(size, std::memory_order_relaxed);
+}
+
+void AllocationTracker::recordRelease() {
+    if (enabled.load(std::memory_order_relaxed)) releaseCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void AllocationTracker::report() {
+    if (!isAvailable()) {
+        printf("Allocation tracking not built in (DHT_TRACK_ALLOCATIONS)\n");
+        return;
+    }
+    for (int tag = 0; tag < TAGS; tag++) {
+        const auto allocationTag = static_cast<AllocationTag>(tag);
+        printf("Allocations %s: %llu (%llu bytes)\n", name(allocationTag),
+               static_cast<unsigned long long>(allocations(allocationTag)), static_cast<unsigned long long>(bytes(allocationTag)));
+    }
+    printf("Deallocations: %llu\n", static_cast<unsigned long long>(deallocations()));
+}
+
+void AllocationTracker::reset() {
+    for (int tag = 0; tag < TAGS; tag++) {
+        allocationCount[tag] = 0;
+        allocatedBytes[tag] = 0;
+    }
+    releaseCount = 0;
+}
+
+AllocationScope::AllocationScope(const AllocationTag tag) : _previous(currentTag) {
+    currentTag = tag;
+}
+
+AllocationScope::~AllocationScope() {
+    currentTag = _previous;
+}
@@ -0,0 +1,54 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef ALLOCATION_TRACKER_H
+#define ALLOCATION_TRACKER_H
+
+#include <cstddef>
+#include <cstdint>
+
+/// @brief The subsystem that an allocation is attributed to
+enum class AllocationTag : uint8_t { Other, Sensor, Aggregation, Publish, Count };
+
+/// @brief Counts heap allocations (operator new) per subsystem.
+/// Only active if AllocationHooks.cpp (which replaces the global operator new/delete) is linked in, and enabled at runtime.
+class AllocationTracker {
+public:
+    static bool isAvailable();
+    static bool isEnabled();
+    static void enable(bool enabled);
+    static uint64_t allocations(AllocationTag tag);
+    static uint64_t allocations();
+    static uint64_t bytes(AllocationTag tag);
+    static uint64_t deallocations();
+    static void markInstalled();
+    static const char* name(AllocationTag tag);
+    static void record(size_t size);
+    static void recordRelease();
+    static void report();
+    static void reset();
+};
+
+/// @brief Attributes allocations on this thread to a subsystem while in scope. Costs a thread-local write.
+class AllocationScope {
+public:
+    explicit AllocationScope(AllocationTag tag);
+    ~AllocationScope();
+    AllocationScope(const AllocationScope&) = delete;
+    AllocationScope(AllocationScope&&) = delete;
+    AllocationScope& operator=(const AllocationScope&) = delete;
+    AllocationScope& operator=(AllocationScope&&) = delete;
+
+private:
+    AllocationTag _previous;
+};
+
+#endif
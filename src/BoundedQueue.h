@@ -0,0 +1,95 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/// @brief Fixed capacity lock-free queue (Vyukov's bounded MPMC design). Capacity is rounded up to a power of two.
+/// Any thread may push or pop, so a producer can make room by popping the oldest item itself.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size *= 2;
+        _mask = size - 1;
+        _cells = std::make_unique<Cell[]>(size);
+        for (size_t i = 0; i < size; i++) {
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    [[nodiscard]] size_t capacity() const { return _mask + 1; }
+
+    /// @brief Number of items in the queue. Only approximate while other threads are pushing or popping.
+    [[nodiscard]] size_t size() const {
+        const auto enqueued = _enqueuePosition.load(std::memory_order_relaxed);
+        const auto dequeued = _dequeuePosition.load(std::memory_order_relaxed);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+    bool tryPop(T& item) {
+        Cell* cell;
+        size_t position = _dequeuePosition.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &_cells[position & _mask];
+            const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position + 1);
+            if (difference == 0) {
+                if (_dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = _dequeuePosition.load(std::memory_order_relaxed);
+            }
+        }
+        item = cell->data;
+        cell->sequence.store(position + _mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPush(const T& item) {
+        Cell* cell;
+        size_t position = _enqueuePosition.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &_cells[position & _mask];
+            const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+            if (difference == 0) {
+                if (_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = _enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = item;
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence{0};
+        T data{};
+    };
+
+    std::unique_ptr<Cell[]> _cells;
+    size_t _mask = 0;
+    std::atomic<size_t> _enqueuePosition{0};
+    std::atomic<size_t> _dequeuePosition{0};
+};
+
+#endif
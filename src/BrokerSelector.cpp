@@ -0,0 +1,240 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "BrokerSelector.h"
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include "LatencyRecorder.h"
+#include "ResourceMonitor.h"
+
+BrokerSelector::BrokerSelector(const Config* config) : _config(config) {}
+
+BrokerSelector::~BrokerSelector() {
+    end();
+}
+
+/// @brief Read the brokers (or broker/port), brokerSelection, probeSeconds, probeTimeoutMillis and failbackSeconds,
+/// and start probing if there is more than one broker (and probeSeconds isn't 0).
+/// @return false if the brokers list can't be parsed
+bool BrokerSelector::begin() {
+    int port = 1883;
+    _config->setIfExists("port", &port);
+    std::vector<Broker> brokers;
+    if (const auto list = _config->getEntry("brokers"); !list.empty()) {
+        if (!parse(list, port, &brokers)) {
+            std::cerr << "Could not parse brokers '" << list << "'\n";
+            return false;
+        }
+    } else {
+        brokers.push_back({_config->getEntry("broker", "localhost"), port});
+    }
+    _selection = _config->getEntry("brokerSelection", "order") == "latency" ? Selection::Latency : Selection::Order;
+    _config->setIfExists("probeSeconds", &_probeSeconds);
+    _config->setIfExists("probeTimeoutMillis", &_probeTimeoutMillis);
+    int failbackSeconds = DEFAULT_FAILBACK_SECONDS;
+    _config->setIfExists("failbackSeconds", &failbackSeconds);
+    _failbackMicros = static_cast<int64_t>(failbackSeconds) * 1000000;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _brokers.clear();
+    for (auto& broker : brokers) _brokers.push_back({std::move(broker)});
+    _current = 0;
+    if (_brokers.size() < 2 || _probeSeconds <= 0 || _running) return true;
+    _running = true;
+    _thread = std::thread(&BrokerSelector::probeLoop, this);
+    return true;
+}
+
+/// @brief The broker to connect to
+Broker BrokerSelector::current() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _brokers.empty() ? Broker{} : _brokers[_current].broker;
+}
+
+void BrokerSelector::end() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_running) return;
+        _running = false;
+    }
+    _wake.notify_one();
+    if (_thread.joinable()) _thread.join();
+}
+
+/// @brief Switch to a better broker if it has been healthy for at least failbackSeconds.
+/// The hold-down starts at the first good probe, so a broker that was never probed isn't a candidate.
+/// @return whether the current broker changed (so the client should connect to it)
+bool BrokerSelector::failBack(const int64_t nowMicros) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    size_t best = _current;
+    for (size_t index = 0; index < _brokers.size(); index++) {
+        const auto& candidate = _brokers[index];
+        if (!candidate.isHealthy || candidate.healthySinceMicros < 0) continue;
+        if (nowMicros - candidate.healthySinceMicros < _failbackMicros) continue;
+        if (isBetter(index, best)) best = index;
+    }
+    if (best == _current) return false;
+    switchTo(best, "fail back");
+    return true;
+}
+
+/// @brief The current broker failed: mark it down, and switch to the best healthy other one.
+/// If none is healthy, take the next one in the list.
+/// @return whether the current broker changed
+bool BrokerSelector::failover() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_brokers.size() < 2) return false;
+    _brokers[_current].isHealthy = false;
+    size_t best = _brokers.size();
+    for (size_t index = 0; index < _brokers.size(); index++) {
+        if (index == _current || !_brokers[index].isHealthy) continue;
+        if (best == _brokers.size() || isBetter(index, best)) best = index;
+    }
+    if (best == _brokers.size()) best = (_current + 1) % _brokers.size();
+    switchTo(best, "failover");
+    return true;
+}
+
+/// @brief A snapshot of the state of all brokers
+std::vector<BrokerHealth> BrokerSelector::health() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _brokers;
+}
+
+bool BrokerSelector::isCurrentHealthy() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _brokers.empty() || _brokers[_current].isHealthy;
+}
+
+// by position in the list, or by connect time with a margin so that similar brokers don't make us flap
+bool BrokerSelector::isBetter(const size_t candidate, const size_t than) const {
+    if (_selection == Selection::Order) return candidate < than;
+    const auto candidateRtt = _brokers[candidate].rttMicros;
+    const auto thanRtt = _brokers[than].rttMicros;
+    if (candidateRtt < 0) return false;
+    if (thanRtt < 0) return true;
+    return candidateRtt * 100 < thanRtt * (100 - LATENCY_MARGIN_PERCENT);
+}
+
+/// @brief Parse host[:port],host[:port],... IPv6 addresses with a port go in brackets: [::1]:1883
+bool BrokerSelector::parse(const std::string& list, const int defaultPort, std::vector<Broker>* brokers) {
+    brokers->clear();
+    std::stringstream stream(list);
+    std::string entry;
+    while (std::getline(stream, entry, ',')) {
+        if (entry.empty()) continue;
+        Broker broker{entry, defaultPort};
+        std::string port;
+        if (entry[0] == '[') {
+            const auto end = entry.find(']');
+            if (end == std::string::npos) return false;
+            broker.host = entry.substr(1, end - 1);
+            if (end + 1 < entry.size()) {
+                if (entry[end + 1] != ':') return false;
+                port = entry.substr(end + 2);
+            }
+        } else if (const auto colon = entry.find(':'); colon != std::string::npos && entry.find(':', colon + 1) == std::string::npos) {
+            broker.host = entry.substr(0, colon);
+            port = entry.substr(colon + 1);
+        }
+        if (!port.empty()) {
+            char* end = nullptr;
+            const auto value = strtol(port.c_str(), &end, 10);
+            if (*end != '\0' || value <= 0 || value > 65535) return false;
+            broker.port = static_cast<int>(value);
+        }
+        if (broker.host.empty()) return false;
+        brokers->push_back(std::move(broker));
+    }
+    return !brokers->empty();
+}
+
+/// @brief Measure how long a TCP connect to the broker takes (name resolution not included)
+/// @return the connect time in microseconds, or -1 if the broker could not be reached within the timeout
+int64_t BrokerSelector::probe(const Broker& broker, const int timeoutMillis) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(broker.host.c_str(), std::to_string(broker.port).c_str(), &hints, &result) != 0 || result == nullptr) return -1;
+    int64_t rtt = -1;
+    const int socketFd = socket(result->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socketFd >= 0) {
+        const auto start = LatencyRecorder::nowMicros();
+        int rc = connect(socketFd, result->ai_addr, result->ai_addrlen);
+        if (rc != 0 && errno == EINPROGRESS) {
+            pollfd pollFd{socketFd, POLLOUT, 0};
+            if (poll(&pollFd, 1, timeoutMillis) == 1) {
+                int error = 0;
+                socklen_t length = sizeof error;
+                rc = getsockopt(socketFd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0 ? 0 : -1;
+            }
+        }
+        if (rc == 0) rtt = LatencyRecorder::nowMicros() - start;
+        close(socketFd);
+    }
+    freeaddrinfo(result);
+    return rtt;
+}
+
+void BrokerSelector::probeLoop() {
+    ResourceMonitor::nameThread("broker-probe");
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_running) {
+        std::vector<Broker> brokers;
+        for (const auto& health : _brokers) brokers.push_back(health.broker);
+        // don't block selection while probing
+        lock.unlock();
+        for (size_t index = 0; index < brokers.size(); index++) {
+            recordProbe(index, probe(brokers[index], _probeTimeoutMillis), LatencyRecorder::nowMicros());
+        }
+        lock.lock();
+        _wake.wait_for(lock, std::chrono::seconds(_probeSeconds), [this] { return !_running; });
+    }
+}
+
+/// @brief Take in a probe result: the connect time in microseconds, or -1 if the broker couldn't be reached
+void BrokerSelector::recordProbe(const size_t index, const int64_t rttMicros, const int64_t nowMicros) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (index >= _brokers.size()) return;
+    auto& health = _brokers[index];
+    if (rttMicros < 0) {
+        if (health.isHealthy) std::cout << "Broker " << health.broker.name() << " is down" << std::endl;
+        health.isHealthy = false;
+        health.failedProbes++;
+        return;
+    }
+    if (!health.isHealthy || health.healthySinceMicros < 0) {
+        health.isHealthy = true;
+        health.healthySinceMicros = nowMicros;
+    }
+    // smoothed, so a single slow connect doesn't trigger a switch
+    health.rttMicros = health.rttMicros < 0 ? rttMicros : (3 * health.rttMicros + rttMicros) / 4;
+}
+
+uint64_t BrokerSelector::switches() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _switches;
+}
+
+// under the lock
+void BrokerSelector::switchTo(const size_t index, const char* reason) {
+    std::cout << "Broker " << reason << ": " << _brokers[_current].broker.name() << " -> " << _brokers[index].broker.name() << std::endl;
+    _current = index;
+    _switches++;
+}
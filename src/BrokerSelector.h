@@ -0,0 +1,90 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef BROKER_SELECTOR_H
+#define BROKER_SELECTOR_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Config.h"
+
+struct Broker {
+    std::string host;
+    int port = 1883;
+    [[nodiscard]] std::string name() const { return host + ":" + std::to_string(port); }
+};
+
+/// @brief What the probes know about a broker
+struct BrokerHealth {
+    Broker broker;
+    bool isHealthy = true;          // until a probe or a connection attempt says otherwise
+    int64_t healthySinceMicros = -1;  // of the first good probe after it was down; -1 before the first good probe
+    int64_t rttMicros = -1;         // smoothed TCP connect time; -1 if not measured yet
+    uint64_t failedProbes = 0;
+};
+
+/// @brief Chooses a broker from the brokers list (host[:port],...; the first one is preferred), with background
+/// probes measuring the TCP connect time of each. The client fails over to another broker when the current one is
+/// down, and fails back when a better one has been healthy for failbackSeconds. Better is earlier in the list
+/// (brokerSelection=order), or clearly faster to connect to (brokerSelection=latency).
+/// Without a brokers entry, it's just broker/port, without probes.
+class BrokerSelector {
+public:
+    enum class Selection { Order, Latency };
+
+    static constexpr int DEFAULT_PROBE_SECONDS = 10;
+    static constexpr int DEFAULT_PROBE_TIMEOUT_MILLIS = 1000;
+    static constexpr int DEFAULT_FAILBACK_SECONDS = 60;
+    static constexpr int LATENCY_MARGIN_PERCENT = 25;
+
+    explicit BrokerSelector(const Config* config);
+    ~BrokerSelector();
+    BrokerSelector(const BrokerSelector&) = delete;
+    BrokerSelector(BrokerSelector&&) = delete;
+    BrokerSelector& operator=(const BrokerSelector&) = delete;
+    BrokerSelector& operator=(BrokerSelector&&) = delete;
+    bool begin();
+    void end();
+    [[nodiscard]] Broker current() const;
+    bool failBack(int64_t nowMicros);
+    bool failover();
+    [[nodiscard]] std::vector<BrokerHealth> health() const;
+    [[nodiscard]] bool isCurrentHealthy() const;
+    static bool parse(const std::string& list, int defaultPort, std::vector<Broker>* brokers);
+    static int64_t probe(const Broker& broker, int timeoutMillis);
+    void recordProbe(size_t index, int64_t rttMicros, int64_t nowMicros);
+    [[nodiscard]] size_t size() const { return _brokers.size(); }
+    [[nodiscard]] uint64_t switches() const;
+
+private:
+    const Config* _config;
+    Selection _selection = Selection::Order;
+    int _probeSeconds = DEFAULT_PROBE_SECONDS;
+    int _probeTimeoutMillis = DEFAULT_PROBE_TIMEOUT_MILLIS;
+    int64_t _failbackMicros = static_cast<int64_t>(DEFAULT_FAILBACK_SECONDS) * 1000000;
+    mutable std::mutex _mutex;
+    std::condition_variable _wake;
+    std::vector<BrokerHealth> _brokers;
+    size_t _current = 0;
+    uint64_t _switches = 0;
+    std::thread _thread;
+    bool _running = false;
+
+    bool isBetter(size_t candidate, size_t than) const;
+    void probeLoop();
+    void switchTo(size_t index, const char* reason);
+};
+
+#endif
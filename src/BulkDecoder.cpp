@@ -0,0 +1,172 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "BulkDecoder.h"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace {
+    constexpr int LANES = 4;
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    // the bytes of LANES frames, one frame per lane
+    void store(const uint32_t bytes[BYTES][LANES], const uint32_t valid[LANES], DecodedFrame* output) {
+        for (int lane = 0; lane < LANES; lane++) {
+            for (int i = 0; i < BYTES; i++) output[lane].data[i] = static_cast<uint8_t>(bytes[i][lane]);
+            output[lane].state = valid[lane] != 0 ? SensorState::Done : SensorState::ReadError;
+        }
+    }
+#endif
+}
+
+float DecodedFrame::humidity() const {
+    return state == SensorState::Done ? SensorData::humidityFromWord(word(0)) : NAN;
+}
+
+float DecodedFrame::temperature() const {
+    return state == SensorState::Done ? SensorData::temperatureFromWord(word(2)) : NAN;
+}
+
+PulseBatch::PulseBatch(const size_t capacity) :
+    _capacity(capacity), _low(capacity * BITS), _high(capacity * BITS) {}
+
+/// @brief Add the pulse widths of a regular frame
+/// @return false if the frame isn't regular (replay it through SensorData instead) or the batch is full
+bool PulseBatch::add(const EdgeFrame& frame) {
+    if (isFull() || !isRegular(frame)) return false;
+    // bit k: the low pulse ends at edge START_EDGE + 2k, the high pulse at the next one
+    for (int bit = 0; bit < BITS; bit++) {
+        const int edge = START_EDGE + 2 * bit;
+        _low[static_cast<size_t>(bit) * _capacity + _size] = frame.tick(edge) - frame.tick(edge - 1);
+        _high[static_cast<size_t>(bit) * _capacity + _size] = frame.tick(edge + 1) - frame.tick(edge);
+    }
+    _size++;
+    return true;
+}
+
+/// @brief Add a frame from its BITS low and high pulse widths. The batch must not be full.
+void PulseBatch::add(const uint32_t* low, const uint32_t* high) {
+    for (int bit = 0; bit < BITS; bit++) {
+        _low[static_cast<size_t>(bit) * _capacity + _size] = low[bit];
+        _high[static_cast<size_t>(bit) * _capacity + _size] = high[bit];
+    }
+    _size++;
+}
+
+/// @brief Whether SensorData reads the frame as plain alternating edges: rising first, at least EDGES, no timeout,
+/// no zero-length pulses. Then each bit is only a comparison of two pulse widths. Anything else (anomalies,
+/// missing edges, timeouts) depends on SensorData's per-edge state, and is left to it.
+bool PulseBatch::isRegular(const EdgeFrame& frame) {
+    if (frame.edgeCount < EDGES) return false;
+    for (int i = 0; i < EDGES; i++) {
+        if (frame.level(i) != (i % 2 == 0 ? 1 : 0)) return false;
+        if (i > 0 && frame.tick(i) == frame.tick(i - 1)) return false;
+    }
+    return true;
+}
+
+BulkDecoder::BulkDecoder(const unsigned int threads) :
+    _threads(threads > 0 ? threads : std::max(1U, std::thread::hardware_concurrency())) {}
+
+/// @brief Decode all frames in the batch into output (batch.size() entries)
+void BulkDecoder::decode(const PulseBatch& batch, DecodedFrame* output) const {
+    const size_t frames = batch.size();
+    const auto threads = static_cast<size_t>(std::min<size_t>(_threads, std::max<size_t>(1, frames / MIN_FRAMES_PER_THREAD)));
+    if (threads <= 1) {
+        decodeVector(batch, 0, frames, output);
+        return;
+    }
+    // whole vectors per thread, so only the last one has a scalar tail
+    const size_t perThread = (frames / threads + LANES - 1) / LANES * LANES;
+    std::vector<std::thread> workers;
+    for (size_t first = 0; first < frames; first += perThread) {
+        const size_t last = std::min(frames, first + perThread);
+        workers.emplace_back([&batch, first, last, output] { decodeVector(batch, first, last, output); });
+    }
+    for (auto& worker : workers) worker.join();
+}
+
+const char* BulkDecoder::kernel() {
+#if defined(__SSE2__)
+    return "sse2";
+#elif defined(__ARM_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+/// @brief Decode frames [first, last) one at a time. The reference for the vector kernels.
+void BulkDecoder::decodeScalar(const PulseBatch& batch, const size_t first, const size_t last, DecodedFrame* output) {
+    for (size_t frame = first; frame < last; frame++) {
+        auto& decoded = output[frame];
+        decoded.data = {};
+        for (int bit = 0; bit < PulseBatch::BITS; bit++) {
+            auto& byte = decoded.data[bit / 8];
+            byte = static_cast<uint8_t>(byte << 1 | (batch.high(bit)[frame] > batch.low(bit)[frame] ? 1 : 0));
+        }
+        const auto checksum = (decoded.data[0] + decoded.data[1] + decoded.data[2] + decoded.data[3]) & 0xFF;
+        decoded.state = checksum == decoded.data[4] ? SensorState::Done : SensorState::ReadError;
+    }
+}
+
+/// @brief Decode frames [first, last), LANES frames per step: compare, shift in the bit, and check the sums in vector
+/// registers. The remainder goes through the scalar kernel.
+void BulkDecoder::decodeVector(const PulseBatch& batch, const size_t first, const size_t last, DecodedFrame* output) {
+    size_t frame = first;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    alignas(16) uint32_t bytes[BYTES][LANES];
+    alignas(16) uint32_t valid[LANES];
+    for (; frame + LANES <= last; frame += LANES) {
+#if defined(__SSE2__)
+        // SSE2 only compares signed; flipping the sign bits makes that an unsigned comparison
+        const __m128i sign = _mm_set1_epi32(static_cast<int>(0x80000000U));
+        for (int byte = 0; byte < BYTES; byte++) {
+            __m128i value = _mm_setzero_si128();
+            for (int bit = byte * 8; bit < byte * 8 + 8; bit++) {
+                const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(batch.low(bit) + frame));
+                const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(batch.high(bit) + frame));
+                const __m128i isOne = _mm_cmpgt_epi32(_mm_xor_si128(high, sign), _mm_xor_si128(low, sign));
+                value = _mm_or_si128(_mm_slli_epi32(value, 1), _mm_srli_epi32(isOne, 31));
+            }
+            _mm_store_si128(reinterpret_cast<__m128i*>(bytes[byte]), value);
+        }
+        const __m128i sum = _mm_add_epi32(
+            _mm_add_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(bytes[0])), _mm_load_si128(reinterpret_cast<const __m128i*>(bytes[1]))),
+            _mm_add_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(bytes[2])), _mm_load_si128(reinterpret_cast<const __m128i*>(bytes[3]))));
+        const __m128i checksum = _mm_and_si128(sum, _mm_set1_epi32(0xFF));
+        _mm_store_si128(reinterpret_cast<__m128i*>(valid),
+                        _mm_cmpeq_epi32(checksum, _mm_load_si128(reinterpret_cast<const __m128i*>(bytes[4]))));
+#else
+        for (int byte = 0; byte < BYTES; byte++) {
+            uint32x4_t value = vdupq_n_u32(0);
+            for (int bit = byte * 8; bit < byte * 8 + 8; bit++) {
+                const uint32x4_t isOne = vcgtq_u32(vld1q_u32(batch.high(bit) + frame), vld1q_u32(batch.low(bit) + frame));
+                value = vorrq_u32(vshlq_n_u32(value, 1), vshrq_n_u32(isOne, 31));
+            }
+            vst1q_u32(bytes[byte], value);
+        }
+        const uint32x4_t sum = vaddq_u32(vaddq_u32(vld1q_u32(bytes[0]), vld1q_u32(bytes[1])),
+                                         vaddq_u32(vld1q_u32(bytes[2]), vld1q_u32(bytes[3])));
+        vst1q_u32(valid, vceqq_u32(vandq_u32(sum, vdupq_n_u32(0xFF)), vld1q_u32(bytes[4])));
+#endif
+        store(bytes, valid, output + frame);
+    }
+#endif
+    decodeScalar(batch, frame, last, output);
+}
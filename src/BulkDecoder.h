@@ -0,0 +1,77 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef BULK_DECODER_H
+#define BULK_DECODER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "EdgeRecorder.h"
+#include "SensorData.h"
+
+/// @brief The outcome of decoding one frame: the five data bytes, and Done or ReadError (checksum).
+struct DecodedFrame {
+    std::array<uint8_t, BYTES> data{};
+    SensorState state = SensorState::Reading;
+
+    [[nodiscard]] float humidity() const;
+    [[nodiscard]] float temperature() const;
+    [[nodiscard]] uint16_t word(int index) const { return static_cast<uint16_t>(data[index] * 256u + data[index + 1]); }
+};
+
+/// @brief Pulse widths of many frames in structure-of-arrays form: for each of the 40 bits, the low (reference)
+/// and high durations of all frames are contiguous, so a vector register holds the same bit of several frames.
+class PulseBatch {
+public:
+    static constexpr int BITS = 40;
+
+    explicit PulseBatch(size_t capacity);
+    bool add(const EdgeFrame& frame);
+    void add(const uint32_t* low, const uint32_t* high);
+    void clear() { _size = 0; }
+    size_t capacity() const { return _capacity; }
+    bool isFull() const { return _size == _capacity; }
+    size_t size() const { return _size; }
+    const uint32_t* low(const int bit) const { return _low.data() + static_cast<size_t>(bit) * _capacity; }
+    const uint32_t* high(const int bit) const { return _high.data() + static_cast<size_t>(bit) * _capacity; }
+
+    static bool isRegular(const EdgeFrame& frame);
+
+private:
+    size_t _capacity;
+    size_t _size = 0;
+    std::vector<uint32_t> _low;
+    std::vector<uint32_t> _high;
+};
+
+/// @brief Decodes batches of frames, with the same result as feeding their edges through SensorData, but
+/// a vector register of frames at a time (SSE2 or NEON, with a scalar fallback), split over threads.
+/// Only regular frames (see PulseBatch::isRegular) can be batched; replay the others through SensorData.
+class BulkDecoder {
+public:
+    explicit BulkDecoder(unsigned int threads = 0);
+    void decode(const PulseBatch& batch, DecodedFrame* output) const;
+    unsigned int threads() const { return _threads; }
+
+    static const char* kernel();
+    static void decodeScalar(const PulseBatch& batch, size_t first, size_t last, DecodedFrame* output);
+    static void decodeVector(const PulseBatch& batch, size_t first, size_t last, DecodedFrame* output);
+
+private:
+    // below this, starting threads costs more than it saves
+    static constexpr size_t MIN_FRAMES_PER_THREAD = 4096;
+
+    unsigned int _threads;
+};
+
+#endif
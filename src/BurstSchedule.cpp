@@ -0,0 +1,95 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "BurstSchedule.h"
+#include <algorithm>
+#include <utility>
+
+namespace {
+    // ticks wrap around (every 72 minutes), so compare differences
+    bool isBefore(const uint32_t tick, const uint32_t other) {
+        return static_cast<int32_t>(tick - other) < 0;
+    }
+}
+
+BurstSchedule::BurstSchedule(const Config* config, Aligner aligner) : _config(config), _aligner(std::move(aligner)) {}
+
+/// @brief Read dutyCycle, burstSamples and warmupMillis
+void BurstSchedule::begin() {
+    _config->setIfExists("dutyCycle", &_enabled);
+    _config->setIfExists("burstSamples", &_burstSamples);
+    _burstSamples = std::clamp(_burstSamples, 1, MAX_BURST_SAMPLES);
+    int warmupMillis = DEFAULT_WARMUP_MILLIS;
+    _config->setIfExists("warmupMillis", &warmupMillis);
+    _warmupMicros = static_cast<uint32_t>(std::max(warmupMillis, 0)) * 1000U;
+}
+
+uint32_t BurstSchedule::align(const uint32_t tick, const bool notBefore) const {
+    return _aligner ? _aligner(tick, notBefore) : tick;
+}
+
+/// @brief Start over after an interval change: the next burst starts an interval after the start of the last one
+/// (not after the one already scheduled, which was based on the old interval). Not before the sensor can be read
+/// again, and if it is powered down, not before it had its warm-up.
+void BurstSchedule::changeInterval(const uint32_t intervalMicros, const uint32_t now, const bool isSuspended) {
+    _index = 0;
+    auto next = align(_lastBurstStart + intervalMicros, true);
+    if (isBefore(next, _lastRead + MIN_READ_GAP_MICROS)) next = _lastRead + MIN_READ_GAP_MICROS;
+    if (isSuspended && isBefore(next, now + _warmupMicros)) next = now + _warmupMicros;
+    _burstStart = next;
+    _nextRead = next;
+}
+
+/// @brief The shortest interval with which there is time to power down between bursts
+uint32_t BurstSchedule::minimumIntervalMicros() const {
+    return static_cast<uint32_t>(_burstSamples - 1) * MIN_READ_GAP_MICROS + _warmupMicros + MIN_SUSPEND_MICROS;
+}
+
+/// @brief Move the next burst back, e.g. when the sensor could not be powered up
+void BurstSchedule::postpone(const uint32_t micros) {
+    _burstStart += micros;
+    _nextRead += micros;
+}
+
+/// @brief Schedule the read after the one that was scheduled at previousRead: the next one in the burst,
+/// or the start of the next burst, intervalMicros (which may be stretched by the adaptive interval) after this one's.
+void BurstSchedule::readDone(const uint32_t previousRead, const uint32_t intervalMicros) {
+    if (_index == 0) _lastBurstStart = _burstStart;
+    _lastRead = previousRead;
+    if (++_index < _burstSamples) {
+        _nextRead = previousRead + MIN_READ_GAP_MICROS;
+        return;
+    }
+    _index = 0;
+    _burstStart = align(_burstStart + intervalMicros, false);
+    // an interval shorter than the burst: the next one starts right after this one
+    if (isBefore(_burstStart, previousRead + MIN_READ_GAP_MICROS)) _burstStart = previousRead + MIN_READ_GAP_MICROS;
+    _nextRead = _burstStart;
+}
+
+/// @brief Whether to power down now: between bursts, if the gap is longer than the warm-up plus MIN_SUSPEND
+bool BurstSchedule::shouldSuspend(const uint32_t now) const {
+    return _enabled && _index == 0 && static_cast<int32_t>(_nextRead - now) > static_cast<int32_t>(_warmupMicros + MIN_SUSPEND_MICROS);
+}
+
+/// @brief Begin with a burst at firstRead
+void BurstSchedule::start(const uint32_t firstRead) {
+    _index = 0;
+    _burstStart = firstRead;
+    _lastBurstStart = firstRead;
+    _lastRead = firstRead - MIN_READ_GAP_MICROS;
+    _nextRead = firstRead;
+}
+
+/// @brief Time until the sensor must be powered up for the next burst (0 or less: now)
+int32_t BurstSchedule::untilWarmup(const uint32_t now) const {
+    return static_cast<int32_t>(_nextRead - _warmupMicros - now);
+}
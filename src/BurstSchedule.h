@@ -0,0 +1,62 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef BURST_SCHEDULE_H
+#define BURST_SCHEDULE_H
+
+#include <cstdint>
+#include <functional>
+#include "Config.h"
+
+/// @brief The read schedule with duty cycling (dutyCycle=1): bursts of burstSamples reads, MIN_READ_GAP apart,
+/// with the interval between the starts of the bursts. In between, the sensor may be powered down if the gap is
+/// worth it, and is powered up warmupMillis before the next burst. Works on gpioTick values passed in, so it can be tested.
+class BurstSchedule {
+public:
+    /// @brief Moves a tick onto the read grid (see PhaseSchedule): the first slot at or after it, or the nearest one
+    using Aligner = std::function<uint32_t(uint32_t tick, bool notBefore)>;
+
+    static constexpr int DEFAULT_BURST_SAMPLES = 3;   // the minimum for ClimateMeasurement's outlier rejection
+    static constexpr int MAX_BURST_SAMPLES = 30;
+    static constexpr int DEFAULT_WARMUP_MILLIS = 2000;
+    static constexpr uint32_t MIN_READ_GAP_MICROS = 2000000;  // the sensor can't be read more often
+    static constexpr uint32_t MIN_SUSPEND_MICROS = 1000000;   // not worth powering down for less (on top of the warm-up)
+
+    explicit BurstSchedule(const Config* config, Aligner aligner = nullptr);
+    void begin();
+    int burstSamples() const { return _burstSamples; }
+    void changeInterval(uint32_t intervalMicros, uint32_t now, bool isSuspended);
+    int index() const { return _index; }
+    bool isEnabled() const { return _enabled; }
+    uint32_t minimumIntervalMicros() const;
+    uint32_t nextRead() const { return _nextRead; }
+    void postpone(uint32_t micros);
+    void readDone(uint32_t previousRead, uint32_t intervalMicros);
+    bool shouldSuspend(uint32_t now) const;
+    void start(uint32_t firstRead);
+    int32_t untilWarmup(uint32_t now) const;
+
+private:
+    const Config* _config;
+    Aligner _aligner;
+    bool _enabled = false;
+    int _burstSamples = DEFAULT_BURST_SAMPLES;
+    uint32_t _warmupMicros = DEFAULT_WARMUP_MILLIS * 1000U;
+    int _index = 0;
+    uint32_t _burstStart = 0;      // of the running or the next burst
+    uint32_t _lastBurstStart = 0;  // of the burst that ran last (or is running)
+    uint32_t _lastRead = 0;
+    uint32_t _nextRead = 0;
+
+    uint32_t align(uint32_t tick, bool notBefore) const;
+};
+
+#endif
@@ -10,6 +10,12 @@
 //   See the License for the specific language governing permissions and limitations under the License.
 
 #include "ClimateMeasurement.h"
+#include "AllocationTracker.h"
+#include "ColumnReducer.h"
+#include "LatencyRecorder.h"
+#include "Trace.h"
+#include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <iostream>
 
@@ -17,80 +23,208 @@ ClimateMeasurement::ClimateMeasurement(ISender* sender) {
     _sender = sender;
 }
 
+/// @brief Keep a quantile sketch of temperature and humidity over clock-aligned horizons of the given length
+/// (e.g. 3600 for hours), and send it at the end of each. Horizons align to the epoch, so days are UTC days.
+/// @param accuracy the k of the sketches: the rank error is around 1.7/k, memory about 3k values per property
+/// @return false if seconds isn't positive, or there already is a horizon of that length
+bool ClimateMeasurement::addSummaryHorizon(const int seconds, const int accuracy) {
+    if (seconds <= 0) return false;
+    for (const auto& horizon : _horizons) {
+        if (horizon.seconds == seconds) return false;
+    }
+    _horizons.emplace_back(seconds, accuracy);
+    return true;
+}
+
 /// @brief Initialize the climate sensor
 void ClimateMeasurement::begin() {
     _sampleCount = 0;
     _consecutiveNanCount = 0;
 }
 
-/// @brief Send the average of the last 5 measurements to the communicator
-void ClimateMeasurement::processSample(float temperature, float humidity) {
-    // Since a sample is taken every 2 seconds, we have a measurement to send every 10 seconds.
-    _temperature[_sampleCount] = temperature;
-    _humidity[_sampleCount] = humidity;
+/// @brief Process a sample without timing information; it is taken to be from now.
+void ClimateMeasurement::processSample(const float temperature, const float humidity, const float weight) {
+    Sample sample;
+    sample.temperature = temperature;
+    sample.humidity = humidity;
+    sample.monotonicMicros = LatencyRecorder::nowMicros();
+    sample.decodedMicros = sample.monotonicMicros;
+    sample.wallMillis = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    processSample(sample, weight);
+}
+
+/// @brief Send the average of the last samplesPerMeasurement (default 5) samples to the communicator
+/// @param weight the relative time the sample stands for. Only matters if the read interval varies.
+void ClimateMeasurement::processSample(const Sample& sample, const float weight) {
+    AllocationScope scope(AllocationTag::Aggregation);
+    // Since a sample is taken every 2 seconds by default, we have a measurement to send every 10 seconds.
+    _temperature[_sampleCount] = sample.temperature;
+    _humidity[_sampleCount] = sample.humidity;
+    _newest = sample;
+    _weight[_sampleCount] = weight;
     _sampleCount++;
-    if (_sampleCount >= SAMPLES_PER_MEASUREMENT) {
+    summarize(sample, weight);
+    if (isWindowComplete(sample, weight)) {
+        TRACE_SPAN("aggregate");
+        // e.g. after the interval was shortened at runtime
+        if (_windowSchedule != nullptr && _sampleCount >= MAX_SAMPLES_PER_MEASUREMENT) {
+            std::cout << "Window full after " << _sampleCount << " samples; measuring before its end" << std::endl;
+        }
+        const int samples = _sampleCount;
 	    std::cout <<  "Temperatures: ";
-        for (const float temperatureSample : _temperature) {
-            std::cout << temperatureSample << ";";
+        for (int i = 0; i < samples; i++) {
+            std::cout << _temperature[i] << ";";
         }
         std::cout << std::endl;
-        const float averageTemperature = roundedAverage(_temperature, SAMPLES_PER_MEASUREMENT);
-        _sender->sendTemperature(averageTemperature);
+        Measurement measurement;
+        measurement.temperature = roundedAverage(_temperature, samples);
 
         std::cout << "Humidities: ";
-        for (const float humiditySample : _humidity) {
-            std::cout << humiditySample << ";";
+        for (int i = 0; i < samples; i++) {
+            std::cout << _humidity[i] << ";";
         }
         std::cout << std::endl;
 
-        const float averageHumidity = roundedAverage(_humidity, SAMPLES_PER_MEASUREMENT);
-        _sender->sendHumidity(averageHumidity);
+        measurement.humidity = roundedAverage(_humidity, samples);
+        measurement.sampleCount = samples;
+        // temperature and humidity come from the same read, so they are NaN together
+        measurement.nanCount = countNans(_temperature, samples);
+        measurement.timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        measurement.sampledMillis = _newest.wallMillis;
+        measurement.sampledMicros = _newest.monotonicMicros;
+        measurement.aggregatedMicros = LatencyRecorder::nowMicros();
+        LatencyRecorder::record(LatencyStage::Aggregate, measurement.aggregatedMicros - _newest.decodedMicros);
+        _sender->sendMeasurement(measurement);
     	_sampleCount = 0;
     }
 }
 
+// Every sample goes into the sketches, weighted by the whole seconds it stands for (at least 1), so that with a
+// variable read interval the percentiles are over time rather than over reads.
+// The first sample of a new horizon sends the summaries of the previous one.
+void ClimateMeasurement::summarize(const Sample& sample, const float weight) {
+    const auto sketchWeight = static_cast<uint64_t>(std::max(1.0f, std::round(weight)));
+    for (auto& horizon : _horizons) {
+        const int64_t horizonMillis = static_cast<int64_t>(horizon.seconds) * 1000;
+        const int64_t index = sample.wallMillis / horizonMillis;
+        if (index != horizon.index) {
+            if (horizon.index >= 0) {
+                const auto startMillis = horizon.index * horizonMillis;
+                if (horizon.temperature.count() > 0) {
+                    _sender->sendSummary({"temperature", horizon.seconds, startMillis, horizon.temperature});
+                }
+                if (horizon.humidity.count() > 0) {
+                    _sender->sendSummary({"humidity", horizon.seconds, startMillis, horizon.humidity});
+                }
+            }
+            horizon.temperature.reset();
+            horizon.humidity.reset();
+            horizon.index = index;
+        }
+        horizon.temperature.add(sample.temperature, sketchWeight);
+        horizon.humidity.add(sample.humidity, sketchWeight);
+    }
+}
+
+/// @brief With windowSeconds (see PhaseSchedule), measurements cover clock-aligned windows instead of a number of samples.
+/// A window must fit in the sample buffer: at most MAX_SAMPLES_PER_MEASUREMENT reads.
+/// @param readsPerInterval the reads in each interval (burstSamples with duty cycling)
+/// @return false if the window holds too many reads; measurements then keep counting samples
+bool ClimateMeasurement::alignWindows(const PhaseSchedule* schedule, const int intervalSeconds, const int readsPerInterval) {
+    _windowSchedule = nullptr;
+    if (schedule == nullptr || !schedule->hasWindows()) return true;
+    if (intervalSeconds <= 0) return false;
+    const auto intervalMicros = static_cast<uint64_t>(intervalSeconds) * 1000000U;
+    const auto intervals = (schedule->windowMicros() + intervalMicros - 1) / intervalMicros;
+    if (intervals * static_cast<uint64_t>(std::max(readsPerInterval, 1)) > MAX_SAMPLES_PER_MEASUREMENT) return false;
+    _windowSchedule = schedule;
+    return true;
+}
+
+/// @brief Whether the samples collected so far make a measurement. That's when we have samplesPerMeasurement of them
+/// (or more, if the number was lowered while collecting), or with aligned windows when the next sample falls in a later
+/// window. A window with too few samples to drop the highest and lowest is merged with the next one.
+bool ClimateMeasurement::isWindowComplete(const Sample& sample, const float weight) const {
+    if (_sampleCount >= MAX_SAMPLES_PER_MEASUREMENT) return true;
+    if (_windowSchedule == nullptr) return _sampleCount >= _samplesPerMeasurement;
+    if (_sampleCount < MIN_SAMPLES_PER_MEASUREMENT) return false;
+    const auto wallMicros = sample.wallMillis * 1000;
+    const auto nextMicros = wallMicros + static_cast<int64_t>(weight * 1e6f);
+    return _windowSchedule->windowIndex(nextMicros) != _windowSchedule->windowIndex(wallMicros);
+}
+
+/// @brief Change the number of samples per measurement. Takes effect for the measurement being collected.
+/// @return false if the number is out of range (MIN_SAMPLES_PER_MEASUREMENT .. MAX_SAMPLES_PER_MEASUREMENT)
+bool ClimateMeasurement::setSamplesPerMeasurement(const int samples) {
+    if (samples < MIN_SAMPLES_PER_MEASUREMENT || samples > MAX_SAMPLES_PER_MEASUREMENT) return false;
+    _samplesPerMeasurement = samples;
+    return true;
+}
+
 /// @brief Calculate the average of the last 5 measurements
 /// We use an average over 5 samples for humidity and temperature to smoothen the noise.
 /// Also the highest and lowest values are discarded to eliminate outliers.
 /// Finally, sometimes the sensor returns "NaN". If that is the case, ignore those samples if possible.
 float ClimateMeasurement::average(float input[], const int sampleSize) {
-    int firstNumberIndex = 0;
-    while (firstNumberIndex < sampleSize && std::isnan(input[firstNumberIndex])) { firstNumberIndex++; }
-
-    // if we only have NaN values, return NaN
-    if (firstNumberIndex >= sampleSize) return NAN;
-
-    int nanCount = firstNumberIndex;
-    for (int i = firstNumberIndex + 1; i < sampleSize; i++) {
-        if (std::isnan(input[i])) {
-            nanCount++;
-            _overallNanCount++;
-            std::cout << "NaN count: " << _overallNanCount << std::endl;
-        }
+    ColumnStatistics statistics;
+    ColumnReducer::reduce(input, static_cast<size_t>(sampleSize), 1, 1, &statistics);
+    const int nanCount = sampleSize - statistics.count;
+    if (nanCount > 0) {
+        _overallNanCount += nanCount;
+        std::cout << "NaN count: " << _overallNanCount << std::endl;
     }
 
     // if we have two or less measurements, return NaN. Outliers happen too often to ignore
-    if (nanCount >= sampleSize - 2) return NAN;
-
-    // Discard the highest and the lowest value and take the average of the rest.
-    auto minValue = input[firstNumberIndex];
-    auto maxValue = minValue;
-    auto totalValue = minValue;
-    for (int i = firstNumberIndex + 1; i < sampleSize; i++) {
-        if (!std::isnan(input[i])) {
-            totalValue += input[i];
-            if (input[i] < minValue) minValue = input[i];
-            if (input[i] > maxValue) maxValue = input[i];
-        }
+    if (statistics.count <= 2) return NAN;
+
+    if ((statistics.max - statistics.min > 5.0f) || (statistics.min / statistics.max < 0.8f)) {
+        std::cout << "outliers: " << statistics.min << ", " << statistics.max << std::endl;
     }
-    if ((maxValue - minValue > 5.0f) || (minValue / maxValue < 0.8f)) {
-		std::cout << "outliers: " << minValue << ", " << maxValue << std::endl;
+    // the highest and the lowest value are discarded
+    return statistics.trimmedMean;
+}
+
+bool ClimateMeasurement::hasEqualWeights(const int length) const {
+    for (int i = 1; i < length; i++) {
+        if (_weight[i] != _weight[0]) return false;
     }
+    return true;
+}
+
+/// @brief Like average, but each sample counts for the time it stands for. Used when the read interval varies.
+/// The highest and lowest values are still discarded, as are NaN values.
+float ClimateMeasurement::weightedAverage(const float input[], const int length) const {
+    int minIndex = -1;
+    int maxIndex = -1;
+    int valueCount = 0;
+    for (int i = 0; i < length; i++) {
+        if (std::isnan(input[i])) continue;
+        valueCount++;
+        if (minIndex < 0 || input[i] < input[minIndex]) minIndex = i;
+        if (maxIndex < 0 || input[i] >= input[maxIndex]) maxIndex = i;
+    }
+    // same rule as the unweighted version: we need at least 3 values
+    if (valueCount < 3) return NAN;
+    double total = 0.0;
+    double totalWeight = 0.0;
+    for (int i = 0; i < length; i++) {
+        if (std::isnan(input[i]) || i == minIndex || i == maxIndex) continue;
+        total += static_cast<double>(input[i]) * _weight[i];
+        totalWeight += _weight[i];
+    }
+    if (totalWeight <= 0.0) return NAN;
+    return static_cast<float>(total / totalWeight);
+}
 
-    totalValue -= (minValue + maxValue);
-    // Not seeing the issue here. Even static_cast to float doesn't help to remove the finding on sampleSize
-    return totalValue / static_cast<float>(sampleSize - nanCount - 2);  // NOLINT(clang-diagnostic-implicit-int-float-conversion) 
+/// @brief Count the number of samples that failed (i.e. are NaN)
+int ClimateMeasurement::countNans(const float input[], const int length) {
+    int nanCount = 0;
+    for (int i = 0; i < length; i++) {
+        if (std::isnan(input[i])) nanCount++;
+    }
+    return nanCount;
 }
 
 /// @brief Calculate the average of the measurements and round it to 1 decimal
@@ -99,7 +233,8 @@ float ClimateMeasurement::average(float input[], const int sampleSize) {
 /// @return rounded average
 float ClimateMeasurement::roundedAverage(float input[], const int length) {
     // round is tricky. It converts NAN to zero, and it calls arguments twice.
-    const auto result = average(input, length);
+    // With a fixed read interval all weights are equal, and we keep the plain average.
+    const auto result = hasEqualWeights(length) ? average(input, length) : weightedAverage(input, length);
     if (std::isnan(result)) {
         return NAN;
     }
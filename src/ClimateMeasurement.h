@@ -11,28 +11,62 @@
 
 #ifndef CLIMATE_MEASUREMENT_H
 #define CLIMATE_MEASUREMENT_H
+#include <atomic>
+#include <vector>
 #include "ISender.h"
+#include "PhaseSchedule.h"
+#include "Sample.h"
 
 /// @brief Class to take climate measurements and send them to the communicator
 class ClimateMeasurement {
 public:
 	explicit ClimateMeasurement(ISender* sender);
+    bool addSummaryHorizon(int seconds, int accuracy = QuantileSketch::DEFAULT_K);
+    bool alignWindows(const PhaseSchedule* schedule, int intervalSeconds, int readsPerInterval = 1);
     void begin();
-    void processSample(float temperatureIn, float humidityIn);
+    void processSample(float temperatureIn, float humidityIn, float weight = 1.0f);
+    void processSample(const Sample& sample, float weight = 1.0f);
+    int samplesPerMeasurement() const { return _samplesPerMeasurement; }
+    bool setSamplesPerMeasurement(int samples);
+
+    constexpr static int MIN_SAMPLES_PER_MEASUREMENT = 3;  // we discard highest and lowest
+    constexpr static int MAX_SAMPLES_PER_MEASUREMENT = 30;
 
 private:
-    constexpr static int SAMPLES_PER_MEASUREMENT = 5; // number of samples for aggregation. Must be at least 3 as we discard highest and lowest.
+    constexpr static int SAMPLES_PER_MEASUREMENT = 5; // default number of samples for aggregation
     constexpr static int MAX_CONSECUTIVE_NANS = 2;    // Failing to get values two times or more requires action (reset)
-    float _temperature[SAMPLES_PER_MEASUREMENT] = { 0 };
-    float _humidity[SAMPLES_PER_MEASUREMENT] = { 0 };
+
+    /// @brief Sketches of the samples in the current horizon (e.g. the current hour)
+    struct Horizon {
+        Horizon(const int horizonSeconds, const int accuracy) :
+            seconds(horizonSeconds), temperature(accuracy), humidity(accuracy) {}
+        int seconds;
+        int64_t index = -1;   // the horizon since the epoch
+        QuantileSketch temperature;
+        QuantileSketch humidity;
+    };
+
+    float _temperature[MAX_SAMPLES_PER_MEASUREMENT] = { 0 };
+    float _humidity[MAX_SAMPLES_PER_MEASUREMENT] = { 0 };
+    float _weight[MAX_SAMPLES_PER_MEASUREMENT] = { 0 };  // the time each sample stands for (with a variable read interval)
+    // can be changed at runtime from another thread (e.g. via MQTT)
+    std::atomic<int> _samplesPerMeasurement{SAMPLES_PER_MEASUREMENT};
     ISender* _sender;
     ISender* _display;
+    const PhaseSchedule* _windowSchedule = nullptr;
     int _sampleCount = 0;
+    Sample _newest;
     int _consecutiveNanCount = 0;
     int _overallNanCount = 0;
+    std::vector<Horizon> _horizons;
 
 	float average(float input[], int sampleSize);
+    static int countNans(const float input[], int length);
+    bool hasEqualWeights(int length) const;
+    bool isWindowComplete(const Sample& sample, float weight) const;
+    float weightedAverage(const float input[], int length) const;
     float roundedAverage(float input[], int length);
+    void summarize(const Sample& sample, float weight);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,320 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "ColumnReducer.h"
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace {
+    constexpr size_t LANES = 4;
+
+    // count, sum, min and max are in; add the trimmed mean. The expression is the one ClimateMeasurement used.
+    void finish(const int32_t count, const float sum, const float min, const float max, ColumnStatistics* output) {
+        output->count = count;
+        output->sum = sum;
+        output->min = count > 0 ? min : NAN;
+        output->max = count > 0 ? max : NAN;
+        output->trimmedMean = count < 3 ? NAN : (sum - (min + max)) / static_cast<float>(count - 2);
+    }
+
+    // int16 sums are exact, so the trimmed mean only rounds once
+    void finish(const int32_t count, const int32_t sum, const int32_t min, const int32_t max, ColumnStatistics* output) {
+        finish(count, static_cast<float>(sum), static_cast<float>(min), static_cast<float>(max), output);
+        if (count >= 3) output->trimmedMean = static_cast<float>(sum - min - max) / static_cast<float>(count - 2);
+    }
+
+    float mean(const ColumnStatistics& statistics) {
+        return statistics.count > 0 ? statistics.sum / static_cast<float>(statistics.count) : 0.0f;
+    }
+
+    void setVariance(const float squares, ColumnStatistics* output) {
+        output->variance = output->count < 2 ? NAN : squares / static_cast<float>(output->count - 1);
+    }
+
+    // The scalar kernels do per column what the vector kernels do per lane, in the same order:
+    // missing values add zero, and min/max keep the old value when the comparison fails.
+
+    void reduceColumn(const float* column, const size_t rows, const size_t stride, ColumnStatistics* output) {
+        int32_t count = 0;
+        float sum = 0.0f;
+        float min = INFINITY;
+        float max = -INFINITY;
+        for (size_t row = 0; row < rows; row++) {
+            const float value = column[row * stride];
+            const bool isNumber = !std::isnan(value);
+            count += isNumber ? 1 : 0;
+            sum += isNumber ? value : 0.0f;
+            if (value < min) min = value;
+            if (value > max) max = value;
+        }
+        finish(count, sum, min, max, output);
+        const float average = mean(*output);
+        float squares = 0.0f;
+        for (size_t row = 0; row < rows; row++) {
+            const float value = column[row * stride];
+            const float deviation = std::isnan(value) ? 0.0f : value - average;
+            squares += deviation * deviation;
+        }
+        setVariance(squares, output);
+    }
+
+    void reduceColumn(const int16_t* column, const size_t rows, const size_t stride, ColumnStatistics* output) {
+        int32_t count = 0;
+        int32_t sum = 0;
+        int32_t min = INT16_MAX;
+        int32_t max = INT16_MIN;
+        for (size_t row = 0; row < rows; row++) {
+            const int16_t value = column[row * stride];
+            if (value == ColumnReducer::MISSING_INT16) continue;
+            count++;
+            sum += value;
+            if (value < min) min = value;
+            if (value > max) max = value;
+        }
+        finish(count, sum, min, max, output);
+        const float average = mean(*output);
+        float squares = 0.0f;
+        for (size_t row = 0; row < rows; row++) {
+            const int16_t value = column[row * stride];
+            const float deviation = value == ColumnReducer::MISSING_INT16 ? 0.0f : static_cast<float>(value) - average;
+            squares += deviation * deviation;
+        }
+        setVariance(squares, output);
+    }
+
+#if defined(__SSE2__)
+    // LANES adjacent columns at a time, one per lane
+    void reduceBlock(const float* block, const size_t rows, const size_t stride, ColumnStatistics* output) {
+        __m128i count = _mm_setzero_si128();
+        __m128 sum = _mm_setzero_ps();
+        __m128 min = _mm_set1_ps(INFINITY);
+        __m128 max = _mm_set1_ps(-INFINITY);
+        for (size_t row = 0; row < rows; row++) {
+            const __m128 value = _mm_loadu_ps(block + row * stride);
+            const __m128 isNumber = _mm_cmpord_ps(value, value);
+            // the mask is -1 per number
+            count = _mm_sub_epi32(count, _mm_castps_si128(isNumber));
+            sum = _mm_add_ps(sum, _mm_and_ps(value, isNumber));
+            // min/max return the second operand if the first one is NaN
+            min = _mm_min_ps(value, min);
+            max = _mm_max_ps(value, max);
+        }
+        alignas(16) int32_t counts[LANES];
+        alignas(16) float sums[LANES];
+        alignas(16) float mins[LANES];
+        alignas(16) float maxes[LANES];
+        _mm_store_si128(reinterpret_cast<__m128i*>(counts), count);
+        _mm_store_ps(sums, sum);
+        _mm_store_ps(mins, min);
+        _mm_store_ps(maxes, max);
+        alignas(16) float means[LANES];
+        for (size_t lane = 0; lane < LANES; lane++) {
+            finish(counts[lane], sums[lane], mins[lane], maxes[lane], output + lane);
+            means[lane] = mean(output[lane]);
+        }
+        const __m128 average = _mm_load_ps(means);
+        __m128 squares = _mm_setzero_ps();
+        for (size_t row = 0; row < rows; row++) {
+            const __m128 value = _mm_loadu_ps(block + row * stride);
+            const __m128 deviation = _mm_and_ps(_mm_sub_ps(value, average), _mm_cmpord_ps(value, value));
+            squares = _mm_add_ps(squares, _mm_mul_ps(deviation, deviation));
+        }
+        alignas(16) float squareSums[LANES];
+        _mm_store_ps(squareSums, squares);
+        for (size_t lane = 0; lane < LANES; lane++) setVariance(squareSums[lane], output + lane);
+    }
+
+    void reduceBlock(const int16_t* block, const size_t rows, const size_t stride, ColumnStatistics* output) {
+        const __m128i missing = _mm_set1_epi16(ColumnReducer::MISSING_INT16);
+        const __m128i highest = _mm_set1_epi16(INT16_MAX);
+        __m128i count = _mm_setzero_si128();
+        __m128i sum = _mm_setzero_si128();
+        __m128i min = highest;
+        __m128i max = missing;
+        for (size_t row = 0; row < rows; row++) {
+            // LANES values in the low half; min/max stay 16 bit (SSE2 has no 32 bit ones), the sum widens
+            const __m128i value = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(block + row * stride));
+            const __m128i isMissing = _mm_cmpeq_epi16(value, missing);
+            min = _mm_min_epi16(min, _mm_or_si128(_mm_andnot_si128(isMissing, value), _mm_and_si128(isMissing, highest)));
+            max = _mm_max_epi16(max, value);
+            const __m128i wide = _mm_srai_epi32(_mm_unpacklo_epi16(value, value), 16);
+            const __m128i wideMissing = _mm_srai_epi32(_mm_unpacklo_epi16(isMissing, isMissing), 16);
+            count = _mm_sub_epi32(count, _mm_xor_si128(wideMissing, _mm_set1_epi32(-1)));
+            sum = _mm_add_epi32(sum, _mm_andnot_si128(wideMissing, wide));
+        }
+        min = _mm_srai_epi32(_mm_unpacklo_epi16(min, min), 16);
+        max = _mm_srai_epi32(_mm_unpacklo_epi16(max, max), 16);
+        alignas(16) int32_t counts[LANES];
+        alignas(16) int32_t sums[LANES];
+        alignas(16) int32_t mins[LANES];
+        alignas(16) int32_t maxes[LANES];
+        _mm_store_si128(reinterpret_cast<__m128i*>(counts), count);
+        _mm_store_si128(reinterpret_cast<__m128i*>(sums), sum);
+        _mm_store_si128(reinterpret_cast<__m128i*>(mins), min);
+        _mm_store_si128(reinterpret_cast<__m128i*>(maxes), max);
+        alignas(16) float means[LANES];
+        for (size_t lane = 0; lane < LANES; lane++) {
+            finish(counts[lane], sums[lane], mins[lane], maxes[lane], output + lane);
+            means[lane] = mean(output[lane]);
+        }
+        const __m128 average = _mm_load_ps(means);
+        __m128 squares = _mm_setzero_ps();
+        for (size_t row = 0; row < rows; row++) {
+            const __m128i value = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(block + row * stride));
+            const __m128i isMissing = _mm_cmpeq_epi16(value, missing);
+            const __m128 wide = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(value, value), 16));
+            const __m128i wideMissing = _mm_srai_epi32(_mm_unpacklo_epi16(isMissing, isMissing), 16);
+            const __m128 deviation = _mm_andnot_ps(_mm_castsi128_ps(wideMissing), _mm_sub_ps(wide, average));
+            squares = _mm_add_ps(squares, _mm_mul_ps(deviation, deviation));
+        }
+        alignas(16) float squareSums[LANES];
+        _mm_store_ps(squareSums, squares);
+        for (size_t lane = 0; lane < LANES; lane++) setVariance(squareSums[lane], output + lane);
+    }
+#elif defined(__ARM_NEON)
+    void reduceBlock(const float* block, const size_t rows, const size_t stride, ColumnStatistics* output) {
+        int32x4_t count = vdupq_n_s32(0);
+        float32x4_t sum = vdupq_n_f32(0.0f);
+        float32x4_t min = vdupq_n_f32(INFINITY);
+        float32x4_t max = vdupq_n_f32(-INFINITY);
+        for (size_t row = 0; row < rows; row++) {
+            const float32x4_t value = vld1q_f32(block + row * stride);
+            const uint32x4_t isNumber = vceqq_f32(value, value);
+            count = vsubq_s32(count, vreinterpretq_s32_u32(isNumber));
+            sum = vaddq_f32(sum, vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(value), isNumber)));
+            // vminq/vmaxq propagate NaN, so select on the comparison like the scalar kernel does
+            min = vbslq_f32(vcltq_f32(value, min), value, min);
+            max = vbslq_f32(vcgtq_f32(value, max), value, max);
+        }
+        int32_t counts[LANES];
+        float sums[LANES];
+        float mins[LANES];
+        float maxes[LANES];
+        vst1q_s32(counts, count);
+        vst1q_f32(sums, sum);
+        vst1q_f32(mins, min);
+        vst1q_f32(maxes, max);
+        float means[LANES];
+        for (size_t lane = 0; lane < LANES; lane++) {
+            finish(counts[lane], sums[lane], mins[lane], maxes[lane], output + lane);
+            means[lane] = mean(output[lane]);
+        }
+        const float32x4_t average = vld1q_f32(means);
+        float32x4_t squares = vdupq_n_f32(0.0f);
+        for (size_t row = 0; row < rows; row++) {
+            const float32x4_t value = vld1q_f32(block + row * stride);
+            const uint32x4_t difference = vreinterpretq_u32_f32(vsubq_f32(value, average));
+            const float32x4_t deviation = vreinterpretq_f32_u32(vandq_u32(difference, vceqq_f32(value, value)));
+            squares = vaddq_f32(squares, vmulq_f32(deviation, deviation));
+        }
+        float squareSums[LANES];
+        vst1q_f32(squareSums, squares);
+        for (size_t lane = 0; lane < LANES; lane++) setVariance(squareSums[lane], output + lane);
+    }
+
+    void reduceBlock(const int16_t* block, const size_t rows, const size_t stride, ColumnStatistics* output) {
+        const int16x4_t missing = vdup_n_s16(ColumnReducer::MISSING_INT16);
+        int32x4_t count = vdupq_n_s32(0);
+        int32x4_t sum = vdupq_n_s32(0);
+        int16x4_t min = vdup_n_s16(INT16_MAX);
+        int16x4_t max = missing;
+        for (size_t row = 0; row < rows; row++) {
+            const int16x4_t value = vld1_s16(block + row * stride);
+            const uint16x4_t isMissing = vceq_s16(value, missing);
+            min = vmin_s16(min, vbsl_s16(isMissing, vdup_n_s16(INT16_MAX), value));
+            max = vmax_s16(max, value);
+            // sign extension turns the 16 bit mask into a 32 bit one
+            const int32x4_t wideMissing = vmovl_s16(vreinterpret_s16_u16(isMissing));
+            count = vsubq_s32(count, vmvnq_s32(wideMissing));
+            sum = vaddq_s32(sum, vbicq_s32(vmovl_s16(value), wideMissing));
+        }
+        int32_t counts[LANES];
+        int32_t sums[LANES];
+        int32_t mins[LANES];
+        int32_t maxes[LANES];
+        vst1q_s32(counts, count);
+        vst1q_s32(sums, sum);
+        vst1q_s32(mins, vmovl_s16(min));
+        vst1q_s32(maxes, vmovl_s16(max));
+        float means[LANES];
+        for (size_t lane = 0; lane < LANES; lane++) {
+            finish(counts[lane], sums[lane], mins[lane], maxes[lane], output + lane);
+            means[lane] = mean(output[lane]);
+        }
+        const float32x4_t average = vld1q_f32(means);
+        float32x4_t squares = vdupq_n_f32(0.0f);
+        for (size_t row = 0; row < rows; row++) {
+            const int16x4_t value = vld1_s16(block + row * stride);
+            const uint32x4_t isPresent = vreinterpretq_u32_s32(vmvnq_s32(vmovl_s16(vreinterpret_s16_u16(vceq_s16(value, missing)))));
+            const uint32x4_t difference = vreinterpretq_u32_f32(vsubq_f32(vcvtq_f32_s32(vmovl_s16(value)), average));
+            const float32x4_t deviation = vreinterpretq_f32_u32(vandq_u32(difference, isPresent));
+            squares = vaddq_f32(squares, vmulq_f32(deviation, deviation));
+        }
+        float squareSums[LANES];
+        vst1q_f32(squareSums, squares);
+        for (size_t lane = 0; lane < LANES; lane++) setVariance(squareSums[lane], output + lane);
+    }
+#endif
+
+    template <typename T>
+    void reduceColumns(const T* matrix, const size_t rows, const size_t columns, const size_t stride,
+                       ColumnStatistics* output, const bool useVectors) {
+        size_t column = 0;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+        if (useVectors) {
+            for (; column + LANES <= columns; column += LANES) reduceBlock(matrix + column, rows, stride, output + column);
+        }
+#else
+        (void)useVectors;
+#endif
+        for (; column < columns; column++) reduceColumn(matrix + column, rows, stride, output + column);
+    }
+}
+
+const char* ColumnReducer::kernel() {
+#if defined(__SSE2__)
+    return "sse2";
+#elif defined(__ARM_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+/// @brief Reduce each of the columns of a row-major matrix (stride values per row, stride >= columns)
+/// into output[column]. NaN values are skipped.
+void ColumnReducer::reduce(const float* matrix, const size_t rows, const size_t columns, const size_t stride,
+                           ColumnStatistics* output) {
+    reduceColumns(matrix, rows, columns, stride, output, true);
+}
+
+/// @brief Like the float version, skipping MISSING_INT16 values. Statistics are in the units of the input.
+void ColumnReducer::reduce(const int16_t* matrix, const size_t rows, const size_t columns, const size_t stride,
+                           ColumnStatistics* output) {
+    reduceColumns(matrix, rows, columns, stride, output, true);
+}
+
+/// @brief Reduce one column at a time. The reference for the vector kernels.
+void ColumnReducer::reduceScalar(const float* matrix, const size_t rows, const size_t columns, const size_t stride,
+                                 ColumnStatistics* output) {
+    reduceColumns(matrix, rows, columns, stride, output, false);
+}
+
+/// @brief Reduce one column at a time. The reference for the vector kernels.
+void ColumnReducer::reduceScalar(const int16_t* matrix, const size_t rows, const size_t columns, const size_t stride,
+                                 ColumnStatistics* output) {
+    reduceColumns(matrix, rows, columns, stride, output, false);
+}
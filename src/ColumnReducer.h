@@ -0,0 +1,44 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef COLUMN_REDUCER_H
+#define COLUMN_REDUCER_H
+
+#include <cstddef>
+#include <cstdint>
+
+/// @brief Statistics of one column, over the values that are not missing (NaN, or MISSING_INT16)
+struct ColumnStatistics {
+    int32_t count = 0;
+    float sum = 0.0f;
+    float min = 0.0f;
+    float max = 0.0f;
+    float trimmedMean = 0.0f;  // without the highest and the lowest value; NaN with fewer than 3 values
+    float variance = 0.0f;     // sample variance; NaN with fewer than 2 values
+};
+
+/// @brief Reductions over the columns of a row-major matrix, e.g. samples (rows) of several sensors (columns).
+/// A vector register holds the same row of adjacent columns (SSE2 or NEON, with a scalar fallback), so each
+/// column is still reduced in row order: the results are bit-identical to the scalar kernel, and the trimmed mean
+/// to what ClimateMeasurement always did (which rounding to one decimal is sensitive to).
+/// int16 columns (e.g. tenths of degrees) mark missing values with MISSING_INT16, and are summed exactly.
+class ColumnReducer {
+public:
+    static constexpr int16_t MISSING_INT16 = INT16_MIN;
+
+    static const char* kernel();
+    static void reduce(const float* matrix, size_t rows, size_t columns, size_t stride, ColumnStatistics* output);
+    static void reduce(const int16_t* matrix, size_t rows, size_t columns, size_t stride, ColumnStatistics* output);
+    static void reduceScalar(const float* matrix, size_t rows, size_t columns, size_t stride, ColumnStatistics* output);
+    static void reduceScalar(const int16_t* matrix, size_t rows, size_t columns, size_t stride, ColumnStatistics* output);
+};
+
+#endif
@@ -9,6 +9,7 @@
 //   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 //   See the License for the specific language governing permissions and limitations under the License.
 
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 #include <iostream>
@@ -53,6 +54,18 @@ bool Config::setDevice(std::string_view hostName) {
     return true;
 }
 
+/// @brief All entries with keys starting with prefix (e.g. "zone."), without the prefix, sorted by key
+ConfigEntries Config::entriesWithPrefix(const std::string& prefix) const {
+    ConfigEntries entries;
+    for (const auto& [key, value] : _config) {
+        if (key.size() > prefix.size() && key.compare(0, prefix.size(), prefix) == 0) {
+            entries.emplace_back(key.substr(prefix.size()), value);
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+    return entries;
+}
+
 std::string Config::getEntry(const std::string& key, const std::string& defaultValue) const {
 	const auto iterator = _config.find(key);
     if (iterator == _config.end()) {
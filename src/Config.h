@@ -4,8 +4,11 @@
 #include <unordered_map>
 #include <string>
 #include <type_traits>
+#include <utility>
+#include <vector>
 
 using ConfigMap = std::unordered_map<std::string, std::string>;
+using ConfigEntries = std::vector<std::pair<std::string, std::string>>;
 
 // Copyright 2023 Rik Essenius
 // 
@@ -22,6 +25,7 @@ class Config {
 public:
     bool begin(const std::string& configInput, const std::string& hostName = "");
 
+    [[nodiscard]] ConfigEntries entriesWithPrefix(const std::string& prefix) const;
     [[nodiscard]] std::string getEntry(const std::string& key, const std::string& defaultValue = "") const;
 
     template <typename T>
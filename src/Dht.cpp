@@ -10,9 +10,16 @@
 //   See the License for the specific language governing permissions and limitations under the License.
 
 #include <pigpio.h>
+#include <algorithm>
+#include <chrono>
 #include <cstdio> 
 #include <cmath>
+#include "AllocationTracker.h"
 #include "Dht.h"
+#include "LatencyRecorder.h"
+#include "ResourceMonitor.h"
+#include "Shutdown.h"
+#include "Trace.h"
 
 // must run as sudo
 
@@ -27,8 +34,19 @@ constexpr uint32_t WAIT_INTERVAL_MICROS = 500;
 // when powering down, wait at least 50 ms before powering up
 constexpr uint32_t SHUTDOWN_TIME_MICROS = 50000;
 constexpr int MAX_CONSECUTIVE_FAILURES = 10;
+// with duty cycling, when powering up fails, try again after this (with the full warm-up)
+constexpr uint32_t RESUME_RETRY_MICROS = 1000000;
 
-Dht::Dht(SensorData* sensorData, Config* config) :  _sensorData(sensorData), _config(config) {}
+namespace {
+    uint32_t steadyMicros() {
+        return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+}
+
+Dht::Dht(SensorData* sensorData, Config* config) :  _sensorData(sensorData), _config(config), _adaptiveInterval(config),
+    _edgeRecorder(config, sensorData), _phaseSchedule(config),
+    _burstSchedule(config, [this](const uint32_t tick, const bool notBefore) { return alignToGrid(tick, notBefore); }) {}
 
 Dht::~Dht() {
     log("Dht destructor", true);
@@ -38,6 +56,30 @@ Dht::~Dht() {
 bool Dht::begin() {
     _config->setIfExists("dataPin", &_dataPin);
     _config->setIfExists("powerPin", &_powerPin);
+    // only the first time: after a reset (which calls begin again), an interval set via the control node must stay
+    if (!_isIntervalConfigured) {
+        _isIntervalConfigured = true;
+        int intervalSeconds = 0;
+        _config->setIfExists("intervalSeconds", &intervalSeconds);
+        if (intervalSeconds != 0 && !setIntervalSeconds(intervalSeconds)) {
+            printf("Ignoring intervalSeconds=%d: must be between %d and %d\n", intervalSeconds, MIN_INTERVAL_SECONDS, MAX_INTERVAL_SECONDS);
+        }
+    }
+    // adaptive=1 stretches the interval while the values are stable
+    _adaptiveInterval.begin();
+    // edgeTrace=failures|all records the raw edges of (failed) frames for offline replay
+    _edgeRecorder.begin();
+    // phaseSpread=1 reads on a wall-clock grid, shifted by a phase that follows from the device name
+    _phaseSchedule.begin();
+    _phaseSchedule.report(_intervalMicros);
+    // dutyCycle=1 powers the sensor up warmupMillis before a burst of burstSamples reads, and down after it
+    _burstSchedule.begin();
+    if (_burstSchedule.isEnabled()) {
+        const auto burstMicros = _burstSchedule.minimumIntervalMicros();
+        if (burstMicros >= _intervalMicros) {
+            printf("Duty cycling needs an interval over %u s; until then the sensor stays powered\n", burstMicros / 1000000);
+        }
+    }
     auto cfg = gpioCfgGetInternals();
     cfg |= PI_CFG_NOSIGHANDLER;  
     gpioCfgSetInternals(cfg);
@@ -49,14 +91,27 @@ bool Dht::begin() {
 
     gpioSetMode(_powerPin, PI_OUTPUT);
     gpioWrite(_powerPin, PI_HIGH);
+    _isPowered = true;
+    _isSuspended = false;
     _startupTime = gpioTick();
     printf("%u: Initialized GPIO v%u, HW revision: %u\n", _startupTime, gpioVersion(), gpioHardwareRevision());
     _lastReadTime = _startupTime - MIN_INTERVAL_MICROS;
-    _nextScheduledRead = _startupTime + MIN_INTERVAL_MICROS;
+    _nextScheduledRead = alignToGrid(_startupTime + MIN_INTERVAL_MICROS, true);
+    _burstSchedule.start(_nextScheduledRead);
     _consecutiveFailures = 0;
     return true;
 }
 
+/// @brief With phaseSpread, move a read to this device's slot on the wall-clock grid of the read interval:
+/// the first one at or after the tick, or the nearest one (which also corrects drift between gpioTick and the wall clock).
+uint32_t Dht::alignToGrid(const uint32_t tick, const bool notBefore) const {
+    if (!_phaseSchedule.isEnabled()) return tick;
+    const auto wallMicros = PhaseSchedule::wallMicros() + static_cast<int32_t>(tick - this->tick());
+    const auto correction = notBefore ? _phaseSchedule.untilNextSlotMicros(wallMicros, _intervalMicros)
+                                      : _phaseSchedule.nearestSlotMicros(wallMicros, _intervalMicros);
+    return tick + static_cast<uint32_t>(correction);
+}
+
 float Dht::readHumidity() {
     if (read()) {
         return _humidity;
@@ -64,6 +119,16 @@ float Dht::readHumidity() {
     return NAN;
 }
 
+/// @brief Read the sensor (or use the cached result, like readTemperature), with the time the sensor sent the values.
+/// Values are NaN if the read failed.
+Sample Dht::readSample() {
+    if (read()) return _sample;
+    Sample failed = _sample;
+    failed.temperature = NAN;
+    failed.humidity = NAN;
+    return failed;
+}
+
 float Dht::readTemperature() {
     if (read()) {
         return _temperature;
@@ -84,7 +149,56 @@ void Dht::reportResult(const bool success) {
     }
 }
 
-void Dht::shutdown() const {
+/// @brief Power up the sensor (and pigpio) again after suspend(), for the warm-up before a burst
+/// @return false if pigpio could not be initialized; we're then still suspended
+bool Dht::resume() {
+    if (gpioInitialise() < 0) {
+        log("could not initialize GPIO after suspending", false);
+        return false;
+    }
+    _isSuspended = false;
+    gpioSetMode(_powerPin, PI_OUTPUT);
+    gpioWrite(_powerPin, PI_HIGH);
+    _isPowered = true;
+    log("Sensor powered up for the next burst", true);
+    return true;
+}
+
+/// @brief Change the time between sensor reads. A pending wait is adjusted right away.
+/// @return false if out of range (MIN_INTERVAL_SECONDS .. MAX_INTERVAL_SECONDS)
+bool Dht::setIntervalSeconds(const int seconds) {
+    if (seconds < MIN_INTERVAL_SECONDS || seconds > MAX_INTERVAL_SECONDS) return false;
+    _intervalMicros = static_cast<uint32_t>(seconds) * 1000000U;
+    _intervalChanged = true;
+    return true;
+}
+
+/// @brief Record the values with the time of the first edge, mapped from gpioTick to the steady and system clocks,
+/// and the capture and decode latencies.
+void Dht::stampSample() {
+    const uint32_t now = gpioTick();
+    const auto monotonicNow = LatencyRecorder::nowMicros();
+    const auto wallNow = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    const uint32_t firstEdge = _sensorData->firstEdgeTime();
+    // unsigned arithmetic deals with the tick wrapping around (every 72 minutes)
+    const auto sinceFirstEdge = static_cast<int64_t>(now - firstEdge);
+    _sample.temperature = _temperature;
+    _sample.humidity = _humidity;
+    _sample.tick = firstEdge;
+    _sample.monotonicMicros = monotonicNow - sinceFirstEdge;
+    _sample.wallMillis = wallNow - sinceFirstEdge / 1000;
+    _sample.decodedMicros = monotonicNow;
+    if (_conversionOk) {
+        LatencyRecorder::record(LatencyStage::Capture, static_cast<int64_t>(_sensorData->lastEdgeTime() - firstEdge));
+        LatencyRecorder::record(LatencyStage::Decode, static_cast<int64_t>(now - _sensorData->lastEdgeTime()));
+    }
+}
+
+/// @brief Power down the sensor and release the GPIO. Only the first call does something, so the shutdown sequence,
+/// the deadline hook and the destructor can all call it.
+void Dht::shutdown() {
+    if (!_isPowered.exchange(false)) return;
     log("Shutting down DHT", false);
     gpioWrite(_powerPin, PI_LOW);
     gpioTerminate();
@@ -99,32 +213,104 @@ void Dht::reset() {
     _lastReadTime = _startupTime;
 }
 
+/// @brief Time until the next scheduled read, taking a changed interval into account.
+/// If we're more than 10 milliseconds late (e.g. after connection issues), the schedule is reset to now.
+/// With duty cycling, this powers the sensor up again once the warm-up before the next burst starts.
+int32_t Dht::microsUntilNextRead() {
+    if (_intervalChanged.exchange(false)) {
+        _adaptiveInterval.reset();
+        if (_burstSchedule.isEnabled()) {
+            _sampleMicros = _intervalMicros / static_cast<uint32_t>(_burstSchedule.burstSamples());
+            _burstSchedule.changeInterval(_intervalMicros, tick(), _isSuspended);
+            _nextScheduledRead = _burstSchedule.nextRead();
+        } else {
+            _sampleMicros = _intervalMicros;
+            _nextScheduledRead = alignToGrid(_lastReadTime + _intervalMicros, true);
+        }
+    }
+    if (_isSuspended) {
+        const auto untilWarmup = _burstSchedule.untilWarmup(tick());
+        if (untilWarmup > 0) return untilWarmup;
+        if (!resume()) {
+            // stay suspended, and try again later, with the full warm-up
+            _burstSchedule.postpone(RESUME_RETRY_MICROS);
+            _nextScheduledRead = _burstSchedule.nextRead();
+            return static_cast<int32_t>(RESUME_RETRY_MICROS);
+        }
+    }
+    const auto waitTime = static_cast<int32_t>(_nextScheduledRead - tick());
+    if (waitTime < -10000) {
+        printf("Recalibrating. Next scheduled read was %u us ago. New is %u plus time for this print command\n", -waitTime, tick());
+        _nextScheduledRead = tick();
+    }
+    return waitTime > 0 ? waitTime : 0;
+}
+
 bool Dht::waitForNextMeasurement(volatile bool& keepGoing) {
-	const uint32_t currentTime = gpioTick();
-    if (currentTime == static_cast<uint32_t>(PI_NOT_INITIALISED)) return false;
+    if (!_isSuspended && gpioTick() == static_cast<uint32_t>(PI_NOT_INITIALISED)) return false;
     log("Waiting", true);
     int32_t waitTime;
-    while (waitTime = static_cast<int32_t>(_nextScheduledRead - gpioTick()), waitTime > 0 && keepGoing) {
+    // sleep in slices, so an interval change is picked up quickly; a shutdown request ends the sleep right away
+    while (waitTime = microsUntilNextRead(), waitTime > 0 && keepGoing) {
         const auto timeToSleep = std::min(waitTime, 100000);
-        gpioDelay(timeToSleep);
-    }
-    // printf("Waited %u us for next measurement\n", gpioTick() - currentTime);
-    if (waitTime < -10000) {
-        // if we're off more than 10 milliseconds, recalibrate. This could happen after connection issues
-        printf("Recalibrating. Next scheduled read was %u us ago. New is %u plus time for this print command\n", -waitTime, gpioTick());
-        _nextScheduledRead = gpioTick();
+        if (!Shutdown::sleepMicros(timeToSleep)) break;
     }
     return true;
 }
 
+/// @brief Power down the sensor until the next burst. The data line must not pull up, or it would feed the sensor.
+/// Terminating pigpio stops its sampling and threads; the schedule continues on the steady clock.
+void Dht::suspend() {
+    log("Suspending until the next burst", true);
+    gpioWrite(_powerPin, PI_LOW);
+    gpioSetMode(_dataPin, PI_INPUT);
+    gpioSetPullUpDown(_dataPin, PI_PUD_OFF);
+    _tickOffset = gpioTick() - steadyMicros();
+    _isSuspended = true;
+    _isPowered = false;
+    gpioTerminate();
+}
+
+/// @brief gpioTick, also while pigpio is terminated between bursts
+uint32_t Dht::tick() const {
+    return _isSuspended ? steadyMicros() + _tickOffset : gpioTick();
+}
+
+// pigpio's alert thread doesn't have a name of its own; give it one on its first callback
+void nameAlertThread() {
+    thread_local const bool isNamed = (ResourceMonitor::nameThread("pigpio-alert"), true);
+    (void)isNamed;
+}
+
+// one span per burst of edges, on the pigpio thread
+void traceBurst([[maybe_unused]] const SensorData* data, [[maybe_unused]] const bool wasReading) {
+    if (wasReading && !data->isReading()) {
+        [[maybe_unused]] const auto burst = static_cast<int64_t>(data->lastEdgeTime() - data->firstEdgeTime());
+        TRACE_COMPLETE("pigpio edges", Trace::nowMicros() - burst, burst);
+    }
+}
+
 void pinCallback([[maybe_unused]] int gpio, int level, uint32_t tick, void *userData) {
+    nameAlertThread();
 	auto*data = static_cast<SensorData*>(userData);
+    [[maybe_unused]] const bool wasReading = data->isReading();
     data->addEdge(level, tick);
+    traceBurst(data, wasReading);
+}
+
+// used with edgeTrace; the recorder passes the edges on to the sensor data
+void recordingPinCallback([[maybe_unused]] int gpio, int level, uint32_t tick, void *userData) {
+    nameAlertThread();
+    auto* recorder = static_cast<EdgeRecorder*>(userData);
+    [[maybe_unused]] const bool wasReading = recorder->sensorData()->isReading();
+    recorder->addEdge(level, tick);
+    traceBurst(recorder->sensorData(), wasReading);
 }
 
 /// @brief Read the sensor and store the result in the class variables. Expects the sensor to be powered up (does not wait).
 /// @return whether a valid result is available. A cached result of less than two seconds old is considered valid.
 bool Dht::read() {
+    AllocationScope scope(AllocationTag::Sensor);
     // printf("Reading\n");
     const uint32_t currentTime = gpioTick();
     if ((static_cast<int32_t>(currentTime - _lastReadTime) < static_cast<int32_t>(MIN_INTERVAL_MICROS)) && (static_cast<int32_t>(currentTime - _nextScheduledRead) < 0)) {
@@ -133,65 +319,100 @@ bool Dht::read() {
     }
 
     _lastReadTime = currentTime;
-    _nextScheduledRead += MIN_INTERVAL_MICROS;
     // printf("Reading.. (last=%u, next=%u, diff=%d)\n", _lastReadTime, _nextScheduledRead, static_cast<int32_t>(_nextScheduledRead - _lastReadTime));
 
     // Send start signal.  See DHT data sheet for full signal diagram:
     //   http://www.adafruit.com/datasheets/Digital%20humidity%20and%20temperature%20sensor%20AM2302.pdf
 
-    // Pull up the data line and wait a millisecond.
-    gpioSetMode(_dataPin, PI_INPUT);
-    gpioSetPullUpDown(_dataPin, PI_PUD_UP);
-    gpioDelay(1000);
+    TRACE_SPAN("Dht::read");
+    {
+        TRACE_SPAN("start pulse");
+        // Pull up the data line and wait a millisecond.
+        gpioSetMode(_dataPin, PI_INPUT);
+        gpioSetPullUpDown(_dataPin, PI_PUD_UP);
+        gpioDelay(1000);
 
-    // Set data line low for 1.1 ms (which satisfies "at least 1ms" for DHT22)
+        // Set data line low for 1.1 ms (which satisfies "at least 1ms" for DHT22)
 
-    gpioSetMode(_dataPin, PI_OUTPUT);
-    gpioWrite(_dataPin, PI_LOW);
+        gpioSetMode(_dataPin, PI_OUTPUT);
+        gpioWrite(_dataPin, PI_LOW);
 
-    gpioDelay(1100); 
+        gpioDelay(1100); 
+    }
+    {
+        TRACE_SPAN("capture");
+        const uint32_t startTick = gpioTick();
+        _sensorData->initRead(startTick);
+        _edgeRecorder.beginFrame(startTick);
 
-    _sensorData->initRead(gpioTick());
+        // Pull up the data line again, and let the sensor take over.
+        gpioSetMode(_dataPin, PI_INPUT);
+        gpioSetPullUpDown(_dataPin, PI_PUD_UP);
 
-    // Pull up the data line again, and let the sensor take over.
-    gpioSetMode(_dataPin, PI_INPUT);
-    gpioSetPullUpDown(_dataPin, PI_PUD_UP);
-
-    // monitor the pin for changes 
-    gpioSetAlertFuncEx(_dataPin, pinCallback, _sensorData);
-    // time out if we don't get a change on time
-    gpioSetWatchdog(_dataPin, READ_TIMEOUT_MILLIS); 
-
-    // uint32_t waitTime = gpioTick();
-    // wait for the callback to complete reading.
-    gpioDelay(MINIMUM_READ_TIME_MICROS);
-    while (_sensorData->isReading()) {
-        log("Waiting for data", true);
-        gpioDelay(WAIT_INTERVAL_MICROS);
-    } 
-    // waitTime = gpioTick() - waitTime;
+        // monitor the pin for changes 
+        if (_edgeRecorder.isRecording()) {
+            gpioSetAlertFuncEx(_dataPin, recordingPinCallback, &_edgeRecorder);
+        } else {
+            gpioSetAlertFuncEx(_dataPin, pinCallback, _sensorData);
+        }
+        // time out if we don't get a change on time
+        gpioSetWatchdog(_dataPin, READ_TIMEOUT_MILLIS); 
+
+        // wait for the callback to complete reading.
+        gpioDelay(MINIMUM_READ_TIME_MICROS);
+    }
+    {
+        TRACE_SPAN("wait loop");
+        while (_sensorData->isReading()) {
+            log("Waiting for data", true);
+            gpioDelay(WAIT_INTERVAL_MICROS);
+        } 
+    }
 
     // stop the watch dog and the callback
     log("Stopping watchdog", true);
     gpioSetWatchdog(_dataPin, 0);
     log("Stopping callback", true);
     gpioSetAlertFuncEx(_dataPin, nullptr, nullptr);
-    // printf("Waited %u ns for data\n", waitTime);
+    _edgeRecorder.endFrame();
 
-    log("getting humidity", true);
-    _humidity = _sensorData->getHumidity();
-    log("getting temperature", true);
-    _temperature = _sensorData->getTemperature();
+    {
+        TRACE_SPAN("decode");
+        log("getting humidity", true);
+        _humidity = _sensorData->getHumidity();
+        log("getting temperature", true);
+        _temperature = _sensorData->getTemperature();
+    }
     if (const auto anomalies = _sensorData->getAnomalyCount(); anomalies > 0) {
         printf("Found %d anomalies\n", anomalies);
     }
     _conversionOk = _sensorData->isDone();
+    stampSample();
+    // schedule from the previous schedule rather than from now, so we don't drift
+    const auto previousRead = _nextScheduledRead;
+    if (_burstSchedule.isEnabled()) {
+        // reads come in bursts; the interval (stretched by the adaptive interval, if enabled) is between their starts
+        _sampleMicros = _intervalMicros / static_cast<uint32_t>(_burstSchedule.burstSamples());
+        const bool isBurstDone = _burstSchedule.index() + 1 >= _burstSchedule.burstSamples();
+        const auto interval = isBurstDone ? _adaptiveInterval.next(_conversionOk, _temperature, _humidity, _intervalMicros)
+                                          : _intervalMicros.load();
+        _burstSchedule.readDone(previousRead, interval);
+        _nextScheduledRead = _burstSchedule.nextRead();
+    } else {
+        _nextScheduledRead = alignToGrid(previousRead + _adaptiveInterval.next(_conversionOk, _temperature, _humidity, _intervalMicros), false);
+        _sampleMicros = _nextScheduledRead - previousRead;
+    }
     reportResult(_conversionOk);
+    // after a burst, power down if the gap is worth it (a reset in reportResult restarts the schedule)
+    if (_burstSchedule.shouldSuspend(tick())) {
+        suspend();
+    }
     return _conversionOk;
 }
 
-void Dht::log(const std::string& message, bool trace) const {
+// takes a C string, as building a std::string from the (often long) literals would allocate in the read loop
+void Dht::log(const char* message, bool trace) const {
     if (!trace || (trace && _trace)) {
-        printf("%u: %s\n", gpioTick(), message.c_str());
+        printf("%u: %s\n", tick(), message);
     }
 }
@@ -12,8 +12,14 @@
 #ifndef DHT_H
 #define DHT_H
 
+#include "AdaptiveInterval.h"
+#include "BurstSchedule.h"
+#include "EdgeRecorder.h"
+#include "PhaseSchedule.h"
+#include "Sample.h"
 #include "SensorData.h"
 #include "Config.h"
+#include <atomic>
 #include <cstdint>
 
 class Dht {
@@ -22,11 +28,24 @@ public:
     ~Dht();
     bool begin();
     float readHumidity();
+    Sample readSample();
     float readTemperature();
     void reset();
-    void shutdown() const;
+    void shutdown();
     bool waitForNextMeasurement(volatile bool& keepGoing);
-    void trace() { _trace = true; }
+    int32_t microsUntilNextRead();
+    bool hasIntervalChanged() const { return _intervalChanged; }
+    int intervalSeconds() const { return static_cast<int>(_intervalMicros / 1000000); }
+    bool setIntervalSeconds(int seconds);
+    float sampleSeconds() const { return static_cast<float>(_sampleMicros) / 1e6f; }
+    bool isTracing() const { return _trace; }
+    bool isDutyCycling() const { return _burstSchedule.isEnabled(); }
+    int burstSamples() const { return _burstSchedule.burstSamples(); }
+    const PhaseSchedule* phaseSchedule() const { return &_phaseSchedule; }
+    void trace(const bool on = true) { _trace = on; }
+
+    static constexpr int MIN_INTERVAL_SECONDS = 2; // the sensor can't be read more often
+    static constexpr int MAX_INTERVAL_SECONDS = 3600;
 
 private:
     uint8_t _powerPin = 4;
@@ -39,12 +58,32 @@ private:
     bool _conversionOk = false;
     float _humidity = 0.0f;
     float _temperature = 0.0f;
-    bool _trace = false;
+    // interval and trace can be changed at runtime from another thread (e.g. via MQTT)
+    std::atomic<uint32_t> _intervalMicros{MIN_INTERVAL_SECONDS * 1000000U};
+    std::atomic<bool> _intervalChanged{false};
+    bool _isIntervalConfigured = false;
+    std::atomic<bool> _trace{false};
+    // the shutdown sequence and the deadline hook (on the watcher thread) may race to power down
+    std::atomic<bool> _isPowered{false};
+    AdaptiveInterval _adaptiveInterval;
+    EdgeRecorder _edgeRecorder;
+    PhaseSchedule _phaseSchedule;
+    uint32_t _sampleMicros = MIN_INTERVAL_SECONDS * 1000000U;  // time until the next read, i.e. what the last sample stands for
     unsigned int _consecutiveFailures = 0;
+    Sample _sample;
+    // dutyCycle=1: the sensor and pigpio are only powered for a burst of reads per interval
+    BurstSchedule _burstSchedule;
+    bool _isSuspended = false;
+    uint32_t _tickOffset = 0;
 
+    uint32_t alignToGrid(uint32_t tick, bool notBefore) const;
     bool read();
-    void log(const std::string& message, bool trace = false) const;
+    void log(const char* message, bool trace = false) const;
     void reportResult(bool success);
+    bool resume();
+    void stampSample();
+    void suspend();
+    uint32_t tick() const;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,208 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "EdgeRecorder.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// File layout (native byte order, i.e. little endian on the Pi): a FileHeader, then frames of a FrameHeader
+// followed by edgeCount packed edges. The file is preallocated to edgeTraceMaxBytes while recording;
+// usedBytes says how much of it is valid, so a file left by a crashed process can still be read.
+namespace {
+    constexpr char MAGIC[8] = {'D', 'H', 'T', 'E', 'D', 'G', 'E', '1'};
+    constexpr size_t MIN_FILE_BYTES = 4096;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t usedBytes;
+    };
+
+    struct FrameHeader {
+        uint32_t startTick;
+        uint16_t edgeCount;
+        uint8_t state;
+        uint8_t anomalies;
+    };
+
+    static_assert(sizeof(FileHeader) == 16 && sizeof(FrameHeader) == 8, "trace file layout must not change");
+}
+
+EdgeRecorder::EdgeRecorder(const Config* config, SensorData* sensorData) : _config(config), _sensorData(sensorData) {}
+
+EdgeRecorder::~EdgeRecorder() {
+    close();
+}
+
+/// @brief Record the edge and pass it on to the SensorData. Runs on the pigpio thread, so it only stores a word.
+void EdgeRecorder::addEdge(const int level, const uint32_t tick) {
+    if (_sensorData->isReading()) {
+        const int index = _edgeCount.load(std::memory_order_relaxed);
+        if (index < MAX_FRAME_EDGES) {
+            _edges[index] = static_cast<uint32_t>(level) << EdgeFrame::LEVEL_SHIFT | ((tick - _frameStart) & EdgeFrame::OFFSET_MASK);
+            _edgeCount.store(index + 1, std::memory_order_release);
+        }
+    }
+    _sensorData->addEdge(level, tick);
+}
+
+/// @brief Read edgeTrace (off|failures|all), edgeTraceFile and edgeTraceMaxBytes, and open the trace file.
+/// @return whether frames are being recorded
+bool EdgeRecorder::begin() {
+    if (isRecording()) return true;
+    const auto mode = _config->getEntry("edgeTrace", "off");
+    if (mode == "all") {
+        _mode = EdgeTraceMode::All;
+    } else if (mode == "failures") {
+        _mode = EdgeTraceMode::Failures;
+    } else {
+        _mode = EdgeTraceMode::Off;
+        return false;
+    }
+    _path = _config->getEntry("edgeTraceFile", _path);
+    _config->setIfExists("edgeTraceMaxBytes", &_maxBytes);
+    if (_maxBytes < MIN_FILE_BYTES) _maxBytes = MIN_FILE_BYTES;
+    return open();
+}
+
+void EdgeRecorder::beginFrame(const uint32_t tick) {
+    _frameStart = tick;
+    _edgeCount.store(0, std::memory_order_release);
+}
+
+/// @brief Write the frame to the trace file if the mode asks for it. Call when the SensorData is no longer reading.
+/// @return whether the frame was written
+bool EdgeRecorder::endFrame() {
+    if (!isRecording()) return false;
+    const auto state = _sensorData->getState();
+    const auto anomalies = _sensorData->getAnomalyCount();
+    if (_mode == EdgeTraceMode::Failures && state == SensorState::Done && anomalies == 0) return false;
+
+    const int edgeCount = _edgeCount.load(std::memory_order_acquire);
+    const size_t frameBytes = sizeof(FrameHeader) + edgeCount * sizeof(uint32_t);
+    if (_used + frameBytes > _maxBytes && !rotate()) return false;
+
+    const FrameHeader header{_frameStart, static_cast<uint16_t>(edgeCount), static_cast<uint8_t>(state),
+                             static_cast<uint8_t>(anomalies > 255 ? 255 : anomalies)};
+    memcpy(_mapping + _used, &header, sizeof header);
+    memcpy(_mapping + _used + sizeof header, _edges, edgeCount * sizeof(uint32_t));
+    _used += frameBytes;
+    // the page cache takes care of writing it out; no msync, we only need to survive a crash of the process
+    reinterpret_cast<FileHeader*>(_mapping)->usedBytes = static_cast<uint32_t>(_used);
+    _framesWritten++;
+    return true;
+}
+
+/// @brief Call the visitor for each frame in a trace file, in the order they were recorded.
+/// @return the number of frames, or -1 if the file can't be read or isn't an edge trace
+long EdgeRecorder::forEachFrame(const std::string& path, const FrameVisitor& visitor) {
+    const int file = ::open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+        perror(("Could not open edge trace " + path).c_str());
+        return -1;
+    }
+    struct stat status{};
+    if (fstat(file, &status) != 0 || static_cast<size_t>(status.st_size) < sizeof(FileHeader)) {
+        ::close(file);
+        return -1;
+    }
+    const auto size = static_cast<size_t>(status.st_size);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+    ::close(file);
+    if (mapping == MAP_FAILED) {
+        perror("Could not map edge trace");
+        return -1;
+    }
+    const auto* data = static_cast<const uint8_t*>(mapping);
+    FileHeader fileHeader{};
+    memcpy(&fileHeader, data, sizeof fileHeader);
+    if (memcmp(fileHeader.magic, MAGIC, sizeof MAGIC) != 0 || fileHeader.version != 1) {
+        fprintf(stderr, "%s is not an edge trace\n", path.c_str());
+        munmap(mapping, size);
+        return -1;
+    }
+    const size_t used = fileHeader.usedBytes < size ? fileHeader.usedBytes : size;
+    long frames = 0;
+    size_t offset = sizeof(FileHeader);
+    while (offset + sizeof(FrameHeader) <= used) {
+        FrameHeader header{};
+        memcpy(&header, data + offset, sizeof header);
+        const size_t edgeBytes = header.edgeCount * sizeof(uint32_t);
+        if (offset + sizeof header + edgeBytes > used) break;
+        // frames are 4-byte aligned, so the edges can be used in place
+        const EdgeFrame frame{header.startTick, static_cast<SensorState>(header.state), header.anomalies, header.edgeCount,
+                              reinterpret_cast<const uint32_t*>(data + offset + sizeof header)};
+        visitor(frame);
+        frames++;
+        offset += sizeof header + edgeBytes;
+    }
+    munmap(mapping, size);
+    return frames;
+}
+
+/// @brief Feed the recorded edges into the sensor data, as the pigpio callback did
+void EdgeRecorder::replay(const EdgeFrame& frame, SensorData* sensorData) {
+    sensorData->initRead(frame.startTick);
+    for (int i = 0; i < frame.edgeCount; i++) {
+        sensorData->addEdge(frame.level(i), frame.tick(i));
+    }
+}
+
+// Unmap, and cut the file back to the part in use
+void EdgeRecorder::close() {
+    if (_mapping == nullptr) return;
+    munmap(_mapping, _maxBytes);
+    _mapping = nullptr;
+    if (ftruncate(_file, static_cast<off_t>(_used)) != 0) perror("Could not truncate edge trace");
+    ::close(_file);
+    _file = -1;
+}
+
+bool EdgeRecorder::open() {
+    _file = ::open(_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (_file < 0) {
+        perror(("Could not create edge trace " + _path).c_str());
+        return false;
+    }
+    if (ftruncate(_file, static_cast<off_t>(_maxBytes)) != 0) {
+        perror("Could not size edge trace");
+        ::close(_file);
+        _file = -1;
+        return false;
+    }
+    void* mapping = mmap(nullptr, _maxBytes, PROT_READ | PROT_WRITE, MAP_SHARED, _file, 0);
+    if (mapping == MAP_FAILED) {
+        perror("Could not map edge trace");
+        ::close(_file);
+        _file = -1;
+        return false;
+    }
+    _mapping = static_cast<uint8_t*>(mapping);
+    FileHeader header{};
+    memcpy(header.magic, MAGIC, sizeof MAGIC);
+    header.version = 1;
+    header.usedBytes = sizeof(FileHeader);
+    memcpy(_mapping, &header, sizeof header);
+    _used = sizeof(FileHeader);
+    printf("Recording %s edge frames to %s\n", _mode == EdgeTraceMode::All ? "all" : "failed", _path.c_str());
+    return true;
+}
+
+bool EdgeRecorder::rotate() {
+    close();
+    const auto previous = _path + ".1";
+    if (rename(_path.c_str(), previous.c_str()) != 0) perror("Could not rotate edge trace");
+    return open();
+}
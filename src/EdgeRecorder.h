@@ -0,0 +1,89 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef EDGE_RECORDER_H
+#define EDGE_RECORDER_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include "Config.h"
+#include "SensorData.h"
+
+enum class EdgeTraceMode { Off, Failures, All };
+
+/// @brief One recorded frame: the edges the sensor sent after initRead, and how SensorData judged them.
+/// Each edge is packed in 32 bits: the level in the top 2 bits, the ticks since startTick in the rest.
+struct EdgeFrame {
+    static constexpr int LEVEL_SHIFT = 30;
+    static constexpr uint32_t OFFSET_MASK = (1U << LEVEL_SHIFT) - 1;
+
+    uint32_t startTick;
+    SensorState state;
+    uint8_t anomalies;
+    uint16_t edgeCount;
+    const uint32_t* edges;
+
+    int level(const int index) const { return static_cast<int>(edges[index] >> LEVEL_SHIFT); }
+    uint32_t tick(const int index) const { return startTick + (edges[index] & OFFSET_MASK); }
+};
+
+/// @brief Records the raw (level, tick) edges of each frame into a memory-mapped trace file, either all frames
+/// (edgeTrace=all) or only those that failed or had anomalies (edgeTrace=failures). When the file reaches
+/// edgeTraceMaxBytes it is renamed to <edgeTraceFile>.1 (replacing an older one) and a new one is started.
+/// The files can be read back with forEachFrame and fed into a SensorData with replay.
+class EdgeRecorder {
+public:
+    static constexpr int MAX_FRAME_EDGES = 128;  // EDGES plus room for spurious edges and the watchdog timeout
+
+    using FrameVisitor = std::function<void(const EdgeFrame& frame)>;
+
+    EdgeRecorder(const Config* config, SensorData* sensorData);
+    ~EdgeRecorder();
+    EdgeRecorder(const EdgeRecorder&) = delete;
+    EdgeRecorder(EdgeRecorder&&) = delete;
+    EdgeRecorder& operator=(const EdgeRecorder&) = delete;
+    EdgeRecorder& operator=(EdgeRecorder&&) = delete;
+
+    void addEdge(int level, uint32_t tick);
+    bool begin();
+    void beginFrame(uint32_t tick);
+    bool endFrame();
+    uint64_t framesWritten() const { return _framesWritten; }
+    bool isRecording() const { return _mapping != nullptr; }
+    EdgeTraceMode mode() const { return _mode; }
+    SensorData* sensorData() const { return _sensorData; }
+
+    static long forEachFrame(const std::string& path, const FrameVisitor& visitor);
+    static void replay(const EdgeFrame& frame, SensorData* sensorData);
+
+private:
+    const Config* _config;
+    SensorData* _sensorData;
+    EdgeTraceMode _mode = EdgeTraceMode::Off;
+    std::string _path = "/var/tmp/dht-edges.bin";
+    size_t _maxBytes = 1024 * 1024;
+    int _file = -1;
+    uint8_t* _mapping = nullptr;
+    size_t _used = 0;
+    uint64_t _framesWritten = 0;
+    uint32_t _frameStart = 0;
+    // written by the pigpio thread, read after the frame is complete
+    uint32_t _edges[MAX_FRAME_EDGES] = {};
+    std::atomic<int> _edgeCount{0};
+
+    void close();
+    bool open();
+    bool rotate();
+};
+
+#endif
@@ -0,0 +1,157 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "EventLoop.h"
+#include <cerrno>
+#include <cstdio>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+EventLoop::~EventLoop() {
+    for (const int timer : _timers) close(timer);
+    if (_signals >= 0) close(_signals);
+    if (_epoll >= 0) close(_epoll);
+    if (_hasPreviousMask) pthread_sigmask(SIG_SETMASK, &_previousMask, nullptr);
+}
+
+bool EventLoop::begin() {
+    if (_epoll >= 0) return true;
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (_epoll < 0) {
+        perror("Could not create epoll instance");
+        return false;
+    }
+    return true;
+}
+
+/// @brief Run the hook before each wait, e.g. to update what a file descriptor is watched for
+void EventLoop::beforeWait(Hook hook) {
+    _hooks.push_back(std::move(hook));
+}
+
+/// @brief Create a (disarmed) timer; set it with setTimer. The handler is called after each expiry.
+/// @return the timer's file descriptor, or -1 on failure
+int EventLoop::createTimer(Handler handler) {
+    const int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer < 0) {
+        perror("Could not create timer");
+        return -1;
+    }
+    const bool watching = watch(timer, EPOLLIN, [timer, handler = std::move(handler)](const uint32_t events) {
+        uint64_t expirations;
+        if (read(timer, &expirations, sizeof expirations) != sizeof expirations) return;
+        handler(events);
+    });
+    if (!watching) {
+        close(timer);
+        return -1;
+    }
+    _timers.push_back(timer);
+    return timer;
+}
+
+/// @brief Deliver the signals through the loop instead of asynchronously. They are blocked for this thread
+/// (and threads it starts later), so call this before starting other threads. The mask is restored on destruction.
+bool EventLoop::handleSignals(const std::initializer_list<int> signals, SignalHandler handler) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (const int signal : signals) sigaddset(&mask, signal);
+    sigset_t previous;
+    if (pthread_sigmask(SIG_BLOCK, &mask, &previous) != 0) return false;
+    if (!_hasPreviousMask) {
+        _previousMask = previous;
+        _hasPreviousMask = true;
+    }
+    _signals = signalfd(_signals, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (_signals < 0) {
+        perror("Could not create signalfd");
+        return false;
+    }
+    return watch(_signals, EPOLLIN, [this, handler = std::move(handler)](uint32_t) {
+        signalfd_siginfo info{};
+        while (read(_signals, &info, sizeof info) == sizeof info) {
+            handler(static_cast<int>(info.ssi_signo));
+        }
+    });
+}
+
+void EventLoop::run(volatile bool& keepGoing) {
+    // the timeout only matters if keepGoing is reset outside of the loop's handlers
+    constexpr int CHECK_MILLIS = 1000;
+    while (keepGoing) {
+        if (runOnce(CHECK_MILLIS) < 0) break;
+    }
+}
+
+/// @brief Wait for events (at most timeoutMillis, -1 is forever), and call their handlers.
+/// @return the number of events handled, or -1 on failure
+int EventLoop::runOnce(const int timeoutMillis) {
+    for (const auto& hook : _hooks) hook();
+    epoll_event events[MAX_EVENTS];
+    const int count = epoll_wait(_epoll, events, MAX_EVENTS, timeoutMillis);
+    if (count < 0) {
+        if (errno == EINTR) return 0;
+        perror("epoll_wait failed");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        const auto iterator = _handlers.find(events[i].data.fd);
+        // an earlier handler may have unwatched it
+        if (iterator == _handlers.end()) continue;
+        // copy, as the handler may unwatch itself
+        const auto handler = iterator->second;
+        handler(events[i].events);
+    }
+    return count;
+}
+
+/// @brief Arm the timer to fire after delayMicros (0 fires right away), and then every intervalMicros (0 is once)
+bool EventLoop::setTimer(const int timer, const uint64_t delayMicros, const uint64_t intervalMicros) {
+    itimerspec spec{};
+    // a zero value would disarm the timer
+    const uint64_t delayNanos = delayMicros == 0 ? 1 : delayMicros * 1000;
+    spec.it_value.tv_sec = static_cast<time_t>(delayNanos / 1000000000);
+    spec.it_value.tv_nsec = static_cast<long>(delayNanos % 1000000000);
+    spec.it_interval.tv_sec = static_cast<time_t>(intervalMicros / 1000000);
+    spec.it_interval.tv_nsec = static_cast<long>(intervalMicros % 1000000 * 1000);
+    return timerfd_settime(timer, 0, &spec, nullptr) == 0;
+}
+
+bool EventLoop::unwatch(const int fd) {
+    if (_handlers.erase(fd) == 0) return false;
+    // closing the descriptor already removed it from the epoll set
+    if (epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, nullptr) != 0 && errno != EBADF && errno != ENOENT) {
+        perror("Could not stop watching descriptor");
+        return false;
+    }
+    return true;
+}
+
+/// @brief Call the handler when one of the events (EPOLLIN, EPOLLOUT) occurs on the descriptor.
+/// Watching a descriptor again replaces its events and handler.
+bool EventLoop::watch(const int fd, const uint32_t events, Handler handler) {
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = fd;
+    const bool known = _handlers.find(fd) != _handlers.end();
+    int result = epoll_ctl(_epoll, known ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event);
+    // a closed descriptor drops out of the set, and its number can be reused
+    if (result != 0 && known && errno == ENOENT) result = epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event);
+    if (result != 0) {
+        perror("Could not watch descriptor");
+        return false;
+    }
+    _handlers[fd] = std::move(handler);
+    return true;
+}
@@ -0,0 +1,60 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <csignal>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <unordered_map>
+#include <vector>
+
+/// @brief Single-threaded epoll loop: file descriptors, timers (timerfd) and signals (signalfd) all end up
+/// as handlers called from run(). Handlers may watch, unwatch and set timers.
+class EventLoop {
+public:
+    /// @brief Called with the epoll events (EPOLLIN etc.) of the file descriptor
+    using Handler = std::function<void(uint32_t events)>;
+    using SignalHandler = std::function<void(int signal)>;
+    using Hook = std::function<void()>;
+
+    EventLoop() = default;
+    ~EventLoop();
+    EventLoop(const EventLoop&) = delete;
+    EventLoop(EventLoop&&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+    EventLoop& operator=(EventLoop&&) = delete;
+
+    bool begin();
+    void beforeWait(Hook hook);
+    int createTimer(Handler handler);
+    bool handleSignals(std::initializer_list<int> signals, SignalHandler handler);
+    void run(volatile bool& keepGoing);
+    int runOnce(int timeoutMillis);
+    bool setTimer(int timer, uint64_t delayMicros, uint64_t intervalMicros = 0);
+    bool unwatch(int fd);
+    bool watch(int fd, uint32_t events, Handler handler);
+
+private:
+    static constexpr int MAX_EVENTS = 16;
+
+    int _epoll = -1;
+    int _signals = -1;
+    bool _hasPreviousMask = false;
+    sigset_t _previousMask{};
+    std::unordered_map<int, Handler> _handlers;
+    std::vector<int> _timers;
+    std::vector<Hook> _hooks;
+};
+
+#endif
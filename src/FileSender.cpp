@@ -0,0 +1,73 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "FileSender.h"
+#include <cmath>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include "PayloadEncoder.h"
+
+FileSender::FileSender(Config* config) : _config(config) {}
+
+FileSender::~FileSender() {
+    if (_file >= 0) close(_file);
+}
+
+/// @brief Read the path from the fileSink config entry
+/// @return whether the sink is configured
+bool FileSender::begin() {
+    _path = _config->getEntry("fileSink");
+    if (_path.empty()) return false;
+    // a pipe without reader can't be opened yet. That's fine, we try again on the next write.
+    open();
+    return true;
+}
+
+bool FileSender::sendHumidity(const float value) {
+    return sendValue("humidity", value);
+}
+
+bool FileSender::sendMeasurement(const Measurement& measurement) {
+    PayloadEncoder::toJson(measurement, _line);
+    return write();
+}
+
+bool FileSender::sendTemperature(const float value) {
+    return sendValue("temperature", value);
+}
+
+bool FileSender::open() {
+    if (_file >= 0) return true;
+    _file = ::open(_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_NONBLOCK | O_CLOEXEC, 0644);
+    return _file >= 0;
+}
+
+bool FileSender::sendValue(const char* name, const float value) {
+    char buffer[40];
+    if (std::isnan(value)) {
+        (void)snprintf(buffer, sizeof(buffer), "{\"%s\":null}", name);
+    } else {
+        (void)snprintf(buffer, sizeof(buffer), "{\"%s\":%.1f}", name, static_cast<double>(value));
+    }
+    _line = buffer;
+    return write();
+}
+
+bool FileSender::write() {
+    if (!open()) return false;
+    _line += '\n';
+    if (::write(_file, _line.c_str(), _line.size()) == static_cast<ssize_t>(_line.size())) return true;
+    // the reader went away, or the pipe is full. Reopen next time.
+    close(_file);
+    _file = -1;
+    return false;
+}
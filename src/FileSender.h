@@ -0,0 +1,45 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef FILE_SENDER_H
+#define FILE_SENDER_H
+
+#include <string>
+#include "Config.h"
+#include "ISender.h"
+
+/// @brief Writes measurements as JSON lines to a file. If the file is a named pipe, this is local IPC:
+/// writes never block, and fail while nobody is reading.
+class FileSender final : public ISender {
+public:
+    explicit FileSender(Config* config);
+    ~FileSender() override;
+    FileSender(const FileSender&) = delete;
+    FileSender(FileSender&&) = delete;
+    FileSender& operator=(const FileSender&) = delete;
+    FileSender& operator=(FileSender&&) = delete;
+    bool begin();
+    bool sendHumidity(float value) override;
+    bool sendMeasurement(const Measurement& measurement) override;
+    bool sendTemperature(float value) override;
+
+private:
+    Config* _config;
+    std::string _path;
+    std::string _line;
+    int _file = -1;
+
+    bool open();
+    bool sendValue(const char* name, float value);
+    bool write();
+};
+
+#endif
@@ -0,0 +1,104 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "Gateway.h"
+#include <cstdlib>
+#include <iostream>
+#include <utility>
+#include <vector>
+#include "LatencyRecorder.h"
+#include "Shutdown.h"
+
+Gateway::Gateway(queuing::Mqtt* mqtt, const Config* config) : _mqtt(mqtt), _config(config), _aggregator(config) {}
+
+Gateway::~Gateway() {
+    end();
+}
+
+/// @brief Read the zones, gatewayNode and gatewaySeconds, and connect
+/// @return false if there are no zones or MQTT can't start
+bool Gateway::begin() {
+    if (!_aggregator.begin()) {
+        std::cerr << "Gateway needs at least one zone (zone.<name>=<device>,<device>,...)\n";
+        return false;
+    }
+    _node = _config->getEntry("gatewayNode", _node);
+    _config->setIfExists("gatewaySeconds", &_intervalSeconds);
+    if (_intervalSeconds < 1) _intervalSeconds = DEFAULT_INTERVAL_SECONDS;
+    _prefix = "homie/" + _config->getEntry("device") + "/";
+    _stateTopic = _prefix + "$state";
+    _mqtt->setWill(_stateTopic);
+    return _mqtt->begin();
+}
+
+/// @brief Announce $state=disconnected, within the shutdown deadline. Only the first call does something.
+void Gateway::end() {
+    if (_isEnded) return;
+    _isEnded = true;
+    if (!_mqtt->isConnected()) return;
+    _mqtt->publish(_stateTopic, "disconnected", true, queuing::MessageClass::State);
+    if (!_mqtt->flush(Shutdown::remainingMicros())) std::cout << "Could not deliver the disconnected state in time\n";
+}
+
+// on the MQTT network thread
+void Gateway::onMessage(const std::string& topic, const std::string& payload) {
+    std::string device;
+    Quantity quantity;
+    if (!ZoneAggregator::parseTopic(topic, _node, &device, &quantity)) return;
+    char* end = nullptr;
+    const float value = strtof(payload.c_str(), &end);
+    if (end == payload.c_str()) return;
+    if (_aggregator.ingest(device, quantity, value, LatencyRecorder::nowMicros())) _ingested++;
+}
+
+/// @brief Publish the rollup of each zone
+/// @return whether all of them were handed over to MQTT
+bool Gateway::publish() {
+    bool success = true;
+    for (const auto& rollup : _aggregator.rollups(LatencyRecorder::nowMicros())) {
+        success &= _mqtt->publish(_prefix + rollup.zone + "/" + ROLLUP, ZoneAggregator::toJson(rollup), false,
+                                  queuing::MessageClass::Measurement);
+    }
+    return success;
+}
+
+/// @brief Publish the Homie description (a node per zone with a JSON rollup property), subscribe to the siblings,
+/// and announce $state=ready
+bool Gateway::sendMetadata() {
+    std::string nodes;
+    for (const auto& zone : _aggregator.zones()) nodes += (nodes.empty() ? "" : ",") + zone;
+    std::vector<std::pair<std::string, std::string>> metadata = {
+        {_prefix + "$homie", "4.0.0"},
+        {_prefix + "$name", _config->getEntry("device")},
+        {_prefix + "$nodes", nodes},
+        {_prefix + "$extensions", ""},
+        {_prefix + "$implementation", "pi-zero-w gateway"}};
+    for (const auto& zone : _aggregator.zones()) {
+        const auto nodePrefix = _prefix + zone + "/";
+        metadata.emplace_back(nodePrefix + "$name", zone);
+        metadata.emplace_back(nodePrefix + "$type", "zone");
+        metadata.emplace_back(nodePrefix + "$properties", ROLLUP);
+        metadata.emplace_back(nodePrefix + ROLLUP + "/$name", ROLLUP);
+        metadata.emplace_back(nodePrefix + ROLLUP + "/$datatype", "string");
+        metadata.emplace_back(nodePrefix + ROLLUP + "/$settable", "false");
+    }
+    for (const auto& [topic, value] : metadata) {
+        if (!_mqtt->publish(topic, value, true, queuing::MessageClass::Metadata)) return false;
+    }
+    // Mqtt renews the subscriptions after a reconnect
+    const auto handler = [this](const std::string& topic, const std::string& payload, bool) { onMessage(topic, payload); };
+    if (!_mqtt->subscribe("homie/+/" + _node + "/temperature", handler) ||
+        !_mqtt->subscribe("homie/+/" + _node + "/humidity", handler)) {
+        std::cerr << "Could not subscribe to the devices\n";
+        return false;
+    }
+    return _mqtt->publish(_stateTopic, "ready", true, queuing::MessageClass::State);
+}
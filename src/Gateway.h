@@ -0,0 +1,58 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include "Config.h"
+#include "Mqtt.h"
+#include "ZoneAggregator.h"
+
+/// @brief Rolls up the measurements of the sibling devices per zone, and publishes the rollups as a Homie device
+/// (homie/<device>/<zone>/rollup, one JSON message per zone per gatewaySeconds). It listens to the property topics
+/// of the siblings' gatewayNode (default climate), so those must be on (the default).
+class Gateway {
+public:
+    static constexpr int DEFAULT_INTERVAL_SECONDS = 60;
+
+    Gateway(queuing::Mqtt* mqtt, const Config* config);
+    ~Gateway();
+    Gateway(const Gateway&) = delete;
+    Gateway(Gateway&&) = delete;
+    Gateway& operator=(const Gateway&) = delete;
+    Gateway& operator=(Gateway&&) = delete;
+    bool begin();
+    void end();
+    [[nodiscard]] int64_t intervalMicros() const { return static_cast<int64_t>(_intervalSeconds) * 1000000; }
+    bool publish();
+    bool sendMetadata();
+    [[nodiscard]] uint64_t ingested() const { return _ingested; }
+
+private:
+    static constexpr const char* ROLLUP = "rollup";
+
+    void onMessage(const std::string& topic, const std::string& payload);
+
+    queuing::Mqtt* _mqtt;
+    const Config* _config;
+    ZoneAggregator _aggregator;
+    std::string _prefix;
+    std::string _stateTopic;
+    std::string _node = "climate";
+    int _intervalSeconds = DEFAULT_INTERVAL_SECONDS;
+    std::atomic<uint64_t> _ingested{0};
+    bool _isEnded = false;
+};
+
+#endif
@@ -10,16 +10,33 @@
 //   See the License for the specific language governing permissions and limitations under the License.
 
 #include "Homie.h"
+#include "AllocationTracker.h"
+#include "LatencyRecorder.h"
+#include "Shutdown.h"
+#include "Trace.h"
+#include <chrono>
 #include <iostream>
+#include <utility>
+
+// after the first retained message came in, a gap this long means the broker sent them all
+constexpr auto RETAINED_QUIET_TIME = std::chrono::milliseconds(200);
 
 Homie::Homie(queuing::Mqtt *mqtt, Config* config): _mqtt(mqtt), _config(config) {}
 
 Homie::~Homie() {
     printf("Homie destructor\n");
-    if (_mqtt->isConnected()) {
-        printf("Disconnecting from MQTT broker\n");
-        sendState("disconnected");
-    }
+    end();
+}
+
+/// @brief Announce $state=disconnected and wait (within the shutdown deadline) until the broker has it, so the
+/// state isn't left to the will. Only the first call does something.
+void Homie::end() {
+    if (_isEnded) return;
+    _isEnded = true;
+    if (!_mqtt->isConnected()) return;
+    printf("Disconnecting from MQTT broker\n");
+    sendState("disconnected");
+    if (!_mqtt->flush(Shutdown::remainingMicros())) printf("Could not deliver the disconnected state in time\n");
 }
 
 bool Homie::begin() {
@@ -28,10 +45,82 @@ bool Homie::begin() {
     _prefix = std::string(HOMIE_PREFIX) + "/" + _deviceName + "/";
     _nodePrefix = _prefix + _nodeName + "/";
     _stateTopic = _prefix + "$state";
+    _controlPrefix = _prefix + CONTROL + "/";
+    _measurementTopic = _nodePrefix + MEASUREMENT;
+    // topics are built once, so the measurement path doesn't allocate
+    _temperatureTopic = _nodePrefix + TEMPERATURE;
+    _humidityTopic = _nodePrefix + HUMIDITY;
+    // payloadFormat=json or cbor sends each measurement as a single message. The per-property
+    // topics stay on unless propertyTopics=0 (and are always on for the plain Homie format).
+    _payloadFormat = PayloadEncoder::parseFormat(_config->getEntry("payloadFormat"));
+    _config->setIfExists("propertyTopics", &_propertyTopics);
+    if (_payloadFormat == PayloadFormat::Homie) _propertyTopics = true;
+    // payloadTimestamps=1 adds when the newest sample was taken ("sampled") to the json/cbor payload
+    _config->setIfExists("payloadTimestamps", &_payloadTimestamps);
+    // metadataSync=1 only publishes the metadata the broker does not have yet
+    _config->setIfExists("metadataSync", &_metadataSync);
+    _config->setIfExists("metadataSyncMillis", &_metadataSyncMillis);
+    // control=1 advertises the settable properties, and accepts new values for them
+    _config->setIfExists("control", &_controlEnabled);
     _mqtt->setWill(_stateTopic);
+    // a new broker has none of our retained topics: resend them, and the state, with the next measurement
+    _mqtt->setBrokerChangeHandler([this] {
+        if (!_metadataSent) return;
+        _resyncMetadata = true;
+        _statePending = true;
+    });
     return _mqtt->begin();
 }
 
+/// @brief Register a property for the control node. Call before sendMetadata.
+void Homie::addSettableProperty(SettableProperty property) {
+    _settableProperties.push_back(std::move(property));
+}
+
+/// @brief Check a new value against the data type and format of the property (Homie convention)
+bool Homie::isValid(const SettableProperty& property, const std::string& value) {
+    if (property.dataType == "boolean") return value == "true" || value == "false";
+    if (property.dataType != "integer") return true;
+    size_t end = 0;
+    long number;
+    try {
+        number = std::stol(value, &end);
+    } catch (const std::exception&) {
+        return false;
+    }
+    if (end != value.size()) return false;
+    const auto separator = property.format.find(':');
+    if (separator == std::string::npos) return true;
+    return number >= std::stol(property.format.substr(0, separator)) && number <= std::stol(property.format.substr(separator + 1));
+}
+
+/// @brief Handle homie/<device>/control/<property>/set. Runs on the MQTT network thread.
+/// Valid values are applied and echoed on the property topic; invalid ones are ignored.
+void Homie::onSet(const std::string& topic, const std::string& value) {
+    constexpr size_t SET_LENGTH = 4; // "/set"
+    if (topic.size() <= _controlPrefix.size() + SET_LENGTH) return;
+    const auto name = topic.substr(_controlPrefix.size(), topic.size() - _controlPrefix.size() - SET_LENGTH);
+    for (const auto& property : _settableProperties) {
+        if (property.name != name) continue;
+        if (!isValid(property, value) || !property.setter(value)) {
+            std::cout << "Ignoring invalid value '" << value << "' for " << name << std::endl;
+            return;
+        }
+        std::cout << "Set " << name << " to " << property.getter() << std::endl;
+        _mqtt->publish(_controlPrefix + name, property.getter(), true, queuing::MessageClass::State);
+        return;
+    }
+}
+
+bool Homie::subscribeControl() {
+    if (!_controlEnabled || _settableProperties.empty() || _controlSubscribed) return true;
+    // Mqtt keeps the registration and renews it on reconnect, so we only do this once
+    _controlSubscribed = true;
+    return _mqtt->subscribe(_controlPrefix + "+/set", [this](const std::string& topic, const std::string& payload, bool) {
+        onSet(topic, payload);
+    }, 1);
+}
+
 std::string Homie::toString(const float f) {
     char buffer[20];
     (void)snprintf(buffer, sizeof(buffer), "%.1f", f);
@@ -39,48 +128,217 @@ std::string Homie::toString(const float f) {
 }
 
 bool Homie::sendTemperature(const float value) {
-	const std::string topic = _nodePrefix + TEMPERATURE;
-    return sendMessage(topic, toString(value), false);
+    // the values are short enough for the small string optimization, so toString doesn't allocate
+    return sendMessage(_temperatureTopic, toString(value), false, queuing::MessageClass::Measurement);
 }
 
 bool Homie::sendHumidity(const float value) {
-	const std::string topic = _nodePrefix + HUMIDITY;
-    return sendMessage(topic, toString(value), false);
+    return sendMessage(_humidityTopic, toString(value), false, queuing::MessageClass::Measurement);
 }
 
-bool Homie::sendMessage(const std::string& topic, const std::string& message, const bool retain) {
-    const bool isConnected = _mqtt->publish(topic, message, retain);
-    std::cout << "MQTT publish t=" << topic << " m=" << message << " r=" << retain << " conn=" << isConnected << "_c=" << _isConnected << std::endl;
+bool Homie::sendMeasurement(const Measurement& measurement) {
+    AllocationScope scope(AllocationTag::Publish);
+    TRACE_SPAN("Homie publish");
+    const auto started = LatencyRecorder::nowMicros();
+    bool success = true;
+    if (PayloadEncoder::encode(_payloadFormat, measurement, _payload, _payloadTimestamps)) {
+        success = sendMessage(_measurementTopic, _payload, false, queuing::MessageClass::Measurement);
+    }
+    if (_propertyTopics) {
+        success &= ISender::sendMeasurement(measurement);
+    }
+    const auto finished = LatencyRecorder::nowMicros();
+    LatencyRecorder::record(LatencyStage::Publish, finished - started);
+    if (success && measurement.sampledMicros > 0) {
+        LatencyRecorder::record(LatencyStage::EndToEnd, finished - measurement.sampledMicros);
+    }
+    if (_resyncMetadata.exchange(false)) {
+        sendMetadata();
+    }
+    return success;
+}
+
+/// @brief Publish a summary as JSON to homie/<device>/<node>/$summary/<property>/<horizon seconds>.
+/// It's a node attribute rather than a property: the sketch is for machines (merging), not for Homie controllers.
+bool Homie::sendSummary(const Summary& summary) {
+    const auto topic = _nodePrefix + "$summary/" + summary.property + "/" + std::to_string(summary.horizonSeconds);
+    return sendMessage(topic, QuantileSketch::toJson(summary), false, queuing::MessageClass::Measurement);
+}
+
+bool Homie::sendMessage(const std::string& topic, const std::string& message, const bool retain,
+                        const queuing::MessageClass messageClass) {
+    const bool isConnected = _mqtt->publish(topic, message, retain, messageClass);
+    // CBOR is binary, so only its size goes to the console
+    std::cout << "MQTT publish t=" << topic;
+    if (_payloadFormat == PayloadFormat::Cbor && topic == _measurementTopic) {
+        std::cout << " m=<" << message.size() << " bytes cbor>";
+    } else {
+        std::cout << " m=" << message;
+    }
+    std::cout << " r=" << retain << " conn=" << isConnected << "_c=" << _isConnected << std::endl;
     if (isConnected != _isConnected) {
         _isConnected = isConnected;
         std::cout << "MQTT connected=" << _isConnected << std::endl;
-        if (isConnected) sendState("ready");
+        if (isConnected) {
+            // after a reconnect, the broker may have lost our metadata. Syncing takes care of the state too.
+            if (_metadataSync && _metadataSent) {
+                _resyncMetadata = true;
+                _statePending = true;
+            } else {
+                sendState("ready");
+            }
+        }
     } 
     return isConnected;
 }
 
+void Homie::addPropertyMetadata(MetadataList& list, const std::string& propertyPrefix, const std::string& property,
+                                const std::string& unit, const std::string& dataType) {
+    list.emplace_back(propertyPrefix + property + "/" + NAME, property);
+    list.emplace_back(propertyPrefix + property + "/$datatype", dataType);
+    if (!unit.empty()) list.emplace_back(propertyPrefix + property + "/$unit", unit);
+    list.emplace_back(propertyPrefix + property + "/$settable", "false");
+}
+
+/// @brief The retained metadata topics and values describing this device
+Homie::MetadataList Homie::metadata() const {
+    MetadataList list;
+    list.emplace_back(_prefix + "$homie", HOMIE_VERSION);
+    list.emplace_back(_prefix + NAME, _deviceName);
+    const bool control = _controlEnabled && !_settableProperties.empty();
+    list.emplace_back(_prefix + "$nodes", control ? _nodeName + "," + CONTROL : _nodeName);
+    list.emplace_back(_prefix + "$extensions", "");
+    list.emplace_back(_prefix + "$implementation", "pi-zero-w");
+    list.emplace_back(_nodePrefix + NAME, _nodeName);
+    list.emplace_back(_nodePrefix + "$type", "climate");
+    const bool combined = _payloadFormat != PayloadFormat::Homie;
+    std::string properties;
+    if (_propertyTopics) properties = std::string(TEMPERATURE) + "," + HUMIDITY;
+    if (combined) properties += std::string(properties.empty() ? "" : ",") + MEASUREMENT;
+    list.emplace_back(_nodePrefix + "$properties", properties);
+    if (_propertyTopics) {
+        addPropertyMetadata(list, _nodePrefix, TEMPERATURE, "°C");
+        addPropertyMetadata(list, _nodePrefix, HUMIDITY, "%");
+    }
+    if (combined) addPropertyMetadata(list, _nodePrefix, MEASUREMENT, "", "string");
+    if (!control) return list;
+    list.emplace_back(_controlPrefix + NAME, CONTROL);
+    list.emplace_back(_controlPrefix + "$type", "settings");
+    std::string controlProperties;
+    for (const auto& property : _settableProperties) {
+        controlProperties += (controlProperties.empty() ? "" : ",") + property.name;
+    }
+    list.emplace_back(_controlPrefix + "$properties", controlProperties);
+    for (const auto& property : _settableProperties) {
+        const auto propertyPrefix = _controlPrefix + property.name;
+        list.emplace_back(propertyPrefix + "/" + NAME, property.name);
+        list.emplace_back(propertyPrefix + "/$datatype", property.dataType);
+        if (!property.unit.empty()) list.emplace_back(propertyPrefix + "/$unit", property.unit);
+        if (!property.format.empty()) list.emplace_back(propertyPrefix + "/$format", property.format);
+        list.emplace_back(propertyPrefix + "/$settable", "true");
+        list.emplace_back(propertyPrefix, property.getter());
+    }
+    return list;
+}
+
+/// @brief Determine which metadata needs publishing, given what the broker has retained
+Homie::MetadataList Homie::metadataChanges(const MetadataList& desired, const RetainedMap& retained) {
+    MetadataList changes;
+    for (const auto& [topic, value] : desired) {
+        const auto iterator = retained.find(topic);
+        const bool present = iterator != retained.end() && !iterator->second.empty();
+        // an empty retained message deletes the topic, so for empty values 'not present' is what we want
+        const bool upToDate = value.empty() ? !present : present && iterator->second == value;
+        if (!upToDate) changes.emplace_back(topic, value);
+    }
+    return changes;
+}
+
 bool Homie::sendMetadata() {
-    if (!sendMessage(_prefix + "$homie", HOMIE_VERSION)) return false;
+    if (!subscribeControl()) std::cout << "Could not subscribe to the control properties" << std::endl;
+    if (_metadataSync && syncMetadata()) return true;
+    const auto list = metadata();
+    if (!sendMessage(list[0].first, list[0].second)) return false;
     // assume that next sendMessage calls succeed if the first one does
-    sendMessage(_prefix + NAME, _deviceName);
-    sendMessage(_prefix + "$nodes", _nodeName);
-    sendMessage(_prefix + "$extensions", "");
-    sendMessage(_prefix + "$implementation", "pi-zero-w");
-    sendMessage(_nodePrefix + NAME, _nodeName);
-    sendMessage(_nodePrefix + "$type", "climate");
-    sendMessage(_nodePrefix + "$properties", std::string(TEMPERATURE) + "," + HUMIDITY);
-    sendPropertyMetadata(TEMPERATURE, "°C");
-    sendPropertyMetadata(HUMIDITY, "%");
+    for (size_t i = 1; i < list.size(); i++) {
+        sendMessage(list[i].first, list[i].second);
+    }
+    _metadataSent = true;
+    if (_statePending) {
+        _statePending = false;
+        sendState("ready");
+    }
     return true;
 }
 
-void Homie::sendState(const std::string& state) {
-    sendMessage(_stateTopic, state);
+/// @brief Subscribe to our own topics to see which metadata the broker retained, and publish only what is missing or changed.
+/// Waits until all metadata came in, the broker stops sending, or the timeout (metadataSyncMillis) expires.
+/// @return whether we could subscribe. If not, the caller falls back to sending everything.
+bool Homie::syncMetadata() {
+    auto desired = metadata();
+    desired.emplace_back(_stateTopic, "ready");
+    size_t expected = 0;
+    for (const auto& entry : desired) {
+        if (!entry.second.empty()) expected++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_retainedMutex);
+        _retained.clear();
+    }
+    const std::string filter = _prefix + "#";
+    const bool subscribed = _mqtt->subscribe(filter, [this](const std::string& topic, const std::string& payload, const bool retained) {
+        if (!retained) return;
+        {
+            std::lock_guard<std::mutex> lock(_retainedMutex);
+            _retained[topic] = payload;
+            _lastRetainedAt = std::chrono::steady_clock::now();
+        }
+        _retainedArrived.notify_one();
+    });
+    if (!subscribed) {
+        _mqtt->unsubscribe(filter);
+        return false;
+    }
+
+    constexpr auto WAIT_SLICE = std::chrono::milliseconds(50);
+    MetadataList changes;
+    {
+        std::unique_lock<std::mutex> lock(_retainedMutex);
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(_metadataSyncMillis);
+        for (;;) {
+            const auto now = std::chrono::steady_clock::now();
+            size_t seen = 0;
+            for (const auto& entry : desired) {
+                if (!entry.second.empty() && _retained.count(entry.first) > 0) seen++;
+            }
+            if (seen >= expected || now >= deadline) break;
+            if (!_retained.empty() && now - _lastRetainedAt >= RETAINED_QUIET_TIME) break;
+            if (_mqtt->isThreaded()) {
+                _retainedArrived.wait_for(lock, WAIT_SLICE);
+                continue;
+            }
+            // without a network thread, nobody else reads the socket; the handler takes the lock
+            lock.unlock();
+            const bool polled = _mqtt->poll(static_cast<int>(WAIT_SLICE.count()));
+            lock.lock();
+            if (!polled) _retainedArrived.wait_for(lock, WAIT_SLICE);
+        }
+        changes = metadataChanges(desired, _retained);
+        _retained.clear();
+    }
+    _mqtt->unsubscribe(filter);
+
+    // we could subscribe, so we're connected, and the state is part of the sync
+    _isConnected = true;
+    _statePending = false;
+    for (const auto& [topic, value] : changes) {
+        sendMessage(topic, value, true, topic == _stateTopic ? queuing::MessageClass::State : queuing::MessageClass::Metadata);
+    }
+    printf("Metadata sync: published %zu of %zu topics\n", changes.size(), desired.size());
+    _metadataSent = true;
+    return true;
 }
 
-void Homie::sendPropertyMetadata(const std::string& property, const std::string& unit) {
-    sendMessage(_nodePrefix + property + "/" + NAME, property);
-    sendMessage(_nodePrefix + property + "/$datatype", "float");
-    sendMessage(_nodePrefix + property + "/$unit", unit);
-    sendMessage(_nodePrefix + property + "/$settable", "false");
+void Homie::sendState(const std::string& state) {
+    sendMessage(_stateTopic, state, true, queuing::MessageClass::State);
 }
@@ -12,42 +12,100 @@
 #ifndef HOMIE_H
 #define HOMIE_H
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include "Config.h"
 #include "Mqtt.h"
 #include "ISender.h"
+#include "PayloadEncoder.h"
 
 class Homie final : public ISender {
 public:
+    using MetadataList = std::vector<std::pair<std::string, std::string>>;
+    using RetainedMap = std::unordered_map<std::string, std::string>;
+
+    /// @brief A property of the control node that can be set via MQTT (homie/<device>/control/<name>/set)
+    struct SettableProperty {
+        std::string name;
+        std::string dataType;   // integer or boolean
+        std::string unit;
+        std::string format;     // for integers: min:max
+        std::function<std::string()> getter;
+        std::function<bool(const std::string&)> setter;
+    };
+
     Homie(queuing::Mqtt* mqtt, Config* config);
     ~Homie() override;
     Homie(const Homie&) = delete;
     Homie(Homie&&) = delete;
     Homie& operator=(const Homie&) = delete;
     ISender& operator=(Homie&&) = delete;
+    void addSettableProperty(SettableProperty property);
     bool begin();
+    [[nodiscard]] std::string deviceTopic(const std::string& name) const { return _prefix + name; }
+    void end();
     bool sendHumidity(float value) override;
+    bool sendMeasurement(const Measurement& measurement) override;
     bool sendMetadata();
+    bool sendSummary(const Summary& summary) override;
     bool sendTemperature(float value) override;
+    static MetadataList metadataChanges(const MetadataList& desired, const RetainedMap& retained);
+    static bool isValid(const SettableProperty& property, const std::string& value);
 
 private:
     static constexpr const char* HOMIE_PREFIX = "homie";
     static constexpr const char* HOMIE_VERSION = "4.0.0";
     static constexpr const char* TEMPERATURE =  "temperature";
     static constexpr const char* HUMIDITY = "humidity";
+    static constexpr const char* MEASUREMENT = "measurement";
     static constexpr const char* NAME = "$name";
+    static constexpr const char* CONTROL = "control";
 
-    bool sendMessage(const std::string& topic, const std::string& message, bool retain = true);
-    void sendPropertyMetadata(const std::string& property, const std::string& unit);
+    static void addPropertyMetadata(MetadataList& list, const std::string& propertyPrefix, const std::string& property,
+                                    const std::string& unit, const std::string& dataType = "float");
+    MetadataList metadata() const;
+    void onSet(const std::string& topic, const std::string& value);
+    bool subscribeControl();
+    bool syncMetadata();
+    bool sendMessage(const std::string& topic, const std::string& message, bool retain = true,
+                     queuing::MessageClass messageClass = queuing::MessageClass::Metadata);
     void sendState(const std::string& state);
     static std::string toString(float f);
 
     queuing::Mqtt* _mqtt;
     Config* _config;
     bool _isConnected = false;
+    bool _isEnded = false;
     std::string _deviceName;
     std::string _nodeName;
     std::string _prefix;
     std::string _nodePrefix;
     std::string _stateTopic;
+    std::string _measurementTopic;
+    std::string _temperatureTopic;
+    std::string _humidityTopic;
+    std::string _payload;
+    PayloadFormat _payloadFormat = PayloadFormat::Homie;
+    bool _propertyTopics = true;
+    bool _payloadTimestamps = false;
+    bool _metadataSync = false;
+    int _metadataSyncMillis = 1000;
+    std::atomic<bool> _metadataSent{false};
+    std::atomic<bool> _resyncMetadata{false};
+    std::atomic<bool> _statePending{false};
+    std::mutex _retainedMutex;
+    std::condition_variable _retainedArrived;
+    RetainedMap _retained;
+    std::chrono::steady_clock::time_point _lastRetainedAt;
+    bool _controlEnabled = false;
+    bool _controlSubscribed = false;
+    std::string _controlPrefix;
+    std::vector<SettableProperty> _settableProperties;
 };
 #endif
\ No newline at end of file
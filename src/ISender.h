@@ -12,6 +12,9 @@
 #ifndef I_SENDER_H
 #define I_SENDER_H
 
+#include "Measurement.h"
+#include "QuantileSketch.h"
+
 class ISender {
 public:
     ISender() = default;
@@ -22,6 +25,18 @@ public:
     ISender& operator=(ISender&&) = delete;
     virtual bool sendHumidity(float value) = 0;
     virtual bool sendTemperature(float value) = 0;
+
+    /// @brief Send a complete measurement. By default, the values are sent one by one.
+    virtual bool sendMeasurement(const Measurement& measurement) {
+        const bool temperatureSent = sendTemperature(measurement.temperature);
+        return sendHumidity(measurement.humidity) && temperatureSent;
+    }
+
+    /// @brief Send the distribution of a property over a horizon. By default, summaries are not sent.
+    virtual bool sendSummary(const Summary& summary) {
+        (void)summary;
+        return true;
+    }
 };
 
 #endif
@@ -0,0 +1,97 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "InflightWindow.h"
+#include <iostream>
+
+namespace queuing {
+
+    /// @brief Record the acknowledgement of a message. Unknown ids (e.g. of QoS 0 messages) are ignored.
+    /// @return the latency in microseconds, or -1 if the message wasn't tracked or the broker refused it
+    int64_t InflightWindow::acknowledge(const int messageId, const bool accepted, const Clock::time_point now) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        const auto iterator = _inflight.find(messageId);
+        if (iterator == _inflight.end()) return -1;
+        const auto sentAt = iterator->second.sentAt;
+        _inflight.erase(iterator);
+        if (!accepted) {
+            _statistics.undelivered++;
+            return -1;
+        }
+        const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(now - sentAt).count();
+        _statistics.acknowledged++;
+        _statistics.lastLatencyMicros = latency;
+        _statistics.totalLatencyMicros += latency;
+        if (latency > _statistics.maxLatencyMicros) _statistics.maxLatencyMicros = latency;
+        return latency;
+    }
+
+    /// @brief Send a message and track it, if the window has room.
+    /// The lock is held while sending, so the acknowledgement can't arrive before the message is registered.
+    /// @return false if the window was full or sending failed
+    bool InflightWindow::add(const std::string& topic, const Sender& send, const Clock::time_point now) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_inflight.size() >= _maxInflight) {
+            _statistics.rejected++;
+            std::cerr << "In-flight window full (" << _maxInflight << "), not publishing " << topic << "\n";
+            return false;
+        }
+        int messageId;
+        if (!send(&messageId)) return false;
+        _statistics.published++;
+        _inflight[messageId] = InflightMessage{topic, now};
+        return true;
+    }
+
+    void InflightWindow::configure(const size_t maxInflight, const int ackTimeoutSeconds) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _maxInflight = maxInflight;
+        _ackTimeoutSeconds = ackTimeoutSeconds;
+    }
+
+    /// @brief Count a message that isn't tracked (QoS 0)
+    void InflightWindow::countPublished() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _statistics.published++;
+    }
+
+    /// @brief Stop tracking the messages that were not acknowledged within the timeout, and count them as undelivered.
+    /// @return the number of messages that expired
+    size_t InflightWindow::expire(const Clock::time_point now) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        const auto deadline = now - std::chrono::seconds(_ackTimeoutSeconds);
+        size_t expired = 0;
+        for (auto iterator = _inflight.begin(); iterator != _inflight.end();) {
+            if (iterator->second.sentAt >= deadline) {
+                ++iterator;
+                continue;
+            }
+            std::cerr << "Message " << iterator->first << " on " << iterator->second.topic << " not acknowledged within "
+                      << _ackTimeoutSeconds << " s\n";
+            iterator = _inflight.erase(iterator);
+            expired++;
+        }
+        _statistics.undelivered += expired;
+        return expired;
+    }
+
+    bool InflightWindow::isEmpty() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _inflight.empty();
+    }
+
+    PublishStatistics InflightWindow::statistics() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto statistics = _statistics;
+        statistics.inflight = _inflight.size();
+        return statistics;
+    }
+}
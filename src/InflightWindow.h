@@ -0,0 +1,69 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef INFLIGHT_WINDOW_H
+#define INFLIGHT_WINDOW_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace queuing {
+    struct PublishStatistics {
+        uint64_t published = 0;
+        uint64_t acknowledged = 0;
+        uint64_t undelivered = 0;  // refused by the broker, or not acknowledged in time
+        uint64_t rejected = 0;     // in-flight window was full
+        size_t inflight = 0;
+        int64_t lastLatencyMicros = 0;
+        int64_t maxLatencyMicros = 0;
+        int64_t totalLatencyMicros = 0;
+        uint64_t topicBytes = 0;    // topic bytes sent; aliased topics count as 0
+        uint64_t payloadBytes = 0;
+        uint64_t aliased = 0;
+    };
+
+    /// @brief Keeps track of the QoS 1/2 messages until the broker acknowledges them, and of the delivery statistics.
+    /// Messages that are not acknowledged in time count as undelivered. They are not published again:
+    /// mosquitto resends them itself (same message id, DUP set), which keeps QoS 2 exactly-once.
+    class InflightWindow {
+    public:
+        using Clock = std::chrono::steady_clock;
+        /// @brief Hands the message over, and returns whether that worked; sets the message id if it did.
+        using Sender = std::function<bool(int* messageId)>;
+
+        int64_t acknowledge(int messageId, bool accepted, Clock::time_point now = Clock::now());
+        bool add(const std::string& topic, const Sender& send, Clock::time_point now = Clock::now());
+        void configure(size_t maxInflight, int ackTimeoutSeconds);
+        void countPublished();
+        size_t expire(Clock::time_point now = Clock::now());
+        bool isEmpty() const;
+        size_t maxInflight() const { return _maxInflight; }
+        PublishStatistics statistics() const;
+
+    private:
+        struct InflightMessage {
+            std::string topic;
+            Clock::time_point sentAt;
+        };
+
+        size_t _maxInflight = 20;
+        int _ackTimeoutSeconds = 10;
+        mutable std::mutex _mutex;
+        std::unordered_map<int, InflightMessage> _inflight;
+        PublishStatistics _statistics;
+    };
+}
+
+#endif
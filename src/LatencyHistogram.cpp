@@ -0,0 +1,67 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "LatencyHistogram.h"
+
+/// @brief Values below 16 get their own bucket; above that, each power of two is split into 16 buckets.
+int LatencyHistogram::bucketFor(const int64_t value) {
+    if (value < SUB_BUCKETS) return value < 0 ? 0 : static_cast<int>(value);
+    const auto unsignedValue = static_cast<uint64_t>(value);
+    const int mostSignificantBit = 63 - __builtin_clzll(unsignedValue);
+    const int shift = mostSignificantBit - SUB_BUCKET_BITS;
+    const auto subBucket = static_cast<int>((unsignedValue >> shift) & (SUB_BUCKETS - 1));
+    return (shift + 1) * SUB_BUCKETS + subBucket;
+}
+
+int64_t LatencyHistogram::bucketUpperBound(const int bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+    const int shift = bucket / SUB_BUCKETS - 1;
+    const int64_t lowerBound = static_cast<int64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return lowerBound + (int64_t{1} << shift) - 1;
+}
+
+double LatencyHistogram::mean() const {
+    const auto samples = count();
+    return samples == 0 ? 0.0 : static_cast<double>(_total.load(std::memory_order_relaxed)) / static_cast<double>(samples);
+}
+
+/// @brief The value below which the given percentage of the samples fall (the upper bound of its bucket, capped at the maximum)
+int64_t LatencyHistogram::percentile(const double percent) const {
+    const auto samples = count();
+    if (samples == 0) return 0;
+    auto rank = static_cast<uint64_t>(percent / 100.0 * static_cast<double>(samples) + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < BUCKETS; bucket++) {
+        seen += _buckets[bucket].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            const auto upperBound = bucketUpperBound(bucket);
+            return upperBound < max() ? upperBound : max();
+        }
+    }
+    return max();
+}
+
+void LatencyHistogram::record(const int64_t value) {
+    _buckets[bucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+    _total.fetch_add(value, std::memory_order_relaxed);
+    auto currentMax = _max.load(std::memory_order_relaxed);
+    while (value > currentMax && !_max.compare_exchange_weak(currentMax, value, std::memory_order_relaxed)) {}
+}
+
+/// @brief Clear all samples. Not atomic with respect to concurrent record() calls.
+void LatencyHistogram::reset() {
+    for (auto& bucket : _buckets) bucket.store(0, std::memory_order_relaxed);
+    _count = 0;
+    _total = 0;
+    _max = 0;
+}
@@ -0,0 +1,50 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+
+/// @brief Lock-free histogram of non-negative values (e.g. latencies in microseconds) for percentiles.
+/// Buckets are log-linear: 16 per power of two, so percentiles are accurate to about 6%.
+class LatencyHistogram {
+public:
+    LatencyHistogram() = default;
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram(LatencyHistogram&&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(LatencyHistogram&&) = delete;
+    ~LatencyHistogram() = default;
+
+    uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+    int64_t max() const { return _max.load(std::memory_order_relaxed); }
+    double mean() const;
+    int64_t percentile(double percent) const;
+    void record(int64_t value);
+    void reset();
+
+    static int bucketFor(int64_t value);
+    static int64_t bucketUpperBound(int bucket);
+
+private:
+    static constexpr int SUB_BUCKET_BITS = 4;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr int BUCKETS = (64 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+    std::atomic<uint64_t> _buckets[BUCKETS]{};
+    std::atomic<uint64_t> _count{0};
+    std::atomic<int64_t> _total{0};
+    std::atomic<int64_t> _max{0};
+};
+
+#endif
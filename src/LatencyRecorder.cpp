@@ -0,0 +1,60 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "LatencyRecorder.h"
+#include <chrono>
+#include <cstdio>
+
+namespace {
+    constexpr int STAGES = static_cast<int>(LatencyStage::Count);
+    LatencyHistogram histograms[STAGES];
+}
+
+const LatencyHistogram& LatencyRecorder::histogram(const LatencyStage stage) {
+    return histograms[static_cast<int>(stage)];
+}
+
+const char* LatencyRecorder::name(const LatencyStage stage) {
+    switch (stage) {
+        case LatencyStage::Capture: return "capture";
+        case LatencyStage::Decode: return "decode";
+        case LatencyStage::Aggregate: return "aggregate";
+        case LatencyStage::Enqueue: return "enqueue";
+        case LatencyStage::Publish: return "publish";
+        case LatencyStage::Ack: return "ack";
+        case LatencyStage::EndToEnd: return "end-to-end";
+        default: return "unknown";
+    }
+}
+
+/// @brief The steady clock in microseconds, the time base for the monotonic timestamps in Sample and Measurement
+int64_t LatencyRecorder::nowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void LatencyRecorder::record(const LatencyStage stage, const int64_t micros) {
+    if (stage == LatencyStage::Count) return;
+    histograms[static_cast<int>(stage)].record(micros < 0 ? 0 : micros);
+}
+
+void LatencyRecorder::report() {
+    for (int stage = 0; stage < STAGES; stage++) {
+        const auto& entry = histograms[stage];
+        if (entry.count() == 0) continue;
+        printf("Latency %s (us, %llu samples): p50 %lld, p99 %lld, max %lld\n", name(static_cast<LatencyStage>(stage)),
+               static_cast<unsigned long long>(entry.count()), static_cast<long long>(entry.percentile(50)),
+               static_cast<long long>(entry.percentile(99)), static_cast<long long>(entry.max()));
+    }
+}
+
+void LatencyRecorder::reset() {
+    for (auto& entry : histograms) entry.reset();
+}
@@ -0,0 +1,41 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef LATENCY_RECORDER_H
+#define LATENCY_RECORDER_H
+
+#include <cstdint>
+#include "LatencyHistogram.h"
+
+/// @brief The stages a reading goes through, from the sensor to the broker
+enum class LatencyStage : uint8_t {
+    Capture,     // first to last edge from the sensor
+    Decode,      // last edge to decoded values
+    Aggregate,   // decoded (newest sample) to measurement built
+    Enqueue,     // measurement built to picked up by the sender
+    Publish,     // handing the messages to mosquitto
+    Ack,         // broker acknowledgement (QoS 1/2)
+    EndToEnd,    // first edge of the newest sample to published
+    Count
+};
+
+/// @brief Process-wide latency histograms per stage (microseconds). Recording is lock-free.
+class LatencyRecorder {
+public:
+    static const LatencyHistogram& histogram(LatencyStage stage);
+    static const char* name(LatencyStage stage);
+    static int64_t nowMicros();
+    static void record(LatencyStage stage, int64_t micros);
+    static void report();
+    static void reset();
+};
+
+#endif
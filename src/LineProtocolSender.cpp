@@ -0,0 +1,291 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "LineProtocolSender.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "PayloadEncoder.h"
+
+namespace {
+    size_t countLines(const std::string& payload) {
+        return static_cast<size_t>(std::count(payload.begin(), payload.end(), '\n'));
+    }
+}
+
+LineProtocolSender::LineProtocolSender(Config* config) : _config(config) {}
+
+LineProtocolSender::~LineProtocolSender() {
+    flush();
+}
+
+/// @brief Read the lineProtocol* config entries. Tags are the device name; the measurement name is
+/// lineProtocolMeasurement (default climate). lineProtocolToken is sent as an InfluxDB token (HTTP only).
+/// @return whether the sink is configured
+bool LineProtocolSender::begin() {
+    const auto target = _config->getEntry("lineProtocol");
+    if (target.empty()) return false;
+    if (!parseTarget(target)) {
+        std::cerr << "Ignoring lineProtocol=" << target << ": expected udp://host:port or http://host[:port][/path]\n";
+        return false;
+    }
+    _seriesKey = PayloadEncoder::escapeTag(_config->getEntry("lineProtocolMeasurement", "climate")) +
+                 ",device=" + PayloadEncoder::escapeTag(_config->getEntry("device"));
+    _config->setIfExists("lineProtocolBatchLines", &_maxLines);
+    _config->setIfExists("lineProtocolBatchBytes", &_maxBytes);
+    _config->setIfExists("lineProtocolBatchMillis", &_maxMillis);
+    _config->setIfExists("lineProtocolRetries", &_retries);
+    _token = _config->getEntry("lineProtocolToken");
+    _spillPath = _config->getEntry("lineProtocolSpill");
+    // whatever a previous run couldn't deliver goes out after the first successful batch
+    if (!_spillPath.empty()) {
+        if (FILE* file = fopen(_spillPath.c_str(), "rb"); file != nullptr) {
+            fclose(file);
+            _spillPending = true;
+        }
+    }
+    _batch.reserve(_maxBytes + 256);
+    return true;
+}
+
+/// @brief Deliver the batch. If that fails, it goes to the spill file.
+/// @return whether the batch was delivered or spilled
+bool LineProtocolSender::flush() {
+    if (_batch.empty()) return true;
+    bool result = deliver(_batch);
+    if (result) {
+        if (_spillPending) drainSpill();
+    } else {
+        result = spill(_batch);
+    }
+    _batch.clear();
+    _batchLines = 0;
+    return result;
+}
+
+bool LineProtocolSender::sendHumidity(const float value) {
+    return sendValue("humidity", value);
+}
+
+bool LineProtocolSender::sendMeasurement(const Measurement& measurement) {
+    const auto previousSize = _batch.size();
+    PayloadEncoder::appendLineProtocol(measurement, _seriesKey, _batch);
+    // a UDP batch must fit in a datagram, so a line that doesn't fit goes in the next batch
+    if (_batchLines > 0 && _batch.size() > _maxBytes) {
+        const auto line = _batch.substr(previousSize);
+        _batch.resize(previousSize);
+        const bool flushed = flush();
+        _batch = line;
+        _batchLines = 1;
+        _batchStarted = Clock::now();
+        return add() && flushed;
+    }
+    if (_batchLines++ == 0) _batchStarted = Clock::now();
+    return add();
+}
+
+bool LineProtocolSender::sendTemperature(const float value) {
+    return sendValue("temperature", value);
+}
+
+// flush if the batch is full or old enough
+bool LineProtocolSender::add() {
+    const bool isFull = _batchLines >= _maxLines || _batch.size() >= _maxBytes;
+    const bool isOld = Clock::now() - _batchStarted >= std::chrono::milliseconds(_maxMillis);
+    return isFull || isOld ? flush() : true;
+}
+
+bool LineProtocolSender::deliver(const std::string& payload) {
+    for (int attempt = 0; attempt <= _retries; attempt++) {
+        if (attempt > 0) std::this_thread::sleep_for(std::chrono::milliseconds(RETRY_MILLIS));
+        if (_transport == Transport::Udp ? deliverUdp(payload) : deliverHttp(payload)) {
+            _statistics.batches++;
+            _statistics.lines += countLines(payload);
+            return true;
+        }
+        _statistics.failures++;
+    }
+    return false;
+}
+
+/// @brief POST the payload, and check for a 2xx status (InfluxDB answers 204)
+bool LineProtocolSender::deliverHttp(const std::string& payload) {
+    const int socket = openSocket(SOCK_STREAM);
+    if (socket < 0) return false;
+    _request = "POST " + _path + " HTTP/1.1\r\nHost: " + _host + ":" + _port +
+               "\r\nContent-Type: text/plain; charset=utf-8\r\nContent-Length: " + std::to_string(payload.size()) + "\r\n";
+    if (!_token.empty()) _request += "Authorization: Token " + _token + "\r\n";
+    _request += "Connection: close\r\n\r\n";
+    _request += payload;
+    size_t sent = 0;
+    while (sent < _request.size()) {
+        const auto result = send(socket, _request.data() + sent, _request.size() - sent, MSG_NOSIGNAL);
+        if (result <= 0) {
+            close(socket);
+            return false;
+        }
+        sent += static_cast<size_t>(result);
+    }
+    // we only need the status line
+    char response[256];
+    size_t received = 0;
+    while (received < sizeof response - 1) {
+        const auto result = recv(socket, response + received, sizeof response - 1 - received, 0);
+        if (result <= 0) break;
+        received += static_cast<size_t>(result);
+        response[received] = 0;
+        if (strstr(response, "\r\n") != nullptr) break;
+    }
+    close(socket);
+    response[received] = 0;
+    int status = 0;
+    if (sscanf(response, "HTTP/%*s %d", &status) != 1 || status < 200 || status >= 300) {
+        std::cerr << "Line protocol POST failed: " << (received > 0 ? strtok(response, "\r\n") : "no response") << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool LineProtocolSender::deliverUdp(const std::string& payload) const {
+    const int socket = openSocket(SOCK_DGRAM);
+    if (socket < 0) return false;
+    const auto result = send(socket, payload.data(), payload.size(), 0);
+    close(socket);
+    return result == static_cast<ssize_t>(payload.size());
+}
+
+/// @brief Send the spill file in batches. Stops at the first failure; the rest goes out after the next delivery.
+/// @return whether the spill file was emptied
+bool LineProtocolSender::drainSpill() {
+    FILE* file = fopen(_spillPath.c_str(), "rb");
+    if (file == nullptr) {
+        _spillPending = false;
+        return true;
+    }
+    (void)fseek(file, _spillOffset, SEEK_SET);
+    std::string chunk;
+    char* line = nullptr;
+    size_t capacity = 0;
+    bool delivered = true;
+    for (;;) {
+        const auto length = getline(&line, &capacity, file);
+        if (length > 0 && (chunk.empty() || chunk.size() + static_cast<size_t>(length) <= _maxBytes)) {
+            chunk.append(line, static_cast<size_t>(length));
+            continue;
+        }
+        if (!chunk.empty()) {
+            delivered = deliver(chunk);
+            if (!delivered) break;
+            // everything up to (but not including) the line we just read is out
+            _spillOffset = ftell(file) - (length > 0 ? length : 0);
+            chunk.clear();
+        }
+        if (length <= 0) break;
+        chunk.assign(line, static_cast<size_t>(length));
+    }
+    free(line);
+    fclose(file);
+    if (!delivered) return false;
+    (void)remove(_spillPath.c_str());
+    _spillOffset = 0;
+    _spillPending = false;
+    return true;
+}
+
+int LineProtocolSender::openSocket(const int type) const {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = type;
+    addrinfo* addresses = nullptr;
+    if (const int rc = getaddrinfo(_host.c_str(), _port.c_str(), &hints, &addresses); rc != 0) {
+        std::cerr << "Could not resolve " << _host << ": " << gai_strerror(rc) << "\n";
+        return -1;
+    }
+    int result = -1;
+    for (const auto* address = addresses; address != nullptr && result < 0; address = address->ai_next) {
+        const int candidate = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (candidate < 0) continue;
+        // also limits how long connect takes
+        timeval timeout{TIMEOUT_MILLIS / 1000, TIMEOUT_MILLIS % 1000 * 1000};
+        (void)setsockopt(candidate, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+        (void)setsockopt(candidate, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        if (connect(candidate, address->ai_addr, address->ai_addrlen) == 0) {
+            result = candidate;
+        } else {
+            close(candidate);
+        }
+    }
+    freeaddrinfo(addresses);
+    return result;
+}
+
+bool LineProtocolSender::parseTarget(const std::string& target) {
+    std::string rest;
+    if (target.rfind("udp://", 0) == 0) {
+        _transport = Transport::Udp;
+        rest = target.substr(6);
+    } else if (target.rfind("http://", 0) == 0) {
+        _transport = Transport::Http;
+        rest = target.substr(7);
+        _port = "8086";
+    } else {
+        return false;
+    }
+    if (const auto slash = rest.find('/'); slash != std::string::npos) {
+        _path = rest.substr(slash);
+        rest.resize(slash);
+    }
+    if (const auto colon = rest.rfind(':'); colon != std::string::npos) {
+        _port = rest.substr(colon + 1);
+        rest.resize(colon);
+    }
+    _host = rest;
+    return !_host.empty() && !_port.empty();
+}
+
+bool LineProtocolSender::sendValue(const char* name, const float value) {
+    if (std::isnan(value)) return true;
+    const auto nowNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    char buffer[80];
+    (void)snprintf(buffer, sizeof(buffer), " %s=%.1f %" PRId64 "\n", name, static_cast<double>(value), static_cast<int64_t>(nowNanos));
+    _batch += _seriesKey;
+    _batch += buffer;
+    if (_batchLines++ == 0) _batchStarted = Clock::now();
+    return add();
+}
+
+bool LineProtocolSender::spill(const std::string& payload) {
+    if (_spillPath.empty()) {
+        std::cerr << "Dropping " << countLines(payload) << " line protocol lines (no lineProtocolSpill)\n";
+        return false;
+    }
+    FILE* file = fopen(_spillPath.c_str(), "ab");
+    if (file == nullptr) {
+        perror("Could not open line protocol spill file");
+        return false;
+    }
+    const bool written = fwrite(payload.data(), 1, payload.size(), file) == payload.size();
+    const bool closed = fclose(file) == 0;
+    if (!written || !closed) return false;
+    _statistics.spilled += countLines(payload);
+    _spillPending = true;
+    return true;
+}
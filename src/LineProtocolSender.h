@@ -0,0 +1,88 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef LINE_PROTOCOL_SENDER_H
+#define LINE_PROTOCOL_SENDER_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include "Config.h"
+#include "ISender.h"
+
+struct LineProtocolStatistics {
+    uint64_t batches = 0;     // batches delivered
+    uint64_t lines = 0;       // lines delivered, including those from the spill file
+    uint64_t failures = 0;    // failed delivery attempts
+    uint64_t spilled = 0;     // lines written to the spill file
+};
+
+/// @brief Sends measurements straight to a time-series database as InfluxDB line protocol, bypassing the broker.
+/// Lines are batched until lineProtocolBatchLines or lineProtocolBatchBytes is reached, or the oldest line is
+/// lineProtocolBatchMillis old (checked when a measurement comes in). A batch goes out as one UDP datagram
+/// (lineProtocol=udp://host:port) or one HTTP POST (lineProtocol=http://host:port/path?query, e.g. /write?db=climate).
+/// A batch that still fails after lineProtocolRetries retries is appended to lineProtocolSpill, and sent after the
+/// next successful delivery. Points have explicit timestamps, so order doesn't matter and resending is harmless.
+class LineProtocolSender final : public ISender {
+public:
+    explicit LineProtocolSender(Config* config);
+    ~LineProtocolSender() override;
+    LineProtocolSender(const LineProtocolSender&) = delete;
+    LineProtocolSender(LineProtocolSender&&) = delete;
+    LineProtocolSender& operator=(const LineProtocolSender&) = delete;
+    LineProtocolSender& operator=(LineProtocolSender&&) = delete;
+    bool begin();
+    bool flush();
+    bool sendHumidity(float value) override;
+    bool sendMeasurement(const Measurement& measurement) override;
+    bool sendTemperature(float value) override;
+    [[nodiscard]] size_t pendingLines() const { return _batchLines; }
+    [[nodiscard]] LineProtocolStatistics statistics() const { return _statistics; }
+
+private:
+    using Clock = std::chrono::steady_clock;
+    enum class Transport { Udp, Http };
+
+    static constexpr int TIMEOUT_MILLIS = 2000;
+    static constexpr int RETRY_MILLIS = 100;
+
+    Config* _config;
+    Transport _transport = Transport::Udp;
+    std::string _host;
+    std::string _port;
+    std::string _path = "/write";
+    std::string _token;
+    std::string _seriesKey;
+    std::string _spillPath;
+    size_t _maxLines = 50;
+    size_t _maxBytes = 1400;  // fits in one Ethernet frame
+    int _maxMillis = 10000;
+    int _retries = 1;
+    std::string _batch;
+    size_t _batchLines = 0;
+    Clock::time_point _batchStarted;
+    long _spillOffset = 0;
+    bool _spillPending = false;
+    std::string _request;
+    LineProtocolStatistics _statistics;
+
+    bool add();
+    bool deliver(const std::string& payload);
+    bool deliverHttp(const std::string& payload);
+    bool deliverUdp(const std::string& payload) const;
+    bool drainSpill();
+    int openSocket(int type) const;
+    bool parseTarget(const std::string& target);
+    bool sendValue(const char* name, float value);
+    bool spill(const std::string& payload);
+};
+
+#endif
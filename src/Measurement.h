@@ -0,0 +1,30 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef MEASUREMENT_H
+#define MEASUREMENT_H
+
+#include <cstdint>
+
+/// @brief An aggregated climate measurement: the result of one aggregation window in ClimateMeasurement
+struct Measurement {
+    float temperature = 0.0f;
+    float humidity = 0.0f;
+    int sampleCount = 0;
+    int nanCount = 0;
+    int64_t timestamp = 0; // milliseconds since the epoch
+    // when the newest sample was taken (its first edge), and when the measurement was built. 0 if unknown.
+    int64_t sampledMillis = 0;      // system clock, milliseconds since the epoch
+    int64_t sampledMicros = 0;      // steady clock
+    int64_t aggregatedMicros = 0;   // steady clock
+};
+
+#endif
@@ -15,6 +15,11 @@
 #include <chrono>
 
 #include "Mqtt.h"
+#include "EventLoop.h"
+#include "ResourceMonitor.h"
+#include "Shutdown.h"
+#include "Trace.h"
+#include <sys/epoll.h>
 #include <mosquitto.h>
 
 namespace queuing {
@@ -23,7 +28,12 @@ namespace queuing {
         const auto mqtt = static_cast<Mqtt*>(userdata);
         mqtt->setErrorCode(returnCode);
         mqtt->setConnected(returnCode == MOSQ_ERR_SUCCESS);
+        // without a network thread, the callbacks run on the main thread, which keeps its name
+        if (mqtt->isThreaded()) ResourceMonitor::nameThread("mosquitto");
+        TRACE_INSTANT("mqtt connack");
         if (mqtt->isConnected()) {
+            // the v3 callback doesn't get the CONNACK flags, so we can't tell whether the session survived
+            mqtt->connectionMade(false);
             std::cout << "## Connected" << std::endl;
         }
         else {
@@ -36,102 +46,568 @@ namespace queuing {
         const auto mqtt = static_cast<Mqtt*>(userdata);
         mqtt->setErrorCode(returnCode);
         mqtt->setConnected(false);
+        mqtt->connectionLost();
+        TRACE_INSTANT("mqtt disconnected");
         std::cout << "## Disconnected" << std::endl;
     }
 
-/*    void onPublish(mosquitto *mosquittoInstance, void *userdata, int messageId) {
+    void onPublish(mosquitto *mosquittoInstance, void *userdata, const int messageId) {
         (void)mosquittoInstance;
-        (void)userdata;
-        std::cout << "## - Message published successfully: " << messageId << std::endl;
+        TRACE_INSTANT("mqtt puback");
+        static_cast<Mqtt*>(userdata)->acknowledge(messageId);
+    }
+
+    void onMessage(mosquitto *mosquittoInstance, void *userdata, const mosquitto_message *message) {
+        (void)mosquittoInstance;
+        TRACE_SPAN("mqtt message");
+        static_cast<Mqtt*>(userdata)->dispatch(message);
+    }
+
+    // MQTT v5 variants. Reason codes of 0x80 and up are failures.
+
+    void onConnectV5(mosquitto *mosquittoInstance, void *userdata, const int reasonCode, const int flags, const mosquitto_property *properties) {
+        (void)mosquittoInstance;
+        const auto mqtt = static_cast<Mqtt*>(userdata);
+        mqtt->setErrorCode(reasonCode);
+        mqtt->setConnected(reasonCode == 0);
+        // without a network thread, the callbacks run on the main thread, which keeps its name
+        if (mqtt->isThreaded()) ResourceMonitor::nameThread("mosquitto");
+        TRACE_INSTANT("mqtt connack");
+        if (mqtt->isConnected()) {
+            mqtt->resetTopicAliases(properties);
+            // bit 0 of the CONNACK flags is 'session present'
+            mqtt->connectionMade((flags & 1) != 0);
+            std::cout << "## Connected (v5)" << std::endl;
+        }
+        else {
+            std::cout << "## Failed connecting - reason " << reasonCode << ": " << mosquitto_reason_string(reasonCode) << std::endl;
+        }
+    }
+
+    void onDisconnectV5(mosquitto *mosquittoInstance, void *userdata, const int reasonCode, const mosquitto_property *properties) {
+        (void)mosquittoInstance;
+        (void)properties;
+        const auto mqtt = static_cast<Mqtt*>(userdata);
+        mqtt->setErrorCode(reasonCode);
+        mqtt->setConnected(false);
+        mqtt->connectionLost();
+        TRACE_INSTANT("mqtt disconnected");
+        std::cout << "## Disconnected - reason " << reasonCode << ": " 
+                  << (reasonCode >= 0x80 ? mosquitto_reason_string(reasonCode) : mosquitto_strerror(reasonCode)) << std::endl;
+    }
+
+    void onPublishV5(mosquitto *mosquittoInstance, void *userdata, const int messageId, const int reasonCode, const mosquitto_property *properties) {
+        (void)mosquittoInstance;
+        (void)properties;
+        TRACE_INSTANT("mqtt puback");
+        if (reasonCode >= 0x80) {
+            std::cerr << "Message " << messageId << " rejected by broker: " << mosquitto_reason_string(reasonCode) << "\n";
+        }
+        static_cast<Mqtt*>(userdata)->acknowledge(messageId, reasonCode < 0x80);
     }
 
-    void onLog(struct mosquitto *mosquittoInstance, void *userdata, const int level, const char *str) {
+/*    void onLog(struct mosquitto *mosquittoInstance, void *userdata, const int level, const char *str) {
         (void)mosquittoInstance;
         (void)userdata;
         std::cout << "## - Log: " << level << ": " << str << std::endl;
     } */
 
-    Mqtt::Mqtt(const Config* config, volatile bool* keepGoing) : _config(config), _keepGoing(keepGoing) {
-	    const auto id = config->getEntry("device");
+    Mqtt::Mqtt(const Config* config, volatile bool* keepGoing) : _config(config), _keepGoing(keepGoing), _brokers(config) {
+        // fastReconnect: a persistent session with a stable client id, and a cached broker address.
+        config->setIfExists("fastReconnect", &_fastReconnect);
+	    const auto id = clientId();
         mosquitto_lib_init();
-        _mosquitto = mosquitto_new(id.c_str(), true, this);
-        mosquitto_connect_callback_set(_mosquitto, &onConnect);
-        mosquitto_disconnect_callback_set(_mosquitto, &onDisconnect);
-        // mosquitto_publish_callback_set(_mosquitto, &onPublish);
+        _mosquitto = mosquitto_new(id.c_str(), !_fastReconnect, this);
+        config->setIfExists("protocolVersion", &_protocolVersion);
+        if (_protocolVersion == MQTT_PROTOCOL_V5) {
+            mosquitto_int_option(_mosquitto, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+            mosquitto_connect_v5_callback_set(_mosquitto, &onConnectV5);
+            mosquitto_disconnect_v5_callback_set(_mosquitto, &onDisconnectV5);
+            mosquitto_publish_v5_callback_set(_mosquitto, &onPublishV5);
+        } else {
+            _protocolVersion = MQTT_PROTOCOL_V311;
+            mosquitto_connect_callback_set(_mosquitto, &onConnect);
+            mosquitto_disconnect_callback_set(_mosquitto, &onDisconnect);
+            mosquitto_publish_callback_set(_mosquitto, &onPublish);
+        }
+        mosquitto_message_callback_set(_mosquitto, &onMessage);
         // mosquitto_log_callback_set(_mosquitto, &onLog);  
+        // the will is set before begin(), and needs the QoS for state messages
+        readQosConfig();
+    }
+
+    /// @brief Record the acknowledgement of a QoS 1/2 message. QoS 0 messages also end up here (when sent), but aren't tracked.
+    void Mqtt::acknowledge(const int messageId, const bool accepted) {
+        const auto latency = _window.acknowledge(messageId, accepted);
+        if (latency >= 0 && _latencyObserver) _latencyObserver(latency);
+    }
+
+    /// @brief Let the event loop drive the connection: the socket is watched (and rewatched after reconnects),
+    /// and a timer takes care of keep-alives. Needs eventLoop=1, so there is no network thread.
+    void Mqtt::attach(EventLoop* loop) {
+        if (_threaded) return;
+        loop->beforeWait([this, loop] { watchSocket(loop); });
+        constexpr uint64_t MISC_INTERVAL_MICROS = 1000000;
+        const int timer = loop->createTimer([this](uint32_t) { mosquitto_loop_misc(_mosquitto); });
+        if (timer >= 0) loop->setTimer(timer, MISC_INTERVAL_MICROS, MISC_INTERVAL_MICROS);
     }
 
     bool Mqtt::begin() {
-        _caCert = _config->getEntry("caCert").c_str();
-        _broker = _config->getEntry("broker", "localhost").c_str();
-        _config->setIfExists("port", &_port);
-        _user = _config->getEntry("user").c_str();
-        _password = _config->getEntry("password").c_str();
+        bool eventLoop = false;
+        _config->setIfExists("eventLoop", &eventLoop);
+        _threaded = !eventLoop;
+        _caCert = _config->getEntry("caCert");
+        _user = _config->getEntry("user");
+        _password = _config->getEntry("password");
         _config->setIfExists("keepAliveSeconds", &_keepAliveSeconds);
+        _config->setIfExists("maxInflight", &_maxInflight);
+        int ackTimeoutSeconds = 10;
+        _config->setIfExists("ackTimeoutSeconds", &ackTimeoutSeconds);
+        _window.configure(_maxInflight, ackTimeoutSeconds);
+        _config->setIfExists("messageExpirySeconds", &_messageExpirySeconds);
+        _config->setIfExists("sessionExpirySeconds", &_sessionExpirySeconds);
+        mosquitto_max_inflight_messages_set(_mosquitto, _maxInflight);
+        if (!_brokers.begin()) return false;
+        useCurrentBroker();
+        // TLS needs the host name to verify the certificate, so there we leave resolution to mosquitto
+        if (_fastReconnect && _caCert.empty()) {
+            int refreshSeconds = 0;
+            _config->setIfExists("dnsRefreshSeconds", &refreshSeconds);
+            if (refreshSeconds > 0) _addressCache.setRefreshSeconds(refreshSeconds);
+            _addressCache.begin();
+        }
 
         return firstConnect();
     }
 
+    /// @brief Disconnect and stop the network thread. Safe to call more than once; the destructor does it too.
+    void Mqtt::end() {
+        if (_isEnded) return;
+        _isEnded = true;
+        _brokers.end();
+        mosquitto_disconnect(_mosquitto);
+        mosquitto_loop_stop(_mosquitto, true);
+        _isConnected = false;
+    }
+
+    /// @brief Wait until all QoS 1/2 messages are acknowledged and mosquitto has written everything it queued.
+    /// Without a network thread, this runs the network loop itself.
+    /// @return whether everything went out within the timeout
+    bool Mqtt::flush(const int64_t timeoutMicros) {
+        constexpr int SLICE_MILLIS = 10;
+        const auto deadline = Clock::now() + std::chrono::microseconds(timeoutMicros);
+        for (;;) {
+            const bool isPending = !_window.isEmpty() || mosquitto_want_write(_mosquitto);
+            if (!isPending) return true;
+            if (!_isConnected || Clock::now() >= deadline) return false;
+            if (_threaded || mosquitto_loop(_mosquitto, SLICE_MILLIS, 1) != MOSQ_ERR_SUCCESS) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(SLICE_MILLIS));
+            }
+        }
+    }
+
     bool Mqtt::firstConnect() {
-        if (strlen(_caCert) > 0) {
-            printf("setting ca cert %s\n", _caCert);
-            if (mosquitto_tls_set(_mosquitto, _caCert, nullptr, nullptr, nullptr, nullptr) != MOSQ_ERR_SUCCESS) {
+        if (!_caCert.empty()) {
+            printf("setting ca cert %s\n", _caCert.c_str());
+            if (mosquitto_tls_set(_mosquitto, _caCert.c_str(), nullptr, nullptr, nullptr, nullptr) != MOSQ_ERR_SUCCESS) {
                 std::cerr << "failed\n";
                 return false;
             }
         }
-        if (strlen(_user) > 0) {
-            printf("setting user %s\n", _user);
-            if (mosquitto_username_pw_set(_mosquitto, _user, _password) != MOSQ_ERR_SUCCESS) {
+        if (!_user.empty()) {
+            printf("setting user %s\n", _user.c_str());
+            if (mosquitto_username_pw_set(_mosquitto, _user.c_str(), _password.c_str()) != MOSQ_ERR_SUCCESS) {
                 std::cerr << "failed\n";
                 return false;
             }
         }
 
-        printf("Connecting to %s:%d, with keep-alive %d\n", _broker, _port, _keepAliveSeconds);
-        if (const int rc = mosquitto_connect(_mosquitto, _broker, _port, _keepAliveSeconds); rc != MOSQ_ERR_SUCCESS) {
+        printf("Connecting to %s:%d, with keep-alive %d\n", _broker.c_str(), _port, _keepAliveSeconds);
+        int rc = connect();
+        // with a brokers list, try the others before giving up
+        for (size_t attempt = 1; rc != MOSQ_ERR_SUCCESS && attempt < _brokers.size() && _brokers.failover(); attempt++) {
+            useCurrentBroker();
+            printf("Connecting to %s:%d\n", _broker.c_str(), _port);
+            rc = connect();
+        }
+        if (rc != MOSQ_ERR_SUCCESS) {
             _errorCode = rc;
             std::cerr << "Connect failed, error: " << rc << "/" << mosquitto_strerror(rc) << "\n";
             return false;
         }
+        _connectedBroker = _brokers.current().name();
 
+        if (!_threaded) return true;
         printf("starting loop\n");
         mosquitto_loop_start(_mosquitto);        
         std::cout << "Started loop\n";
         return true;
     }
 
+    /// @brief The device name; in fast reconnect mode, the idTemplate with %s replaced by the device name
+    std::string Mqtt::clientId() const {
+        const auto device = _config->getEntry("device");
+        if (!_fastReconnect) return device;
+        auto id = _config->getEntry("idTemplate", "%s");
+        if (const auto position = id.find("%s"); position != std::string::npos) {
+            id.replace(position, 2, device);
+        }
+        return id;
+    }
+
+    /// @brief Connect to the broker, at its cached address in fast reconnect mode.
+    /// With MQTT v5, a persistent session also needs an expiry interval (or it ends at disconnect).
+    int Mqtt::connect() {
+        const auto host = connectHost();
+        if (_fastReconnect && _protocolVersion == MQTT_PROTOCOL_V5) {
+            mosquitto_property* properties = nullptr;
+            mosquitto_property_add_int32(&properties, MQTT_PROP_SESSION_EXPIRY_INTERVAL, _sessionExpirySeconds);
+            const int rc = mosquitto_connect_bind_v5(_mosquitto, host.c_str(), _port, _keepAliveSeconds, nullptr, properties);
+            mosquitto_property_free_all(&properties);
+            return rc;
+        }
+        return mosquitto_connect(_mosquitto, host.c_str(), _port, _keepAliveSeconds);
+    }
+
+    std::string Mqtt::connectHost() {
+        if (!_fastReconnect || !_caCert.empty()) return _broker;
+        const auto address = _addressCache.lookup(_broker);
+        return address.empty() ? _broker : address;
+    }
+
+    ConnectionStatistics Mqtt::connectionStatistics() const {
+        ConnectionStatistics statistics;
+        statistics.reconnects = _reconnects;
+        statistics.lastReconnectMicros = _lastReconnectMicros;
+        statistics.maxReconnectMicros = _maxReconnectMicros;
+        statistics.lastOutageMicros = _lastOutageMicros;
+        statistics.sessionPresent = _sessionPresent;
+        statistics.broker = _brokers.current().name();
+        statistics.brokerSwitches = _brokers.switches();
+        return statistics;
+    }
+
+    void Mqtt::connectionLost() {
+        int64_t notSet = 0;
+        _disconnectedAt.compare_exchange_strong(notSet, nowMicros());
+    }
+
+    void Mqtt::connectionMade(const bool sessionPresent) {
+        const auto now = nowMicros();
+        _sessionPresent = sessionPresent;
+        // without a session, the broker forgot our subscriptions
+        if (!sessionPresent) {
+            std::lock_guard<std::mutex> lock(_subscriptionMutex);
+            for (const auto& subscription : _subscriptions) {
+                mosquitto_subscribe(_mosquitto, nullptr, subscription.topicFilter.c_str(), subscription.qos);
+            }
+        }
+        const auto disconnectedAt = _disconnectedAt.exchange(0);
+        if (disconnectedAt == 0) return;
+        ++_reconnects;
+        _lastOutageMicros = now - disconnectedAt;
+        if (const auto startedAt = _reconnectStartedAt.exchange(0); startedAt != 0) {
+            const auto reconnectMicros = now - startedAt;
+            _lastReconnectMicros = reconnectMicros;
+            if (reconnectMicros > _maxReconnectMicros) _maxReconnectMicros = reconnectMicros;
+        }
+        std::cout << "Reconnected in " << _lastReconnectMicros / 1000 << " ms after an outage of " 
+                  << _lastOutageMicros / 1000 << " ms (session present: " << sessionPresent << ")" << std::endl;
+    }
+
+    /// @brief Pass an incoming message to the handlers of all matching subscriptions. 
+    /// Handlers are called outside the lock, so they can (un)subscribe.
+    void Mqtt::dispatch(const mosquitto_message* message) {
+        if (message == nullptr || message->topic == nullptr) return;
+        std::vector<MessageHandler> handlers;
+        {
+            std::lock_guard<std::mutex> lock(_subscriptionMutex);
+            for (const auto& subscription : _subscriptions) {
+                bool matches = false;
+                mosquitto_topic_matches_sub(subscription.topicFilter.c_str(), message->topic, &matches);
+                if (matches) handlers.push_back(subscription.handler);
+            }
+        }
+        if (handlers.empty()) return;
+        const std::string topic(message->topic);
+        const std::string payload(static_cast<const char*>(message->payload), static_cast<size_t>(message->payloadlen));
+        for (const auto& handler : handlers) {
+            handler(topic, payload, message->retain);
+        }
+    }
+
+    /// @brief Move to the broker the selector fails back to. Disconnecting first is a clean disconnect, so the old
+    /// broker doesn't publish our will. Connecting again needs a new network thread, since the old one ends at the disconnect.
+    bool Mqtt::failBack() {
+        useCurrentBroker();
+        printf("Moving to broker %s:%d\n", _broker.c_str(), _port);
+        mosquitto_disconnect(_mosquitto);
+        if (_threaded) mosquitto_loop_stop(_mosquitto, false);
+        _isConnected = false;
+        connectionLost();
+        _reconnectStartedAt = nowMicros();
+        const int rc = connect();
+        if (rc != MOSQ_ERR_SUCCESS) std::cerr << "Connect failed, error: " << rc << "/" << mosquitto_strerror(rc) << "\n";
+        if (_threaded) mosquitto_loop_start(_mosquitto);
+        return waitForConnection();
+    }
+
+    // the callbacks (and so connection state changes) run here, on the loop's thread
+    void Mqtt::handleSocket(const uint32_t events) {
+        if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0) mosquitto_loop_read(_mosquitto, 1);
+        if ((events & EPOLLOUT) != 0) mosquitto_loop_write(_mosquitto, 1);
+    }
+
+    int64_t Mqtt::nowMicros() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+    }
+
     Mqtt::~Mqtt() {
         std::cout << "##-Mqtt Destructor-##" << std::endl; 
-        mosquitto_disconnect(_mosquitto);
-        mosquitto_loop_stop(_mosquitto, true);
+        const auto statistics = publishStatistics();
+        std::cout << "Published " << statistics.published << ", acknowledged " << statistics.acknowledged 
+                  << " (average " << (statistics.acknowledged > 0 ? statistics.totalLatencyMicros / static_cast<int64_t>(statistics.acknowledged) : 0)
+                  << " us, max " << statistics.maxLatencyMicros << " us), undelivered " << statistics.undelivered << ", rejected " << statistics.rejected 
+                  << ", in flight " << statistics.inflight << std::endl;
+        if (_brokers.size() > 1) std::cout << "Broker " << _brokers.current().name() << " after " << _brokers.switches() << " switches" << std::endl;
+        end();
         mosquitto_destroy(_mosquitto);
         mosquitto_lib_cleanup();
     }
 
-    bool Mqtt::publish(const std::string& topic, const std::string& message, bool retain) {
+    /// @brief Without a network thread, run the network loop once (waiting up to timeoutMillis), so callbacks come in.
+    /// @return false if there is a network thread, or the loop failed; the caller should then just wait
+    bool Mqtt::poll(const int timeoutMillis) {
+        return !_threaded && mosquitto_loop(_mosquitto, timeoutMillis, 1) == MOSQ_ERR_SUCCESS;
+    }
+
+    /// @brief Hand a message over from a thread that doesn't own the connection (e.g. a monitor).
+    /// It goes out with the next publish, so only one thread ever (re)connects or drives the socket.
+    /// Only the newest MAX_POSTED messages are kept.
+    void Mqtt::post(const std::string& topic, const std::string& message, const MessageClass messageClass) {
+        std::lock_guard<std::mutex> lock(_postedMutex);
+        if (_posted.size() >= MAX_POSTED) _posted.erase(_posted.begin());
+        _posted.push_back({topic, message, messageClass});
+    }
+
+    /// @brief Publish a message with the QoS of its class, and the messages posted since the last publish.
+    /// QoS 1/2 messages are tracked until acknowledged.
+    /// @return whether the message was handed over to mosquitto
+    bool Mqtt::publish(const std::string& topic, const std::string& message, const bool retain, const MessageClass messageClass) {
         if (!verifyConnection()) return false;
-        int messageId;
-        _errorCode = mosquitto_publish(_mosquitto, &messageId, topic.c_str(), 
-                            static_cast<int>(message.length()), message.c_str(), 0, retain);
+        _window.expire();
+        publishPosted();
+        return publishConnected(topic, message, retain, messageClass);
+    }
+
+    bool Mqtt::publishConnected(const std::string& topic, const std::string& message, const bool retain, const MessageClass messageClass) {
+        const int qos = qosFor(messageClass);
+        if (qos == 0) {
+            if (!send(topic, message, qos, retain, messageClass, nullptr)) return false;
+            _window.countPublished();
+            return true;
+        }
+        return _window.add(topic, [&](int* messageId) { return send(topic, message, qos, retain, messageClass, messageId); });
+    }
+
+    void Mqtt::publishPosted() {
+        std::vector<Posted> posted;
+        {
+            std::lock_guard<std::mutex> lock(_postedMutex);
+            if (_posted.empty()) return;
+            posted.swap(_posted);
+        }
+        for (const auto& [topic, message, messageClass] : posted) {
+            if (!publishConnected(topic, message, false, messageClass)) std::cerr << "Could not publish " << topic << "\n";
+        }
+    }
+
+    PublishStatistics Mqtt::publishStatistics() const {
+        auto statistics = _window.statistics();
+        statistics.topicBytes = _topicBytes;
+        statistics.payloadBytes = _payloadBytes;
+        statistics.aliased = _aliased;
+        return statistics;
+    }
+
+    void Mqtt::readQosConfig() {
+        const char* keys[MESSAGE_CLASSES] = { "qosMetadata", "qosState", "qosMeasurement" };
+        for (int i = 0; i < MESSAGE_CLASSES; i++) {
+            _config->setIfExists(keys[i], &_qos[i]);
+            if (_qos[i] < 0 || _qos[i] > 2) {
+                std::cerr << "Invalid " << keys[i] << " " << _qos[i] << ", using 0\n";
+                _qos[i] = 0;
+            }
+        }
+    }
+
+    /// @brief Tell the handler if we are now connected to another broker than the last time
+    void Mqtt::reportBrokerChange() {
+        auto broker = _brokers.current().name();
+        if (broker == _connectedBroker) return;
+        _connectedBroker = std::move(broker);
+        if (_brokerChangeHandler) _brokerChangeHandler();
+    }
+
+    /// @brief Forget the topic aliases of the previous connection, and take over the maximum the broker allows (v5 only)
+    void Mqtt::resetTopicAliases(const mosquitto_property* properties) {
+        uint16_t maximum = 0;
+        if (properties != nullptr) {
+            (void)mosquitto_property_read_int16(properties, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &maximum, false);
+        }
+        std::lock_guard<std::mutex> lock(_aliasMutex);
+        _topicAliases.clear();
+        _topicAliasMaximum = maximum;
+    }
+
+    bool Mqtt::send(const std::string& topic, const std::string& message, const int qos, const bool retain,
+                    const MessageClass messageClass, int* messageId) {
+        int id;
+        bool aliased = false;
+        if (_protocolVersion == MQTT_PROTOCOL_V5) {
+            _errorCode = sendV5(topic, message, qos, retain, messageClass, messageId == nullptr ? &id : messageId, &aliased);
+        } else {
+            _errorCode = mosquitto_publish(_mosquitto, messageId == nullptr ? &id : messageId, topic.c_str(), 
+                                static_cast<int>(message.length()), message.c_str(), qos, retain);
+        }
 
         if (_errorCode != MOSQ_ERR_SUCCESS) {
             std::cerr << "Publish failed, error: " << _errorCode << "/" << mosquitto_strerror(_errorCode) << "\n";
             return false;
         }
+        _payloadBytes += message.length();
+        if (aliased) {
+            ++_aliased;
+        } else {
+            _topicBytes += topic.length();
+        }
         return true;
     }
 
+    /// @brief Publish with v5 properties. Measurements get the configured expiry, so brokers drop them when stale.
+    /// QoS 0 measurements use topic aliases: the first publish on a topic sends it with a new alias, 
+    /// later ones only the alias. QoS 1/2 messages always carry the topic, since they may be resent on another connection.
+    /// @return mosquitto error code
+    int Mqtt::sendV5(const std::string& topic, const std::string& message, const int qos, const bool retain,
+                     const MessageClass messageClass, int* messageId, bool* aliased) {
+        mosquitto_property* properties = nullptr;
+        const char* topicToSend = topic.c_str();
+        uint16_t newAlias = 0;
+        // the lock also covers the publish, so the alias we register is the one the broker got with the topic
+        std::unique_lock<std::mutex> lock(_aliasMutex, std::defer_lock);
+        if (messageClass == MessageClass::Measurement) {
+            if (_messageExpirySeconds > 0) {
+                mosquitto_property_add_int32(&properties, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, _messageExpirySeconds);
+            }
+            if (qos == 0) {
+                lock.lock();
+                if (const auto iterator = _topicAliases.find(topic); iterator != _topicAliases.end()) {
+                    mosquitto_property_add_int16(&properties, MQTT_PROP_TOPIC_ALIAS, iterator->second);
+                    topicToSend = nullptr;
+                    *aliased = true;
+                } else if (_topicAliases.size() < _topicAliasMaximum) {
+                    newAlias = static_cast<uint16_t>(_topicAliases.size() + 1);
+                    mosquitto_property_add_int16(&properties, MQTT_PROP_TOPIC_ALIAS, newAlias);
+                }
+            }
+        }
+        const int result = mosquitto_publish_v5(_mosquitto, messageId, topicToSend, static_cast<int>(message.length()),
+                                                message.c_str(), qos, retain, properties);
+        mosquitto_property_free_all(&properties);
+        // only a publish that went out tells the broker the alias
+        if (newAlias != 0 && result == MOSQ_ERR_SUCCESS) _topicAliases.emplace(topic, newAlias);
+        return result;
+    }
+
+    /// @brief Set before begin()
+    void Mqtt::setBrokerChangeHandler(BrokerChangeHandler handler) {
+        _brokerChangeHandler = std::move(handler);
+    }
+
+    /// @brief Set before begin(), since the network thread calls the observer
+    void Mqtt::setLatencyObserver(LatencyObserver observer) {
+        _latencyObserver = std::move(observer);
+    }
+
     void Mqtt::setWill(const std::string &topic) const {
         constexpr const char* LOST = "lost";
-        mosquitto_will_set(_mosquitto, topic.c_str(), static_cast<int>(strlen(LOST)), LOST, 0, false);
+        mosquitto_will_set(_mosquitto, topic.c_str(), static_cast<int>(strlen(LOST)), LOST, qosFor(MessageClass::State), false);
+    }
+
+    /// @brief Subscribe to a topic filter. The subscription is renewed on reconnect (unless the session survived).
+    bool Mqtt::subscribe(const std::string& topicFilter, MessageHandler handler, const int qos) {
+        {
+            std::lock_guard<std::mutex> lock(_subscriptionMutex);
+            _subscriptions.push_back({topicFilter, qos, std::move(handler)});
+        }
+        if (!verifyConnection()) return false;
+        _errorCode = mosquitto_subscribe(_mosquitto, nullptr, topicFilter.c_str(), qos);
+        if (_errorCode != MOSQ_ERR_SUCCESS) {
+            std::cerr << "Subscribe to " << topicFilter << " failed, error: " << _errorCode << "/" << mosquitto_strerror(_errorCode) << "\n";
+            return false;
+        }
+        return true;
     }
 
-    bool Mqtt::verifyConnection() const {
-        if (_isConnected) return true;
+    bool Mqtt::unsubscribe(const std::string& topicFilter) {
+        {
+            std::lock_guard<std::mutex> lock(_subscriptionMutex);
+            for (auto iterator = _subscriptions.begin(); iterator != _subscriptions.end();) {
+                iterator = iterator->topicFilter == topicFilter ? _subscriptions.erase(iterator) : iterator + 1;
+            }
+        }
+        if (!_isConnected) return false;
+        _errorCode = mosquitto_unsubscribe(_mosquitto, nullptr, topicFilter.c_str());
+        return _errorCode == MOSQ_ERR_SUCCESS;
+    }
+
+    /// @brief Make the loop watch the current socket, for writing only if mosquitto has something to send
+    void Mqtt::watchSocket(EventLoop* loop) {
+        const int socket = mosquitto_socket(_mosquitto);
+        if (socket != _watchedSocket) {
+            if (_watchedSocket >= 0) loop->unwatch(_watchedSocket);
+            _watchedSocket = -1;
+            _watchedEvents = 0;
+        }
+        if (socket < 0) return;
+        const uint32_t events = mosquitto_want_write(_mosquitto) ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        if (socket == _watchedSocket && events == _watchedEvents) return;
+        if (loop->watch(socket, events, [this](const uint32_t socketEvents) { handleSocket(socketEvents); })) {
+            _watchedSocket = socket;
+            _watchedEvents = events;
+        }
+    }
+
+    /// @brief Take over the host and port of the broker the selector chose
+    void Mqtt::useCurrentBroker() {
+        const auto broker = _brokers.current();
+        _broker = broker.host;
+        _port = broker.port;
+    }
+
+    bool Mqtt::verifyConnection() {
+        if (_isConnected) {
+            if (!_brokers.failBack(nowMicros())) return true;
+            _isReconnectFailed = !failBack();
+            if (!_isReconnectFailed) reportBrokerChange();
+            return !_isReconnectFailed;
+        }
         printf("Connection lost. Reconnecting\n");
-        mosquitto_reconnect(_mosquitto);
-        return waitForConnection();
+        connectionLost();
+        _reconnectStartedAt = nowMicros();
+        // go to another broker if the probes say this one is down, or we couldn't get back to it last time
+        if ((_isReconnectFailed || !_brokers.isCurrentHealthy()) && _brokers.failover()) {
+            useCurrentBroker();
+            connect();
+        } else if (_fastReconnect) {
+            // in fast reconnect mode, the broker may have moved since we last connected. Otherwise, reuse the last host.
+            connect();
+        } else {
+            mosquitto_reconnect(_mosquitto);
+        }
+        _isReconnectFailed = !waitForConnection();
+        if (!_isReconnectFailed) reportBrokerChange();
+        return !_isReconnectFailed;
     }
 
     bool Mqtt::waitForConnection() const { 
@@ -140,7 +616,11 @@ namespace queuing {
         for (int i = 0; i < MAX_WAIT_DECISECONDS; i++) {
             if (_isConnected) return true;
             if (!*_keepGoing) return false;
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            // without a network thread, we need to run the network loop ourselves to get the CONNACK
+            // a shutdown request ends the wait right away
+            if ((_threaded || mosquitto_loop(_mosquitto, 100, 1) != MOSQ_ERR_SUCCESS) && !Shutdown::sleepMicros(100000)) {
+                return false;
+            }
         }
     return _isConnected;
     }
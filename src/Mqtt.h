@@ -13,46 +13,177 @@
 #define MQTT1_H
 
 #include <mosquitto.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "AddressCache.h"
+#include "BrokerSelector.h"
 #include "Config.h"
+#include "InflightWindow.h"
+
+class EventLoop;
 
 namespace queuing {
     void onConnect(mosquitto* mosquittoInstance, void* userdata, int returnCode);
     void onDisconnect(mosquitto* mosquittoInstance, void* userdata, int returnCode);
-    // void onPublish(mosquitto* mosquittoInstance, void* userdata, int messageId);
+    void onPublish(mosquitto* mosquittoInstance, void* userdata, int messageId);
+    void onMessage(mosquitto* mosquittoInstance, void* userdata, const mosquitto_message* message);
+    void onConnectV5(mosquitto* mosquittoInstance, void* userdata, int reasonCode, int flags, const mosquitto_property* properties);
+    void onDisconnectV5(mosquitto* mosquittoInstance, void* userdata, int reasonCode, const mosquitto_property* properties);
+    void onPublishV5(mosquitto* mosquittoInstance, void* userdata, int messageId, int reasonCode, const mosquitto_property* properties);
     // void onLog(mosquitto* mosquittoInstance, void* userdata, int level, const char* str);
 
+    /// @brief Message classes can have their own QoS (config entries qosMetadata, qosState, qosMeasurement)
+    enum class MessageClass { Metadata, State, Measurement };
+
+    struct ConnectionStatistics {
+        uint64_t reconnects = 0;
+        int64_t lastReconnectMicros = 0; // from starting the reconnect to the broker accepting it
+        int64_t maxReconnectMicros = 0;
+        int64_t lastOutageMicros = 0;    // from losing the connection to having it back
+        bool sessionPresent = false;     // only known with MQTT v5
+        std::string broker;              // host:port of the current broker
+        uint64_t brokerSwitches = 0;     // failovers and fail backs
+    };
+
+    /// @brief Called (from the network thread) for each incoming message on a subscribed topic filter
+    using MessageHandler = std::function<void(const std::string& topic, const std::string& payload, bool retained)>;
+
+    /// @brief Called (from the network thread, keep it cheap) with the acknowledgement latency of each QoS 1/2 message
+    using LatencyObserver = std::function<void(int64_t latencyMicros)>;
+
+    /// @brief Called when the client is connected to another broker than before (failover or fail back),
+    /// on the thread that verified the connection. The new broker doesn't have our retained messages yet.
+    using BrokerChangeHandler = std::function<void()>;
+
     class Mqtt {
     public:
         explicit Mqtt(const Config* config, volatile bool* keepGoing);
         ~Mqtt();
+        void attach(EventLoop* loop);
         bool begin();
+        std::vector<BrokerHealth> brokerHealth() const { return _brokers.health(); }
+        void end();
         int errorCode() const { return _errorCode; }
+        bool flush(int64_t timeoutMicros);
         bool isConnected() const { return _isConnected; }
-        bool publish(const std::string& topic, const std::string& message, bool retain = false);
+        bool isThreaded() const { return _threaded; }
+        bool poll(int timeoutMillis);
+        void post(const std::string& topic, const std::string& message, MessageClass messageClass);
+        bool publish(const std::string& topic, const std::string& message, bool retain = false,
+                     MessageClass messageClass = MessageClass::Measurement);
+        PublishStatistics publishStatistics() const;
+        ConnectionStatistics connectionStatistics() const;
+        void setBrokerChangeHandler(BrokerChangeHandler handler);
+        void setLatencyObserver(LatencyObserver observer);
         void setWill(const std::string& topic) const;
-        bool verifyConnection() const;
+        bool subscribe(const std::string& topicFilter, MessageHandler handler, int qos = 0);
+        bool unsubscribe(const std::string& topicFilter);
+        bool verifyConnection();
         bool waitForConnection() const;
         friend void onConnect(mosquitto* mosquittoInstance, void* userdata, int returnCode);
         friend void onDisconnect(mosquitto* mosquittoInstance, void* userdata, int returnCode);
-        // friend void onPublish(mosquitto* mosquittoInstance, void* userdata, int messageId);
+        friend void onPublish(mosquitto* mosquittoInstance, void* userdata, int messageId);
+        friend void onMessage(mosquitto* mosquittoInstance, void* userdata, const mosquitto_message* message);
+        friend void onConnectV5(mosquitto* mosquittoInstance, void* userdata, int reasonCode, int flags, const mosquitto_property* properties);
+        friend void onDisconnectV5(mosquitto* mosquittoInstance, void* userdata, int reasonCode, const mosquitto_property* properties);
+        friend void onPublishV5(mosquitto* mosquittoInstance, void* userdata, int messageId, int reasonCode, const mosquitto_property* properties);
         // friend void onLog(mosquitto* mosquittoInstance, void* userdata, int level, const char* str);
 
 
     private:
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr int MESSAGE_CLASSES = 3;
+        static constexpr size_t MAX_POSTED = 8;
+
         const Config* _config;
         mosquitto* _mosquitto;
-        const char* _broker = nullptr;
-        const char* _caCert = nullptr;
-        const char* _user = nullptr;
-        const char* _password = nullptr;
+        std::string _broker;
+        std::string _caCert;
+        std::string _user;
+        std::string _password;
         int _errorCode = 0;
         int _port = 1883;
         int _keepAliveSeconds = 60;
         bool _isConnected = false;
         volatile bool* _keepGoing = nullptr;
+        int _qos[MESSAGE_CLASSES] = { 0, 0, 0 };
+        unsigned int _maxInflight = 20;
+        InflightWindow _window;
+        LatencyObserver _latencyObserver;
+        int _protocolVersion = MQTT_PROTOCOL_V311;
+        uint32_t _messageExpirySeconds = 0;
+        std::mutex _aliasMutex;
+        uint16_t _topicAliasMaximum = 0;
+        std::unordered_map<std::string, uint16_t> _topicAliases;
+        std::atomic<uint64_t> _topicBytes{0};
+        std::atomic<uint64_t> _payloadBytes{0};
+        std::atomic<uint64_t> _aliased{0};
+        bool _fastReconnect = false;
+        uint32_t _sessionExpirySeconds = 3600;
+        AddressCache _addressCache;
+        BrokerSelector _brokers;
+        BrokerChangeHandler _brokerChangeHandler;
+        std::string _connectedBroker;   // host:port of the broker we connected to last
+        bool _isReconnectFailed = false;
+        std::atomic<int64_t> _disconnectedAt{0};
+        std::atomic<int64_t> _reconnectStartedAt{0};
+        std::atomic<uint64_t> _reconnects{0};
+        std::atomic<int64_t> _lastReconnectMicros{0};
+        std::atomic<int64_t> _maxReconnectMicros{0};
+        std::atomic<int64_t> _lastOutageMicros{0};
+        std::atomic<bool> _sessionPresent{false};
+
+        struct Subscription {
+            std::string topicFilter;
+            int qos;
+            MessageHandler handler;
+        };
+        struct Posted {
+            std::string topic;
+            std::string message;
+            MessageClass messageClass;
+        };
+        std::mutex _postedMutex;
+        std::vector<Posted> _posted;
+
+        std::mutex _subscriptionMutex;
+        std::vector<Subscription> _subscriptions;
+        // eventLoop=1: no network thread, an EventLoop (or waitForConnection) drives the socket
+        bool _threaded = true;
+        int _watchedSocket = -1;
+        uint32_t _watchedEvents = 0;
+        bool _isEnded = false;
+
+        void acknowledge(int messageId, bool accepted = true);
+        std::string clientId() const;
+        int connect();
+        std::string connectHost();
+        void connectionLost();
+        void connectionMade(bool sessionPresent);
+        void dispatch(const mosquitto_message* message);
+        bool failBack();
+        static int64_t nowMicros();
         bool firstConnect();
+        void handleSocket(uint32_t events);
+        bool publishConnected(const std::string& topic, const std::string& message, bool retain, MessageClass messageClass);
+        void publishPosted();
+        int qosFor(MessageClass messageClass) const { return _qos[static_cast<int>(messageClass)]; }
+        void readQosConfig();
+        void reportBrokerChange();
+        void resetTopicAliases(const mosquitto_property* properties);
+        bool send(const std::string& topic, const std::string& message, int qos, bool retain, MessageClass messageClass, int* messageId);
+        int sendV5(const std::string& topic, const std::string& message, int qos, bool retain, MessageClass messageClass, int* messageId, bool* aliased);
         void setConnected(bool connected) { _isConnected = connected; }
         void setErrorCode(int returnCode) { _errorCode = returnCode; }
+        void useCurrentBroker();
+        void watchSocket(EventLoop* loop);
     };
 }
 
@@ -0,0 +1,174 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "PayloadEncoder.h"
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+// CBOR major types (RFC 8949)
+constexpr uint8_t CBOR_UNSIGNED = 0;
+constexpr uint8_t CBOR_NEGATIVE = 1;
+constexpr uint8_t CBOR_TEXT = 3;
+constexpr uint8_t CBOR_MAP = 5;
+constexpr uint8_t CBOR_FLOAT32 = 0xFA;
+constexpr int MEASUREMENT_FIELDS = 5;
+
+/// @param withSampleTime also include when the newest sample was taken ("sampled", ms since the epoch)
+bool PayloadEncoder::encode(const PayloadFormat format, const Measurement& measurement, std::string& output, const bool withSampleTime) {
+    switch (format) {
+        case PayloadFormat::Json:
+            toJson(measurement, output, withSampleTime);
+            return true;
+        case PayloadFormat::Cbor:
+            toCbor(measurement, output, withSampleTime);
+            return true;
+        default:
+            output.clear();
+            return false;
+    }
+}
+
+/// @brief Append the measurement as an InfluxDB line protocol line (nanosecond timestamp). NaN values can't be
+/// represented, so they are left out; the counts are always there, so a line always has a field.
+/// @param seriesKey measurement name plus tags, e.g. climate,device=kitchen (see escapeTag)
+void PayloadEncoder::appendLineProtocol(const Measurement& measurement, const std::string& seriesKey, std::string& output) {
+    output += seriesKey;
+    char buffer[64];
+    char separator = ' ';
+    const std::pair<const char*, float> values[] = {{TEMPERATURE, measurement.temperature}, {HUMIDITY, measurement.humidity}};
+    for (const auto& [key, value] : values) {
+        if (std::isnan(value)) continue;
+        (void)snprintf(buffer, sizeof(buffer), "%c%s=%.1f", separator, key, static_cast<double>(value));
+        output += buffer;
+        separator = ',';
+    }
+    (void)snprintf(buffer, sizeof(buffer), "%c%s=%di,%s=%di %" PRId64 "000000\n",
+        separator, SAMPLES, measurement.sampleCount, NANS, measurement.nanCount, measurement.timestamp);
+    output += buffer;
+}
+
+/// @brief Escape commas, spaces and equal signs for use in a line protocol tag key or value
+std::string PayloadEncoder::escapeTag(const std::string& value) {
+    std::string result;
+    for (const char c : value) {
+        if (c == ',' || c == ' ' || c == '=') result += '\\';
+        result += c;
+    }
+    return result;
+}
+
+PayloadFormat PayloadEncoder::parseFormat(const std::string& format) {
+    if (format == "json") return PayloadFormat::Json;
+    if (format == "cbor") return PayloadFormat::Cbor;
+    return PayloadFormat::Homie;
+}
+
+/// @brief Render the measurement as a CBOR map with the same keys as the JSON variant.
+/// Floats are sent as single precision (NaN stays NaN), counts and timestamp as integers.
+void PayloadEncoder::toCbor(const Measurement& measurement, std::string& output, const bool withSampleTime) {
+    output.clear();
+    appendCborHeader(output, CBOR_MAP, MEASUREMENT_FIELDS + (withSampleTime ? 1 : 0));
+    appendCborText(output, TEMPERATURE);
+    appendCborFloat(output, measurement.temperature);
+    appendCborText(output, HUMIDITY);
+    appendCborFloat(output, measurement.humidity);
+    appendCborText(output, SAMPLES);
+    appendCborHeader(output, CBOR_UNSIGNED, static_cast<uint64_t>(measurement.sampleCount));
+    appendCborText(output, NANS);
+    appendCborHeader(output, CBOR_UNSIGNED, static_cast<uint64_t>(measurement.nanCount));
+    appendCborText(output, TIMESTAMP);
+    appendCborInteger(output, measurement.timestamp);
+    if (withSampleTime) {
+        appendCborText(output, SAMPLED);
+        appendCborInteger(output, measurement.sampledMillis);
+    }
+}
+
+/// @brief Render the measurement as compact JSON. Values use the same precision as the Homie properties, NaN becomes null.
+void PayloadEncoder::toJson(const Measurement& measurement, std::string& output, const bool withSampleTime) {
+    output.clear();
+    output += '{';
+    appendJsonFloat(output, TEMPERATURE, measurement.temperature);
+    output += ',';
+    appendJsonFloat(output, HUMIDITY, measurement.humidity);
+    char buffer[80];
+    (void)snprintf(buffer, sizeof(buffer), R"(,"%s":%d,"%s":%d,"%s":%)" PRId64,
+        SAMPLES, measurement.sampleCount, NANS, measurement.nanCount, TIMESTAMP, measurement.timestamp);
+    output += buffer;
+    if (withSampleTime) {
+        (void)snprintf(buffer, sizeof(buffer), R"(,"%s":%)" PRId64, SAMPLED, measurement.sampledMillis);
+        output += buffer;
+    }
+    output += '}';
+}
+
+void PayloadEncoder::appendCborFloat(std::string& output, const float value) {
+    uint32_t bits;
+    static_assert(sizeof(bits) == sizeof(value), "float must be 32 bits");
+    memcpy(&bits, &value, sizeof(bits));
+    output += static_cast<char>(CBOR_FLOAT32);
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        output += static_cast<char>((bits >> shift) & 0xFF);
+    }
+}
+
+/// @brief Append a CBOR initial byte plus argument, using the shortest encoding for the value
+void PayloadEncoder::appendCborHeader(std::string& output, const uint8_t majorType, const uint64_t value) {
+    const auto type = static_cast<uint8_t>(majorType << 5);
+    if (value < 24) {
+        output += static_cast<char>(type | value);
+        return;
+    }
+    int bytes;
+    if (value <= 0xFF) {
+        output += static_cast<char>(type | 24);
+        bytes = 1;
+    } else if (value <= 0xFFFF) {
+        output += static_cast<char>(type | 25);
+        bytes = 2;
+    } else if (value <= 0xFFFFFFFF) {
+        output += static_cast<char>(type | 26);
+        bytes = 4;
+    } else {
+        output += static_cast<char>(type | 27);
+        bytes = 8;
+    }
+    for (int i = bytes - 1; i >= 0; i--) {
+        output += static_cast<char>((value >> (i * 8)) & 0xFF);
+    }
+}
+
+void PayloadEncoder::appendCborInteger(std::string& output, const int64_t value) {
+    if (value >= 0) {
+        appendCborHeader(output, CBOR_UNSIGNED, static_cast<uint64_t>(value));
+    } else {
+        appendCborHeader(output, CBOR_NEGATIVE, static_cast<uint64_t>(-1 - value));
+    }
+}
+
+void PayloadEncoder::appendCborText(std::string& output, const char* text) {
+    const auto length = strlen(text);
+    appendCborHeader(output, CBOR_TEXT, length);
+    output.append(text, length);
+}
+
+void PayloadEncoder::appendJsonFloat(std::string& output, const char* key, const float value) {
+    char buffer[40];
+    if (std::isnan(value)) {
+        (void)snprintf(buffer, sizeof(buffer), "\"%s\":null", key);
+    } else {
+        (void)snprintf(buffer, sizeof(buffer), "\"%s\":%.1f", key, static_cast<double>(value));
+    }
+    output += buffer;
+}
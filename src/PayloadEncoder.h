@@ -0,0 +1,49 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef PAYLOAD_ENCODER_H
+#define PAYLOAD_ENCODER_H
+
+#include <string>
+#include "Measurement.h"
+
+enum class PayloadFormat {
+    Homie, // one message per property, no combined payload
+    Json,
+    Cbor
+};
+
+/// @brief Encodes a complete measurement into a single message payload
+class PayloadEncoder {
+public:
+    static void appendLineProtocol(const Measurement& measurement, const std::string& seriesKey, std::string& output);
+    static bool encode(PayloadFormat format, const Measurement& measurement, std::string& output, bool withSampleTime = false);
+    static std::string escapeTag(const std::string& value);
+    static PayloadFormat parseFormat(const std::string& format);
+    static void toCbor(const Measurement& measurement, std::string& output, bool withSampleTime = false);
+    static void toJson(const Measurement& measurement, std::string& output, bool withSampleTime = false);
+
+private:
+    static constexpr const char* TEMPERATURE = "temperature";
+    static constexpr const char* HUMIDITY = "humidity";
+    static constexpr const char* SAMPLES = "samples";
+    static constexpr const char* NANS = "nans";
+    static constexpr const char* TIMESTAMP = "timestamp";
+    static constexpr const char* SAMPLED = "sampled";
+
+    static void appendCborFloat(std::string& output, float value);
+    static void appendCborHeader(std::string& output, uint8_t majorType, uint64_t value);
+    static void appendCborInteger(std::string& output, int64_t value);
+    static void appendCborText(std::string& output, const char* text);
+    static void appendJsonFloat(std::string& output, const char* key, float value);
+};
+
+#endif
@@ -0,0 +1,83 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "PhaseSchedule.h"
+#include <chrono>
+#include <cstdio>
+
+PhaseSchedule::PhaseSchedule(const Config* config) : _config(config) {}
+
+/// @brief Read phaseSpread (1 to shift this device's grid) and windowSeconds (aggregation window, 0 counts samples instead).
+/// Without phaseSpread, the windows are still aligned to the clock (and shared by all devices), but reads are not
+/// put on a grid: they follow the interval from startup.
+void PhaseSchedule::begin() {
+    _config->setIfExists("phaseSpread", &_enabled);
+    int windowSeconds = 0;
+    _config->setIfExists("windowSeconds", &windowSeconds);
+    _windowMicros = windowSeconds > 0 ? static_cast<uint64_t>(windowSeconds) * 1000000U : 0;
+    _hash = _enabled ? hash(_config->getEntry("device")) : 0;
+}
+
+/// @brief Log the offset for the read interval. Only the first time, since begin() runs again on every sensor reset.
+void PhaseSchedule::report(const uint64_t periodMicros) {
+    if (!_enabled || _isReported) return;
+    _isReported = true;
+    printf("Phase spread: read offset %lld us in each %llu s\n", static_cast<long long>(offsetMicros(periodMicros)),
+           static_cast<unsigned long long>(periodMicros / 1000000U));
+}
+
+/// @brief FNV-1a, with a final mix so that names differing only in the last digit end up far apart
+uint64_t PhaseSchedule::hash(const std::string& device) {
+    uint64_t result = 14695981039346656037ULL;
+    for (const char c : device) {
+        result ^= static_cast<uint8_t>(c);
+        result *= 1099511628211ULL;
+    }
+    result ^= result >> 33;
+    result *= 0xff51afd7ed558ccdULL;
+    result ^= result >> 33;
+    result *= 0xc4ceb9fe1a85ec53ULL;
+    result ^= result >> 33;
+    return result;
+}
+
+/// @brief The correction (at most half a period either way) that moves the time to the nearest slot of this device
+int64_t PhaseSchedule::nearestSlotMicros(const int64_t wallMicros, const uint64_t periodMicros) const {
+    const auto untilNext = untilNextSlotMicros(wallMicros, periodMicros);
+    const auto period = static_cast<int64_t>(periodMicros);
+    return untilNext > period / 2 ? untilNext - period : untilNext;
+}
+
+int64_t PhaseSchedule::offsetMicros(const uint64_t periodMicros) const {
+    if (periodMicros == 0) return 0;
+    return static_cast<int64_t>(_hash % periodMicros);
+}
+
+/// @brief Time from wallMicros to the next slot of this device (0 if it's right on one)
+int64_t PhaseSchedule::untilNextSlotMicros(const int64_t wallMicros, const uint64_t periodMicros) const {
+    if (periodMicros == 0) return 0;
+    const auto period = static_cast<int64_t>(periodMicros);
+    const auto sinceSlot = ((wallMicros - offsetMicros(periodMicros)) % period + period) % period;
+    return sinceSlot == 0 ? 0 : period - sinceSlot;
+}
+
+/// @brief The number of the aggregation window the time falls in. Windows start on this device's slots.
+int64_t PhaseSchedule::windowIndex(const int64_t wallMicros) const {
+    if (_windowMicros == 0) return 0;
+    const auto window = static_cast<int64_t>(_windowMicros);
+    const auto shifted = wallMicros - offsetMicros(_windowMicros);
+    // floor division, also before the epoch
+    return shifted >= 0 ? shifted / window : (shifted - window + 1) / window;
+}
+
+int64_t PhaseSchedule::wallMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
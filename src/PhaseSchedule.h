@@ -0,0 +1,48 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef PHASE_SCHEDULE_H
+#define PHASE_SCHEDULE_H
+
+#include <cstdint>
+#include <string>
+#include "Config.h"
+
+/// @brief Puts reads and aggregation windows on a wall-clock grid, shifted by a phase that follows from the device name.
+/// Devices restarting together then still read and publish at different moments, spread evenly over the period,
+/// while each device keeps a fixed place in it. The offset for a period is hash(device) modulo the period, so
+/// offsets for a period and for its multiples agree: reads line up with window boundaries if the window is
+/// a multiple of the read interval.
+class PhaseSchedule {
+public:
+    explicit PhaseSchedule(const Config* config);
+    void begin();
+    bool isEnabled() const { return _enabled; }
+    bool hasWindows() const { return _windowMicros > 0; }
+    int64_t nearestSlotMicros(int64_t wallMicros, uint64_t periodMicros) const;
+    int64_t offsetMicros(uint64_t periodMicros) const;
+    void report(uint64_t periodMicros);
+    int64_t untilNextSlotMicros(int64_t wallMicros, uint64_t periodMicros) const;
+    int64_t windowIndex(int64_t wallMicros) const;
+    uint64_t windowMicros() const { return _windowMicros; }
+
+    static uint64_t hash(const std::string& device);
+    static int64_t wallMicros();
+
+private:
+    const Config* _config;
+    bool _enabled = false;
+    uint64_t _hash = 0;
+    uint64_t _windowMicros = 0;
+    bool _isReported = false;
+};
+
+#endif
@@ -0,0 +1,249 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "QuantileSketch.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <utility>
+
+namespace {
+    constexpr const char* FORMAT = "kll1";
+    constexpr size_t MAX_LEVELS = 63;  // weights are 2^level in a uint64_t
+
+    // the shortest text that reads back as the same float; sensor values need only a few digits
+    void appendValue(std::string& output, const float value) {
+        char buffer[32];
+        snprintf(buffer, sizeof buffer, "%g", static_cast<double>(value));
+        if (strtof(buffer, nullptr) != value) snprintf(buffer, sizeof buffer, "%.9g", static_cast<double>(value));
+        output += buffer;
+    }
+
+    bool parseValue(const std::string& text, float* value) {
+        if (text.empty()) return false;
+        char* end = nullptr;
+        *value = strtof(text.c_str(), &end);
+        return *end == '\0';
+    }
+}
+
+QuantileSketch::QuantileSketch(const int k) : _k(std::max(k, MIN_K)) {
+    _levels.emplace_back();
+}
+
+/// @brief Take in a value that stands for weight inputs. NaN values (and a weight of 0) are ignored.
+/// A weight goes in as one copy of the value on each level whose bit is set in it, since level h stands for 2^h inputs.
+void QuantileSketch::add(const float value, const uint64_t weight) {
+    if (std::isnan(value) || weight == 0) return;
+    _min = _count == 0 ? value : std::min(_min, value);
+    _max = _count == 0 ? value : std::max(_max, value);
+    _count += weight;
+    if (weight == 1) {
+        _levels[0].push_back(value);
+        // only level 0 grows between compressions
+        if (_levels[0].size() >= capacity(0)) compress();
+        return;
+    }
+    for (size_t level = 0; level < MAX_LEVELS && (weight >> level) != 0; level++) {
+        if (((weight >> level) & 1U) == 0) continue;
+        while (_levels.size() <= level) _levels.emplace_back();
+        _levels[level].push_back(value);
+    }
+    compress();
+}
+
+// lower levels get less room: k * (2/3)^depth, with depth 0 for the top level
+size_t QuantileSketch::capacity(const size_t level) const {
+    const auto depth = _levels.size() - 1 - level;
+    double capacity = _k;
+    for (size_t i = 0; i < depth; i++) capacity *= 2.0 / 3.0;
+    return std::max<size_t>(2, static_cast<size_t>(std::ceil(capacity)));
+}
+
+// Sort the level and promote every other value (starting at a random one of the first two, so the error is unbiased)
+void QuantileSketch::compact(const size_t level) {
+    if (level + 1 >= _levels.size()) _levels.emplace_back();
+    auto& items = _levels[level];
+    auto& above = _levels[level + 1];
+    std::sort(items.begin(), items.end());
+    const size_t paired = items.size() & ~static_cast<size_t>(1);
+    for (size_t i = nextBit() ? 1 : 0; i < paired; i += 2) above.push_back(items[i]);
+    // with an odd number, the highest value stays behind
+    if (paired < items.size()) {
+        items[0] = items[paired];
+        items.resize(1);
+    } else {
+        items.clear();
+    }
+}
+
+// compact the lowest full level until all values fit in the total capacity
+void QuantileSketch::compress() {
+    for (;;) {
+        size_t total = 0;
+        size_t limit = 0;
+        for (size_t level = 0; level < _levels.size(); level++) {
+            total += _levels[level].size();
+            limit += capacity(level);
+        }
+        if (total <= limit) return;
+        bool isCompacted = false;
+        for (size_t level = 0; level < _levels.size() && level < MAX_LEVELS && !isCompacted; level++) {
+            if (_levels[level].size() < capacity(level)) continue;
+            compact(level);
+            isCompacted = true;
+        }
+        if (!isCompacted) return;
+    }
+}
+
+/// @brief Read a sketch written by serialize()
+/// @return false if the text isn't a valid sketch (the sketch is then undefined)
+bool QuantileSketch::deserialize(const std::string& text, QuantileSketch* sketch) {
+    std::vector<std::string> fields;
+    std::stringstream stream(text);
+    std::string field;
+    while (std::getline(stream, field, ';')) fields.push_back(field);
+    if (fields.size() < 5 || fields[0] != FORMAT) return false;
+    char* end = nullptr;
+    const auto k = strtol(fields[1].c_str(), &end, 10);
+    if (*end != '\0' || k < MIN_K || k > 1000000) return false;
+    const auto count = strtoull(fields[2].c_str(), &end, 10);
+    if (*end != '\0' || fields.size() - 5 > MAX_LEVELS + 1) return false;
+    *sketch = QuantileSketch(static_cast<int>(k));
+    sketch->_count = count;
+    if (count > 0 && (!parseValue(fields[3], &sketch->_min) || !parseValue(fields[4], &sketch->_max))) return false;
+    sketch->_levels.clear();
+    uint64_t weight = 0;
+    for (size_t level = 0; level + 5 < fields.size(); level++) {
+        std::vector<float> items;
+        std::stringstream values(fields[level + 5]);
+        std::string value;
+        while (std::getline(values, value, ',')) {
+            float item;
+            if (!parseValue(value, &item) || std::isnan(item)) return false;
+            items.push_back(item);
+        }
+        weight += static_cast<uint64_t>(items.size()) << level;
+        sketch->_levels.push_back(std::move(items));
+    }
+    if (sketch->_levels.empty()) sketch->_levels.emplace_back();
+    // the weights must account for all values
+    return weight == count;
+}
+
+float QuantileSketch::max() const {
+    return _count == 0 ? NAN : _max;
+}
+
+/// @brief Add the values of another sketch (with the same k), as if they had been added here
+/// @return false if k differs
+bool QuantileSketch::merge(const QuantileSketch& other) {
+    if (other._k != _k) return false;
+    if (&other == this) {
+        const QuantileSketch copy = other;
+        return merge(copy);
+    }
+    if (other._count == 0) return true;
+    while (_levels.size() < other._levels.size()) _levels.emplace_back();
+    for (size_t level = 0; level < other._levels.size(); level++) {
+        _levels[level].insert(_levels[level].end(), other._levels[level].begin(), other._levels[level].end());
+    }
+    _min = _count == 0 ? other._min : std::min(_min, other._min);
+    _max = _count == 0 ? other._max : std::max(_max, other._max);
+    _count += other._count;
+    compress();
+    return true;
+}
+
+float QuantileSketch::min() const {
+    return _count == 0 ? NAN : _min;
+}
+
+/// @brief The value at a rank between 0 (the minimum) and 1 (the maximum), e.g. 0.95 for p95
+/// @return NaN if the sketch is empty
+float QuantileSketch::quantile(const double rank) const {
+    if (_count == 0) return NAN;
+    if (rank <= 0.0) return _min;
+    if (rank >= 1.0) return _max;
+    std::vector<std::pair<float, uint64_t>> weighted;
+    weighted.reserve(retained());
+    for (size_t level = 0; level < _levels.size(); level++) {
+        for (const auto value : _levels[level]) weighted.emplace_back(value, static_cast<uint64_t>(1) << level);
+    }
+    std::sort(weighted.begin(), weighted.end());
+    const double target = rank * static_cast<double>(_count);
+    uint64_t cumulative = 0;
+    for (const auto& [value, weight] : weighted) {
+        cumulative += weight;
+        if (static_cast<double>(cumulative) >= target) return value;
+    }
+    return _max;
+}
+
+// xorshift32: cheap, and deterministic so summaries can be reproduced
+bool QuantileSketch::nextBit() {
+    _random ^= _random << 13;
+    _random ^= _random >> 17;
+    _random ^= _random << 5;
+    return (_random & 1) != 0;
+}
+
+/// @brief Start over, e.g. for the next horizon
+void QuantileSketch::reset() {
+    for (auto& level : _levels) level.clear();
+    _levels.resize(1);
+    _count = 0;
+}
+
+/// @brief The number of values kept
+size_t QuantileSketch::retained() const {
+    size_t total = 0;
+    for (const auto& level : _levels) total += level.size();
+    return total;
+}
+
+/// @brief kll1;k;count;min;max;level 0 values;level 1 values;... with comma separated values
+std::string QuantileSketch::serialize() const {
+    std::string output = FORMAT;
+    output += ";" + std::to_string(_k) + ";" + std::to_string(_count) + ";";
+    if (_count > 0) appendValue(output, _min);
+    output += ";";
+    if (_count > 0) appendValue(output, _max);
+    for (const auto& level : _levels) {
+        output += ";";
+        for (size_t i = 0; i < level.size(); i++) {
+            if (i > 0) output += ",";
+            appendValue(output, level[i]);
+        }
+    }
+    return output;
+}
+
+/// @brief {"property":..,"start":ms,"seconds":s,"count":n,"min":..,"p5":..,"p50":..,"p95":..,"max":..,"sketch":".."}
+/// The percentiles are for direct use, the sketch for merging.
+std::string QuantileSketch::toJson(const Summary& summary) {
+    const auto& sketch = summary.sketch;
+    std::string json = "{\"property\":\"" + summary.property + "\",\"start\":" + std::to_string(summary.startMillis) +
+                       ",\"seconds\":" + std::to_string(summary.horizonSeconds) + ",\"count\":" + std::to_string(sketch.count());
+    if (sketch.count() > 0) {
+        const std::pair<const char*, float> values[] = {
+            {"min", sketch.min()}, {"p5", sketch.quantile(0.05)}, {"p50", sketch.quantile(0.5)},
+            {"p95", sketch.quantile(0.95)}, {"max", sketch.max()}};
+        for (const auto& [key, value] : values) {
+            json += std::string(",\"") + key + "\":";
+            appendValue(json, value);
+        }
+    }
+    return json + ",\"sketch\":\"" + sketch.serialize() + "\"}";
+}
@@ -0,0 +1,67 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef QUANTILE_SKETCH_H
+#define QUANTILE_SKETCH_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct Summary;
+
+/// @brief A KLL sketch: approximate quantiles of a stream in fixed memory (about 3k values, whatever the count).
+/// Level h holds values that stand for 2^h inputs; a full level sorts itself and passes every other value up.
+/// Sketches with the same k merge, so per-device summaries combine into fleet percentiles.
+/// The rank error is around 1.7/k (1% at the default k=200).
+/// Values can carry an integer weight (e.g. the seconds a sample stands for); count() is then the total weight.
+class QuantileSketch {
+public:
+    static constexpr int DEFAULT_K = 200;
+    static constexpr int MIN_K = 8;
+
+    explicit QuantileSketch(int k = DEFAULT_K);
+    void add(float value, uint64_t weight = 1);
+    [[nodiscard]] uint64_t count() const { return _count; }
+    static bool deserialize(const std::string& text, QuantileSketch* sketch);
+    [[nodiscard]] int k() const { return _k; }
+    [[nodiscard]] float max() const;
+    bool merge(const QuantileSketch& other);
+    [[nodiscard]] float min() const;
+    [[nodiscard]] float quantile(double rank) const;
+    void reset();
+    [[nodiscard]] size_t retained() const;
+    [[nodiscard]] std::string serialize() const;
+    static std::string toJson(const Summary& summary);
+
+private:
+    int _k;
+    uint64_t _count = 0;
+    float _min = 0.0f;
+    float _max = 0.0f;
+    std::vector<std::vector<float>> _levels;
+    uint32_t _random = 0x9E3779B9;
+
+    [[nodiscard]] size_t capacity(size_t level) const;
+    void compact(size_t level);
+    void compress();
+    bool nextBit();
+};
+
+/// @brief The distribution of a property over a clock-aligned horizon (e.g. an hour or a day)
+struct Summary {
+    std::string property;
+    int horizonSeconds = 0;
+    int64_t startMillis = 0;  // the start of the horizon (ms since epoch)
+    QuantileSketch sketch;
+};
+
+#endif
@@ -0,0 +1,283 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "ResourceMonitor.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "Trace.h"
+
+namespace {
+    // Linux encodes "CPU time of thread tid" as a clock id (see MAKE_THREAD_CPUCLOCK in the kernel), which gives
+    // CLOCK_THREAD_CPUTIME_ID precision for any thread of the process, not just the calling one
+    constexpr clockid_t CPUCLOCK_PERTHREAD_SCHED = 6;
+
+    struct TaskSample {
+        std::string name;
+        int64_t cpuMicros = 0;
+        uint64_t voluntarySwitches = 0;
+        uint64_t involuntarySwitches = 0;
+    };
+
+    int64_t steadyMicros() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    int64_t clockMicros(const clockid_t clock) {
+        timespec time{};
+        if (clock_gettime(clock, &time) != 0) return -1;
+        return static_cast<int64_t>(time.tv_sec) * 1000000 + time.tv_nsec / 1000;
+    }
+
+    bool readFile(const std::string& path, char* buffer, const size_t size) {
+        FILE* file = fopen(path.c_str(), "r");
+        if (file == nullptr) return false;
+        const size_t length = fread(buffer, 1, size - 1, file);
+        fclose(file);
+        buffer[length] = 0;
+        return length > 0;
+    }
+
+    // utime + stime from the stat file, in clock ticks (usually 10 ms), if the thread clock isn't available
+    int64_t statCpuMicros(const std::string& taskPath) {
+        char buffer[512];
+        if (!readFile(taskPath + "/stat", buffer, sizeof buffer)) return 0;
+        // the name (field 2) may contain spaces; fields 14 and 15 are the 11th and 12th after it
+        const char* fields = strrchr(buffer, ')');
+        if (fields == nullptr) return 0;
+        unsigned long long userTicks = 0;
+        unsigned long long systemTicks = 0;
+        if (sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &userTicks, &systemTicks) != 2) return 0;
+        return static_cast<int64_t>((userTicks + systemTicks) * 1000000ULL / static_cast<unsigned long long>(sysconf(_SC_CLK_TCK)));
+    }
+
+    bool readTask(const int tid, TaskSample* sample) {
+        const std::string taskPath = "/proc/self/task/" + std::to_string(tid);
+        char buffer[2048];
+        if (!readFile(taskPath + "/comm", buffer, sizeof buffer)) return false;
+        buffer[strcspn(buffer, "\n")] = 0;
+        // the main thread's name is the program's name
+        sample->name = tid == getpid() ? "main" : buffer;
+        if (readFile(taskPath + "/status", buffer, sizeof buffer)) {
+            if (const char* line = strstr(buffer, "\nvoluntary_ctxt_switches:"); line != nullptr) {
+                sample->voluntarySwitches = strtoull(line + strlen("\nvoluntary_ctxt_switches:"), nullptr, 10);
+            }
+            if (const char* line = strstr(buffer, "\nnonvoluntary_ctxt_switches:"); line != nullptr) {
+                sample->involuntarySwitches = strtoull(line + strlen("\nnonvoluntary_ctxt_switches:"), nullptr, 10);
+            }
+        }
+        const auto clock = static_cast<clockid_t>(~static_cast<unsigned int>(tid) << 3) | CPUCLOCK_PERTHREAD_SCHED;
+        sample->cpuMicros = clockMicros(clock);
+        if (sample->cpuMicros < 0) sample->cpuMicros = statCpuMicros(taskPath);
+        return true;
+    }
+
+    int64_t rssKb() {
+        char buffer[128];
+        if (!readFile("/proc/self/statm", buffer, sizeof buffer)) return 0;
+        unsigned long long residentPages = 0;
+        if (sscanf(buffer, "%*u %llu", &residentPages) != 1) return 0;
+        return static_cast<int64_t>(residentPages * static_cast<unsigned long long>(sysconf(_SC_PAGESIZE)) / 1024);
+    }
+
+    int64_t heapKb() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+        return static_cast<int64_t>(mallinfo2().uordblks / 1024);
+#elif defined(__GLIBC__)
+        return static_cast<int64_t>(static_cast<unsigned int>(mallinfo().uordblks) / 1024);
+#else
+        return 0;
+#endif
+    }
+
+    void appendEscaped(std::string& json, const std::string& text) {
+        for (const char c : text) {
+            if (c == '"' || c == '\\') json += '\\';
+            json += c;
+        }
+    }
+}
+
+double ResourceUsage::cpuPercent(const ThreadUsage& usage) const {
+    return intervalMicros > 0 ? 100.0 * static_cast<double>(usage.intervalCpuMicros) / static_cast<double>(intervalMicros) : 0.0;
+}
+
+double ResourceUsage::wakeupsPerMinute(const ThreadUsage& usage) const {
+    return intervalMicros > 0 ? 60e6 * static_cast<double>(usage.voluntarySwitches) / static_cast<double>(intervalMicros) : 0.0;
+}
+
+ResourceMonitor::ResourceMonitor(const Config* config) : _config(config) {}
+
+ResourceMonitor::~ResourceMonitor() {
+    end();
+}
+
+/// @brief Read resourceSeconds (0: only on request) and start the reporting thread
+bool ResourceMonitor::begin() {
+    _config->setIfExists("resourceSeconds", &_intervalSeconds);
+    std::lock_guard<std::mutex> lock(_wakeMutex);
+    if (_running) return true;
+    _running = true;
+    _thread = std::thread(&ResourceMonitor::run, this);
+    return true;
+}
+
+void ResourceMonitor::end() {
+    {
+        std::lock_guard<std::mutex> lock(_wakeMutex);
+        if (!_running) return;
+        _running = false;
+    }
+    _wake.notify_all();
+    _thread.join();
+}
+
+/// @brief Name the calling thread, for the OS (ps -L, top -H, /proc) as well as for the trace.
+/// Names longer than 15 characters are cut off.
+void ResourceMonitor::nameThread(const char* name) {
+    char osName[16];
+    snprintf(osName, sizeof osName, "%s", name);
+    pthread_setname_np(pthread_self(), osName);
+    Trace::setThreadName(name);
+}
+
+void ResourceMonitor::publish() {
+    const auto json = toJson(sample());
+    if (_publisher) {
+        _publisher(json);
+    } else {
+        printf("Resources: %s\n", json.c_str());
+    }
+}
+
+/// @brief Print the usage since the previous sample per thread name
+void ResourceMonitor::report() {
+    const auto usage = sample();
+    printf("Resources over %.1f s: rss %lld kB, heap %lld kB, cpu %.1f s in total\n", static_cast<double>(usage.intervalMicros) / 1e6,
+           static_cast<long long>(usage.rssKb), static_cast<long long>(usage.heapKb), static_cast<double>(usage.processCpuMicros) / 1e6);
+    printf("%-16s %7s %7s %10s %11s %12s\n", "thread", "threads", "cpu %", "cpu ms", "wakeups/min", "preempted");
+    for (const auto& thread : usage.threads) {
+        printf("%-16s %7d %7.2f %10lld %11.1f %12llu\n", thread.name.c_str(), thread.threads, usage.cpuPercent(thread),
+               static_cast<long long>(thread.cpuMicros / 1000), usage.wakeupsPerMinute(thread),
+               static_cast<unsigned long long>(thread.involuntarySwitches));
+    }
+}
+
+/// @brief Publish a report right away (e.g. from the control node). Needs begin().
+void ResourceMonitor::request() {
+    {
+        std::lock_guard<std::mutex> lock(_wakeMutex);
+        _requested = true;
+    }
+    _wake.notify_all();
+}
+
+void ResourceMonitor::run() {
+    nameThread("resources");
+    // the baseline for the first interval
+    sample();
+    std::unique_lock<std::mutex> lock(_wakeMutex);
+    while (_running) {
+        const auto wakeUp = [this] { return !_running || _requested; };
+        if (_intervalSeconds > 0) {
+            _wake.wait_for(lock, std::chrono::seconds(_intervalSeconds), wakeUp);
+        } else {
+            _wake.wait(lock, wakeUp);
+        }
+        if (!_running) break;
+        _requested = false;
+        lock.unlock();
+        publish();
+        lock.lock();
+    }
+}
+
+/// @brief Take a snapshot. Interval figures are relative to the previous sample (zero for the first one).
+ResourceUsage ResourceMonitor::sample() {
+    std::lock_guard<std::mutex> lock(_sampleMutex);
+    ResourceUsage usage;
+    const auto now = steadyMicros();
+    if (_previousSampleMicros > 0) usage.intervalMicros = now - _previousSampleMicros;
+    _previousSampleMicros = now;
+    usage.processCpuMicros = std::max<int64_t>(clockMicros(CLOCK_PROCESS_CPUTIME_ID), 0);
+    usage.rssKb = rssKb();
+    usage.heapKb = heapKb();
+
+    std::map<std::string, ThreadUsage> byName;
+    std::map<int, Previous> current;
+    if (DIR* directory = opendir("/proc/self/task"); directory != nullptr) {
+        while (const dirent* entry = readdir(directory)) {
+            if (entry->d_name[0] == '.') continue;
+            const int tid = atoi(entry->d_name);
+            TaskSample task;
+            // the thread may have ended in the meantime
+            if (!readTask(tid, &task)) continue;
+            current[tid] = {task.cpuMicros, task.voluntarySwitches, task.involuntarySwitches};
+            auto& thread = byName[task.name];
+            thread.name = task.name;
+            thread.threads++;
+            thread.cpuMicros += task.cpuMicros;
+            if (usage.intervalMicros == 0) continue;
+            // threads started during the interval count from their start
+            const auto previous = _previous.find(tid);
+            const Previous since = previous != _previous.end() ? previous->second : Previous{0, 0, 0};
+            thread.intervalCpuMicros += task.cpuMicros - since.cpuMicros;
+            thread.voluntarySwitches += task.voluntarySwitches - since.voluntarySwitches;
+            thread.involuntarySwitches += task.involuntarySwitches - since.involuntarySwitches;
+        }
+        closedir(directory);
+    }
+    _previous = std::move(current);
+    for (auto& [name, thread] : byName) usage.threads.push_back(std::move(thread));
+    return usage;
+}
+
+/// @brief Where request() and the periodic reports go (e.g. MQTT); without one, they are printed
+void ResourceMonitor::setPublisher(Publisher publisher) {
+    _publisher = std::move(publisher);
+}
+
+std::string ResourceMonitor::toJson(const ResourceUsage& usage) {
+    char field[128];
+    int64_t intervalCpuMicros = 0;
+    for (const auto& thread : usage.threads) intervalCpuMicros += thread.intervalCpuMicros;
+    ThreadUsage total;
+    total.intervalCpuMicros = intervalCpuMicros;
+    std::string json;
+    snprintf(field, sizeof field, "{\"intervalSeconds\":%.1f,\"cpuPercent\":%.2f,\"cpuMs\":%lld,",
+             static_cast<double>(usage.intervalMicros) / 1e6, usage.cpuPercent(total), static_cast<long long>(usage.processCpuMicros / 1000));
+    json += field;
+    snprintf(field, sizeof field, "\"rssKb\":%lld,\"heapKb\":%lld,\"threads\":{",
+             static_cast<long long>(usage.rssKb), static_cast<long long>(usage.heapKb));
+    json += field;
+    for (size_t i = 0; i < usage.threads.size(); i++) {
+        const auto& thread = usage.threads[i];
+        if (i > 0) json += ',';
+        json += '"';
+        appendEscaped(json, thread.name);
+        snprintf(field, sizeof field, "\":{\"threads\":%d,\"cpuPercent\":%.2f,", thread.threads, usage.cpuPercent(thread));
+        json += field;
+        snprintf(field, sizeof field, "\"cpuMs\":%lld,\"wakeupsPerMinute\":%.1f,",
+                 static_cast<long long>(thread.cpuMicros / 1000), usage.wakeupsPerMinute(thread));
+        json += field;
+        snprintf(field, sizeof field, "\"preempted\":%llu}", static_cast<unsigned long long>(thread.involuntarySwitches));
+        json += field;
+    }
+    json += "}}";
+    return json;
+}
@@ -0,0 +1,93 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef RESOURCE_MONITOR_H
+#define RESOURCE_MONITOR_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Config.h"
+
+/// @brief Resource use of the threads with the same name (e.g. all unnamed pigpio threads), over the last interval
+struct ThreadUsage {
+    std::string name;
+    int threads = 0;
+    int64_t cpuMicros = 0;          // total since the threads started
+    int64_t intervalCpuMicros = 0;
+    uint64_t voluntarySwitches = 0;   // in the interval: each one is a wakeup after blocking
+    uint64_t involuntarySwitches = 0; // in the interval: preempted
+};
+
+struct ResourceUsage {
+    int64_t intervalMicros = 0;
+    int64_t processCpuMicros = 0;
+    int64_t rssKb = 0;
+    int64_t heapKb = 0;
+    std::vector<ThreadUsage> threads;  // sorted by name
+
+    [[nodiscard]] double cpuPercent(const ThreadUsage& usage) const;
+    [[nodiscard]] double wakeupsPerMinute(const ThreadUsage& usage) const;
+};
+
+/// @brief Samples CPU time and context switches per thread (from /proc/self/task) and memory use, and attributes
+/// them to thread names, so the cost of each subsystem shows. Threads we start name themselves via nameThread.
+/// With resourceSeconds > 0, a thread publishes a JSON report that often; request() publishes one right away.
+class ResourceMonitor {
+public:
+    /// @brief Called on the monitor's own thread (or the one calling request()), so it should hand the report over
+    using Publisher = std::function<void(const std::string& json)>;
+
+    explicit ResourceMonitor(const Config* config);
+    ~ResourceMonitor();
+    ResourceMonitor(const ResourceMonitor&) = delete;
+    ResourceMonitor(ResourceMonitor&&) = delete;
+    ResourceMonitor& operator=(const ResourceMonitor&) = delete;
+    ResourceMonitor& operator=(ResourceMonitor&&) = delete;
+    bool begin();
+    void end();
+    void report();
+    void request();
+    ResourceUsage sample();
+    void setPublisher(Publisher publisher);
+
+    static void nameThread(const char* name);
+    static std::string toJson(const ResourceUsage& usage);
+
+private:
+    struct Previous {
+        int64_t cpuMicros;
+        uint64_t voluntarySwitches;
+        uint64_t involuntarySwitches;
+    };
+
+    void publish();
+    void run();
+
+    const Config* _config;
+    int _intervalSeconds = 0;
+    Publisher _publisher;
+    std::mutex _sampleMutex;
+    std::map<int, Previous> _previous;
+    int64_t _previousSampleMicros = 0;
+    std::mutex _wakeMutex;
+    std::condition_variable _wake;
+    bool _running = false;
+    bool _requested = false;
+    std::thread _thread;
+};
+
+#endif
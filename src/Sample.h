@@ -0,0 +1,28 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include <cmath>
+#include <cstdint>
+
+/// @brief One sensor read, with the time the sensor sent it
+struct Sample {
+    float temperature = NAN;
+    float humidity = NAN;
+    uint32_t tick = 0;              // gpioTick of the first edge
+    int64_t monotonicMicros = 0;    // the first edge on the steady clock (CLOCK_MONOTONIC)
+    int64_t wallMillis = 0;         // the first edge on the system clock (ms since epoch)
+    int64_t decodedMicros = 0;      // steady clock when decoding finished
+};
+
+#endif
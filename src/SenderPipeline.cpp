@@ -0,0 +1,294 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "SenderPipeline.h"
+#include "LatencyRecorder.h"
+#include "ResourceMonitor.h"
+#include <chrono>
+#include <iostream>
+#include <type_traits>
+
+// spill files contain raw records, and queue cells are copied with plain assignment
+static_assert(std::is_trivially_copyable_v<Measurement>, "Measurement must be trivially copyable");
+
+SenderPipeline::SenderPipeline(Config* config) : _config(config) {}
+
+SenderPipeline::~SenderPipeline() {
+    end();
+}
+
+/// @brief Add a sink. Its policy comes from config entries <name>Policy (dropOldest, block, spill),
+/// <name>BlockMillis and <name>Spill (the spill file). Spill without a file falls back to dropOldest.
+/// The queue size is taken from queueCapacity. Must be called before begin().
+void SenderPipeline::addSink(const std::string& name, ISender* sink) {
+    size_t capacity = DEFAULT_CAPACITY;
+    _config->setIfExists("queueCapacity", &capacity);
+    auto channel = std::make_unique<Channel>(name, sink, capacity);
+    channel->policy = parsePolicy(_config->getEntry(name + "Policy"));
+    _config->setIfExists(name + "BlockMillis", &channel->blockMillis);
+    channel->spillPath = _config->getEntry(name + "Spill");
+    if (channel->policy == BackpressurePolicy::Spill && channel->spillPath.empty()) {
+        std::cerr << "No spill file for sink " << name << ", dropping oldest instead\n";
+        channel->policy = BackpressurePolicy::DropOldest;
+    }
+    // pick up what a previous run could not deliver (only a spilling sink drains its file)
+    if (channel->policy == BackpressurePolicy::Spill) {
+        if (FILE* file = fopen(channel->spillPath.c_str(), "rb"); file != nullptr) {
+            fclose(file);
+            channel->spillPending = true;
+        }
+    }
+    _channels.push_back(std::move(channel));
+}
+
+bool SenderPipeline::begin() {
+    if (_running) return true;
+    _running = true;
+    _thread = std::thread(&SenderPipeline::run, this);
+    return true;
+}
+
+/// @brief Stop the sender thread, after it made a last attempt to deliver what is queued
+void SenderPipeline::end() {
+    if (!_running) return;
+    {
+        std::lock_guard<std::mutex> lock(_wakeMutex);
+        _running = false;
+    }
+    _wake.notify_one();
+    if (_thread.joinable()) _thread.join();
+}
+
+BackpressurePolicy SenderPipeline::parsePolicy(const std::string& policy) {
+    if (policy == "block") return BackpressurePolicy::Block;
+    if (policy == "spill") return BackpressurePolicy::Spill;
+    return BackpressurePolicy::DropOldest;
+}
+
+// The pipeline only carries complete measurements
+
+bool SenderPipeline::sendHumidity(float) { return false; }
+
+bool SenderPipeline::sendTemperature(float) { return false; }
+
+/// @brief Queue the measurement for all sinks, and wake up the sender thread. Does not do I/O
+/// unless a sink's queue is full and its policy is to spill.
+bool SenderPipeline::sendMeasurement(const Measurement& measurement) {
+    for (const auto& channel : _channels) {
+        enqueue(*channel, measurement);
+    }
+    {
+        std::lock_guard<std::mutex> lock(_wakeMutex);
+        _pending = true;
+    }
+    _wake.notify_one();
+    return true;
+}
+
+/// @brief Queue the summary for all sinks. Summaries are rare (one per horizon), so they share one small queue,
+/// and are sent once without retries.
+bool SenderPipeline::sendSummary(const Summary& summary) {
+    {
+        std::lock_guard<std::mutex> lock(_wakeMutex);
+        if (_summaries.size() >= MAX_PENDING_SUMMARIES) _summaries.erase(_summaries.begin());
+        _summaries.push_back(summary);
+        _pending = true;
+    }
+    _wake.notify_one();
+    return true;
+}
+
+SinkStatistics SenderPipeline::statistics(const size_t sinkIndex) const {
+    SinkStatistics statistics;
+    if (sinkIndex >= _channels.size()) return statistics;
+    const auto& channel = *_channels[sinkIndex];
+    statistics.depth = channel.queue.size();
+    statistics.highWater = channel.highWater;
+    statistics.delivered = channel.delivered;
+    statistics.failed = channel.failed;
+    statistics.dropped = channel.dropped;
+    statistics.spilled = channel.spilled;
+    return statistics;
+}
+
+void SenderPipeline::deliverSummaries() {
+    std::vector<Summary> summaries;
+    {
+        std::lock_guard<std::mutex> lock(_wakeMutex);
+        summaries.swap(_summaries);
+    }
+    for (const auto& summary : summaries) {
+        for (const auto& channel : _channels) {
+            if (!channel->sink->sendSummary(summary)) std::cerr << "Sink " << channel->name << " did not take a summary\n";
+        }
+    }
+}
+
+bool SenderPipeline::deliver(Channel& channel, const Measurement& measurement) {
+    if (channel.sink->sendMeasurement(measurement)) {
+        ++channel.delivered;
+        return true;
+    }
+    ++channel.failed;
+    return false;
+}
+
+/// @brief Deliver the queued measurements. A spilling sink that fails keeps the measurement for the next attempt
+/// and stops taking more, so new measurements back up into the spill file in order.
+/// @return whether the queue was emptied
+bool SenderPipeline::deliverQueued(Channel& channel) {
+    if (channel.hasRetry) {
+        if (!deliver(channel, channel.retry)) return false;
+        channel.hasRetry = false;
+    }
+    Measurement measurement;
+    while (channel.queue.tryPop(measurement)) {
+        if (measurement.aggregatedMicros > 0) {
+            LatencyRecorder::record(LatencyStage::Enqueue, LatencyRecorder::nowMicros() - measurement.aggregatedMicros);
+        }
+        if (!deliver(channel, measurement) && channel.policy == BackpressurePolicy::Spill) {
+            channel.retry = measurement;
+            channel.hasRetry = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+/// @brief Deliver spilled measurements in order. Stops at the first failure, so the rest is retried later.
+/// The lock is only held to read a batch, not while the sink sends it, so spilling new measurements doesn't wait for the network.
+/// @return whether the spill file was emptied
+bool SenderPipeline::drainSpill(Channel& channel) {
+    Measurement batch[SPILL_BATCH];
+    for (;;) {
+        size_t count;
+        {
+            std::lock_guard<std::mutex> lock(channel.spillMutex);
+            FILE* file = fopen(channel.spillPath.c_str(), "rb");
+            if (file == nullptr) {
+                channel.spillPending = false;
+                return true;
+            }
+            (void)fseek(file, channel.spillReadOffset, SEEK_SET);
+            count = fread(batch, sizeof(Measurement), SPILL_BATCH, file);
+            fclose(file);
+            // all delivered; spill() can't append before the file is gone, as it needs the lock
+            if (count == 0) {
+                (void)remove(channel.spillPath.c_str());
+                channel.spillReadOffset = 0;
+                channel.spillPending = false;
+                return true;
+            }
+        }
+        size_t sent = 0;
+        while (sent < count && deliver(channel, batch[sent])) sent++;
+        {
+            std::lock_guard<std::mutex> lock(channel.spillMutex);
+            channel.spillReadOffset += static_cast<long>(sent * sizeof(Measurement));
+        }
+        if (sent < count) return false;
+    }
+}
+
+void SenderPipeline::enqueue(Channel& channel, const Measurement& measurement) {
+    // once spilling started, new measurements go to the spill file too, to keep them in order
+    if (channel.spillPending && spill(channel, measurement)) return;
+
+    if (!channel.queue.tryPush(measurement)) {
+        switch (channel.policy) {
+            case BackpressurePolicy::Spill:
+                if (spill(channel, measurement)) return;
+                ++channel.dropped;
+                return;
+            case BackpressurePolicy::Block: {
+                const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(channel.blockMillis);
+                while (!channel.queue.tryPush(measurement)) {
+                    if (std::chrono::steady_clock::now() >= deadline) {
+                        ++channel.dropped;
+                        return;
+                    }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                break;
+            }
+            default: {
+                Measurement oldest;
+                do {
+                    if (channel.queue.tryPop(oldest)) ++channel.dropped;
+                } while (!channel.queue.tryPush(measurement));
+                break;
+            }
+        }
+    }
+    const auto depth = channel.queue.size();
+    if (depth > channel.highWater) channel.highWater = depth;
+}
+
+/// @brief Write what a spilling sink still has in memory to the front of its spill file, so a next run delivers it in order
+void SenderPipeline::persist(Channel& channel) {
+    std::vector<Measurement> measurements;
+    if (channel.hasRetry) measurements.push_back(channel.retry);
+    channel.hasRetry = false;
+    Measurement measurement;
+    while (channel.queue.tryPop(measurement)) measurements.push_back(measurement);
+    if (measurements.empty()) return;
+
+    std::lock_guard<std::mutex> lock(channel.spillMutex);
+    if (FILE* file = fopen(channel.spillPath.c_str(), "rb"); file != nullptr) {
+        (void)fseek(file, channel.spillReadOffset, SEEK_SET);
+        while (fread(&measurement, sizeof(measurement), 1, file) == 1) measurements.push_back(measurement);
+        fclose(file);
+    }
+    FILE* file = fopen(channel.spillPath.c_str(), "wb");
+    if (file == nullptr || fwrite(measurements.data(), sizeof(Measurement), measurements.size(), file) != measurements.size()) {
+        std::cerr << "Could not save undelivered measurements for " << channel.name << "\n";
+    }
+    if (file != nullptr) fclose(file);
+    channel.spillReadOffset = 0;
+}
+
+void SenderPipeline::run() {
+    ResourceMonitor::nameThread("sender");
+    std::unique_lock<std::mutex> lock(_wakeMutex);
+    while (_running) {
+        _pending = false;
+        lock.unlock();
+        for (const auto& channel : _channels) {
+            if (deliverQueued(*channel) && channel->spillPending) drainSpill(*channel);
+        }
+        deliverSummaries();
+        lock.lock();
+        _wake.wait_for(lock, std::chrono::milliseconds(RETRY_MILLIS), [this] { return _pending || !_running; });
+    }
+    lock.unlock();
+    // last attempt before stopping
+    for (const auto& channel : _channels) {
+        if (deliverQueued(*channel) && channel->spillPending) drainSpill(*channel);
+        if (channel->policy == BackpressurePolicy::Spill) persist(*channel);
+    }
+    deliverSummaries();
+}
+
+bool SenderPipeline::spill(Channel& channel, const Measurement& measurement) {
+    std::lock_guard<std::mutex> lock(channel.spillMutex);
+    FILE* file = fopen(channel.spillPath.c_str(), "ab");
+    if (file == nullptr) {
+        std::cerr << "Could not open spill file " << channel.spillPath << "\n";
+        return false;
+    }
+    const bool written = fwrite(&measurement, sizeof(measurement), 1, file) == 1;
+    fclose(file);
+    if (written) {
+        ++channel.spilled;
+        channel.spillPending = true;
+    }
+    return written;
+}
@@ -0,0 +1,113 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef SENDER_PIPELINE_H
+#define SENDER_PIPELINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BoundedQueue.h"
+#include "Config.h"
+#include "ISender.h"
+
+/// @brief What to do with a new measurement if a sink's queue is full
+enum class BackpressurePolicy {
+    DropOldest, // discard the oldest queued measurement to make room
+    Block,      // wait (bounded) for the sender thread to make room, then drop the new one
+    Spill       // append to a spill file, delivered once the sink catches up
+};
+
+struct SinkStatistics {
+    size_t depth = 0;
+    size_t highWater = 0;
+    uint64_t delivered = 0;
+    uint64_t failed = 0;
+    uint64_t dropped = 0;
+    uint64_t spilled = 0;
+};
+
+/// @brief Decouples sampling from I/O. Measurements go into a bounded lock-free queue per sink,
+/// and a sender thread delivers them to the sinks.
+class SenderPipeline final : public ISender {
+public:
+    explicit SenderPipeline(Config* config);
+    ~SenderPipeline() override;
+    SenderPipeline(const SenderPipeline&) = delete;
+    SenderPipeline(SenderPipeline&&) = delete;
+    SenderPipeline& operator=(const SenderPipeline&) = delete;
+    SenderPipeline& operator=(SenderPipeline&&) = delete;
+    void addSink(const std::string& name, ISender* sink);
+    bool begin();
+    void end();
+    bool sendHumidity(float value) override;
+    bool sendMeasurement(const Measurement& measurement) override;
+    bool sendSummary(const Summary& summary) override;
+    bool sendTemperature(float value) override;
+    [[nodiscard]] size_t sinkCount() const { return _channels.size(); }
+    [[nodiscard]] SinkStatistics statistics(size_t sinkIndex) const;
+    static BackpressurePolicy parsePolicy(const std::string& policy);
+
+private:
+    static constexpr size_t DEFAULT_CAPACITY = 16;
+    static constexpr int DEFAULT_BLOCK_MILLIS = 1000;
+    static constexpr int RETRY_MILLIS = 1000;
+    static constexpr size_t MAX_PENDING_SUMMARIES = 16;
+    static constexpr size_t SPILL_BATCH = 16;  // spilled measurements read per lock
+
+    struct Channel {
+        Channel(std::string channelName, ISender* channelSink, size_t capacity) :
+            name(std::move(channelName)), sink(channelSink), queue(capacity) {}
+        std::string name;
+        ISender* sink;
+        BoundedQueue<Measurement> queue;
+        BackpressurePolicy policy = BackpressurePolicy::DropOldest;
+        int blockMillis = DEFAULT_BLOCK_MILLIS;
+        std::string spillPath;
+        std::mutex spillMutex;
+        long spillReadOffset = 0;
+        std::atomic<bool> spillPending{false};
+        // owned by the sender thread: the oldest measurement, which a spilling sink failed to take
+        Measurement retry;
+        bool hasRetry = false;
+        std::atomic<size_t> highWater{0};
+        std::atomic<uint64_t> delivered{0};
+        std::atomic<uint64_t> failed{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<uint64_t> spilled{0};
+    };
+
+    Config* _config;
+    std::vector<std::unique_ptr<Channel>> _channels;
+    std::thread _thread;
+    std::atomic<bool> _running{false};
+    std::mutex _wakeMutex;
+    std::condition_variable _wake;
+    bool _pending = false;
+    std::vector<Summary> _summaries;  // under _wakeMutex
+
+    static bool deliver(Channel& channel, const Measurement& measurement);
+    static bool deliverQueued(Channel& channel);
+    void deliverSummaries();
+    static bool drainSpill(Channel& channel);
+    static void enqueue(Channel& channel, const Measurement& measurement);
+    static void persist(Channel& channel);
+    void run();
+    static bool spill(Channel& channel, const Measurement& measurement);
+};
+
+#endif
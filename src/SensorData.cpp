@@ -37,6 +37,10 @@ void SensorData::addEdge(const int levelIn, const uint32_t timestamp) {
         return;
     }
     const uint32_t duration = timestamp - _previousTime;
+    if (!_hasFirstEdge) {
+        _firstEdgeTime = timestamp;
+        _hasFirstEdge = true;
+    }
     switch (levelIn) {
         // move from 1 to 0, so we just had a data bit
         case 0:
@@ -80,7 +84,12 @@ float SensorData::getHumidity() const {
     if (!isDone()) {
         return NAN;
     }
-    return static_cast<float>(getWordAtIndex(0)) * 0.1f;
+    return humidityFromWord(getWordAtIndex(0));
+}
+
+/// @brief Humidity from its data word: 10 times the percentage
+float SensorData::humidityFromWord(const uint16_t word) {
+    return static_cast<float>(word) * 0.1f;
 }
 
 SensorState SensorData::getState() const {
@@ -91,7 +100,11 @@ float SensorData::getTemperature() const {
     if (!isDone()) {
         return NAN;
     }
-    const auto word = getWordAtIndex(2);
+    return temperatureFromWord(getWordAtIndex(2));
+}
+
+/// @brief Temperature from its data word: 10 times the value in the lower 15 bits, the sign in the top bit
+float SensorData::temperatureFromWord(const uint16_t word) {
     const bool isNegative = word & 0x8000;
     return static_cast<float>(word & 0x7FFF) * 0.1f * (isNegative ? -1 : 1);
 }
@@ -103,6 +116,8 @@ uint16_t SensorData::getWordAtIndex(const uint8_t index) const {
 
 void SensorData::initRead(const uint32_t timestamp) {
     _previousTime = timestamp;
+    _firstEdgeTime = timestamp;
+    _hasFirstEdge = false;
     _referenceDuration = 0;
     _currentIndex = 0;
     _anomaly = 0;
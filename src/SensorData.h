@@ -37,12 +37,19 @@ public:
     [[nodiscard]] uint16_t getWordAtIndex(const uint8_t index) const;
     void initRead(uint32_t timestamp);
     int getAnomalyCount() { return _anomaly; }
+    /// @brief gpioTick of the first edge the sensor sent, i.e. when the sample was taken
+    [[nodiscard]] uint32_t firstEdgeTime() const { return _firstEdgeTime; }
+    [[nodiscard]] uint32_t lastEdgeTime() const { return _previousTime; }
+    [[nodiscard]] static float humidityFromWord(uint16_t word);
+    [[nodiscard]] static float temperatureFromWord(uint16_t word);
 private:
     int _currentIndex = 0;
     std::array<uint8_t, BYTES> _data = {};
     int _overrunCount = 0;
     unsigned int _anomaly = 0;
     uint32_t _previousTime = 0;
+    uint32_t _firstEdgeTime = 0;
+    bool _hasFirstEdge = false;
     uint32_t _referenceDuration = 0;
     uint16_t _lastGoodHumidity = 0;
     SensorState _state = SensorState::Timeout; // any state not Done or Reading
@@ -0,0 +1,259 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "Shutdown.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include "ResourceMonitor.h"
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    // the third signal forces the exit, for when the sequence itself hangs
+    constexpr int MAX_SIGNALS = 3;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<bool> requested{false};
+    bool finished = false;
+    volatile bool* keepGoingFlag = nullptr;
+    int deadlineMillis = Shutdown::DEFAULT_DEADLINE_MILLIS;
+    Clock::time_point requestedAt;
+    Clock::time_point deadline;
+    // separate from the main lock, and held while the hooks run, so a hook can't be removed (and its objects go away) halfway
+    std::mutex hookMutex;
+    std::vector<std::pair<int, Shutdown::Hook>> deadlineHooks;
+    int nextHookId = 0;
+    std::vector<std::pair<const char*, int64_t>> phases;
+    const char* currentPhase = "running";
+    Clock::time_point phaseStart;
+
+    int signalFd = -1;
+    int requestFd = -1;
+    int stopFd = -1;
+    sigset_t previousMask;
+    std::thread watcher;
+
+    // write a string without stdio, which may be what is hanging
+    void say(const std::string& message) {
+        (void)!write(STDERR_FILENO, message.data(), message.size());
+    }
+
+    [[noreturn]] void forceExit(const char* reason) {
+        std::string phase;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            phase = currentPhase;
+        }
+        say(std::string("Shutdown: ") + reason + " during phase '" + phase + "', forcing exit\n");
+        std::lock_guard<std::mutex> hookLock(hookMutex);
+        for (const auto& [id, hook] : deadlineHooks) hook();
+        _exit(Shutdown::EXIT_CODE);
+    }
+
+    void watch() {
+        ResourceMonitor::nameThread("shutdown");
+        int signals = 0;
+        for (;;) {
+            int timeout = -1;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (requested && !finished) {
+                    const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+                    timeout = static_cast<int>(std::max<int64_t>(left, 0));
+                }
+            }
+            pollfd fds[2] = {{stopFd, POLLIN, 0}, {signalFd, POLLIN, 0}};
+            if (poll(fds, 2, timeout) < 0 && errno != EINTR) return;
+            if ((fds[0].revents & POLLIN) != 0) return;
+            if ((fds[1].revents & POLLIN) != 0) {
+                signalfd_siginfo info{};
+                while (read(signalFd, &info, sizeof info) == sizeof info) {
+                    if (++signals >= MAX_SIGNALS) forceExit("too many signals");
+                    Shutdown::request(strsignal(static_cast<int>(info.ssi_signo)));
+                }
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            if (requested && !finished && Clock::now() >= deadline) {
+                lock.unlock();
+                forceExit("deadline passed");
+            }
+        }
+    }
+
+    // stops the watcher at exit if end() wasn't called (a joinable std::thread would terminate the process)
+    struct WatcherGuard {
+        WatcherGuard() = default;
+        WatcherGuard(const WatcherGuard&) = delete;
+        WatcherGuard(WatcherGuard&&) = delete;
+        WatcherGuard& operator=(const WatcherGuard&) = delete;
+        WatcherGuard& operator=(WatcherGuard&&) = delete;
+        ~WatcherGuard() { Shutdown::end(); }
+    } watcherGuard;
+}
+
+/// @brief Read shutdownMillis, block SIGINT and SIGTERM and start watching for them. Blocking only works for threads
+/// started afterwards, so call this before anything starts a thread.
+bool Shutdown::begin(const Config* config, volatile bool* keepGoing) {
+    if (watcher.joinable()) return true;
+    keepGoingFlag = keepGoing;
+    config->setIfExists("shutdownMillis", &deadlineMillis);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &mask, &previousMask) != 0) return false;
+    signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    requestFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (signalFd < 0 || requestFd < 0 || stopFd < 0) {
+        perror("Could not create shutdown descriptors");
+        end();
+        return false;
+    }
+    watcher = std::thread(watch);
+    return true;
+}
+
+void Shutdown::end() {
+    if (watcher.joinable()) {
+        constexpr uint64_t ONE = 1;
+        (void)!write(stopFd, &ONE, sizeof ONE);
+        watcher.join();
+        pthread_sigmask(SIG_SETMASK, &previousMask, nullptr);
+    }
+    for (int* descriptor : {&signalFd, &requestFd, &stopFd}) {
+        if (*descriptor >= 0) close(*descriptor);
+        *descriptor = -1;
+    }
+    keepGoingFlag = nullptr;
+}
+
+/// @brief Becomes readable when shutdown is requested, so an event loop can wake up for it. -1 before begin().
+int Shutdown::fd() {
+    return requestFd;
+}
+
+/// @brief End the sequence: disarm the deadline and log the phase timings
+void Shutdown::finish() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (finished) return;
+    finished = true;
+    const auto now = Clock::now();
+    phases.emplace_back(currentPhase, std::chrono::duration_cast<std::chrono::microseconds>(now - phaseStart).count());
+    std::string report = "Shutdown took " +
+        std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(now - requestedAt).count()) + " ms:";
+    for (const auto& [name, micros] : phases) {
+        report += std::string(" ") + name + " " + std::to_string(micros / 1000) + "." + std::to_string(micros / 100 % 10) + " ms";
+    }
+    printf("%s\n", report.c_str());
+}
+
+bool Shutdown::isRequested() {
+    return requested;
+}
+
+/// @brief Run the hook (on the watcher thread) before exiting on a missed deadline. Keep it short and self-contained.
+/// @return the id to remove it with
+int Shutdown::onDeadline(Hook hook) {
+    std::lock_guard<std::mutex> lock(hookMutex);
+    deadlineHooks.emplace_back(++nextHookId, std::move(hook));
+    return nextHookId;
+}
+
+/// @brief Forget a hook. Waits if the hooks are running (the process then exits before this returns).
+void Shutdown::removeDeadlineHook(const int id) {
+    std::lock_guard<std::mutex> lock(hookMutex);
+    for (auto iterator = deadlineHooks.begin(); iterator != deadlineHooks.end();) {
+        iterator = iterator->first == id ? deadlineHooks.erase(iterator) : iterator + 1;
+    }
+}
+
+/// @brief Start the next phase of the shutdown sequence (which ends the previous one)
+void Shutdown::phase(const char* name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto now = Clock::now();
+    if (requested) {
+        phases.emplace_back(currentPhase, std::chrono::duration_cast<std::chrono::microseconds>(now - phaseStart).count());
+    }
+    currentPhase = name;
+    phaseStart = now;
+}
+
+/// @brief Time left until the deadline; the whole budget if no shutdown was requested yet
+int64_t Shutdown::remainingMicros() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!requested) return static_cast<int64_t>(deadlineMillis) * 1000;
+    return std::max<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(deadline - Clock::now()).count(), 0);
+}
+
+/// @brief Start shutting down: reset keepGoing, wake up sleepers and the event loop, and start the deadline.
+/// Further requests are ignored.
+void Shutdown::request(const char* reason) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (requested) return;
+        requestedAt = Clock::now();
+        deadline = requestedAt + std::chrono::milliseconds(deadlineMillis);
+        phaseStart = requestedAt;
+        currentPhase = "stop";
+        requested = true;
+        if (keepGoingFlag != nullptr) *keepGoingFlag = false;
+    }
+    printf("Shutdown requested (%s), deadline %d ms\n", reason, deadlineMillis);
+    wake.notify_all();
+    if (requestFd >= 0) {
+        constexpr uint64_t ONE = 1;
+        (void)!write(requestFd, &ONE, sizeof ONE);
+    }
+}
+
+/// @brief Forget a request and the recorded phases (for tests). Hooks stay.
+void Shutdown::reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    requested = false;
+    finished = false;
+    phases.clear();
+    currentPhase = "running";
+    if (requestFd >= 0) {
+        uint64_t count;
+        (void)!read(requestFd, &count, sizeof count);
+    }
+}
+
+/// @brief Sleep, but wake up as soon as shutdown is requested
+/// @return false if shutdown was requested (before or during the sleep)
+bool Shutdown::sleepMicros(const int64_t micros) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return !wake.wait_for(lock, std::chrono::microseconds(micros), [] { return requested.load(); });
+}
+
+DeadlineHook::DeadlineHook(Shutdown::Hook hook) : _id(Shutdown::onDeadline(std::move(hook))) {}
+
+DeadlineHook::~DeadlineHook() {
+    Shutdown::removeDeadlineHook(_id);
+}
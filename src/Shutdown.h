@@ -0,0 +1,59 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef SHUTDOWN_H
+#define SHUTDOWN_H
+
+#include <cstdint>
+#include <functional>
+#include "Config.h"
+
+/// @brief Process-wide shutdown coordination. SIGINT and SIGTERM are blocked and read from a signalfd by a watcher
+/// thread, so nothing runs in signal context. A request resets keepGoing, wakes everything waiting in sleepMicros,
+/// and makes fd() readable (for event loops). From then on, the shutdown sequence has shutdownMillis to complete:
+/// if finish() isn't called in time, or a third signal arrives, the deadline hooks run (e.g. powering down the sensor)
+/// and the process exits. The sequence marks its phases, and finish() logs how long each took.
+class Shutdown {
+public:
+    using Hook = std::function<void()>;
+
+    static constexpr int DEFAULT_DEADLINE_MILLIS = 5000;
+    static constexpr int EXIT_CODE = 3;
+
+    static bool begin(const Config* config, volatile bool* keepGoing);
+    static void end();
+    static int fd();
+    static void finish();
+    static bool isRequested();
+    static int onDeadline(Hook hook);
+    static void removeDeadlineHook(int id);
+    static void phase(const char* name);
+    static int64_t remainingMicros();
+    static void request(const char* reason);
+    static void reset();
+    static bool sleepMicros(int64_t micros);
+};
+
+/// @brief A deadline hook for as long as it is in scope, so it can't outlive the objects it uses (e.g. on early returns)
+class DeadlineHook {
+public:
+    explicit DeadlineHook(Shutdown::Hook hook);
+    ~DeadlineHook();
+    DeadlineHook(const DeadlineHook&) = delete;
+    DeadlineHook(DeadlineHook&&) = delete;
+    DeadlineHook& operator=(const DeadlineHook&) = delete;
+    DeadlineHook& operator=(DeadlineHook&&) = delete;
+
+private:
+    int _id;
+};
+
+#endif
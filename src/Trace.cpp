@@ -0,0 +1,210 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "Trace.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "ResourceMonitor.h"
+
+namespace {
+    struct TraceEvent {
+        const char* name;
+        int64_t timestamp;
+        int64_t duration;  // negative for instants
+    };
+
+    /// @brief Written by its own thread only. The lock is uncontended except while dumping.
+    struct ThreadBuffer {
+        int id = 0;
+        std::string name;
+        std::mutex mutex;
+        TraceEvent events[Trace::EVENTS_PER_THREAD] = {};
+        size_t next = 0;
+        size_t count = 0;
+    };
+
+    std::mutex registryMutex;
+    // buffers live until the end of the process, so events of finished threads can still be dumped
+    std::vector<std::shared_ptr<ThreadBuffer>> registry;
+    thread_local std::shared_ptr<ThreadBuffer> threadBuffer;
+
+    std::atomic<bool> dumpRequested{false};
+    std::string dumpPath = "/tmp/dht-trace.json";
+    std::string triggerPath;
+    std::mutex watcherMutex;
+    std::condition_variable watcherWake;
+    bool watcherRunning = false;
+    std::thread watcher;
+
+    ThreadBuffer& buffer() {
+        if (!threadBuffer) {
+            threadBuffer = std::make_shared<ThreadBuffer>();
+            std::lock_guard<std::mutex> lock(registryMutex);
+            threadBuffer->id = static_cast<int>(registry.size()) + 1;
+            registry.push_back(threadBuffer);
+        }
+        return *threadBuffer;
+    }
+
+    void add(const char* name, const int64_t timestamp, const int64_t duration) {
+        auto& entries = buffer();
+        std::lock_guard<std::mutex> lock(entries.mutex);
+        entries.events[entries.next] = {name, timestamp, duration};
+        entries.next = (entries.next + 1) % Trace::EVENTS_PER_THREAD;
+        if (entries.count < Trace::EVENTS_PER_THREAD) entries.count++;
+    }
+
+    // stops the watcher at exit if end() wasn't called (a joinable std::thread would terminate the process)
+    struct WatcherGuard {
+        WatcherGuard() = default;
+        WatcherGuard(const WatcherGuard&) = delete;
+        WatcherGuard(WatcherGuard&&) = delete;
+        WatcherGuard& operator=(const WatcherGuard&) = delete;
+        WatcherGuard& operator=(WatcherGuard&&) = delete;
+        ~WatcherGuard() { Trace::end(); }
+    } watcherGuard;
+
+    void onDumpSignal(int) {
+        dumpRequested = true;
+    }
+
+    void watch() {
+        ResourceMonitor::nameThread("trace");
+        std::unique_lock<std::mutex> lock(watcherMutex);
+        while (watcherRunning) {
+            watcherWake.wait_for(lock, std::chrono::milliseconds(500));
+            const bool triggered = !triggerPath.empty() && access(triggerPath.c_str(), F_OK) == 0;
+            if (!dumpRequested.exchange(false) && !triggered) continue;
+            if (triggered) (void)remove(triggerPath.c_str());
+            if (Trace::dump(dumpPath)) printf("Trace written to %s\n", dumpPath.c_str());
+        }
+    }
+}
+
+/// @brief Read traceFile and traceTrigger, and start watching for SIGUSR1 and the trigger file. Only with DHT_TRACING.
+void Trace::begin(const Config* config) {
+    if (!isCompiledIn()) return;
+    dumpPath = config->getEntry("traceFile", dumpPath);
+    triggerPath = config->getEntry("traceTrigger");
+    setThreadName("main");
+    (void)signal(SIGUSR1, onDumpSignal);
+    std::lock_guard<std::mutex> lock(watcherMutex);
+    if (watcherRunning) return;
+    watcherRunning = true;
+    watcher = std::thread(watch);
+}
+
+void Trace::end() {
+    {
+        std::lock_guard<std::mutex> lock(watcherMutex);
+        if (!watcherRunning) return;
+        watcherRunning = false;
+    }
+    watcherWake.notify_all();
+    watcher.join();
+}
+
+void Trace::clear() {
+    std::lock_guard<std::mutex> registryLock(registryMutex);
+    for (const auto& entries : registry) {
+        std::lock_guard<std::mutex> lock(entries->mutex);
+        entries->next = 0;
+        entries->count = 0;
+    }
+}
+
+void Trace::complete(const char* name, const int64_t startMicros, const int64_t durationMicros) {
+    add(name, startMicros, durationMicros < 0 ? 0 : durationMicros);
+}
+
+/// @brief Write all buffered events as a Chrome JSON trace (load in Perfetto or chrome://tracing)
+bool Trace::dump(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        perror("Could not write trace");
+        return false;
+    }
+    const int processId = getpid();
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    std::lock_guard<std::mutex> registryLock(registryMutex);
+    for (const auto& entries : registry) {
+        std::lock_guard<std::mutex> lock(entries->mutex);
+        if (!entries->name.empty()) {
+            fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    first ? "" : ",\n", processId, entries->id, entries->name.c_str());
+            first = false;
+        }
+        // oldest first
+        const size_t start = (entries->next + EVENTS_PER_THREAD - entries->count) % EVENTS_PER_THREAD;
+        for (size_t i = 0; i < entries->count; i++) {
+            const auto& event = entries->events[(start + i) % EVENTS_PER_THREAD];
+            if (event.duration < 0) {
+                fprintf(file, "%s{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%lld}",
+                        first ? "" : ",\n", event.name, processId, entries->id, static_cast<long long>(event.timestamp));
+            } else {
+                fprintf(file, "%s{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld}",
+                        first ? "" : ",\n", event.name, processId, entries->id,
+                        static_cast<long long>(event.timestamp), static_cast<long long>(event.duration));
+            }
+            first = false;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
+
+size_t Trace::eventCount() {
+    size_t total = 0;
+    std::lock_guard<std::mutex> registryLock(registryMutex);
+    for (const auto& entries : registry) {
+        std::lock_guard<std::mutex> lock(entries->mutex);
+        total += entries->count;
+    }
+    return total;
+}
+
+void Trace::instant(const char* name) {
+    add(name, nowMicros(), -1);
+}
+
+bool Trace::isCompiledIn() {
+#ifdef DHT_TRACING
+    return true;
+#else
+    return false;
+#endif
+}
+
+/// @brief Same time base as LatencyRecorder (the steady clock)
+int64_t Trace::nowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::requestDump() {
+    dumpRequested = true;
+    watcherWake.notify_all();
+}
+
+void Trace::setThreadName(const char* name) {
+    if (!isCompiledIn()) return;
+    auto& entries = buffer();
+    std::lock_guard<std::mutex> lock(entries.mutex);
+    entries.name = name;
+}
@@ -0,0 +1,67 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "Config.h"
+
+/// @brief Trace spans and instants in a ring buffer per thread, dumped as a Chrome/Perfetto JSON trace
+/// on SIGUSR1 or when the trigger file (config traceTrigger) appears. Names must be string literals.
+/// The TRACE_ macros only record if built with DHT_TRACING; otherwise they compile to nothing.
+class Trace {
+public:
+    static constexpr size_t EVENTS_PER_THREAD = 4096;
+
+    static void begin(const Config* config);
+    static void end();
+    static void clear();
+    static void complete(const char* name, int64_t startMicros, int64_t durationMicros);
+    static bool dump(const std::string& path);
+    static size_t eventCount();
+    static void instant(const char* name);
+    static bool isCompiledIn();
+    static int64_t nowMicros();
+    static void requestDump();
+    static void setThreadName(const char* name);
+};
+
+/// @brief Records a complete event from construction to destruction
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name) : _name(name), _start(Trace::nowMicros()) {}
+    ~TraceSpan() { Trace::complete(_name, _start, Trace::nowMicros() - _start); }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan(TraceSpan&&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+    TraceSpan& operator=(TraceSpan&&) = delete;
+
+private:
+    const char* _name;
+    int64_t _start;
+};
+
+#ifdef DHT_TRACING
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+#define TRACE_INSTANT(name) Trace::instant(name)
+#define TRACE_COMPLETE(name, startMicros, durationMicros) Trace::complete(name, startMicros, durationMicros)
+#else
+#define TRACE_SPAN(name) do {} while (false)
+#define TRACE_INSTANT(name) do {} while (false)
+#define TRACE_COMPLETE(name, startMicros, durationMicros) do {} while (false)
+#endif
+
+#endif
@@ -0,0 +1,179 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "ZoneAggregator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+
+namespace {
+    constexpr size_t QUANTITIES = 2;
+
+    size_t indexOf(const Quantity quantity) {
+        return static_cast<size_t>(quantity);
+    }
+}
+
+ZoneAggregator::ZoneAggregator(const Config* config) : _config(config) {}
+
+/// @brief Read the zones (zone.<name>=<device>,...) and staleSeconds.
+/// @return false if there are no valid zones
+bool ZoneAggregator::begin() {
+    int staleSeconds = DEFAULT_STALE_SECONDS;
+    _config->setIfExists("staleSeconds", &staleSeconds);
+    _staleMicros = static_cast<int64_t>(staleSeconds) * 1000000;
+    std::lock_guard<std::mutex> lock(_mutex);
+    _zoneNames.clear();
+    _zones.clear();
+    _devices.clear();
+    for (const auto& [name, deviceList] : _config->entriesWithPrefix("zone.")) {
+        // the zones become Homie nodes
+        if (!isValidId(name)) {
+            printf("Ignoring zone '%s': use lowercase letters, digits and hyphens\n", name.c_str());
+            continue;
+        }
+        Zone zone;
+        std::stringstream stream(deviceList);
+        std::string device;
+        while (std::getline(stream, device, ',')) {
+            if (device.empty() || std::find(zone.devices.begin(), zone.devices.end(), device) != zone.devices.end()) continue;
+            _devices[device].zones.push_back(_zones.size());
+            zone.devices.push_back(device);
+        }
+        if (zone.devices.empty()) {
+            printf("Ignoring zone '%s': no devices\n", name.c_str());
+            continue;
+        }
+        _zoneNames.push_back(name);
+        _zones.push_back(std::move(zone));
+    }
+    return !_zones.empty();
+}
+
+// once per rollup: a walk over the devices, which are few compared to the messages
+void ZoneAggregator::expire(const int64_t nowMicros) {
+    for (auto& [name, device] : _devices) {
+        for (size_t quantity = 0; quantity < QUANTITIES; quantity++) {
+            auto& reading = device.readings[quantity];
+            if (!reading.isSet || nowMicros - reading.atMicros <= _staleMicros) continue;
+            reading.isSet = false;
+            for (const auto zone : device.zones) {
+                auto& sum = _zones[zone].sums[quantity];
+                sum.total -= reading.value;
+                sum.count--;
+            }
+        }
+    }
+}
+
+/// @brief Take in a value of a device, replacing its previous one in the sums of its zones.
+/// @return false if the device isn't in any zone (or the value isn't a number)
+bool ZoneAggregator::ingest(const std::string& device, const Quantity quantity, const float value, const int64_t nowMicros) {
+    if (std::isnan(value)) return false;
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto iterator = _devices.find(device);
+    if (iterator == _devices.end()) return false;
+    auto& reading = iterator->second.readings[indexOf(quantity)];
+    for (const auto zone : iterator->second.zones) {
+        auto& sum = _zones[zone].sums[indexOf(quantity)];
+        if (reading.isSet) {
+            sum.total -= reading.value;
+        } else {
+            sum.count++;
+        }
+        sum.total += value;
+    }
+    reading = {value, nowMicros, true};
+    return true;
+}
+
+/// @brief Whether the name can be a Homie ID (lowercase letters, digits and hyphens, not starting with a hyphen)
+bool ZoneAggregator::isValidId(const std::string& id) {
+    if (id.empty() || id[0] == '-') return false;
+    return std::all_of(id.begin(), id.end(), [](const char c) { return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-'; });
+}
+
+/// @brief Get the device and quantity from a sibling's property topic: homie/<device>/<node>/temperature or humidity
+bool ZoneAggregator::parseTopic(const std::string& topic, const std::string& node, std::string* device, Quantity* quantity) {
+    constexpr size_t PREFIX_LENGTH = 6;  // "homie/"
+    if (topic.compare(0, PREFIX_LENGTH, "homie/") != 0) return false;
+    const auto deviceEnd = topic.find('/', PREFIX_LENGTH);
+    if (deviceEnd == std::string::npos || deviceEnd == PREFIX_LENGTH) return false;
+    if (topic.compare(deviceEnd + 1, node.size(), node) != 0 || topic.size() <= deviceEnd + node.size() + 2 ||
+        topic[deviceEnd + node.size() + 1] != '/') return false;
+    const auto property = topic.substr(deviceEnd + node.size() + 2);
+    if (property == "temperature") {
+        *quantity = Quantity::Temperature;
+    } else if (property == "humidity") {
+        *quantity = Quantity::Humidity;
+    } else {
+        return false;
+    }
+    *device = topic.substr(PREFIX_LENGTH, deviceEnd - PREFIX_LENGTH);
+    return true;
+}
+
+/// @brief The current state of each zone (in zone name order), after dropping stale values
+std::vector<ZoneRollup> ZoneAggregator::rollups(const int64_t nowMicros) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    expire(nowMicros);
+    std::vector<ZoneRollup> result;
+    result.reserve(_zones.size());
+    for (size_t index = 0; index < _zones.size(); index++) {
+        const auto& zone = _zones[index];
+        ZoneRollup rollup;
+        rollup.zone = _zoneNames[index];
+        const auto& temperatures = zone.sums[indexOf(Quantity::Temperature)];
+        const auto& humidities = zone.sums[indexOf(Quantity::Humidity)];
+        rollup.temperatureCount = temperatures.count;
+        rollup.humidityCount = humidities.count;
+        if (temperatures.count > 0) rollup.temperature = static_cast<float>(temperatures.total / temperatures.count);
+        if (humidities.count > 0) rollup.humidity = static_cast<float>(humidities.total / humidities.count);
+        // the spread needs a pass over the devices, but only once per rollup
+        rollup.minTemperature = rollup.minHumidity = INFINITY;
+        rollup.maxTemperature = rollup.maxHumidity = -INFINITY;
+        for (const auto& name : zone.devices) {
+            const auto& device = _devices[name];
+            const auto& temperature = device.readings[indexOf(Quantity::Temperature)];
+            const auto& humidity = device.readings[indexOf(Quantity::Humidity)];
+            if (temperature.isSet || humidity.isSet) rollup.devices++;
+            if (temperature.isSet) {
+                rollup.minTemperature = std::min(rollup.minTemperature, temperature.value);
+                rollup.maxTemperature = std::max(rollup.maxTemperature, temperature.value);
+            }
+            if (humidity.isSet) {
+                rollup.minHumidity = std::min(rollup.minHumidity, humidity.value);
+                rollup.maxHumidity = std::max(rollup.maxHumidity, humidity.value);
+            }
+        }
+        result.push_back(std::move(rollup));
+    }
+    return result;
+}
+
+/// @brief {"devices":n,"temperature":t,"minTemperature":..,"maxTemperature":..,"humidity":h,...}; a quantity
+/// without recent values is left out
+std::string ZoneAggregator::toJson(const ZoneRollup& rollup) {
+    char buffer[128];
+    std::string json = "{\"devices\":" + std::to_string(rollup.devices);
+    if (rollup.temperatureCount > 0) {
+        snprintf(buffer, sizeof buffer, ",\"temperature\":%.2f,\"minTemperature\":%.1f,\"maxTemperature\":%.1f",
+                 static_cast<double>(rollup.temperature), static_cast<double>(rollup.minTemperature), static_cast<double>(rollup.maxTemperature));
+        json += buffer;
+    }
+    if (rollup.humidityCount > 0) {
+        snprintf(buffer, sizeof buffer, ",\"humidity\":%.2f,\"minHumidity\":%.1f,\"maxHumidity\":%.1f",
+                 static_cast<double>(rollup.humidity), static_cast<double>(rollup.minHumidity), static_cast<double>(rollup.maxHumidity));
+        json += buffer;
+    }
+    return json + "}";
+}
@@ -0,0 +1,87 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef ZONE_AGGREGATOR_H
+#define ZONE_AGGREGATOR_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Config.h"
+
+enum class Quantity : uint8_t { Temperature, Humidity };
+
+/// @brief The state of a zone: the mean over the devices with a recent value, and the spread
+struct ZoneRollup {
+    std::string zone;
+    int devices = 0;          // devices with a recent temperature or humidity
+    float temperature = 0.0f;
+    float minTemperature = 0.0f;
+    float maxTemperature = 0.0f;
+    int temperatureCount = 0;
+    float humidity = 0.0f;
+    float minHumidity = 0.0f;
+    float maxHumidity = 0.0f;
+    int humidityCount = 0;
+};
+
+/// @brief Keeps the latest temperature and humidity of each device in a zone (zone.<name>=<device>,<device>,...),
+/// and the per-zone sums incrementally, so a new value costs a hash lookup and two additions per zone it belongs to.
+/// A device may be in several zones (e.g. a room and a floor). Values older than staleSeconds no longer count.
+class ZoneAggregator {
+public:
+    static constexpr int DEFAULT_STALE_SECONDS = 600;
+
+    explicit ZoneAggregator(const Config* config);
+    bool begin();
+    bool ingest(const std::string& device, Quantity quantity, float value, int64_t nowMicros);
+    std::vector<ZoneRollup> rollups(int64_t nowMicros);
+    [[nodiscard]] const std::vector<std::string>& zones() const { return _zoneNames; }
+
+    static bool isValidId(const std::string& id);
+    static bool parseTopic(const std::string& topic, const std::string& node, std::string* device, Quantity* quantity);
+    static std::string toJson(const ZoneRollup& rollup);
+
+private:
+    struct Reading {
+        float value = 0.0f;
+        int64_t atMicros = 0;
+        bool isSet = false;
+    };
+
+    struct Device {
+        std::vector<size_t> zones;
+        Reading readings[2];
+    };
+
+    struct Sum {
+        double total = 0.0;
+        int count = 0;
+    };
+
+    struct Zone {
+        std::vector<std::string> devices;
+        Sum sums[2];
+    };
+
+    void expire(int64_t nowMicros);
+
+    const Config* _config;
+    int64_t _staleMicros = DEFAULT_STALE_SECONDS * 1000000LL;
+    std::mutex _mutex;
+    std::vector<std::string> _zoneNames;
+    std::vector<Zone> _zones;
+    std::unordered_map<std::string, Device> _devices;
+};
+
+#endif
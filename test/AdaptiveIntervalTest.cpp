@@ -0,0 +1,47 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <cmath>
+#include "AdaptiveInterval.h"
+
+class AdaptiveIntervalTest : public ::testing::Test {
+protected:
+    static constexpr uint32_t BASE = 2000000;
+};
+
+TEST_F(AdaptiveIntervalTest, disabledKeepsBase) {
+    Config config;
+    config.begin("device=test\n");
+    AdaptiveInterval interval(&config);
+    interval.begin();
+    EXPECT_FALSE(interval.isEnabled()) << "off by default";
+    for (int i = 0; i < 5; i++) EXPECT_EQ(BASE, interval.next(true, 20.0f, 50.0f, BASE)) << "read " << i;
+}
+
+TEST_F(AdaptiveIntervalTest, stretchesWhileStableAndSnapsBack) {
+    Config config;
+    config.begin("adaptive=1\nadaptiveMaxSeconds=10\nadaptiveTemperatureDelta=0.2\nadaptiveHumidityDelta=1\n");
+    AdaptiveInterval interval(&config);
+    interval.begin();
+    EXPECT_EQ(BASE, interval.next(true, 20.0f, 50.0f, BASE)) << "first read sets the reference";
+    EXPECT_EQ(3000000U, interval.next(true, 20.1f, 50.5f, BASE)) << "stable: stretch";
+    EXPECT_EQ(4500000U, interval.next(true, 20.1f, 50.5f, BASE)) << "stretch again";
+    EXPECT_EQ(6750000U, interval.next(true, 19.9f, 49.5f, BASE)) << "still within the band";
+    EXPECT_EQ(10000000U, interval.next(true, 20.0f, 50.0f, BASE)) << "capped at the maximum";
+    EXPECT_EQ(10000000U, interval.next(true, 20.0f, 50.0f, BASE)) << "stays at the maximum";
+    EXPECT_EQ(BASE, interval.next(true, 20.3f, 50.0f, BASE)) << "temperature changed: snap back";
+    EXPECT_EQ(3000000U, interval.next(true, 20.3f, 50.0f, BASE)) << "stable around the new reference";
+    EXPECT_EQ(BASE, interval.next(true, 20.3f, 51.5f, BASE)) << "humidity changed";
+    EXPECT_EQ(3000000U, interval.next(true, 20.3f, 51.5f, BASE)) << "stable again";
+    EXPECT_EQ(BASE, interval.next(false, NAN, NAN, BASE)) << "failed read snaps back";
+    EXPECT_EQ(BASE, interval.next(true, 20.3f, 51.5f, BASE)) << "new reference after failure";
+}
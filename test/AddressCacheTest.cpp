@@ -0,0 +1,31 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+
+#include "AddressCache.h"
+
+class AddressCacheTest : public ::testing::Test {};
+
+TEST_F(AddressCacheTest, numericResolvesToItself) {
+    EXPECT_EQ("127.0.0.1", AddressCache::resolve("127.0.0.1")) << "IPv4";
+    EXPECT_EQ("::1", AddressCache::resolve("::1")) << "IPv6";
+}
+
+TEST_F(AddressCacheTest, lookupCaches) {
+    AddressCache cache(1);
+    cache.begin();
+    const auto address = cache.lookup("localhost");
+    EXPECT_FALSE(address.empty()) << "localhost resolved";
+    EXPECT_EQ(address, cache.lookup("localhost")) << "Same address from cache";
+    cache.end();
+    cache.end();
+}
@@ -0,0 +1,91 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include "AllocationTracker.h"
+#include "ClimateMeasurement.h"
+#include "Homie.h"
+#include "Mqtt.h"
+#include "SensorData.h"
+
+class AllocationTest : public ::testing::Test {
+protected:
+    // stands in for pigpio: the edges of a valid read, as the alert callback would deliver them
+    static void simulateRead(SensorData& sensorData, uint32_t& timestamp) {
+        sensorData.initRead(timestamp);
+        int level = 0;
+        for (int i = 0; i <= EDGES; i++) {
+            timestamp += 100;
+            sensorData.addEdge(level, timestamp);
+            level = 1 - level;
+        }
+    }
+};
+
+TEST_F(AllocationTest, trackerCountsPerTag) {
+    if (!AllocationTracker::isAvailable()) GTEST_SKIP() << "linked without AllocationHooks.cpp";
+    AllocationTracker::reset();
+    AllocationTracker::enable(true);
+    {
+        AllocationScope scope(AllocationTag::Publish);
+        const auto* value = new std::vector<int>(100);
+        delete value;
+    }
+    AllocationTracker::enable(false);
+    EXPECT_GE(AllocationTracker::allocations(AllocationTag::Publish), 2U) << "vector and its buffer";
+    EXPECT_GE(AllocationTracker::bytes(AllocationTag::Publish), 100 * sizeof(int)) << "bytes";
+    EXPECT_EQ(0U, AllocationTracker::allocations(AllocationTag::Sensor)) << "other tags untouched";
+    EXPECT_GE(AllocationTracker::deallocations(), 2U) << "deallocations";
+}
+
+TEST_F(AllocationTest, steadyStateDoesNotAllocate) {
+    if (!AllocationTracker::isAvailable()) GTEST_SKIP() << "linked without AllocationHooks.cpp";
+    volatile bool keepGoing = true;
+    Config config;
+    // nothing listens on port 1, so we don't connect for real; we force the connected state instead
+    config.begin("device=alloc\nbroker=127.0.0.1\nport=1\npayloadFormat=json\n");
+    queuing::Mqtt mqtt(&config, &keepGoing);
+    Homie homie(&mqtt, &config);
+    homie.begin();
+    queuing::onConnect(nullptr, &mqtt, 0);
+    SensorData sensorData;
+    ClimateMeasurement climateMeasurement(&homie);
+    climateMeasurement.begin();
+
+    uint32_t timestamp = 0;
+    float temperature;
+    float humidity;
+    auto cycle = [&] {
+        {
+            // what Dht::read does under its sensor scope
+            AllocationScope scope(AllocationTag::Sensor);
+            simulateRead(sensorData, timestamp);
+            temperature = sensorData.getTemperature();
+            humidity = sensorData.getHumidity();
+        }
+        climateMeasurement.processSample(temperature, humidity);
+    };
+    // warm up: buffers grow to their final size, streams and the broker connection state settle
+    for (int i = 0; i < 20; i++) cycle();
+
+    AllocationTracker::reset();
+    AllocationTracker::enable(true);
+    for (int i = 0; i < 100; i++) cycle();
+    AllocationTracker::enable(false);
+
+    EXPECT_EQ(0U, AllocationTracker::allocations(AllocationTag::Sensor)) << "sensor";
+    EXPECT_EQ(0U, AllocationTracker::allocations(AllocationTag::Aggregation)) << "aggregation";
+    EXPECT_EQ(0U, AllocationTracker::allocations(AllocationTag::Publish)) << "publish";
+    EXPECT_EQ(0U, AllocationTracker::allocations()) << "all";
+    if (AllocationTracker::allocations() > 0) AllocationTracker::report();
+}
@@ -0,0 +1,132 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "BrokerSelector.h"
+
+class BrokerSelectorTest : public ::testing::Test {
+protected:
+    static constexpr int64_t SECOND = 1000000;
+};
+
+TEST_F(BrokerSelectorTest, parse) {
+    std::vector<Broker> brokers;
+    ASSERT_TRUE(BrokerSelector::parse("primary,secondary:8883,[::1]:1884,::1,,", 1883, &brokers));
+    ASSERT_EQ(4u, brokers.size());
+    EXPECT_EQ("primary:1883", brokers[0].name());
+    EXPECT_EQ("secondary:8883", brokers[1].name());
+    EXPECT_EQ("::1", brokers[2].host);
+    EXPECT_EQ(1884, brokers[2].port);
+    EXPECT_EQ("::1", brokers[3].host) << "bare IPv6 address";
+    EXPECT_EQ(1883, brokers[3].port);
+    EXPECT_FALSE(BrokerSelector::parse("primary:x", 1883, &brokers));
+    EXPECT_FALSE(BrokerSelector::parse("primary:70000", 1883, &brokers));
+    EXPECT_FALSE(BrokerSelector::parse("[::1", 1883, &brokers));
+    EXPECT_FALSE(BrokerSelector::parse(":1883", 1883, &brokers));
+    EXPECT_FALSE(BrokerSelector::parse("", 1883, &brokers));
+}
+
+TEST_F(BrokerSelectorTest, failoverAndFailBackInOrder) {
+    Config config;
+    config.begin("brokers=first,second,third\nport=8883\nprobeSeconds=0\nfailbackSeconds=60\n");
+    BrokerSelector selector(&config);
+    ASSERT_TRUE(selector.begin());
+    EXPECT_EQ("first:8883", selector.current().name());
+    EXPECT_FALSE(selector.failBack(0)) << "already on the preferred one";
+
+    // second is down as well, so third takes over
+    selector.recordProbe(1, -1, 0);
+    EXPECT_TRUE(selector.failover());
+    EXPECT_EQ("third", selector.current().host);
+    EXPECT_FALSE(selector.health()[0].isHealthy) << "the failed one is marked down";
+
+    // first comes back, but has to stay healthy for 60 seconds; second is back sooner
+    selector.recordProbe(0, 2000, 30 * SECOND);
+    selector.recordProbe(1, 3000, 10 * SECOND);
+    EXPECT_FALSE(selector.failBack(60 * SECOND));
+    EXPECT_TRUE(selector.failBack(75 * SECOND));
+    EXPECT_EQ("second", selector.current().host);
+    selector.recordProbe(0, -1, 85 * SECOND);
+    selector.recordProbe(0, 2000, 90 * SECOND);
+    EXPECT_FALSE(selector.failBack(120 * SECOND)) << "the hold-down restarted";
+    EXPECT_TRUE(selector.failBack(150 * SECOND));
+    EXPECT_EQ("first", selector.current().host);
+    EXPECT_EQ(3u, selector.switches());
+
+    // nothing healthy: just the next one
+    selector.recordProbe(1, -1, 160 * SECOND);
+    selector.recordProbe(2, -1, 160 * SECOND);
+    EXPECT_TRUE(selector.failover());
+    EXPECT_EQ("second", selector.current().host);
+}
+
+TEST_F(BrokerSelectorTest, latencySelection) {
+    Config config;
+    config.begin("brokers=near,far,similar\nbrokerSelection=latency\nprobeSeconds=0\nfailbackSeconds=0\n");
+    BrokerSelector selector(&config);
+    ASSERT_TRUE(selector.begin());
+    EXPECT_FALSE(selector.failBack(0)) << "nothing measured yet";
+    selector.recordProbe(0, 10000, 0);
+    selector.recordProbe(1, 1000, 0);
+    selector.recordProbe(2, 1100, 0);
+    EXPECT_TRUE(selector.failBack(SECOND));
+    EXPECT_EQ("far", selector.current().host) << "fastest to connect";
+    EXPECT_FALSE(selector.failBack(2 * SECOND)) << "similar isn't faster by the margin";
+    selector.recordProbe(1, -1, 3 * SECOND);
+    EXPECT_TRUE(selector.failover());
+    EXPECT_EQ("similar", selector.current().host) << "the fastest healthy other one";
+    EXPECT_EQ(1000, selector.health()[1].rttMicros) << "a failed probe keeps the last connect time";
+}
+
+TEST_F(BrokerSelectorTest, holdDownStartsAtFirstProbe) {
+    Config config;
+    config.begin("brokers=near,far\nbrokerSelection=latency\nprobeSeconds=0\nfailbackSeconds=60\n");
+    BrokerSelector selector(&config);
+    ASSERT_TRUE(selector.begin());
+    EXPECT_EQ(-1, selector.health()[1].healthySinceMicros) << "not probed yet";
+    selector.recordProbe(0, 10000, 100 * SECOND);
+    selector.recordProbe(1, 1000, 100 * SECOND);
+    EXPECT_EQ(100 * SECOND, selector.health()[1].healthySinceMicros);
+    EXPECT_FALSE(selector.failBack(120 * SECOND)) << "healthy from the start, but only known to be for 20 seconds";
+    selector.recordProbe(1, 1000, 130 * SECOND);
+    EXPECT_EQ(100 * SECOND, selector.health()[1].healthySinceMicros) << "later probes don't restart the hold-down";
+    EXPECT_TRUE(selector.failBack(160 * SECOND));
+    EXPECT_EQ("far", selector.current().host);
+}
+
+TEST_F(BrokerSelectorTest, singleBrokerNeverSwitches) {
+    Config config;
+    config.begin("broker=only\nport=1884\n");
+    BrokerSelector selector(&config);
+    ASSERT_TRUE(selector.begin());
+    EXPECT_EQ("only:1884", selector.current().name());
+    EXPECT_FALSE(selector.failover());
+    EXPECT_FALSE(selector.failBack(0));
+}
+
+TEST_F(BrokerSelectorTest, probe) {
+    const int listener = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_GE(listener, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(0, bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof address));
+    ASSERT_EQ(0, listen(listener, 1));
+    socklen_t length = sizeof address;
+    ASSERT_EQ(0, getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length));
+    EXPECT_GE(BrokerSelector::probe({"127.0.0.1", ntohs(address.sin_port)}, 1000), 0);
+    close(listener);
+    // nothing listens on port 1
+    EXPECT_EQ(-1, BrokerSelector::probe({"127.0.0.1", 1}, 1000));
+}
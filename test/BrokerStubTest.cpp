@@ -0,0 +1,174 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "BrokerStub.h"
+#include "Mqtt.h"
+
+using namespace std::chrono_literals;
+
+class BrokerStubTest : public ::testing::Test {
+protected:
+    BrokerStub broker;
+
+    void SetUp() override {
+        ASSERT_TRUE(broker.begin());
+    }
+
+    // a hand-rolled client, so the broker can be tested without the mosquitto library
+    int connectClient() const {
+        const int client = socket(AF_INET, SOCK_STREAM, 0);
+        timeval timeout{2, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(static_cast<uint16_t>(broker.port()));
+        EXPECT_EQ(0, connect(client, reinterpret_cast<sockaddr*>(&address), sizeof address));
+        return client;
+    }
+
+    static std::string str(const std::string& value) {
+        return std::string{static_cast<char>(value.size() >> 8), static_cast<char>(value.size() & 0xFF)} + value;
+    }
+
+    static void sendPacket(const int client, const uint8_t header, const std::string& body) {
+        // all our test packets are shorter than 128 bytes
+        const std::string packet = std::string(1, static_cast<char>(header)) + static_cast<char>(body.size()) + body;
+        ASSERT_EQ(static_cast<ssize_t>(packet.size()), send(client, packet.data(), packet.size(), MSG_NOSIGNAL));
+    }
+
+    // returns the packet without the fixed header, and sets the header byte. Empty with header 0 on timeout.
+    static std::string receivePacket(const int client, uint8_t* header) {
+        unsigned char fixed[2];
+        *header = 0;
+        if (recv(client, fixed, 2, MSG_WAITALL) != 2) return "";
+        *header = fixed[0];
+        std::string body(fixed[1], '\0');
+        if (fixed[1] > 0 && recv(client, body.data(), body.size(), MSG_WAITALL) != fixed[1]) return "";
+        return body;
+    }
+
+    static void connectMqtt(const int client, const std::string& clientId, const std::string& willTopic = "") {
+        // protocol name, level 4, flags (clean session, optional will), keepalive 60
+        std::string body = str("MQTT") + '\x04' + (willTopic.empty() ? '\x02' : '\x26') + '\0' + '\x3C' + str(clientId);
+        if (!willTopic.empty()) body += str(willTopic) + str("lost");
+        sendPacket(client, 0x10, body);
+    }
+};
+
+TEST_F(BrokerStubTest, matchesTopicFilters) {
+    EXPECT_TRUE(BrokerStub::matches("homie/dev/#", "homie/dev/climate/temperature"));
+    EXPECT_TRUE(BrokerStub::matches("homie/dev/#", "homie/dev")) << "# includes the parent";
+    EXPECT_TRUE(BrokerStub::matches("homie/+/$state", "homie/dev/$state"));
+    EXPECT_FALSE(BrokerStub::matches("homie/+", "homie/dev/$state")) << "+ is one level";
+    EXPECT_FALSE(BrokerStub::matches("homie/dev", "homie/dev/x"));
+    EXPECT_FALSE(BrokerStub::matches("#", "$SYS/uptime")) << "wildcards skip $ topics";
+}
+
+TEST_F(BrokerStubTest, publishesRetainsAndForwards) {
+    const int publisher = connectClient();
+    connectMqtt(publisher, "publisher", "homie/publisher/$state");
+    uint8_t header;
+    EXPECT_EQ(std::string("\0\0", 2), receivePacket(publisher, &header)) << "accepted";
+    EXPECT_EQ(0x20, header) << "CONNACK";
+
+    // QoS 1, retained
+    sendPacket(publisher, 0x33, str("homie/publisher/$name") + std::string("\0\x07", 2) + "Climate");
+    EXPECT_EQ(std::string("\0\x07", 2), receivePacket(publisher, &header));
+    EXPECT_EQ(0x40, header) << "PUBACK";
+    ASSERT_TRUE(broker.waitForPublishes(1, 1s));
+    std::string payload;
+    EXPECT_TRUE(broker.retained("homie/publisher/$name", &payload));
+    EXPECT_EQ("Climate", payload);
+
+    const int subscriber = connectClient();
+    connectMqtt(subscriber, "subscriber");
+    receivePacket(subscriber, &header);
+    sendPacket(subscriber, 0x82, std::string("\0\x01", 2) + str("homie/#") + '\0');
+    EXPECT_EQ(std::string("\0\x01\0", 3), receivePacket(subscriber, &header));
+    EXPECT_EQ(0x90, header) << "SUBACK";
+    EXPECT_EQ(str("homie/publisher/$name") + "Climate", receivePacket(subscriber, &header)) << "retained message";
+    EXPECT_EQ(0x31, header) << "with the retain flag";
+
+    // the publisher goes away without DISCONNECT, so its will goes out
+    broker.disconnectAll();
+    ASSERT_TRUE(broker.waitForPublishes(2, 1s));
+    const auto publishes = broker.publishes();
+    EXPECT_EQ("homie/publisher/$state", publishes[1].topic);
+    EXPECT_EQ("lost", publishes[1].payload);
+    EXPECT_EQ(1u, broker.statistics().wills) << "the subscriber had no will";
+    close(publisher);
+    close(subscriber);
+}
+
+TEST_F(BrokerStubTest, injectsFaults) {
+    broker.setAckDelay(50ms);
+    const int client = connectClient();
+    connectMqtt(client, "slow");
+    uint8_t header;
+    receivePacket(client, &header);
+    const auto start = std::chrono::steady_clock::now();
+    sendPacket(client, 0x32, str("a/b") + std::string("\0\x01", 2) + "x");
+    receivePacket(client, &header);
+    EXPECT_EQ(0x40, header) << "PUBACK";
+    EXPECT_GE(std::chrono::steady_clock::now() - start, 50ms) << "acknowledgement delayed";
+
+    broker.setAckDelay(0us);
+    broker.disconnectAfter(1);
+    sendPacket(client, 0x32, str("a/b") + std::string("\0\x02", 2) + "y");
+    EXPECT_EQ("", receivePacket(client, &header)) << "connection dropped";
+    EXPECT_EQ(0, header);
+    EXPECT_EQ(2u, broker.statistics().publishes) << "the publish did arrive";
+    EXPECT_EQ(1u, broker.statistics().acknowledgements) << "but wasn't acknowledged";
+    close(client);
+
+    broker.setConnackCode(5);
+    const int refused = connectClient();
+    connectMqtt(refused, "refused");
+    EXPECT_EQ(std::string("\0\x05", 2), receivePacket(refused, &header)) << "not authorized";
+    EXPECT_EQ("", receivePacket(refused, &header)) << "and closed";
+    EXPECT_EQ(1u, broker.statistics().refused);
+    close(refused);
+}
+
+TEST_F(BrokerStubTest, mqttPublishesAndReconnects) {
+    volatile bool keepGoing = true;
+    Config config;
+    config.begin("device=stubbed\nbroker=127.0.0.1\nport=" + std::to_string(broker.port()) + "\nqosMeasurement=1\n");
+    queuing::Mqtt mqtt(&config, &keepGoing);
+    ASSERT_TRUE(mqtt.begin());
+    ASSERT_TRUE(mqtt.waitForConnection());
+    broker.setAckDelay(20ms);
+    for (int i = 0; i < 10; i++) {
+        EXPECT_TRUE(mqtt.publish("homie/stubbed/climate/temperature", std::to_string(20 + i)));
+    }
+    ASSERT_TRUE(broker.waitForPublishes(10, 2s));
+    for (int i = 0; i < 50 && mqtt.publishStatistics().acknowledged < 10; i++) std::this_thread::sleep_for(10ms);
+    const auto statistics = mqtt.publishStatistics();
+    EXPECT_EQ(10u, statistics.acknowledged);
+    EXPECT_GE(statistics.maxLatencyMicros, 20000) << "ack delay shows in the latency";
+    EXPECT_EQ("29", broker.publishes().back().payload) << "in order";
+
+    broker.disconnectAll();
+    for (int i = 0; i < 50 && mqtt.isConnected(); i++) std::this_thread::sleep_for(10ms);
+    EXPECT_FALSE(mqtt.isConnected()) << "connection loss noticed";
+    EXPECT_TRUE(mqtt.verifyConnection()) << "reconnected";
+    EXPECT_TRUE(broker.waitForConnects(2, 2s));
+    EXPECT_GE(mqtt.connectionStatistics().reconnects, 1u) << "the network thread may have beaten us to it";
+}
@@ -0,0 +1,140 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "BulkDecoder.h"
+#include "EdgeRecorder.h"
+
+class BulkDecoderTest : public ::testing::Test {
+protected:
+    std::mt19937 random{42};
+
+    // a regular frame; if checksumOk, the bits form valid data, otherwise they are random
+    std::vector<uint32_t> makeEdges(const bool checksumOk) {
+        uint8_t data[BYTES];
+        for (auto& byte : data) byte = static_cast<uint8_t>(random());
+        if (checksumOk) data[4] = static_cast<uint8_t>(data[0] + data[1] + data[2] + data[3]);
+        std::uniform_int_distribution<uint32_t> jitter(0, 6);
+        std::vector<uint32_t> edges;
+        uint32_t offset = 0;
+        const auto add = [&](const uint32_t level, const uint32_t duration) {
+            offset += duration;
+            edges.push_back(level << EdgeFrame::LEVEL_SHIFT | offset);
+        };
+        add(1, 20);
+        add(0, 30);
+        add(1, 80);
+        add(0, 80);
+        for (int bit = 0; bit < PulseBatch::BITS; bit++) {
+            const uint32_t low = 47 + jitter(random);
+            add(1, low);
+            const bool isOne = (data[bit / 8] >> (7 - bit % 8) & 1) != 0;
+            // every now and then exactly the reference, which is a 0
+            const uint32_t high = isOne ? 68 + jitter(random) : (bit % 13 == 0 ? low : 24 + jitter(random));
+            add(0, high);
+        }
+        return edges;
+    }
+
+    static EdgeFrame frameOf(const std::vector<uint32_t>& edges, const uint32_t startTick) {
+        return EdgeFrame{startTick, SensorState::Reading, 0, static_cast<uint16_t>(edges.size()), edges.data()};
+    }
+
+    static void expectSame(const SensorData& reference, const DecodedFrame& decoded, const size_t index) {
+        ASSERT_EQ(reference.getState(), decoded.state) << "frame " << index;
+        for (uint8_t word = 0; word < BYTES - 1; word++) {
+            EXPECT_EQ(reference.getWordAtIndex(word), decoded.word(word)) << "frame " << index << " word " << int(word);
+        }
+        if (decoded.state == SensorState::Done) {
+            EXPECT_EQ(reference.getHumidity(), decoded.humidity()) << "frame " << index;
+            EXPECT_EQ(reference.getTemperature(), decoded.temperature()) << "frame " << index;
+        } else {
+            EXPECT_TRUE(std::isnan(decoded.humidity()));
+        }
+    }
+};
+
+TEST_F(BulkDecoderTest, matchesSensorData) {
+    constexpr size_t FRAMES = 1003;  // not a multiple of the vector width
+    std::vector<std::vector<uint32_t>> edges;
+    PulseBatch batch(FRAMES);
+    for (size_t i = 0; i < FRAMES; i++) {
+        edges.push_back(makeEdges(i % 3 != 0));
+        // near the end of the tick range, so the ticks wrap within the frame
+        ASSERT_TRUE(batch.add(frameOf(edges.back(), 0xFFFFFF00U + static_cast<uint32_t>(i))));
+    }
+    EXPECT_TRUE(batch.isFull());
+    EXPECT_FALSE(batch.add(frameOf(edges[0], 0))) << "full";
+
+    std::vector<DecodedFrame> decoded(FRAMES);
+    BulkDecoder(1).decode(batch, decoded.data());
+    SensorData sensorData;
+    size_t done = 0;
+    for (size_t i = 0; i < FRAMES; i++) {
+        EdgeRecorder::replay(frameOf(edges[i], 0xFFFFFF00U + static_cast<uint32_t>(i)), &sensorData);
+        expectSame(sensorData, decoded[i], i);
+        if (decoded[i].state == SensorState::Done) done++;
+    }
+    EXPECT_GT(done, FRAMES / 2) << "both outcomes covered";
+    EXPECT_LT(done, FRAMES);
+}
+
+TEST_F(BulkDecoderTest, kernelsAndThreadsAgree) {
+    constexpr size_t FRAMES = 3 * 4096 + 5;
+    PulseBatch batch(FRAMES);
+    std::uniform_int_distribution<uint32_t> any;
+    uint32_t low[PulseBatch::BITS];
+    uint32_t high[PulseBatch::BITS];
+    for (size_t i = 0; i < FRAMES; i++) {
+        for (int bit = 0; bit < PulseBatch::BITS; bit++) {
+            // around the sign bit to catch signed comparisons, and some equal pairs
+            low[bit] = i % 2 == 0 ? 0x7FFFFFF0U + any(random) % 32 : any(random);
+            high[bit] = bit % 7 == 0 ? low[bit] : (i % 2 == 0 ? 0x7FFFFFF0U + any(random) % 32 : any(random));
+        }
+        batch.add(low, high);
+    }
+    std::vector<DecodedFrame> scalar(FRAMES);
+    std::vector<DecodedFrame> vector(FRAMES);
+    std::vector<DecodedFrame> threaded(FRAMES);
+    BulkDecoder::decodeScalar(batch, 0, FRAMES, scalar.data());
+    BulkDecoder::decodeVector(batch, 0, FRAMES, vector.data());
+    const BulkDecoder decoder(3);
+    EXPECT_EQ(3u, decoder.threads());
+    decoder.decode(batch, threaded.data());
+    for (size_t i = 0; i < FRAMES; i++) {
+        ASSERT_EQ(scalar[i].data, vector[i].data) << BulkDecoder::kernel() << " frame " << i;
+        ASSERT_EQ(scalar[i].state, vector[i].state) << BulkDecoder::kernel() << " frame " << i;
+        ASSERT_EQ(scalar[i].data, threaded[i].data) << "threaded frame " << i;
+    }
+}
+
+TEST_F(BulkDecoderTest, irregularFramesAreLeftToSensorData) {
+    auto edges = makeEdges(true);
+    EXPECT_TRUE(PulseBatch::isRegular(frameOf(edges, 0)));
+    auto shortened = edges;
+    shortened.pop_back();
+    EXPECT_FALSE(PulseBatch::isRegular(frameOf(shortened, 0))) << "missing an edge";
+    auto timedOut = edges;
+    timedOut[50] = 2U << EdgeFrame::LEVEL_SHIFT | (timedOut[50] & EdgeFrame::OFFSET_MASK);
+    EXPECT_FALSE(PulseBatch::isRegular(frameOf(timedOut, 0))) << "timeout";
+    auto anomaly = edges;
+    anomaly.insert(anomaly.begin(), 0);
+    EXPECT_FALSE(PulseBatch::isRegular(frameOf(anomaly, 0))) << "falling edge first";
+    auto glitch = edges;
+    glitch[41] = (glitch[41] & ~EdgeFrame::OFFSET_MASK) | (glitch[40] & EdgeFrame::OFFSET_MASK);
+    EXPECT_FALSE(PulseBatch::isRegular(frameOf(glitch, 0))) << "zero-length pulse";
+    PulseBatch batch(4);
+    EXPECT_FALSE(batch.add(frameOf(anomaly, 0)));
+    EXPECT_EQ(0u, batch.size());
+}
@@ -0,0 +1,100 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include "BurstSchedule.h"
+
+class BurstScheduleTest : public ::testing::Test {
+protected:
+    static constexpr uint32_t SECOND = 1000000;
+    static constexpr uint32_t INTERVAL = 60 * SECOND;
+    // close to the wrap-around of gpioTick
+    static constexpr uint32_t START = 0xFFFFFFFFU - 10 * SECOND;
+
+    // one burst of reads, each on time
+    static void runBurst(BurstSchedule& schedule, const uint32_t interval) {
+        for (int i = 0; i < schedule.burstSamples(); i++) {
+            EXPECT_FALSE(schedule.shouldSuspend(schedule.nextRead())) << "not within a burst, read " << i;
+            schedule.readDone(schedule.nextRead(), interval);
+        }
+    }
+};
+
+TEST_F(BurstScheduleTest, burstsAndSuspend) {
+    Config config;
+    config.begin("dutyCycle=1\nburstSamples=3\nwarmupMillis=2000\n");
+    BurstSchedule schedule(&config);
+    schedule.begin();
+    ASSERT_TRUE(schedule.isEnabled());
+    EXPECT_EQ(7 * SECOND, schedule.minimumIntervalMicros()) << "two gaps, the warm-up and the minimum suspend time";
+    schedule.start(START);
+    schedule.readDone(START, INTERVAL);
+    EXPECT_EQ(START + 2 * SECOND, schedule.nextRead());
+    schedule.readDone(START + 2 * SECOND, INTERVAL);
+    schedule.readDone(START + 4 * SECOND, INTERVAL);
+    EXPECT_EQ(START + INTERVAL, schedule.nextRead()) << "an interval after the start of the burst";
+    EXPECT_EQ(0, schedule.index());
+    const uint32_t afterBurst = START + 4 * SECOND + 10000;
+    EXPECT_TRUE(schedule.shouldSuspend(afterBurst));
+    EXPECT_EQ(static_cast<int32_t>(INTERVAL - 4 * SECOND - 10000 - 2 * SECOND), schedule.untilWarmup(afterBurst));
+    EXPECT_FALSE(schedule.shouldSuspend(START + INTERVAL - 3 * SECOND)) << "not worth it";
+
+    schedule.postpone(SECOND);
+    EXPECT_EQ(START + INTERVAL + SECOND, schedule.nextRead()) << "powering up failed";
+    runBurst(schedule, 3 * SECOND);
+    EXPECT_EQ(START + INTERVAL + 7 * SECOND, schedule.nextRead()) << "interval shorter than the burst: right after it";
+}
+
+TEST_F(BurstScheduleTest, intervalChangeWhileSuspended) {
+    Config config;
+    config.begin("dutyCycle=1\n");
+    BurstSchedule schedule(&config);
+    schedule.begin();
+    schedule.start(START);
+    runBurst(schedule, INTERVAL);
+    ASSERT_EQ(START + INTERVAL, schedule.nextRead());
+
+    // shorter: from the start of the last burst, not from the next one
+    schedule.changeInterval(30 * SECOND, START + 10 * SECOND, true);
+    EXPECT_EQ(START + 30 * SECOND, schedule.nextRead());
+    // longer
+    schedule.changeInterval(120 * SECOND, START + 10 * SECOND, true);
+    EXPECT_EQ(START + 120 * SECOND, schedule.nextRead());
+    // so short that the next burst would have been in the past: after the warm-up
+    schedule.changeInterval(5 * SECOND, START + 10 * SECOND, true);
+    EXPECT_EQ(START + 12 * SECOND, schedule.nextRead());
+}
+
+TEST_F(BurstScheduleTest, intervalChangeWithinBurst) {
+    Config config;
+    config.begin("dutyCycle=1\nburstSamples=3\n");
+    BurstSchedule schedule(&config);
+    schedule.begin();
+    schedule.start(START);
+    schedule.readDone(START, INTERVAL);
+    schedule.changeInterval(30 * SECOND, START + SECOND, false);
+    EXPECT_EQ(0, schedule.index()) << "a new burst";
+    EXPECT_EQ(START + 30 * SECOND, schedule.nextRead()) << "from the start of the running burst";
+    schedule.changeInterval(1 * SECOND, START + SECOND, false);
+    EXPECT_EQ(START + 2 * SECOND, schedule.nextRead()) << "not before the sensor can be read again";
+}
+
+TEST_F(BurstScheduleTest, disabledNeverSuspends) {
+    Config config;
+    config.begin("burstSamples=100\nwarmupMillis=-5\n");
+    BurstSchedule schedule(&config);
+    schedule.begin();
+    EXPECT_FALSE(schedule.isEnabled());
+    EXPECT_EQ(BurstSchedule::MAX_BURST_SAMPLES, schedule.burstSamples());
+    schedule.start(START);
+    EXPECT_FALSE(schedule.shouldSuspend(START - INTERVAL));
+    EXPECT_EQ(static_cast<int32_t>(INTERVAL), schedule.untilWarmup(START - INTERVAL)) << "no warm-up";
+}
@@ -0,0 +1,124 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <vector>
+#include "ClimateMeasurement.h"
+
+class ClimateMeasurementTest : public ::testing::Test {
+protected:
+    class RecordingSender final : public ISender {
+    public:
+        bool sendHumidity(float) override { return true; }
+        bool sendTemperature(float) override { return true; }
+        bool sendMeasurement(const Measurement& measurement) override {
+            measurements.push_back(measurement);
+            return true;
+        }
+        bool sendSummary(const Summary& summary) override {
+            summaries.push_back(summary);
+            return true;
+        }
+        std::vector<Measurement> measurements;
+        std::vector<Summary> summaries;
+    };
+};
+
+TEST_F(ClimateMeasurementTest, samplesPerMeasurementChangesLive) {
+    RecordingSender sender;
+    ClimateMeasurement climateMeasurement(&sender);
+    climateMeasurement.begin();
+    EXPECT_EQ(5, climateMeasurement.samplesPerMeasurement()) << "default";
+    EXPECT_FALSE(climateMeasurement.setSamplesPerMeasurement(2)) << "too few to drop outliers";
+    EXPECT_FALSE(climateMeasurement.setSamplesPerMeasurement(31)) << "too many";
+    EXPECT_TRUE(climateMeasurement.setSamplesPerMeasurement(3)) << "set to 3";
+    for (int i = 0; i < 3; i++) climateMeasurement.processSample(20.0f + static_cast<float>(i), 50.0f);
+    ASSERT_EQ(1U, sender.measurements.size()) << "measurement after 3 samples";
+    EXPECT_EQ(3, sender.measurements[0].sampleCount) << "sample count";
+    EXPECT_FLOAT_EQ(21.0f, sender.measurements[0].temperature) << "middle value remains";
+
+    EXPECT_TRUE(climateMeasurement.setSamplesPerMeasurement(10)) << "set to 10";
+    for (int i = 0; i < 4; i++) climateMeasurement.processSample(20.0f, 50.0f);
+    EXPECT_EQ(1U, sender.measurements.size()) << "still collecting";
+    EXPECT_TRUE(climateMeasurement.setSamplesPerMeasurement(4)) << "lowered while collecting";
+    climateMeasurement.processSample(20.0f, 50.0f);
+    ASSERT_EQ(2U, sender.measurements.size()) << "measurement with what we had";
+    EXPECT_EQ(5, sender.measurements[1].sampleCount) << "all collected samples used";
+}
+
+TEST_F(ClimateMeasurementTest, weightedForVariableIntervals) {
+    RecordingSender sender;
+    ClimateMeasurement climateMeasurement(&sender);
+    climateMeasurement.begin();
+    // equal weights: the plain average of the middle three
+    const float temperatures[] = { 20.0f, 21.0f, 22.0f, 23.0f, 24.0f };
+    for (const float temperature : temperatures) climateMeasurement.processSample(temperature, 50.0f, 30.0f);
+    ASSERT_EQ(1U, sender.measurements.size()) << "first measurement";
+    EXPECT_FLOAT_EQ(22.0f, sender.measurements[0].temperature) << "equal weights";
+
+    // 21 stood for 26 seconds, 22 and 23 for 2 seconds each: (21 * 26 + 22 * 2 + 23 * 2) / 30 = 21.2
+    const float weights[] = { 2.0f, 26.0f, 2.0f, 2.0f, 2.0f };
+    for (int i = 0; i < 5; i++) climateMeasurement.processSample(temperatures[i], 50.0f, weights[i]);
+    ASSERT_EQ(2U, sender.measurements.size()) << "second measurement";
+    EXPECT_FLOAT_EQ(21.2f, sender.measurements[1].temperature) << "weighted";
+    EXPECT_FLOAT_EQ(50.0f, sender.measurements[1].humidity) << "constant humidity";
+}
+
+TEST_F(ClimateMeasurementTest, summariesPerHorizon) {
+    RecordingSender sender;
+    ClimateMeasurement climateMeasurement(&sender);
+    climateMeasurement.begin();
+    EXPECT_TRUE(climateMeasurement.addSummaryHorizon(60));
+    EXPECT_FALSE(climateMeasurement.addSummaryHorizon(60)) << "already there";
+    EXPECT_FALSE(climateMeasurement.addSummaryHorizon(0)) << "not positive";
+    EXPECT_TRUE(climateMeasurement.addSummaryHorizon(3600));
+    Sample sample;
+    // a sample every 10 seconds, from 00:59:00 to 01:00:50
+    for (int i = 0; i < 12; i++) {
+        sample.wallMillis = (3540 + 10 * i) * 1000LL;
+        sample.temperature = 20.0f + static_cast<float>(i % 6);
+        sample.humidity = i == 1 ? NAN : 50.0f;
+        climateMeasurement.processSample(sample);
+    }
+    // the first sample after 01:00 ended the minute from 00:59 and the hour from 00:00
+    ASSERT_EQ(4u, sender.summaries.size());
+    EXPECT_EQ("temperature", sender.summaries[0].property);
+    EXPECT_EQ(60, sender.summaries[0].horizonSeconds);
+    EXPECT_EQ(3540000, sender.summaries[0].startMillis);
+    EXPECT_EQ(6u, sender.summaries[0].sketch.count());
+    EXPECT_FLOAT_EQ(22.0f, sender.summaries[0].sketch.quantile(0.5));
+    EXPECT_EQ("humidity", sender.summaries[1].property);
+    EXPECT_EQ(5u, sender.summaries[1].sketch.count()) << "without the NaN";
+    EXPECT_EQ(3600, sender.summaries[2].horizonSeconds);
+    EXPECT_EQ(0, sender.summaries[2].startMillis);
+}
+
+TEST_F(ClimateMeasurementTest, summariesWeightedByTime) {
+    RecordingSender sender;
+    ClimateMeasurement climateMeasurement(&sender);
+    climateMeasurement.begin();
+    EXPECT_TRUE(climateMeasurement.addSummaryHorizon(3600));
+    Sample sample;
+    sample.humidity = 50.0f;
+    // a burst of three reads 2 seconds apart at 25 degrees, then one read standing for 300 seconds at 20
+    sample.wallMillis = 1000;
+    for (int i = 0; i < 3; i++) {
+        sample.temperature = 25.0f;
+        climateMeasurement.processSample(sample, 2.0f);
+    }
+    sample.temperature = 20.0f;
+    climateMeasurement.processSample(sample, 299.6f);
+    sample.wallMillis = 3600000;
+    climateMeasurement.processSample(sample);
+    ASSERT_EQ(2u, sender.summaries.size());
+    EXPECT_EQ(306u, sender.summaries[0].sketch.count()) << "seconds covered, rounded per sample";
+    EXPECT_FLOAT_EQ(20.0f, sender.summaries[0].sketch.quantile(0.5)) << "the value that held most of the time";
+}
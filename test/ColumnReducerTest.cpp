@@ -0,0 +1,147 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "ColumnReducer.h"
+
+class ColumnReducerTest : public ::testing::Test {
+protected:
+    static constexpr size_t COLUMNS = 11;  // two vector blocks and a scalar tail
+    static constexpr size_t STRIDE = 13;
+    std::mt19937 random{42};
+
+    // The trimmed mean as ClimateMeasurement::average calculated it before the kernels existed
+    static float originalAverage(const float input[], const int sampleSize) {
+        int firstNumberIndex = 0;
+        while (firstNumberIndex < sampleSize && std::isnan(input[firstNumberIndex])) { firstNumberIndex++; }
+        if (firstNumberIndex >= sampleSize) return NAN;
+        int nanCount = firstNumberIndex;
+        for (int i = firstNumberIndex + 1; i < sampleSize; i++) {
+            if (std::isnan(input[i])) nanCount++;
+        }
+        if (nanCount >= sampleSize - 2) return NAN;
+        auto minValue = input[firstNumberIndex];
+        auto maxValue = minValue;
+        auto totalValue = minValue;
+        for (int i = firstNumberIndex + 1; i < sampleSize; i++) {
+            if (!std::isnan(input[i])) {
+                totalValue += input[i];
+                if (input[i] < minValue) minValue = input[i];
+                if (input[i] > maxValue) maxValue = input[i];
+            }
+        }
+        totalValue -= (minValue + maxValue);
+        return totalValue / static_cast<float>(sampleSize - nanCount - 2);
+    }
+
+    static float rounded(const float value) {
+        return std::isnan(value) ? NAN : std::round(value * 10.0f) / 10.0f;
+    }
+
+    // bitwise, so that NaN equals NaN and the last bit counts
+    static bool same(const float expected, const float actual) {
+        return std::memcmp(&expected, &actual, sizeof expected) == 0 || (std::isnan(expected) && std::isnan(actual));
+    }
+
+    static void expectSame(const ColumnStatistics& expected, const ColumnStatistics& actual, const size_t column) {
+        EXPECT_EQ(expected.count, actual.count) << "column " << column;
+        EXPECT_TRUE(same(expected.sum, actual.sum)) << "column " << column;
+        EXPECT_TRUE(same(expected.min, actual.min)) << "column " << column;
+        EXPECT_TRUE(same(expected.max, actual.max)) << "column " << column;
+        EXPECT_TRUE(same(expected.trimmedMean, actual.trimmedMean)) << "column " << column;
+        EXPECT_TRUE(same(expected.variance, actual.variance)) << "column " << column;
+    }
+};
+
+TEST_F(ColumnReducerTest, floatStatistics) {
+    // one column, with a NaN and an outlier
+    float column[] = {20.0f, NAN, 21.0f, 22.0f, 30.0f};
+    ColumnStatistics statistics;
+    ColumnReducer::reduce(column, 5, 1, 1, &statistics);
+    EXPECT_EQ(4, statistics.count);
+    EXPECT_FLOAT_EQ(93.0f, statistics.sum);
+    EXPECT_FLOAT_EQ(20.0f, statistics.min);
+    EXPECT_FLOAT_EQ(30.0f, statistics.max);
+    EXPECT_FLOAT_EQ(21.5f, statistics.trimmedMean);
+    EXPECT_FLOAT_EQ(62.75f / 3, statistics.variance);
+
+    ColumnReducer::reduce(column, 2, 1, 1, &statistics);
+    EXPECT_EQ(1, statistics.count);
+    EXPECT_TRUE(std::isnan(statistics.trimmedMean));
+    EXPECT_TRUE(std::isnan(statistics.variance));
+    float nothing[] = {NAN, NAN};
+    ColumnReducer::reduce(nothing, 2, 1, 1, &statistics);
+    EXPECT_EQ(0, statistics.count);
+    EXPECT_TRUE(std::isnan(statistics.min));
+    EXPECT_TRUE(std::isnan(statistics.max));
+}
+
+TEST_F(ColumnReducerTest, floatKernelMatchesScalarAndOriginalAverage) {
+    std::uniform_int_distribution<int> tenths(150, 300);
+    std::uniform_int_distribution<int> percent(0, 99);
+    for (size_t rows = 1; rows <= 30; rows++) {
+        for (int round = 0; round < 50; round++) {
+            std::vector<float> matrix(rows * STRIDE);
+            for (auto& value : matrix) value = percent(random) < 10 ? NAN : static_cast<float>(tenths(random)) / 10.0f;
+            ColumnStatistics vector[COLUMNS];
+            ColumnStatistics scalar[COLUMNS];
+            ColumnReducer::reduce(matrix.data(), rows, COLUMNS, STRIDE, vector);
+            ColumnReducer::reduceScalar(matrix.data(), rows, COLUMNS, STRIDE, scalar);
+            for (size_t column = 0; column < COLUMNS; column++) {
+                expectSame(scalar[column], vector[column], column);
+                std::vector<float> input(rows);
+                for (size_t row = 0; row < rows; row++) input[row] = matrix[row * STRIDE + column];
+                const float expected = originalAverage(input.data(), static_cast<int>(rows));
+                ASSERT_TRUE(same(expected, vector[column].trimmedMean)) << ColumnReducer::kernel() << " rows " << rows << " column " << column;
+                ASSERT_TRUE(same(rounded(expected), rounded(vector[column].trimmedMean)));
+            }
+        }
+    }
+}
+
+TEST_F(ColumnReducerTest, int16KernelMatchesScalar) {
+    constexpr int16_t M = ColumnReducer::MISSING_INT16;
+    // the extremes are values too, only INT16_MIN is missing
+    int16_t fixed[] = {215, M, INT16_MAX, M,
+                       -400, M, INT16_MIN + 1, M,
+                       220, M, 0, 7,
+                       225, M, 5, M};
+    ColumnStatistics statistics[4];
+    ColumnReducer::reduce(fixed, 4, 4, 4, statistics);
+    EXPECT_EQ(4, statistics[0].count);
+    EXPECT_FLOAT_EQ(260.0f, statistics[0].sum);
+    EXPECT_FLOAT_EQ(-400.0f, statistics[0].min);
+    EXPECT_FLOAT_EQ(225.0f, statistics[0].max);
+    EXPECT_FLOAT_EQ(217.5f, statistics[0].trimmedMean);
+    EXPECT_EQ(0, statistics[1].count);
+    EXPECT_TRUE(std::isnan(statistics[1].max));
+    EXPECT_FLOAT_EQ(INT16_MIN + 1, statistics[2].min);
+    EXPECT_FLOAT_EQ(INT16_MAX, statistics[2].max);
+    EXPECT_FLOAT_EQ(2.5f, statistics[2].trimmedMean);
+    EXPECT_EQ(1, statistics[3].count);
+    EXPECT_FLOAT_EQ(7.0f, statistics[3].min);
+
+    std::uniform_int_distribution<int> value(-400, 800);
+    std::uniform_int_distribution<int> percent(0, 99);
+    for (size_t rows = 1; rows <= 60; rows++) {
+        std::vector<int16_t> matrix(rows * STRIDE);
+        for (auto& entry : matrix) entry = percent(random) < 10 ? M : static_cast<int16_t>(value(random));
+        ColumnStatistics vector[COLUMNS];
+        ColumnStatistics scalar[COLUMNS];
+        ColumnReducer::reduce(matrix.data(), rows, COLUMNS, STRIDE, vector);
+        ColumnReducer::reduceScalar(matrix.data(), rows, COLUMNS, STRIDE, scalar);
+        for (size_t column = 0; column < COLUMNS; column++) expectSame(scalar[column], vector[column], column);
+    }
+}
@@ -60,3 +60,15 @@ TEST_F(ConfigTest, deviceFromOSoverruled) {
     EXPECT_EQ("pi", config.getEntry("device")) <<  "device taken from config";
 }
 
+
+TEST_F(ConfigTest, entriesWithPrefix) {
+    Config config;
+    config.begin("device=gateway\nzone.upstairs=bedroom,study\nzone.kitchen=kitchen\nzone.=ignored\nzones=none\n");
+    const auto zones = config.entriesWithPrefix("zone.");
+    ASSERT_EQ(2u, zones.size());
+    EXPECT_EQ("kitchen", zones[0].first) << "sorted by key";
+    EXPECT_EQ("kitchen", zones[0].second);
+    EXPECT_EQ("upstairs", zones[1].first);
+    EXPECT_EQ("bedroom,study", zones[1].second);
+    EXPECT_TRUE(config.entriesWithPrefix("sensor.").empty());
+}
@@ -0,0 +1,143 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <vector>
+#include "EdgeRecorder.h"
+
+class EdgeRecorderTest : public ::testing::Test {
+protected:
+    std::string _path = testing::TempDir() + "edges.bin";
+
+    void TearDown() override {
+        (void)remove(_path.c_str());
+        (void)remove((_path + ".1").c_str());
+    }
+
+    // a frame as the sensor sends it: alternating edges starting with a rise; ones have a long high pulse.
+    // timeoutAt >= 0 sends the watchdog level there.
+    static void sendFrame(EdgeRecorder& recorder, const uint32_t start, const bool ones, const int timeoutAt = -1) {
+        recorder.sensorData()->initRead(start);
+        recorder.beginFrame(start);
+        uint32_t tick = start;
+        int level = 1;
+        for (int i = 0; i < EDGES; i++) {
+            tick += level == 0 && ones ? 70 : 50;
+            recorder.addEdge(i == timeoutAt ? 2 : level, tick);
+            level = 1 - level;
+        }
+    }
+
+    static std::vector<SensorState> replayAll(const std::string& path, long* frames) {
+        std::vector<SensorState> states;
+        SensorData sensorData;
+        *frames = EdgeRecorder::forEachFrame(path, [&](const EdgeFrame& frame) {
+            EdgeRecorder::replay(frame, &sensorData);
+            EXPECT_EQ(frame.state, sensorData.getState()) << "replay decodes as recorded";
+            states.push_back(sensorData.getState());
+        });
+        return states;
+    }
+};
+
+TEST_F(EdgeRecorderTest, recordsAndReplaysFrames) {
+    Config config;
+    config.begin("edgeTrace=all\nedgeTraceFile=" + _path + "\n");
+    SensorData sensorData;
+    long frames;
+    {
+        EdgeRecorder recorder(&config, &sensorData);
+        ASSERT_TRUE(recorder.begin());
+        sendFrame(recorder, 1000, false);
+        EXPECT_EQ(SensorState::Done, sensorData.getState());
+        EXPECT_TRUE(recorder.endFrame());
+        // all ones: checksum 0xFF doesn't match the sum of four 0xFF bytes
+        sendFrame(recorder, 0xFFFFFF00, true);
+        EXPECT_EQ(SensorState::ReadError, sensorData.getState());
+        EXPECT_TRUE(recorder.endFrame());
+        EXPECT_EQ(2u, recorder.framesWritten());
+        // the file is readable while still being recorded
+        EXPECT_EQ(2u, replayAll(_path, &frames).size());
+    }
+    const auto states = replayAll(_path, &frames);
+    ASSERT_EQ(2, frames);
+    EXPECT_EQ(SensorState::Done, states[0]);
+    EXPECT_EQ(SensorState::ReadError, states[1]) << "ticks wrapping around within the frame are kept";
+}
+
+TEST_F(EdgeRecorderTest, failuresOnly) {
+    Config config;
+    config.begin("edgeTrace=failures\nedgeTraceFile=" + _path + "\n");
+    SensorData sensorData;
+    {
+        EdgeRecorder recorder(&config, &sensorData);
+        ASSERT_TRUE(recorder.begin());
+        sendFrame(recorder, 1000, false);
+        EXPECT_FALSE(recorder.endFrame()) << "good frame is skipped";
+        sendFrame(recorder, 20000, false, 30);
+        EXPECT_EQ(SensorState::Timeout, sensorData.getState());
+        EXPECT_TRUE(recorder.endFrame());
+    }
+    long frames;
+    SensorData replayed;
+    int edgeCount = 0;
+    frames = EdgeRecorder::forEachFrame(_path, [&](const EdgeFrame& frame) {
+        edgeCount = frame.edgeCount;
+        EXPECT_EQ(20000u, frame.startTick);
+        EXPECT_EQ(2, frame.level(frame.edgeCount - 1)) << "timeout edge recorded";
+        EdgeRecorder::replay(frame, &replayed);
+    });
+    EXPECT_EQ(1, frames);
+    EXPECT_EQ(31, edgeCount) << "edges after the timeout are not part of the frame";
+    EXPECT_EQ(SensorState::Timeout, replayed.getState());
+}
+
+TEST_F(EdgeRecorderTest, rotatesAtSizeLimit) {
+    Config config;
+    config.begin("edgeTrace=all\nedgeTraceMaxBytes=4096\nedgeTraceFile=" + _path + "\n");
+    SensorData sensorData;
+    {
+        EdgeRecorder recorder(&config, &sensorData);
+        ASSERT_TRUE(recorder.begin());
+        // a frame is 8 + 84 * 4 = 344 bytes, so 11 fit after the 16 byte file header
+        for (uint32_t i = 0; i < 15; i++) {
+            sendFrame(recorder, i * 2000000, false);
+            EXPECT_TRUE(recorder.endFrame());
+        }
+    }
+    long current;
+    long previous;
+    replayAll(_path, &current);
+    replayAll(_path + ".1", &previous);
+    EXPECT_EQ(11, previous);
+    EXPECT_EQ(4, current);
+}
+
+TEST_F(EdgeRecorderTest, offByDefault) {
+    Config config;
+    config.begin("device=test\n");
+    SensorData sensorData;
+    EdgeRecorder recorder(&config, &sensorData);
+    EXPECT_FALSE(recorder.begin());
+    EXPECT_FALSE(recorder.isRecording());
+    sendFrame(recorder, 0, false);
+    EXPECT_TRUE(sensorData.isDone()) << "edges still reach the sensor data";
+    EXPECT_FALSE(recorder.endFrame());
+}
+
+TEST_F(EdgeRecorderTest, rejectsOtherFiles) {
+    FILE* file = fopen(_path.c_str(), "w");
+    ASSERT_NE(nullptr, file);
+    fputs("this is not an edge trace at all", file);
+    fclose(file);
+    EXPECT_EQ(-1, EdgeRecorder::forEachFrame(_path, [](const EdgeFrame&) { FAIL() << "no frames expected"; }));
+}
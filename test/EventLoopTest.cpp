@@ -0,0 +1,97 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <csignal>
+#include <string>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "EventLoop.h"
+
+class EventLoopTest : public ::testing::Test {
+protected:
+    // run until the condition holds, with a safety limit
+    template <typename Condition>
+    static void runUntil(EventLoop& loop, Condition condition) {
+        for (int i = 0; i < 100 && !condition(); i++) {
+            ASSERT_GE(loop.runOnce(100), 0);
+        }
+    }
+};
+
+TEST_F(EventLoopTest, timersFireInOrder) {
+    EventLoop loop;
+    ASSERT_TRUE(loop.begin());
+    std::string fired;
+    const int slow = loop.createTimer([&](uint32_t) { fired += "slow "; });
+    const int fast = loop.createTimer([&](uint32_t) { fired += "fast "; });
+    ASSERT_GE(slow, 0);
+    ASSERT_GE(fast, 0);
+    ASSERT_TRUE(loop.setTimer(slow, 30000));
+    ASSERT_TRUE(loop.setTimer(fast, 0)) << "zero fires right away instead of disarming";
+    runUntil(loop, [&] { return fired.size() >= 10; });
+    EXPECT_EQ("fast slow ", fired);
+}
+
+TEST_F(EventLoopTest, periodicTimerUntilStopped) {
+    EventLoop loop;
+    ASSERT_TRUE(loop.begin());
+    volatile bool keepGoing = true;
+    int count = 0;
+    const int timer = loop.createTimer([&](uint32_t) { if (++count == 3) keepGoing = false; });
+    ASSERT_TRUE(loop.setTimer(timer, 1000, 1000));
+    loop.run(keepGoing);
+    EXPECT_EQ(3, count);
+}
+
+TEST_F(EventLoopTest, watchesDescriptors) {
+    EventLoop loop;
+    ASSERT_TRUE(loop.begin());
+    int pipeEnds[2];
+    ASSERT_EQ(0, pipe(pipeEnds));
+    std::string received;
+    ASSERT_TRUE(loop.watch(pipeEnds[0], EPOLLIN, [&](const uint32_t events) {
+        EXPECT_NE(0u, events & EPOLLIN);
+        char buffer[16];
+        const auto length = read(pipeEnds[0], buffer, sizeof buffer);
+        if (length > 0) received.append(buffer, static_cast<size_t>(length));
+    }));
+    int hookCalls = 0;
+    loop.beforeWait([&] { hookCalls++; });
+    ASSERT_EQ(3, write(pipeEnds[1], "abc", 3));
+    runUntil(loop, [&] { return !received.empty(); });
+    EXPECT_EQ("abc", received);
+    EXPECT_GE(hookCalls, 1);
+
+    EXPECT_TRUE(loop.unwatch(pipeEnds[0]));
+    EXPECT_FALSE(loop.unwatch(pipeEnds[0])) << "not watched anymore";
+    ASSERT_EQ(3, write(pipeEnds[1], "def", 3));
+    EXPECT_EQ(0, loop.runOnce(10));
+    EXPECT_EQ("abc", received);
+    close(pipeEnds[0]);
+    close(pipeEnds[1]);
+}
+
+TEST_F(EventLoopTest, signalsArriveInLoop) {
+    int received = 0;
+    {
+        EventLoop loop;
+        ASSERT_TRUE(loop.begin());
+        ASSERT_TRUE(loop.handleSignals({SIGUSR2}, [&](const int signal) { received = signal; }));
+        // blocked, so it stays pending until the loop reads it
+        ASSERT_EQ(0, raise(SIGUSR2));
+        runUntil(loop, [&] { return received != 0; });
+    }
+    EXPECT_EQ(SIGUSR2, received);
+    sigset_t mask;
+    ASSERT_EQ(0, pthread_sigmask(SIG_BLOCK, nullptr, &mask));
+    EXPECT_FALSE(sigismember(&mask, SIGUSR2)) << "signal mask restored";
+}
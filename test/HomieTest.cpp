@@ -0,0 +1,58 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include "Homie.h"
+
+class HomieTest : public ::testing::Test {};
+
+TEST_F(HomieTest, metadataChangesOnlyMissingOrChanged) {
+    const Homie::MetadataList desired{
+        {"homie/dev/$homie", "4.0.0"},
+        {"homie/dev/$name", "dev"},
+        {"homie/dev/$nodes", "climate"},
+        {"homie/dev/$state", "ready"}};
+    const Homie::RetainedMap retained{
+        {"homie/dev/$homie", "4.0.0"},
+        {"homie/dev/$name", "old"},
+        {"homie/dev/$state", "ready"},
+        {"homie/dev/unrelated", "x"}};
+    const auto changes = Homie::metadataChanges(desired, retained);
+    ASSERT_EQ(2U, changes.size()) << "two changes";
+    EXPECT_EQ("homie/dev/$name", changes[0].first) << "changed topic";
+    EXPECT_EQ("dev", changes[0].second) << "changed value";
+    EXPECT_EQ("homie/dev/$nodes", changes[1].first) << "missing topic";
+}
+
+TEST_F(HomieTest, metadataChangesEmptyValues) {
+    const Homie::MetadataList desired{{"homie/dev/$extensions", ""}};
+    EXPECT_TRUE(Homie::metadataChanges(desired, {}).empty()) << "absent topic matches empty value";
+    EXPECT_EQ(1U, Homie::metadataChanges(desired, {{"homie/dev/$extensions", "legacy"}}).size()) << "non-empty must be cleared";
+}
+
+TEST_F(HomieTest, metadataChangesNothingRetained) {
+    const Homie::MetadataList desired{{"a", "1"}, {"b", "2"}};
+    EXPECT_EQ(desired, Homie::metadataChanges(desired, {})) << "all published";
+}
+
+TEST_F(HomieTest, settableValuesValidated) {
+    const Homie::SettableProperty interval{"interval", "integer", "s", "2:3600", nullptr, nullptr};
+    EXPECT_TRUE(Homie::isValid(interval, "2")) << "lower bound";
+    EXPECT_TRUE(Homie::isValid(interval, "3600")) << "upper bound";
+    EXPECT_FALSE(Homie::isValid(interval, "1")) << "too low";
+    EXPECT_FALSE(Homie::isValid(interval, "3601")) << "too high";
+    EXPECT_FALSE(Homie::isValid(interval, "10s")) << "trailing garbage";
+    EXPECT_FALSE(Homie::isValid(interval, "")) << "empty";
+    const Homie::SettableProperty trace{"trace", "boolean", "", "", nullptr, nullptr};
+    EXPECT_TRUE(Homie::isValid(trace, "true")) << "true";
+    EXPECT_TRUE(Homie::isValid(trace, "false")) << "false";
+    EXPECT_FALSE(Homie::isValid(trace, "1")) << "not a Homie boolean";
+}
@@ -0,0 +1,86 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include "InflightWindow.h"
+
+using queuing::InflightWindow;
+
+class InflightWindowTest : public ::testing::Test {
+protected:
+    const InflightWindow::Clock::time_point start = InflightWindow::Clock::now();
+    int nextId = 0;
+    int sends = 0;
+
+    // the way mosquitto hands out message ids
+    InflightWindow::Sender sender() {
+        return [this](int* messageId) {
+            sends++;
+            *messageId = ++nextId;
+            return true;
+        };
+    }
+
+    InflightWindow::Clock::time_point at(const int millis) const { return start + std::chrono::milliseconds(millis); }
+};
+
+TEST_F(InflightWindowTest, windowLimit) {
+    InflightWindow window;
+    window.configure(2, 10);
+    EXPECT_TRUE(window.add("a", sender(), at(0)));
+    EXPECT_TRUE(window.add("b", sender(), at(0)));
+    EXPECT_FALSE(window.add("c", sender(), at(0))) << "window full";
+    EXPECT_EQ(2, sends) << "nothing sent when full";
+    window.acknowledge(1, true, at(5));
+    EXPECT_FALSE(window.add("c", [](int*) { return false; }, at(5))) << "send failed";
+    EXPECT_TRUE(window.add("c", sender(), at(5))) << "room again";
+    const auto statistics = window.statistics();
+    EXPECT_EQ(3u, statistics.published);
+    EXPECT_EQ(1u, statistics.rejected);
+    EXPECT_EQ(2u, statistics.inflight);
+}
+
+TEST_F(InflightWindowTest, ackLatency) {
+    InflightWindow window;
+    window.countPublished();
+    ASSERT_TRUE(window.add("a", sender(), at(0)));
+    ASSERT_TRUE(window.add("b", sender(), at(10)));
+    EXPECT_EQ(-1, window.acknowledge(42, true, at(20))) << "unknown id";
+    EXPECT_EQ(20000, window.acknowledge(2, true, at(30)));
+    EXPECT_EQ(50000, window.acknowledge(1, true, at(50)));
+    EXPECT_EQ(-1, window.acknowledge(1, true, at(60))) << "only once";
+    EXPECT_TRUE(window.isEmpty());
+    const auto statistics = window.statistics();
+    EXPECT_EQ(3u, statistics.published) << "QoS 0 counts as published";
+    EXPECT_EQ(2u, statistics.acknowledged);
+    EXPECT_EQ(50000, statistics.lastLatencyMicros);
+    EXPECT_EQ(50000, statistics.maxLatencyMicros);
+    EXPECT_EQ(70000, statistics.totalLatencyMicros);
+}
+
+TEST_F(InflightWindowTest, undeliveredWithoutRepublishing) {
+    InflightWindow window;
+    window.configure(20, 1);
+    ASSERT_TRUE(window.add("a", sender(), at(0)));
+    ASSERT_TRUE(window.add("b", sender(), at(500)));
+    ASSERT_TRUE(window.add("c", sender(), at(600)));
+    EXPECT_EQ(0u, window.expire(at(1000))) << "not late yet";
+    EXPECT_EQ(1u, window.expire(at(1001)));
+    EXPECT_EQ(-1, window.acknowledge(1, true, at(1100))) << "a late acknowledgement doesn't count";
+    EXPECT_EQ(-1, window.acknowledge(3, false, at(1100))) << "refused";
+    EXPECT_EQ(1u, window.expire(at(2000)));
+    EXPECT_EQ(3, sends) << "expired messages are not sent again";
+    const auto statistics = window.statistics();
+    EXPECT_EQ(3u, statistics.published);
+    EXPECT_EQ(0u, statistics.acknowledged);
+    EXPECT_EQ(3u, statistics.undelivered);
+    EXPECT_EQ(0u, statistics.inflight);
+}
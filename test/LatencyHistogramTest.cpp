@@ -0,0 +1,39 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include "LatencyHistogram.h"
+
+class LatencyHistogramTest : public ::testing::Test {};
+
+TEST_F(LatencyHistogramTest, bucketsCoverValues) {
+    for (const int64_t value : std::initializer_list<int64_t>{0, 1, 15, 16, 17, 31, 32, 1000, 123456789, INT64_MAX}) {
+        const int bucket = LatencyHistogram::bucketFor(value);
+        EXPECT_GE(LatencyHistogram::bucketUpperBound(bucket), value) << "upper bound of " << value;
+        if (bucket > 0) {
+            EXPECT_LT(LatencyHistogram::bucketUpperBound(bucket - 1), value) << "previous bucket of " << value;
+        }
+    }
+}
+
+TEST_F(LatencyHistogramTest, percentiles) {
+    LatencyHistogram histogram;
+    EXPECT_EQ(0, histogram.percentile(50)) << "empty";
+    for (int64_t value = 1; value <= 1000; value++) histogram.record(value);
+    EXPECT_EQ(1000U, histogram.count()) << "count";
+    EXPECT_EQ(1000, histogram.max()) << "max";
+    EXPECT_DOUBLE_EQ(500.5, histogram.mean()) << "mean";
+    EXPECT_NEAR(500, histogram.percentile(50), 500 / 16) << "median";
+    EXPECT_NEAR(990, histogram.percentile(99), 990 / 16) << "p99";
+    EXPECT_EQ(1000, histogram.percentile(100)) << "p100 is the max";
+    histogram.reset();
+    EXPECT_EQ(0U, histogram.count()) << "reset";
+}
@@ -0,0 +1,62 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <vector>
+#include "ClimateMeasurement.h"
+#include "LatencyRecorder.h"
+
+class LatencyRecorderTest : public ::testing::Test {
+protected:
+    class RecordingSender final : public ISender {
+    public:
+        bool sendHumidity(float) override { return true; }
+        bool sendTemperature(float) override { return true; }
+        bool sendMeasurement(const Measurement& measurement) override {
+            measurements.push_back(measurement);
+            return true;
+        }
+        std::vector<Measurement> measurements;
+    };
+};
+
+TEST_F(LatencyRecorderTest, sampleTimeCarriedToMeasurement) {
+    LatencyRecorder::reset();
+    RecordingSender sender;
+    ClimateMeasurement climateMeasurement(&sender);
+    climateMeasurement.begin();
+    const auto now = LatencyRecorder::nowMicros();
+    for (int i = 0; i < 5; i++) {
+        Sample sample;
+        sample.temperature = 20.0f;
+        sample.humidity = 50.0f;
+        sample.monotonicMicros = now - 10000 + i;
+        sample.wallMillis = 1700000000000 + i;
+        sample.decodedMicros = now - 5000;
+        climateMeasurement.processSample(sample);
+    }
+    ASSERT_EQ(1U, sender.measurements.size()) << "one measurement";
+    const auto& measurement = sender.measurements[0];
+    EXPECT_EQ(1700000000004, measurement.sampledMillis) << "wall time of the newest sample";
+    EXPECT_EQ(now - 10000 + 4, measurement.sampledMicros) << "monotonic time of the newest sample";
+    EXPECT_GE(measurement.aggregatedMicros, now) << "aggregated after the samples";
+    const auto& aggregate = LatencyRecorder::histogram(LatencyStage::Aggregate);
+    EXPECT_EQ(1U, aggregate.count()) << "aggregate latency recorded";
+    EXPECT_GE(aggregate.max(), 5000) << "from decoding to aggregation";
+}
+
+TEST_F(LatencyRecorderTest, negativeClampedAndNamed) {
+    LatencyRecorder::reset();
+    LatencyRecorder::record(LatencyStage::Publish, -5);
+    EXPECT_EQ(1U, LatencyRecorder::histogram(LatencyStage::Publish).count()) << "recorded";
+    EXPECT_EQ(0, LatencyRecorder::histogram(LatencyStage::Publish).max()) << "clamped";
+    EXPECT_STREQ("end-to-end", LatencyRecorder::name(LatencyStage::EndToEnd)) << "name";
+}
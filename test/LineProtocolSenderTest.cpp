@@ -0,0 +1,212 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "LineProtocolSender.h"
+#include "PayloadEncoder.h"
+
+class LineProtocolSenderTest : public ::testing::Test {
+protected:
+    // stands in for the database: answers each POST with the current status, and keeps the bodies
+    class HttpListener {
+    public:
+        HttpListener() {
+            _socket = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            bind(_socket, reinterpret_cast<sockaddr*>(&address), sizeof address);
+            socklen_t length = sizeof address;
+            getsockname(_socket, reinterpret_cast<sockaddr*>(&address), &length);
+            port = ntohs(address.sin_port);
+            listen(_socket, 4);
+            _thread = std::thread([this] { run(); });
+        }
+        ~HttpListener() {
+            shutdown(_socket, SHUT_RDWR);
+            close(_socket);
+            _thread.join();
+        }
+        HttpListener(const HttpListener&) = delete;
+        HttpListener(HttpListener&&) = delete;
+        HttpListener& operator=(const HttpListener&) = delete;
+        HttpListener& operator=(HttpListener&&) = delete;
+
+        int port = 0;
+        std::atomic<int> status{204};
+
+        std::vector<std::string> bodies() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _bodies;
+        }
+
+        std::vector<std::string> requests() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _requests;
+        }
+
+        // the requests are recorded on the listener thread
+        bool waitForRequests(const size_t count) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return _received.wait_for(lock, std::chrono::seconds(5), [this, count] { return _requests.size() >= count; });
+        }
+
+    private:
+        int _socket;
+        std::thread _thread;
+        mutable std::mutex _mutex;
+        std::condition_variable _received;
+        std::vector<std::string> _requests;
+        std::vector<std::string> _bodies;
+
+        void run() {
+            for (;;) {
+                const int connection = accept(_socket, nullptr, nullptr);
+                if (connection < 0) return;
+                std::string request;
+                char buffer[1024];
+                size_t headerEnd = std::string::npos;
+                size_t contentLength = 0;
+                while (headerEnd == std::string::npos || request.size() < headerEnd + 4 + contentLength) {
+                    const auto received = recv(connection, buffer, sizeof buffer, 0);
+                    if (received <= 0) break;
+                    request.append(buffer, static_cast<size_t>(received));
+                    if (headerEnd == std::string::npos && (headerEnd = request.find("\r\n\r\n")) != std::string::npos) {
+                        const auto position = request.find("Content-Length: ");
+                        if (position != std::string::npos) contentLength = std::stoul(request.substr(position + 16));
+                    }
+                }
+                {
+                    // record before responding, so the sender can't be done before we are
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _requests.push_back(request.substr(0, headerEnd));
+                    _bodies.push_back(headerEnd == std::string::npos ? "" : request.substr(headerEnd + 4));
+                }
+                _received.notify_all();
+                const std::string response = "HTTP/1.1 " + std::to_string(status) + " Whatever\r\nContent-Length: 0\r\n\r\n";
+                send(connection, response.c_str(), response.size(), MSG_NOSIGNAL);
+                close(connection);
+            }
+        }
+    };
+
+    static Measurement measurement(const float temperature, const int64_t timestamp) {
+        Measurement result;
+        result.temperature = temperature;
+        result.humidity = 50.0f;
+        result.sampleCount = 5;
+        result.timestamp = timestamp;
+        return result;
+    }
+};
+
+TEST_F(LineProtocolSenderTest, rendersLines) {
+    std::string line;
+    auto value = measurement(21.25f, 1700000000123);
+    value.humidity = NAN;
+    value.nanCount = 1;
+    PayloadEncoder::appendLineProtocol(value, "climate,device=" + PayloadEncoder::escapeTag("living room"), line);
+    EXPECT_EQ("climate,device=living\\ room temperature=21.2,samples=5i,nans=1i 1700000000123000000\n", line);
+}
+
+TEST_F(LineProtocolSenderTest, udpBatchesByLines) {
+    const int listener = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(0, bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof address));
+    socklen_t length = sizeof address;
+    getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length);
+
+    Config config;
+    config.begin("device=kitchen\nlineProtocol=udp://127.0.0.1:" + std::to_string(ntohs(address.sin_port)) +
+                 "\nlineProtocolBatchLines=2\n");
+    LineProtocolSender sender(&config);
+    ASSERT_TRUE(sender.begin());
+    EXPECT_TRUE(sender.sendMeasurement(measurement(20.0f, 1000)));
+    EXPECT_EQ(1u, sender.pendingLines()) << "batched";
+    EXPECT_TRUE(sender.sendMeasurement(measurement(20.5f, 2000)));
+    EXPECT_EQ(0u, sender.pendingLines()) << "sent";
+
+    char datagram[2048];
+    const auto received = recv(listener, datagram, sizeof datagram, 0);
+    ASSERT_GT(received, 0);
+    EXPECT_EQ("climate,device=kitchen temperature=20.0,humidity=50.0,samples=5i,nans=0i 1000000000\n"
+              "climate,device=kitchen temperature=20.5,humidity=50.0,samples=5i,nans=0i 2000000000\n",
+              std::string(datagram, static_cast<size_t>(received)));
+    EXPECT_EQ(1u, sender.statistics().batches);
+    EXPECT_EQ(2u, sender.statistics().lines);
+    close(listener);
+}
+
+TEST_F(LineProtocolSenderTest, httpSpillsAndCatchesUp) {
+    const std::string spillPath = testing::TempDir() + "lineprotocol.spill";
+    (void)remove(spillPath.c_str());
+    HttpListener listener;
+    listener.status = 500;
+    Config config;
+    config.begin("device=kitchen\nlineProtocol=http://127.0.0.1:" + std::to_string(listener.port) +
+                 "/write?db=climate\nlineProtocolBatchLines=1\nlineProtocolRetries=0\nlineProtocolToken=secret\n"
+                 "lineProtocolSpill=" + spillPath + "\n");
+    {
+        LineProtocolSender sender(&config);
+        ASSERT_TRUE(sender.begin());
+        EXPECT_TRUE(sender.sendMeasurement(measurement(20.0f, 1000))) << "spilled counts as accepted";
+        EXPECT_TRUE(sender.sendMeasurement(measurement(21.0f, 2000)));
+        EXPECT_EQ(2u, sender.statistics().spilled);
+        EXPECT_EQ(2u, sender.statistics().failures);
+        EXPECT_EQ(0u, sender.statistics().batches);
+    }
+    listener.status = 204;
+    {
+        // a new run picks up the spill file after its first successful batch
+        LineProtocolSender sender(&config);
+        ASSERT_TRUE(sender.begin());
+        EXPECT_TRUE(sender.sendMeasurement(measurement(22.0f, 3000)));
+        EXPECT_EQ(2u, sender.statistics().batches) << "new batch plus the spill file";
+        EXPECT_EQ(3u, sender.statistics().lines);
+    }
+    ASSERT_TRUE(listener.waitForRequests(4));
+    const auto requests = listener.requests();
+    const auto bodies = listener.bodies();
+    ASSERT_EQ(4u, bodies.size());
+    EXPECT_NE(std::string::npos, requests[0].find("POST /write?db=climate HTTP/1.1"));
+    EXPECT_NE(std::string::npos, requests[0].find("Authorization: Token secret"));
+    EXPECT_NE(std::string::npos, bodies[2].find("temperature=22.0")) << "new measurement first";
+    EXPECT_NE(std::string::npos, bodies[3].find("temperature=20.0")) << "then the spilled ones";
+    EXPECT_NE(std::string::npos, bodies[3].find("temperature=21.0"));
+    FILE* file = fopen(spillPath.c_str(), "rb");
+    EXPECT_EQ(nullptr, file) << "spill file removed";
+    if (file != nullptr) fclose(file);
+}
+
+TEST_F(LineProtocolSenderTest, notConfigured) {
+    Config config;
+    config.begin("device=kitchen\n");
+    LineProtocolSender sender(&config);
+    EXPECT_FALSE(sender.begin());
+    Config wrong;
+    wrong.begin("lineProtocol=tcp://somewhere\n");
+    LineProtocolSender wrongSender(&wrong);
+    EXPECT_FALSE(wrongSender.begin());
+}
@@ -59,4 +59,52 @@ TEST_F(MqttTest, WithAuth) {
     EXPECT_TRUE(mqtt.verifyConnection()) << "Connection verified";
     keepGoing = true;
     EXPECT_TRUE(mqtt.waitForConnection()) << "Wait for connection OK";
-}
\ No newline at end of file
+}
+
+TEST_F(MqttTest, UnknownAcknowledgementIgnored) {
+    Config config;
+    const auto configData = "device=pi230265\nbroker=nonexisting.org\nqosMeasurement=1\nqosState=5\n";
+    config.begin(configData);
+    queuing::Mqtt mqtt(&config, &keepGoing);
+    // QoS 0 messages and unknown ids come in through onPublish too
+    queuing::onPublish(nullptr, &mqtt, 42);
+    const auto statistics = mqtt.publishStatistics();
+    EXPECT_EQ(0u, statistics.acknowledged) << "Nothing acknowledged";
+    EXPECT_EQ(0u, statistics.inflight) << "Nothing in flight";
+    EXPECT_EQ(0, statistics.maxLatencyMicros) << "No latency recorded";
+}
+
+TEST_F(MqttTest, ProtocolV5ReasonCodes) {
+    Config config;
+    const auto configData = "device=pi230265\nbroker=nonexisting.org\nprotocolVersion=5\n";
+    config.begin(configData);
+    queuing::Mqtt mqtt(&config, &keepGoing);
+    // 0x87 = not authorized
+    queuing::onConnectV5(nullptr, &mqtt, 0x87, 0, nullptr);
+    EXPECT_EQ(0x87, mqtt.errorCode()) << "Reason code taken over";
+    EXPECT_FALSE(mqtt.isConnected()) << "Not connected";
+    queuing::onConnectV5(nullptr, &mqtt, 0, 0, nullptr);
+    EXPECT_TRUE(mqtt.isConnected()) << "Connected";
+    queuing::onPublishV5(nullptr, &mqtt, 42, 0x10, nullptr);
+    EXPECT_EQ(0u, mqtt.publishStatistics().undelivered) << "Unknown message ignored";
+    queuing::onDisconnectV5(nullptr, &mqtt, 0x8B, nullptr);
+    EXPECT_EQ(0x8B, mqtt.errorCode()) << "Server shutting down";
+    EXPECT_FALSE(mqtt.isConnected()) << "Disconnected";
+}
+
+TEST_F(MqttTest, ReconnectTimed) {
+    Config config;
+    // nothing listens on port 1, so connecting fails quickly
+    const auto configData = "device=pi230265\nbroker=127.0.0.1\nport=1\nfastReconnect=1\nidTemplate=%s-climate\n";
+    config.begin(configData);
+    queuing::Mqtt mqtt(&config, &keepGoing);
+    EXPECT_FALSE(mqtt.begin()) << "Connect not OK";
+    keepGoing = false;
+    EXPECT_FALSE(mqtt.verifyConnection()) << "Reconnect not OK";
+    queuing::onConnect(nullptr, &mqtt, 0);
+    keepGoing = true;
+    const auto statistics = mqtt.connectionStatistics();
+    EXPECT_EQ(1u, statistics.reconnects) << "Reconnect counted";
+    EXPECT_GE(statistics.lastReconnectMicros, 0) << "Reconnect time measured";
+    EXPECT_EQ(statistics.lastReconnectMicros, statistics.maxReconnectMicros) << "Max reconnect time";
+}
@@ -0,0 +1,69 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <cmath>
+#include "PayloadEncoder.h"
+
+class PayloadEncoderTest : public ::testing::Test {};
+
+TEST_F(PayloadEncoderTest, parseFormat) {
+    EXPECT_EQ(PayloadFormat::Json, PayloadEncoder::parseFormat("json")) << "json";
+    EXPECT_EQ(PayloadFormat::Cbor, PayloadEncoder::parseFormat("cbor")) << "cbor";
+    EXPECT_EQ(PayloadFormat::Homie, PayloadEncoder::parseFormat("")) << "default";
+    EXPECT_EQ(PayloadFormat::Homie, PayloadEncoder::parseFormat("xml")) << "unknown";
+}
+
+TEST_F(PayloadEncoderTest, json) {
+    const Measurement measurement{21.3f, 45.6f, 5, 1, 1700000000123};
+    std::string payload;
+    EXPECT_TRUE(PayloadEncoder::encode(PayloadFormat::Json, measurement, payload)) << "encoded";
+    EXPECT_EQ(R"({"temperature":21.3,"humidity":45.6,"samples":5,"nans":1,"timestamp":1700000000123})", payload);
+}
+
+TEST_F(PayloadEncoderTest, jsonNan) {
+    const Measurement measurement{NAN, NAN, 5, 5, 0};
+    std::string payload;
+    PayloadEncoder::toJson(measurement, payload);
+    EXPECT_EQ(R"({"temperature":null,"humidity":null,"samples":5,"nans":5,"timestamp":0})", payload);
+}
+
+TEST_F(PayloadEncoderTest, cbor) {
+    const Measurement measurement{-10.5f, 100.0f, 5, 0, 1700000000123};
+    std::string payload;
+    EXPECT_TRUE(PayloadEncoder::encode(PayloadFormat::Cbor, measurement, payload)) << "encoded";
+    constexpr char expected[] =
+        "\xA5"
+        "\x6Btemperature" "\xFA\xC1\x28\x00\x00"
+        "\x68humidity" "\xFA\x42\xC8\x00\x00"
+        "\x67samples" "\x05"
+        "\x64nans" "\x00"
+        "\x69timestamp" "\x1B\x00\x00\x01\x8B\xCF\xE5\x68\x7B";
+    EXPECT_EQ(std::string(expected, sizeof(expected) - 1), payload);
+}
+
+TEST_F(PayloadEncoderTest, homieHasNoPayload) {
+    std::string payload = "stale";
+    EXPECT_FALSE(PayloadEncoder::encode(PayloadFormat::Homie, Measurement{}, payload)) << "nothing to encode";
+    EXPECT_TRUE(payload.empty()) << "payload cleared";
+}
+
+TEST_F(PayloadEncoderTest, sampleTime) {
+    Measurement measurement{21.3f, 45.6f, 5, 0, 1700000000123};
+    measurement.sampledMillis = 1700000000001;
+    std::string payload;
+    EXPECT_TRUE(PayloadEncoder::encode(PayloadFormat::Json, measurement, payload, true)) << "json";
+    EXPECT_EQ(R"({"temperature":21.3,"humidity":45.6,"samples":5,"nans":0,"timestamp":1700000000123,"sampled":1700000000001})", payload);
+    EXPECT_TRUE(PayloadEncoder::encode(PayloadFormat::Cbor, measurement, payload, true)) << "cbor";
+    EXPECT_EQ(static_cast<char>(0xA6), payload[0]) << "map of 6";
+    constexpr char sampledKey[] = "\x67sampled\x1B";
+    EXPECT_NE(std::string::npos, payload.find(std::string(sampledKey, sizeof(sampledKey) - 1))) << "sampled as a 64-bit unsigned";
+}
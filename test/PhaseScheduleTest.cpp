@@ -0,0 +1,135 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include "ClimateMeasurement.h"
+#include "PhaseSchedule.h"
+
+class PhaseScheduleTest : public ::testing::Test {
+protected:
+    static constexpr uint64_t INTERVAL = 2000000;
+    static constexpr uint64_t WINDOW = 10000000;
+
+    class RecordingSender final : public ISender {
+    public:
+        bool sendHumidity(float) override { return true; }
+        bool sendTemperature(float) override { return true; }
+        bool sendMeasurement(const Measurement& measurement) override {
+            measurements.push_back(measurement);
+            return true;
+        }
+        std::vector<Measurement> measurements;
+    };
+};
+
+TEST_F(PhaseScheduleTest, devicesSpreadEvenly) {
+    constexpr int DEVICES = 1000;
+    constexpr int BUCKETS = 10;
+    int buckets[BUCKETS] = {};
+    for (int i = 0; i < DEVICES; i++) {
+        Config config;
+        config.begin("phaseSpread=1\ndevice=dht" + std::to_string(i) + "\n");
+        PhaseSchedule schedule(&config);
+        schedule.begin();
+        const auto offset = schedule.offsetMicros(WINDOW);
+        ASSERT_GE(offset, 0);
+        ASSERT_LT(offset, static_cast<int64_t>(WINDOW));
+        buckets[offset * BUCKETS / static_cast<int64_t>(WINDOW)]++;
+        EXPECT_EQ(offset % static_cast<int64_t>(INTERVAL), schedule.offsetMicros(INTERVAL)) << "reads line up with windows";
+    }
+    for (const int count : buckets) {
+        EXPECT_GT(count, 60) << "no gaps";
+        EXPECT_LT(count, 140) << "no clusters";
+    }
+    EXPECT_EQ(PhaseSchedule::hash("dht1"), PhaseSchedule::hash("dht1")) << "deterministic";
+}
+
+TEST_F(PhaseScheduleTest, slotsFollowOffset) {
+    Config config;
+    config.begin("phaseSpread=1\ndevice=kitchen\n");
+    PhaseSchedule schedule(&config);
+    schedule.begin();
+    EXPECT_TRUE(schedule.isEnabled());
+    EXPECT_FALSE(schedule.hasWindows());
+    const int64_t slot = 1700000000000000 + schedule.offsetMicros(INTERVAL);
+    EXPECT_EQ(0, schedule.untilNextSlotMicros(slot, INTERVAL)) << "on a slot";
+    EXPECT_EQ(static_cast<int64_t>(INTERVAL) - 1, schedule.untilNextSlotMicros(slot + 1, INTERVAL)) << "just past";
+    EXPECT_EQ(-1, schedule.nearestSlotMicros(slot + 1, INTERVAL)) << "back to the previous one";
+    EXPECT_EQ(100, schedule.nearestSlotMicros(slot - 100, INTERVAL)) << "on to the next one";
+}
+
+TEST_F(PhaseScheduleTest, reportOnce) {
+    Config config;
+    config.begin("phaseSpread=1\ndevice=kitchen\n");
+    PhaseSchedule schedule(&config);
+    schedule.begin();
+    testing::internal::CaptureStdout();
+    schedule.report(INTERVAL);
+    // a sensor reset runs begin() again
+    schedule.begin();
+    schedule.report(INTERVAL);
+    const auto output = testing::internal::GetCapturedStdout();
+    EXPECT_EQ("Phase spread: read offset " + std::to_string(schedule.offsetMicros(INTERVAL)) + " us in each " +
+              std::to_string(INTERVAL / 1000000) + " s\n", output);
+}
+
+TEST_F(PhaseScheduleTest, disabledAlignsToClock) {
+    Config config;
+    config.begin("device=kitchen\nwindowSeconds=10\n");
+    PhaseSchedule schedule(&config);
+    schedule.begin();
+    EXPECT_FALSE(schedule.isEnabled());
+    EXPECT_TRUE(schedule.hasWindows());
+    EXPECT_EQ(0, schedule.offsetMicros(WINDOW));
+    EXPECT_EQ(1, schedule.windowIndex(static_cast<int64_t>(WINDOW)));
+    EXPECT_EQ(0, schedule.windowIndex(static_cast<int64_t>(WINDOW) - 1));
+    EXPECT_EQ(-1, schedule.windowIndex(-1)) << "floor before the epoch";
+}
+
+TEST_F(PhaseScheduleTest, measurementsCoverAlignedWindows) {
+    Config config;
+    config.begin("phaseSpread=1\ndevice=kitchen\nwindowSeconds=10\n");
+    PhaseSchedule schedule(&config);
+    schedule.begin();
+    RecordingSender sender;
+    ClimateMeasurement climateMeasurement(&sender);
+    climateMeasurement.begin();
+    ASSERT_TRUE(climateMeasurement.alignWindows(&schedule, 2));
+    // start 6 s into a window: the first two samples are too few, so they join the next window
+    const int64_t windowStart = 170000000 * static_cast<int64_t>(WINDOW) + schedule.offsetMicros(WINDOW);
+    for (int i = 0; i < 12; i++) {
+        Sample sample;
+        sample.temperature = 20.0f;
+        sample.humidity = 50.0f;
+        sample.wallMillis = (windowStart + 6000000 + i * static_cast<int64_t>(INTERVAL)) / 1000 + 3;
+        climateMeasurement.processSample(sample, 2.0f);
+    }
+    ASSERT_EQ(2U, sender.measurements.size());
+    EXPECT_EQ(7, sender.measurements[0].sampleCount) << "partial window merged";
+    EXPECT_EQ(5, sender.measurements[1].sampleCount) << "full window";
+    EXPECT_EQ(schedule.windowIndex(windowStart) + 2, schedule.windowIndex(sender.measurements[1].sampledMillis * 1000))
+        << "second measurement ends in the third window";
+}
+
+TEST_F(PhaseScheduleTest, windowMustFitTheSampleBuffer) {
+    Config config;
+    config.begin("device=kitchen\nwindowSeconds=300\n");
+    PhaseSchedule schedule(&config);
+    schedule.begin();
+    RecordingSender sender;
+    ClimateMeasurement climateMeasurement(&sender);
+    EXPECT_FALSE(climateMeasurement.alignWindows(&schedule, 2)) << "150 reads";
+    EXPECT_TRUE(climateMeasurement.alignWindows(&schedule, 10)) << "30 reads";
+    EXPECT_FALSE(climateMeasurement.alignWindows(&schedule, 60, 10)) << "5 bursts of 10 reads";
+    EXPECT_TRUE(climateMeasurement.alignWindows(nullptr, 2)) << "no windows";
+}
@@ -0,0 +1,132 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "QuantileSketch.h"
+
+class QuantileSketchTest : public ::testing::Test {
+protected:
+    std::mt19937 random{42};
+
+    // the fraction of the (sorted) values that are below the estimate
+    static double rankOf(const std::vector<float>& sorted, const float value) {
+        return static_cast<double>(std::lower_bound(sorted.begin(), sorted.end(), value) - sorted.begin()) /
+               static_cast<double>(sorted.size());
+    }
+};
+
+TEST_F(QuantileSketchTest, exactWhileSmall) {
+    QuantileSketch sketch;
+    EXPECT_TRUE(std::isnan(sketch.quantile(0.5))) << "empty";
+    for (int i = 100; i >= 1; i--) sketch.add(static_cast<float>(i) / 10.0f);
+    sketch.add(NAN);
+    EXPECT_EQ(100u, sketch.count()) << "NaN ignored";
+    EXPECT_FLOAT_EQ(0.1f, sketch.min());
+    EXPECT_FLOAT_EQ(0.5f, sketch.quantile(0.05));
+    EXPECT_FLOAT_EQ(5.0f, sketch.quantile(0.5));
+    EXPECT_FLOAT_EQ(9.5f, sketch.quantile(0.95));
+    EXPECT_FLOAT_EQ(10.0f, sketch.max());
+
+    const auto text = sketch.serialize();
+    QuantileSketch copy(QuantileSketch::MIN_K);
+    ASSERT_TRUE(QuantileSketch::deserialize(text, &copy));
+    EXPECT_EQ(text, copy.serialize()) << "round trip";
+    EXPECT_EQ(0, text.find("kll1;200;100;0.1;10;10,9.9,9.8,")) << "compact values";
+    EXPECT_EQ("{\"property\":\"humidity\",\"start\":3600000,\"seconds\":3600,\"count\":0,\"sketch\":\"kll1;200;0;;;\"}",
+              QuantileSketch::toJson({"humidity", 3600, 3600000, QuantileSketch()}));
+}
+
+TEST_F(QuantileSketchTest, boundedMemoryAndRankError) {
+    constexpr int COUNT = 100000;
+    QuantileSketch sketch;
+    std::vector<float> values;
+    std::normal_distribution<float> temperature(21.0f, 2.0f);
+    for (int i = 0; i < COUNT; i++) {
+        const float value = std::round(temperature(random) * 10.0f) / 10.0f;
+        values.push_back(value);
+        sketch.add(value);
+    }
+    EXPECT_EQ(static_cast<uint64_t>(COUNT), sketch.count());
+    EXPECT_LE(sketch.retained(), 3u * QuantileSketch::DEFAULT_K) << "fixed memory";
+    std::sort(values.begin(), values.end());
+    for (const double rank : {0.05, 0.5, 0.95}) {
+        const float estimate = sketch.quantile(rank);
+        // with many equal values, the estimate's rank lies anywhere in the range of its duplicates
+        const auto lower = rankOf(values, estimate);
+        const auto upper = static_cast<double>(std::upper_bound(values.begin(), values.end(), estimate) - values.begin()) / COUNT;
+        EXPECT_LE(lower, rank + 0.02) << "p" << rank * 100;
+        EXPECT_GE(upper, rank - 0.02) << "p" << rank * 100;
+    }
+
+    QuantileSketch copy;
+    ASSERT_TRUE(QuantileSketch::deserialize(sketch.serialize(), &copy));
+    EXPECT_EQ(sketch.quantile(0.5), copy.quantile(0.5));
+}
+
+TEST_F(QuantileSketchTest, weightedValues) {
+    // 20 for 1 second, 25 for 5 seconds, 30 for 58 seconds: a weight is the same as repeating the value
+    QuantileSketch weighted(QuantileSketch::MIN_K);
+    QuantileSketch repeated(QuantileSketch::MIN_K);
+    const std::pair<float, uint64_t> samples[] = {{20.0f, 1}, {25.0f, 5}, {30.0f, 58}};
+    for (const auto& [value, weight] : samples) {
+        weighted.add(value, weight);
+        for (uint64_t i = 0; i < weight; i++) repeated.add(value);
+    }
+    weighted.add(35.0f, 0);
+    EXPECT_EQ(64u, weighted.count()) << "the total weight; weight 0 ignored";
+    EXPECT_FLOAT_EQ(20.0f, weighted.quantile(0.01));
+    EXPECT_FLOAT_EQ(25.0f, weighted.quantile(0.05));
+    EXPECT_FLOAT_EQ(30.0f, weighted.quantile(0.5));
+    EXPECT_FLOAT_EQ(repeated.quantile(0.5), weighted.quantile(0.5));
+    EXPECT_FLOAT_EQ(30.0f, weighted.max());
+    EXPECT_LE(weighted.retained(), repeated.retained()) << "no more room than the repeated values";
+
+    QuantileSketch copy;
+    ASSERT_TRUE(QuantileSketch::deserialize(weighted.serialize(), &copy)) << "the levels account for the weight";
+    EXPECT_EQ(64u, copy.count());
+}
+
+TEST_F(QuantileSketchTest, mergeAcrossDevices) {
+    // two devices, one cold and one warm: the fleet median is in between
+    QuantileSketch cold;
+    QuantileSketch warm;
+    std::vector<float> values;
+    std::uniform_real_distribution<float> spread(0.0f, 4.0f);
+    for (int i = 0; i < 20000; i++) {
+        const float coldValue = 16.0f + spread(random);
+        const float warmValue = 22.0f + spread(random);
+        cold.add(coldValue);
+        warm.add(warmValue);
+        values.push_back(coldValue);
+        values.push_back(warmValue);
+    }
+    QuantileSketch fleet;
+    ASSERT_TRUE(QuantileSketch::deserialize(cold.serialize(), &fleet));
+    ASSERT_TRUE(fleet.merge(warm));
+    EXPECT_EQ(40000u, fleet.count());
+    EXPECT_FLOAT_EQ(cold.min(), fleet.min());
+    EXPECT_FLOAT_EQ(warm.max(), fleet.max());
+    EXPECT_LE(fleet.retained(), 3u * QuantileSketch::DEFAULT_K);
+    std::sort(values.begin(), values.end());
+    for (const double rank : {0.05, 0.25, 0.5, 0.75, 0.95}) {
+        EXPECT_NEAR(rank, rankOf(values, fleet.quantile(rank)), 0.02) << "p" << rank * 100;
+    }
+
+    QuantileSketch other(100);
+    EXPECT_FALSE(fleet.merge(other)) << "different k";
+    EXPECT_FALSE(QuantileSketch::deserialize("kll1;200;3;1;2;1,2", &other)) << "weights don't add up";
+    EXPECT_FALSE(QuantileSketch::deserialize("kll1;200;2;1;2;1,x", &other)) << "not a number";
+    EXPECT_FALSE(QuantileSketch::deserialize("t-digest;200;0;;;", &other)) << "other format";
+}
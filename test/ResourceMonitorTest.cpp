@@ -0,0 +1,95 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "ResourceMonitor.h"
+
+class ResourceMonitorTest : public ::testing::Test {
+protected:
+    static const ThreadUsage* find(const ResourceUsage& usage, const std::string& name) {
+        for (const auto& thread : usage.threads) {
+            if (thread.name == name) return &thread;
+        }
+        return nullptr;
+    }
+};
+
+TEST_F(ResourceMonitorTest, attributesCpuAndWakeupsToNamedThreads) {
+    Config config;
+    config.begin("device=kitchen\n");
+    ResourceMonitor monitor(&config);
+    std::atomic<bool> stop{false};
+    std::atomic<bool> named{false};
+    std::thread worker([&] {
+        ResourceMonitor::nameThread("busy-worker-with-a-long-name");
+        named = true;
+        // alternate spinning and sleeping, for both CPU time and wakeups
+        while (!stop) {
+            const auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(2);
+            while (std::chrono::steady_clock::now() < until) {}
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    while (!named) std::this_thread::yield();
+    const auto first = monitor.sample();
+    EXPECT_EQ(0, first.intervalMicros);
+    EXPECT_GT(first.rssKb, 0);
+    ASSERT_NE(nullptr, find(first, "main"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    const auto second = monitor.sample();
+    stop = true;
+    worker.join();
+
+    EXPECT_GT(second.intervalMicros, 150000);
+    const auto* busy = find(second, "busy-worker-wit");
+    ASSERT_NE(nullptr, busy) << "the OS keeps 15 characters";
+    EXPECT_EQ(1, busy->threads);
+    EXPECT_GT(second.cpuPercent(*busy), 20.0);
+    EXPECT_LE(busy->intervalCpuMicros, busy->cpuMicros);
+    EXPECT_GT(second.wakeupsPerMinute(*busy), 60.0 * 20);
+    const auto* main = find(second, "main");
+    ASSERT_NE(nullptr, main);
+    EXPECT_LT(second.cpuPercent(*main), second.cpuPercent(*busy)) << "main was sleeping";
+    EXPECT_GE(second.processCpuMicros, busy->cpuMicros);
+}
+
+TEST_F(ResourceMonitorTest, requestPublishesJson) {
+    Config config;
+    config.begin("device=kitchen\nresourceSeconds=3600\n");
+    ResourceMonitor monitor(&config);
+    std::mutex mutex;
+    std::condition_variable published;
+    std::string json;
+    monitor.setPublisher([&](const std::string& report) {
+        std::lock_guard<std::mutex> lock(mutex);
+        json = report;
+        published.notify_all();
+    });
+    ASSERT_TRUE(monitor.begin());
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    monitor.request();
+    std::unique_lock<std::mutex> lock(mutex);
+    ASSERT_TRUE(published.wait_for(lock, std::chrono::seconds(5), [&] { return !json.empty(); }));
+    lock.unlock();
+    monitor.end();
+    EXPECT_EQ(0u, json.find("{\"intervalSeconds\":")) << json;
+    EXPECT_NE(std::string::npos, json.find("\"rssKb\":")) << json;
+    EXPECT_NE(std::string::npos, json.find("\"threads\":{")) << json;
+    EXPECT_NE(std::string::npos, json.find("\"resources\":{\"threads\":1,\"cpuPercent\":")) << "the monitor names its thread: " << json;
+    EXPECT_NE(std::string::npos, json.find("\"main\":{")) << json;
+    EXPECT_EQ("}}", json.substr(json.size() - 2));
+}
@@ -0,0 +1,220 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <future>
+#include <mutex>
+#include <vector>
+
+#include "SenderPipeline.h"
+
+class SenderPipelineTest : public ::testing::Test {
+public:
+    class FakeSender final : public ISender {
+    public:
+        bool sendHumidity(float) override { return true; }
+        bool sendTemperature(float) override { return true; }
+        bool sendMeasurement(const Measurement& measurement) override {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!accept) return false;
+            timestamps.push_back(measurement.timestamp);
+            return true;
+        }
+        std::mutex mutex;
+        std::vector<int64_t> timestamps;
+        bool accept = true;
+    };
+
+    // a sink that hangs in sendMeasurement (like a reconnect) until it is opened
+    class GatedSender final : public ISender {
+    public:
+        bool sendHumidity(float) override { return true; }
+        bool sendTemperature(float) override { return true; }
+        bool sendMeasurement(const Measurement& measurement) override {
+            std::unique_lock<std::mutex> lock(mutex);
+            entered = true;
+            changed.notify_all();
+            changed.wait(lock, [this] { return open; });
+            timestamps.push_back(measurement.timestamp);
+            return true;
+        }
+        void waitUntilEntered() {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return entered; });
+        }
+        void release() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                open = true;
+            }
+            changed.notify_all();
+        }
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::vector<int64_t> timestamps;
+        bool entered = false;
+        bool open = false;
+    };
+
+    static Measurement measurementAt(const int64_t timestamp) {
+        return Measurement{20.0f, 50.0f, 5, 0, timestamp};
+    }
+};
+
+TEST_F(SenderPipelineTest, boundedQueue) {
+    BoundedQueue<int> queue(3);
+    EXPECT_EQ(4u, queue.capacity()) << "Capacity rounded up to power of 2";
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(queue.tryPush(i)) << "Push " << i;
+    }
+    EXPECT_FALSE(queue.tryPush(4)) << "Full";
+    EXPECT_EQ(4u, queue.size()) << "Size";
+    int item;
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(queue.tryPop(item)) << "Pop " << i;
+        EXPECT_EQ(i, item) << "FIFO order";
+    }
+    EXPECT_FALSE(queue.tryPop(item)) << "Empty";
+}
+
+TEST_F(SenderPipelineTest, deliversToAllSinks) {
+    Config config;
+    config.begin("device=test\n");
+    FakeSender first;
+    FakeSender second;
+    SenderPipeline pipeline(&config);
+    pipeline.addSink("first", &first);
+    pipeline.addSink("second", &second);
+    EXPECT_FALSE(pipeline.sendTemperature(20.0f)) << "Single values not supported";
+    pipeline.begin();
+    pipeline.sendMeasurement(measurementAt(1));
+    pipeline.sendMeasurement(measurementAt(2));
+    pipeline.end();
+    EXPECT_EQ((std::vector<int64_t>{1, 2}), first.timestamps) << "First sink";
+    EXPECT_EQ((std::vector<int64_t>{1, 2}), second.timestamps) << "Second sink";
+    EXPECT_EQ(2u, pipeline.statistics(1).delivered) << "Delivered count";
+}
+
+TEST_F(SenderPipelineTest, dropOldest) {
+    Config config;
+    config.begin("device=test\nqueueCapacity=2\n");
+    FakeSender sink;
+    SenderPipeline pipeline(&config);
+    pipeline.addSink("sink", &sink);
+    // sender thread not started yet, so the queue fills up
+    for (int i = 1; i <= 4; i++) {
+        pipeline.sendMeasurement(measurementAt(i));
+    }
+    auto statistics = pipeline.statistics(0);
+    EXPECT_EQ(2u, statistics.depth) << "Depth";
+    EXPECT_EQ(2u, statistics.dropped) << "Dropped";
+    EXPECT_EQ(2u, statistics.highWater) << "High water mark";
+    pipeline.begin();
+    pipeline.end();
+    EXPECT_EQ((std::vector<int64_t>{3, 4}), sink.timestamps) << "Newest delivered";
+}
+
+TEST_F(SenderPipelineTest, blockTimesOut) {
+    Config config;
+    config.begin("device=test\nqueueCapacity=2\nsinkPolicy=block\nsinkBlockMillis=10\n");
+    FakeSender sink;
+    SenderPipeline pipeline(&config);
+    pipeline.addSink("sink", &sink);
+    for (int i = 1; i <= 3; i++) {
+        pipeline.sendMeasurement(measurementAt(i));
+    }
+    EXPECT_EQ(1u, pipeline.statistics(0).dropped) << "Dropped after blocking";
+    pipeline.begin();
+    pipeline.end();
+    EXPECT_EQ((std::vector<int64_t>{1, 2}), sink.timestamps) << "Oldest delivered";
+}
+
+TEST_F(SenderPipelineTest, spillKeepsOrder) {
+    const std::string spillFile = testing::TempDir() + "pipeline.spill";
+    (void)remove(spillFile.c_str());
+    Config config;
+    config.begin("device=test\nqueueCapacity=2\nsinkPolicy=spill\nsinkSpill=" + spillFile + "\n");
+    FakeSender sink;
+    sink.accept = false;
+    {
+        SenderPipeline pipeline(&config);
+        pipeline.addSink("sink", &sink);
+        for (int i = 1; i <= 3; i++) {
+            pipeline.sendMeasurement(measurementAt(i));
+        }
+        EXPECT_EQ(1u, pipeline.statistics(0).spilled) << "Spilled when full";
+        pipeline.sendMeasurement(measurementAt(4));
+        EXPECT_EQ(2u, pipeline.statistics(0).spilled) << "Spilling continues while spill file not drained";
+        pipeline.begin();
+        pipeline.end();
+        EXPECT_EQ(2u, pipeline.statistics(0).spilled) << "Failed deliveries not spilled behind newer ones";
+        EXPECT_TRUE(sink.timestamps.empty()) << "Nothing delivered";
+    }
+    // a new pipeline picks up the spill file
+    sink.accept = true;
+    SenderPipeline pipeline(&config);
+    pipeline.addSink("sink", &sink);
+    pipeline.begin();
+    pipeline.sendMeasurement(measurementAt(5));
+    pipeline.end();
+    EXPECT_EQ((std::vector<int64_t>{1, 2, 3, 4, 5}), sink.timestamps) << "Undelivered measurements kept in order";
+    EXPECT_EQ(nullptr, fopen(spillFile.c_str(), "rb")) << "Spill file removed";
+}
+
+TEST_F(SenderPipelineTest, drainingDoesNotBlockSampling) {
+    const std::string spillFile = testing::TempDir() + "draining.spill";
+    FILE* file = fopen(spillFile.c_str(), "wb");
+    ASSERT_NE(nullptr, file);
+    const Measurement spilled[] = { measurementAt(1), measurementAt(2) };
+    ASSERT_EQ(2u, fwrite(spilled, sizeof(Measurement), 2, file));
+    fclose(file);
+    Config config;
+    config.begin("device=test\nsinkPolicy=spill\nsinkSpill=" + spillFile + "\n");
+    GatedSender sink;
+    SenderPipeline pipeline(&config);
+    pipeline.addSink("sink", &sink);
+    pipeline.begin();
+    sink.waitUntilEntered();
+    // the sender thread is stuck delivering the first spilled measurement
+    auto sampling = std::async(std::launch::async, [&pipeline] { pipeline.sendMeasurement(measurementAt(3)); });
+    const auto status = sampling.wait_for(std::chrono::seconds(2));
+    sink.release();
+    EXPECT_EQ(std::future_status::ready, status) << "sendMeasurement did not wait for the sink";
+    sampling.wait();
+    pipeline.end();
+    EXPECT_EQ((std::vector<int64_t>{1, 2, 3}), sink.timestamps) << "in order";
+    EXPECT_EQ(nullptr, fopen(spillFile.c_str(), "rb")) << "Spill file removed";
+}
+
+TEST_F(SenderPipelineTest, oldSpillFileIgnoredWithoutSpillPolicy) {
+    const std::string spillFile = testing::TempDir() + "ignored.spill";
+    FILE* file = fopen(spillFile.c_str(), "wb");
+    ASSERT_NE(nullptr, file);
+    const auto old = measurementAt(1);
+    ASSERT_EQ(1u, fwrite(&old, sizeof(Measurement), 1, file));
+    fclose(file);
+    Config config;
+    config.begin("device=test\nsinkSpill=" + spillFile + "\n");
+    FakeSender sink;
+    SenderPipeline pipeline(&config);
+    pipeline.addSink("sink", &sink);
+    pipeline.begin();
+    pipeline.sendMeasurement(measurementAt(2));
+    pipeline.end();
+    EXPECT_EQ((std::vector<int64_t>{2}), sink.timestamps) << "only the new measurement";
+    FILE* kept = fopen(spillFile.c_str(), "rb");
+    EXPECT_NE(nullptr, kept) << "left alone";
+    if (kept != nullptr) fclose(kept);
+    (void)remove(spillFile.c_str());
+}
@@ -114,3 +114,15 @@ TEST_F(SensorDataTest, Timeout) {
     EXPECT_TRUE(std::isnan(sensorData.getHumidity())) << "Temperature is NaN";
     EXPECT_EQ(SensorState::Timeout, sensorData.getState()) << "State did not change from Timeout";
 }
+
+TEST_F(SensorDataTest, edgeTimes) {
+    SensorData sensorData;
+    sensorData.initRead(1000);
+    int level = 0;
+    for (int i = 0; i <= EDGES; i++) {
+        sensorData.addEdge(level, 1000 + 100 * (i + 1));
+        level = 1 - level;
+    }
+    EXPECT_EQ(1100U, sensorData.firstEdgeTime()) << "first edge";
+    EXPECT_EQ(1000U + 100U * (EDGES + 1), sensorData.lastEdgeTime()) << "last edge";
+}
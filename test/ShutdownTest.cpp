@@ -0,0 +1,95 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <poll.h>
+#include <unistd.h>
+#include "Shutdown.h"
+
+class ShutdownTest : public ::testing::Test {
+protected:
+    volatile bool keepGoing = true;
+
+    void SetUp() override { Shutdown::reset(); }
+
+    void TearDown() override {
+        Shutdown::end();
+        Shutdown::reset();
+    }
+
+    static bool isReadable(const int fd) {
+        pollfd poller{fd, POLLIN, 0};
+        return poll(&poller, 1, 0) == 1 && (poller.revents & POLLIN) != 0;
+    }
+};
+
+TEST_F(ShutdownTest, requestWakesSleepersAndEventLoops) {
+    Config config;
+    config.begin("device=kitchen\nshutdownMillis=60000\n");
+    ASSERT_TRUE(Shutdown::begin(&config, &keepGoing));
+    ASSERT_GE(Shutdown::fd(), 0);
+    EXPECT_FALSE(isReadable(Shutdown::fd()));
+    EXPECT_TRUE(Shutdown::sleepMicros(1000)) << "not interrupted";
+
+    bool slept = true;
+    const auto start = std::chrono::steady_clock::now();
+    std::thread sleeper([&slept] { slept = Shutdown::sleepMicros(10000000); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    Shutdown::request("test");
+    sleeper.join();
+    EXPECT_FALSE(slept);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+    EXPECT_FALSE(keepGoing);
+    EXPECT_TRUE(Shutdown::isRequested());
+    EXPECT_TRUE(isReadable(Shutdown::fd()));
+    EXPECT_FALSE(Shutdown::sleepMicros(1000000)) << "returns right away once requested";
+    EXPECT_GT(Shutdown::remainingMicros(), 50000000);
+}
+
+TEST_F(ShutdownTest, finishReportsPhases) {
+    Config config;
+    config.begin("device=kitchen\nshutdownMillis=60000\n");
+    ASSERT_TRUE(Shutdown::begin(&config, &keepGoing));
+    EXPECT_EQ(60000000, Shutdown::remainingMicros()) << "the whole budget before a request";
+    Shutdown::request("test");
+    Shutdown::request("ignored");
+    Shutdown::phase("flush");
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    Shutdown::phase("sensor");
+    testing::internal::CaptureStdout();
+    Shutdown::finish();
+    Shutdown::finish();
+    const auto output = testing::internal::GetCapturedStdout();
+    EXPECT_EQ(0u, output.find("Shutdown took ")) << output;
+    EXPECT_NE(std::string::npos, output.find(" stop ")) << output;
+    EXPECT_NE(std::string::npos, output.find(" flush ")) << output;
+    EXPECT_NE(std::string::npos, output.find(" sensor ")) << output;
+    EXPECT_EQ(output.find("Shutdown took"), output.rfind("Shutdown took")) << "reported once";
+}
+
+TEST_F(ShutdownTest, missedDeadlineRunsHooksAndExits) {
+    GTEST_FLAG_SET(death_test_style, "threadsafe");
+    EXPECT_EXIT({
+        Config config;
+        config.begin("device=kitchen\nshutdownMillis=50\n");
+        Shutdown::begin(&config, &keepGoing);
+        Shutdown::onDeadline([] { (void)!write(STDERR_FILENO, "hook ran\n", 9); });
+        {
+            const DeadlineHook removed([] { (void)!write(STDERR_FILENO, "removed hook ran\n", 17); });
+        }
+        Shutdown::request("test");
+        Shutdown::phase("stuck");
+        std::this_thread::sleep_for(std::chrono::seconds(10));
+    }, testing::ExitedWithCode(Shutdown::EXIT_CODE), "deadline passed during phase 'stuck', forcing exit\nhook ran\n$");
+}
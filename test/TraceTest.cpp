@@ -0,0 +1,71 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include "Trace.h"
+
+class TraceTest : public ::testing::Test {
+protected:
+    static std::string readFile(const std::string& path) {
+        std::ifstream file(path);
+        std::stringstream content;
+        content << file.rdbuf();
+        return content.str();
+    }
+
+    static int occurrences(const std::string& text, const std::string& pattern) {
+        int count = 0;
+        for (auto position = text.find(pattern); position != std::string::npos; position = text.find(pattern, position + 1)) count++;
+        return count;
+    }
+};
+
+TEST_F(TraceTest, dumpWritesChromeTrace) {
+    Trace::clear();
+    Trace::complete("read", 1000, 250);
+    Trace::instant("ack");
+    std::thread other([] { Trace::complete("publish", 2000, 50); });
+    other.join();
+    EXPECT_EQ(3u, Trace::eventCount());
+
+    const std::string path = testing::TempDir() + "trace.json";
+    ASSERT_TRUE(Trace::dump(path));
+    const auto content = readFile(path);
+    EXPECT_EQ(0u, content.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":["));
+    EXPECT_NE(std::string::npos, content.find("\"ph\":\"X\",\"name\":\"read\"")) << content;
+    EXPECT_NE(std::string::npos, content.find("\"ts\":1000,\"dur\":250")) << content;
+    EXPECT_NE(std::string::npos, content.find("\"ph\":\"i\",\"s\":\"t\",\"name\":\"ack\"")) << content;
+    EXPECT_NE(std::string::npos, content.find("\"name\":\"publish\"")) << content;
+    EXPECT_EQ(2, occurrences(content, "\"ph\":\"X\""));
+    EXPECT_EQ(1, occurrences(content, "\"ph\":\"i\""));
+    EXPECT_NE(std::string::npos, content.rfind("]}"));
+    (void)remove(path.c_str());
+}
+
+TEST_F(TraceTest, ringKeepsNewestEvents) {
+    Trace::clear();
+    for (size_t i = 0; i < Trace::EVENTS_PER_THREAD + 10; i++) {
+        Trace::complete("span", static_cast<int64_t>(i), 1);
+    }
+    EXPECT_EQ(Trace::EVENTS_PER_THREAD, Trace::eventCount());
+
+    const std::string path = testing::TempDir() + "ring.json";
+    ASSERT_TRUE(Trace::dump(path));
+    const auto content = readFile(path);
+    EXPECT_EQ(std::string::npos, content.find("\"ts\":9,")) << "oldest events should be overwritten";
+    EXPECT_NE(std::string::npos, content.find("\"ts\":10,"));
+    EXPECT_NE(std::string::npos, content.find("\"ts\":" + std::to_string(Trace::EVENTS_PER_THREAD + 9) + ","));
+    (void)remove(path.c_str());
+}
@@ -0,0 +1,95 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include <gtest/gtest.h>
+#include <string>
+#include "ZoneAggregator.h"
+
+class ZoneAggregatorTest : public ::testing::Test {
+protected:
+    static constexpr int64_t SECOND = 1000000;
+};
+
+TEST_F(ZoneAggregatorTest, parseTopic) {
+    std::string device;
+    Quantity quantity;
+    EXPECT_TRUE(ZoneAggregator::parseTopic("homie/bedroom/climate/temperature", "climate", &device, &quantity));
+    EXPECT_EQ("bedroom", device);
+    EXPECT_EQ(Quantity::Temperature, quantity);
+    EXPECT_TRUE(ZoneAggregator::parseTopic("homie/study/climate/humidity", "climate", &device, &quantity));
+    EXPECT_EQ("study", device);
+    EXPECT_EQ(Quantity::Humidity, quantity);
+    EXPECT_FALSE(ZoneAggregator::parseTopic("homie/study/climate/measurement", "climate", &device, &quantity));
+    EXPECT_FALSE(ZoneAggregator::parseTopic("homie/study/climatex/humidity", "climate", &device, &quantity));
+    EXPECT_FALSE(ZoneAggregator::parseTopic("homie/study/other/humidity", "climate", &device, &quantity));
+    EXPECT_FALSE(ZoneAggregator::parseTopic("homie//climate/humidity", "climate", &device, &quantity));
+    EXPECT_FALSE(ZoneAggregator::parseTopic("homie/study", "climate", &device, &quantity));
+    EXPECT_FALSE(ZoneAggregator::parseTopic("other/study/climate/humidity", "climate", &device, &quantity));
+}
+
+TEST_F(ZoneAggregatorTest, zonesFromConfig) {
+    Config config;
+    config.begin("device=gateway\nzone.upstairs=bedroom,study,bedroom\nzone.Kitchen=kitchen\nzone.empty=\nzone.house=bedroom,study,kitchen\n");
+    ZoneAggregator aggregator(&config);
+    ASSERT_TRUE(aggregator.begin());
+    ASSERT_EQ(2u, aggregator.zones().size()) << "invalid Homie ID and empty zone left out";
+    EXPECT_EQ("house", aggregator.zones()[0]);
+    EXPECT_EQ("upstairs", aggregator.zones()[1]);
+
+    Config none;
+    none.begin("device=gateway\n");
+    ZoneAggregator nothing(&none);
+    EXPECT_FALSE(nothing.begin());
+}
+
+TEST_F(ZoneAggregatorTest, meansFollowNewValuesAndExpire) {
+    Config config;
+    config.begin("device=gateway\nstaleSeconds=60\nzone.upstairs=bedroom,study\nzone.house=bedroom,study,kitchen\n");
+    ZoneAggregator aggregator(&config);
+    ASSERT_TRUE(aggregator.begin());
+    EXPECT_FALSE(aggregator.ingest("garage", Quantity::Temperature, 10.0f, 0)) << "not in a zone";
+    EXPECT_TRUE(aggregator.ingest("bedroom", Quantity::Temperature, 20.0f, 0));
+    EXPECT_TRUE(aggregator.ingest("study", Quantity::Temperature, 22.0f, 10 * SECOND));
+    EXPECT_TRUE(aggregator.ingest("kitchen", Quantity::Temperature, 24.0f, 10 * SECOND));
+    EXPECT_TRUE(aggregator.ingest("kitchen", Quantity::Humidity, 50.0f, 10 * SECOND));
+    // a new value replaces the previous one
+    EXPECT_TRUE(aggregator.ingest("bedroom", Quantity::Temperature, 19.0f, 20 * SECOND));
+
+    auto rollups = aggregator.rollups(30 * SECOND);
+    ASSERT_EQ(2u, rollups.size());
+    const auto& house = rollups[0];
+    EXPECT_EQ("house", house.zone);
+    EXPECT_EQ(3, house.devices);
+    EXPECT_EQ(3, house.temperatureCount);
+    EXPECT_FLOAT_EQ(65.0f / 3, house.temperature);
+    EXPECT_FLOAT_EQ(19.0f, house.minTemperature);
+    EXPECT_FLOAT_EQ(24.0f, house.maxTemperature);
+    EXPECT_EQ(1, house.humidityCount);
+    EXPECT_FLOAT_EQ(50.0f, house.humidity);
+    const auto& upstairs = rollups[1];
+    EXPECT_EQ(2, upstairs.devices);
+    EXPECT_FLOAT_EQ(20.5f, upstairs.temperature);
+    EXPECT_EQ(0, upstairs.humidityCount);
+    EXPECT_EQ("{\"devices\":2,\"temperature\":20.50,\"minTemperature\":19.0,\"maxTemperature\":22.0}", ZoneAggregator::toJson(upstairs));
+
+    // study and kitchen are stale by now, bedroom isn't
+    rollups = aggregator.rollups(75 * SECOND);
+    EXPECT_EQ(1, rollups[0].devices);
+    EXPECT_FLOAT_EQ(19.0f, rollups[0].temperature);
+    EXPECT_EQ(0, rollups[0].humidityCount);
+    EXPECT_FLOAT_EQ(19.0f, rollups[1].temperature);
+    // back again
+    EXPECT_TRUE(aggregator.ingest("study", Quantity::Temperature, 23.0f, 76 * SECOND));
+    rollups = aggregator.rollups(78 * SECOND);
+    EXPECT_FLOAT_EQ(21.0f, rollups[1].temperature);
+    rollups = aggregator.rollups(200 * SECOND);
+    EXPECT_EQ("{\"devices\":0}", ZoneAggregator::toJson(rollups[1]));
+}
@@ -0,0 +1,557 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "BrokerStub.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+    // MQTT control packet types (high nibble of the first byte)
+    constexpr uint8_t CONNECT = 1;
+    constexpr uint8_t CONNACK = 2;
+    constexpr uint8_t PUBLISH = 3;
+    constexpr uint8_t PUBACK = 4;
+    constexpr uint8_t PUBREC = 5;
+    constexpr uint8_t PUBREL = 6;
+    constexpr uint8_t PUBCOMP = 7;
+    constexpr uint8_t SUBSCRIBE = 8;
+    constexpr uint8_t SUBACK = 9;
+    constexpr uint8_t UNSUBSCRIBE = 10;
+    constexpr uint8_t UNSUBACK = 11;
+    constexpr uint8_t PINGREQ = 12;
+    constexpr uint8_t PINGRESP = 13;
+    constexpr uint8_t DISCONNECT = 14;
+
+    // CONNACK return code for an unsupported protocol level
+    constexpr uint8_t UNACCEPTABLE_PROTOCOL = 1;
+
+    std::string encodeUint16(const uint16_t value) {
+        return {static_cast<char>(value >> 8), static_cast<char>(value & 0xFF)};
+    }
+
+    bool readUint16(const std::string& body, size_t& position, uint16_t* value) {
+        if (position + 2 > body.size()) return false;
+        *value = static_cast<uint16_t>(static_cast<uint8_t>(body[position]) << 8 | static_cast<uint8_t>(body[position + 1]));
+        position += 2;
+        return true;
+    }
+
+    std::vector<std::string> levels(const std::string& topic) {
+        std::vector<std::string> result;
+        size_t start = 0;
+        for (;;) {
+            const auto slash = topic.find('/', start);
+            result.push_back(topic.substr(start, slash == std::string::npos ? std::string::npos : slash - start));
+            if (slash == std::string::npos) return result;
+            start = slash + 1;
+        }
+    }
+}
+
+BrokerStub::~BrokerStub() {
+    end();
+}
+
+/// @brief Start listening on 127.0.0.1 (port 0 picks a free one, see port()) and start the broker thread
+bool BrokerStub::begin(const int port) {
+    if (_thread.joinable()) return true;
+    if (!_loop.begin()) return false;
+    _listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_listener < 0) {
+        perror("Could not create broker socket");
+        return false;
+    }
+    constexpr int ON = 1;
+    (void)setsockopt(_listener, SOL_SOCKET, SO_REUSEADDR, &ON, sizeof ON);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    socklen_t length = sizeof address;
+    if (bind(_listener, reinterpret_cast<sockaddr*>(&address), sizeof address) != 0 ||
+        listen(_listener, SOMAXCONN) != 0 ||
+        getsockname(_listener, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+        perror("Could not listen on broker socket");
+        return false;
+    }
+    _port = ntohs(address.sin_port);
+    _wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    _timer = _loop.createTimer([this](uint32_t) { flushDue(); });
+    if (_wake < 0 || _timer < 0) return false;
+    const bool watching =
+        _loop.watch(_listener, EPOLLIN, [this](uint32_t) { accept(); }) &&
+        _loop.watch(_wake, EPOLLIN, [this](uint32_t) {
+            uint64_t count;
+            (void)read(_wake, &count, sizeof count);
+            std::vector<std::function<void()>> commands;
+            {
+                std::lock_guard<std::mutex> lock(_commandMutex);
+                commands.swap(_commands);
+            }
+            for (const auto& command : commands) command();
+            flushWrites();
+        });
+    if (!watching) return false;
+    _running = true;
+    _thread = std::thread([this] { _loop.run(_running); });
+    return true;
+}
+
+/// @brief Drop all connections (without publishing wills) and stop the broker thread
+void BrokerStub::end() {
+    if (_thread.joinable()) {
+        execute([this] {
+            std::vector<int> sockets;
+            for (auto& [socket, client] : _clients) {
+                client.hasWill = false;
+                sockets.push_back(socket);
+            }
+            for (const int socket : sockets) close(socket);
+            _running = false;
+        });
+        _thread.join();
+    }
+    if (_listener >= 0) ::close(_listener);
+    if (_wake >= 0) ::close(_wake);
+    _listener = -1;
+    _wake = -1;
+}
+
+void BrokerStub::clearPublishes() {
+    std::lock_guard<std::mutex> lock(_recordMutex);
+    _publishes.clear();
+}
+
+/// @brief Close all client connections, as if the network failed: wills are published
+void BrokerStub::disconnectAll() {
+    execute([this] {
+        std::vector<int> sockets;
+        for (const auto& entry : _clients) sockets.push_back(entry.first);
+        for (const int socket : sockets) close(socket);
+    });
+}
+
+/// @brief Close the connection of the client sending the publishes-th publish from now (0 disables),
+/// without acknowledging that publish
+void BrokerStub::disconnectAfter(const uint64_t publishes) {
+    _publishesUntilDrop = publishes;
+}
+
+std::vector<BrokerPublish> BrokerStub::publishes() const {
+    std::lock_guard<std::mutex> lock(_recordMutex);
+    return _publishes;
+}
+
+/// @brief Whether a retained message exists for the topic, and if so its payload
+bool BrokerStub::retained(const std::string& topic, std::string* payload) const {
+    std::lock_guard<std::mutex> lock(_recordMutex);
+    const auto iterator = _retained.find(topic);
+    if (iterator == _retained.end()) return false;
+    if (payload != nullptr) *payload = iterator->second;
+    return true;
+}
+
+BrokerStatistics BrokerStub::statistics() const {
+    std::lock_guard<std::mutex> lock(_recordMutex);
+    return _statistics;
+}
+
+bool BrokerStub::waitForConnects(const uint64_t count, const std::chrono::milliseconds timeout) const {
+    std::unique_lock<std::mutex> lock(_recordMutex);
+    return _recorded.wait_for(lock, timeout, [this, count] { return _statistics.connects >= count; });
+}
+
+bool BrokerStub::waitForPublishes(const uint64_t count, const std::chrono::milliseconds timeout) const {
+    std::unique_lock<std::mutex> lock(_recordMutex);
+    return _recorded.wait_for(lock, timeout, [this, count] { return _statistics.publishes >= count; });
+}
+
+/// @brief MQTT topic filter matching: + matches one level, # the rest (including the parent level)
+bool BrokerStub::matches(const std::string& topicFilter, const std::string& topic) {
+    // wildcards don't match topics starting with $ (e.g. $SYS)
+    if (!topic.empty() && topic[0] == '$' && !topicFilter.empty() && (topicFilter[0] == '+' || topicFilter[0] == '#')) {
+        return false;
+    }
+    const auto filterLevels = levels(topicFilter);
+    const auto topicLevels = levels(topic);
+    for (size_t i = 0; i < filterLevels.size(); i++) {
+        if (filterLevels[i] == "#") return true;
+        if (i >= topicLevels.size()) return false;
+        if (filterLevels[i] != "+" && filterLevels[i] != topicLevels[i]) return false;
+    }
+    return filterLevels.size() == topicLevels.size();
+}
+
+void BrokerStub::accept() {
+    for (;;) {
+        const int socket = accept4(_listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (socket < 0) return;
+        constexpr int ON = 1;
+        (void)setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &ON, sizeof ON);
+        Client client;
+        client.socket = socket;
+        client.serial = _nextSerial++;
+        _clients.emplace(socket, std::move(client));
+        if (!_loop.watch(socket, EPOLLIN, [this, socket](const uint32_t events) { handle(socket, events); })) {
+            _clients.erase(socket);
+            ::close(socket);
+        }
+    }
+}
+
+void BrokerStub::armTimer() {
+    if (_delayed.empty()) return;
+    const auto wait = std::chrono::duration_cast<std::chrono::microseconds>(_delayed.begin()->first - Clock::now()).count();
+    _loop.setTimer(_timer, static_cast<uint64_t>(std::max<int64_t>(wait, 0)));
+}
+
+void BrokerStub::close(const int socket) {
+    const auto iterator = _clients.find(socket);
+    if (iterator == _clients.end()) return;
+    // take it out first: the will goes to the remaining subscribers
+    Client client = std::move(iterator->second);
+    _clients.erase(iterator);
+    _loop.unwatch(socket);
+    ::close(socket);
+    if (!client.connected) return;
+    {
+        std::lock_guard<std::mutex> lock(_recordMutex);
+        _statistics.disconnects++;
+        _statistics.clients--;
+    }
+    if (client.hasWill) {
+        {
+            std::lock_guard<std::mutex> lock(_recordMutex);
+            _statistics.wills++;
+        }
+        publish(client.clientId, client.will.topic, client.will.payload, client.will.qos, client.will.retain);
+    }
+}
+
+// run the command on the broker thread
+void BrokerStub::execute(std::function<void()> command) {
+    {
+        std::lock_guard<std::mutex> lock(_commandMutex);
+        _commands.push_back(std::move(command));
+    }
+    constexpr uint64_t ONE = 1;
+    (void)::write(_wake, &ONE, sizeof ONE);
+}
+
+void BrokerStub::flushDue() {
+    const auto now = Clock::now();
+    std::vector<int> sockets;
+    while (!_delayed.empty() && _delayed.begin()->first <= now) {
+        const auto& delayed = _delayed.begin()->second;
+        // the client may have gone (or its socket number reused) in the meantime
+        const auto client = std::find_if(_clients.begin(), _clients.end(),
+            [&delayed](const auto& entry) { return entry.second.serial == delayed.serial; });
+        if (client != _clients.end()) {
+            client->second.output += delayed.packet;
+            client->second.closing |= delayed.thenClose;
+            sockets.push_back(client->first);
+        }
+        _delayed.erase(_delayed.begin());
+    }
+    for (const int socket : sockets) write(socket);
+    flushWrites();
+    armTimer();
+}
+
+void BrokerStub::handle(const int socket, const uint32_t events) {
+    auto iterator = _clients.find(socket);
+    if (iterator == _clients.end()) return;
+    if ((events & EPOLLOUT) != 0) {
+        write(socket);
+        iterator = _clients.find(socket);
+        if (iterator == _clients.end()) return;
+    }
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) == 0) return;
+    auto& client = iterator->second;
+    char buffer[4096];
+    for (;;) {
+        const auto received = recv(socket, buffer, sizeof buffer, 0);
+        if (received > 0) {
+            client.input.append(buffer, static_cast<size_t>(received));
+            continue;
+        }
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        close(socket);
+        return;
+    }
+    while (!client.closing && client.input.size() >= 2) {
+        // remaining length: up to 4 bytes, 7 bits each, high bit means more follow
+        size_t length = 0;
+        size_t position = 1;
+        bool complete = false;
+        for (int shift = 0; shift < 28 && position < client.input.size(); shift += 7) {
+            const auto byte = static_cast<uint8_t>(client.input[position++]);
+            length |= static_cast<size_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                complete = true;
+                break;
+            }
+        }
+        if (!complete) {
+            if (position - 1 >= 4) {
+                close(socket);
+                return;
+            }
+            break;
+        }
+        if (client.input.size() < position + length) break;
+        const auto header = static_cast<uint8_t>(client.input[0]);
+        const auto body = client.input.substr(position, length);
+        client.input.erase(0, position + length);
+        if (!handlePacket(client, header, body)) {
+            close(socket);
+            break;
+        }
+    }
+    flushWrites();
+}
+
+bool BrokerStub::handleConnect(Client& client, const std::string& body) {
+    size_t position = 0;
+    std::string protocol;
+    uint16_t keepAlive;
+    if (!readString(body, position, &protocol) || position + 2 > body.size()) return false;
+    const auto level = static_cast<uint8_t>(body[position++]);
+    const auto flags = static_cast<uint8_t>(body[position++]);
+    if (!readUint16(body, position, &keepAlive) || !readString(body, position, &client.clientId)) return false;
+    if ((flags & 0x04) != 0) {
+        client.hasWill = true;
+        client.will.qos = (flags >> 3) & 0x03;
+        client.will.retain = (flags & 0x20) != 0;
+        if (!readString(body, position, &client.will.topic) || !readString(body, position, &client.will.payload)) return false;
+    }
+    // user name and password aren't checked
+    uint8_t code = _connackCode;
+    // 3 is MQIsdp (3.1), 4 is 3.1.1. Version 5 has properties we don't parse.
+    if (level != 3 && level != 4) code = UNACCEPTABLE_PROTOCOL;
+    {
+        std::lock_guard<std::mutex> lock(_recordMutex);
+        if (code == 0) {
+            _statistics.connects++;
+            _statistics.clients++;
+        } else {
+            _statistics.refused++;
+        }
+    }
+    _recorded.notify_all();
+    client.connected = code == 0;
+    reply(client, packet(CONNACK << 4, std::string{'\0', static_cast<char>(code)}), _responseDelayMicros, code != 0);
+    return true;
+}
+
+// false closes the connection
+bool BrokerStub::handlePacket(Client& client, const uint8_t header, const std::string& body) {
+    const uint8_t type = header >> 4;
+    if (type == CONNECT) return !client.connected && handleConnect(client, body);
+    if (!client.connected) return false;
+    size_t position = 0;
+    uint16_t packetId;
+    switch (type) {
+        case PUBLISH:
+            return handlePublish(client, header, body);
+        case PUBREL:
+            if (!readUint16(body, position, &packetId)) return false;
+            if (!_dropAcks) {
+                {
+                    std::lock_guard<std::mutex> lock(_recordMutex);
+                    _statistics.acknowledgements++;
+                }
+                reply(client, packet(PUBCOMP << 4, encodeUint16(packetId)), _responseDelayMicros + _ackDelayMicros);
+            }
+            return true;
+        case PUBACK:
+        case PUBREC:
+        case PUBCOMP:
+            // we forward at QoS 0, so there is nothing to acknowledge
+            return true;
+        case SUBSCRIBE:
+            handleSubscribe(client, body);
+            return true;
+        case UNSUBSCRIBE: {
+            if (!readUint16(body, position, &packetId)) return false;
+            std::string filter;
+            while (readString(body, position, &filter)) {
+                auto& subscriptions = client.subscriptions;
+                subscriptions.erase(std::remove(subscriptions.begin(), subscriptions.end(), filter), subscriptions.end());
+            }
+            reply(client, packet(UNSUBACK << 4, encodeUint16(packetId)), _responseDelayMicros);
+            return true;
+        }
+        case PINGREQ:
+            {
+                std::lock_guard<std::mutex> lock(_recordMutex);
+                _statistics.pings++;
+            }
+            reply(client, packet(PINGRESP << 4, ""), _responseDelayMicros);
+            return true;
+        case DISCONNECT:
+            // a clean disconnect discards the will
+            client.hasWill = false;
+            return false;
+        default:
+            return false;
+    }
+}
+
+bool BrokerStub::handlePublish(Client& client, const uint8_t header, const std::string& body) {
+    const int qos = (header >> 1) & 0x03;
+    const bool retain = (header & 0x01) != 0;
+    size_t position = 0;
+    std::string topic;
+    uint16_t packetId = 0;
+    if (qos == 3 || !readString(body, position, &topic)) return false;
+    if (qos > 0 && !readUint16(body, position, &packetId)) return false;
+    publish(client.clientId, topic, body.substr(position), qos, retain);
+    // the connection drops before the acknowledgement goes out
+    if (_publishesUntilDrop > 0 && --_publishesUntilDrop == 0) return false;
+    if (qos == 0 || _dropAcks) return true;
+    {
+        std::lock_guard<std::mutex> lock(_recordMutex);
+        _statistics.acknowledgements++;
+    }
+    const uint8_t type = qos == 1 ? PUBACK : PUBREC;
+    reply(client, packet(static_cast<uint8_t>(type << 4), encodeUint16(packetId)), _responseDelayMicros + _ackDelayMicros);
+    return true;
+}
+
+void BrokerStub::handleSubscribe(Client& client, const std::string& body) {
+    size_t position = 0;
+    uint16_t packetId;
+    if (!readUint16(body, position, &packetId)) return;
+    std::string granted;
+    std::string filter;
+    std::vector<std::string> added;
+    while (readString(body, position, &filter) && position < body.size()) {
+        position++;  // requested QoS: we grant 0
+        client.subscriptions.push_back(filter);
+        added.push_back(filter);
+        granted += '\0';
+    }
+    reply(client, packet(SUBACK << 4, encodeUint16(packetId) + granted), _responseDelayMicros);
+    std::vector<std::pair<std::string, std::string>> matching;
+    {
+        std::lock_guard<std::mutex> lock(_recordMutex);
+        for (const auto& [topic, payload] : _retained) {
+            if (std::any_of(added.begin(), added.end(), [&topic = topic](const auto& f) { return matches(f, topic); })) {
+                matching.emplace_back(topic, payload);
+            }
+        }
+    }
+    // retained messages keep their retain flag when sent on subscribing
+    for (const auto& [topic, payload] : matching) {
+        reply(client, packet(PUBLISH << 4 | 0x01, encodeUint16(static_cast<uint16_t>(topic.size())) + topic + payload), _responseDelayMicros);
+    }
+}
+
+void BrokerStub::publish(const std::string& clientId, const std::string& topic, const std::string& payload, const int qos, const bool retain) {
+    {
+        std::lock_guard<std::mutex> lock(_recordMutex);
+        _statistics.publishes++;
+        if (_recording) _publishes.push_back({clientId, topic, payload, qos, retain, Clock::now()});
+        if (retain) {
+            // an empty retained message removes the retained message
+            if (payload.empty()) {
+                _retained.erase(topic);
+            } else {
+                _retained[topic] = payload;
+            }
+        }
+    }
+    _recorded.notify_all();
+    const auto forward = packet(PUBLISH << 4, encodeUint16(static_cast<uint16_t>(topic.size())) + topic + payload);
+    for (auto& entry : _clients) {
+        auto& subscriber = entry.second;
+        const auto& subscriptions = subscriber.subscriptions;
+        if (std::any_of(subscriptions.begin(), subscriptions.end(), [&topic](const auto& f) { return matches(f, topic); })) {
+            reply(subscriber, forward, _responseDelayMicros);
+        }
+    }
+}
+
+// queue the packet for the client, after the delay. Writing happens in flushWrites, as it may close connections.
+void BrokerStub::reply(Client& client, std::string packet, const int64_t delayMicros, const bool thenClose) {
+    if (delayMicros <= 0) {
+        client.output += packet;
+        client.closing |= thenClose;
+        _unwritten.push_back(client.socket);
+        return;
+    }
+    _delayed.emplace(Clock::now() + std::chrono::microseconds(delayMicros), Delayed{client.serial, std::move(packet), thenClose});
+    armTimer();
+}
+
+void BrokerStub::flushWrites() {
+    // writing may close a connection, which may publish a will, which may add to the list
+    while (!_unwritten.empty()) {
+        std::vector<int> sockets;
+        sockets.swap(_unwritten);
+        std::sort(sockets.begin(), sockets.end());
+        sockets.erase(std::unique(sockets.begin(), sockets.end()), sockets.end());
+        for (const int socket : sockets) write(socket);
+    }
+}
+
+// write what we can; watch for writability if something remains. Closes the connection on errors.
+void BrokerStub::write(const int socket) {
+    const auto iterator = _clients.find(socket);
+    if (iterator == _clients.end()) return;
+    auto& client = iterator->second;
+    while (!client.output.empty()) {
+        const auto sent = send(socket, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (sent <= 0) {
+            close(socket);
+            return;
+        }
+        client.output.erase(0, static_cast<size_t>(sent));
+    }
+    if (client.output.empty() && client.closing) {
+        close(socket);
+        return;
+    }
+    const uint32_t events = client.output.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+    if (events != client.events) {
+        _loop.watch(socket, events, [this, socket](const uint32_t socketEvents) { handle(socket, socketEvents); });
+        client.events = events;
+    }
+}
+
+std::string BrokerStub::packet(const uint8_t header, const std::string& body) {
+    std::string result(1, static_cast<char>(header));
+    size_t length = body.size();
+    do {
+        auto byte = static_cast<uint8_t>(length & 0x7F);
+        length >>= 7;
+        if (length > 0) byte |= 0x80;
+        result += static_cast<char>(byte);
+    } while (length > 0);
+    return result + body;
+}
+
+bool BrokerStub::readString(const std::string& body, size_t& position, std::string* value) {
+    uint16_t length;
+    if (!readUint16(body, position, &length) || position + length > body.size()) return false;
+    value->assign(body, position, length);
+    position += length;
+    return true;
+}
@@ -0,0 +1,162 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef BROKER_STUB_H
+#define BROKER_STUB_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "EventLoop.h"
+
+/// @brief A publish as the broker received it (wills included)
+struct BrokerPublish {
+    std::string clientId;
+    std::string topic;
+    std::string payload;
+    int qos = 0;
+    bool retain = false;
+    std::chrono::steady_clock::time_point receivedAt;
+};
+
+struct BrokerStatistics {
+    uint64_t connects = 0;       // accepted CONNECTs
+    uint64_t refused = 0;        // CONNECTs answered with a non-zero return code
+    uint64_t disconnects = 0;    // connections closed, by the client or injected
+    uint64_t publishes = 0;      // including wills
+    uint64_t acknowledgements = 0; // PUBACK, PUBREC and PUBCOMP sent
+    uint64_t wills = 0;
+    uint64_t pings = 0;
+    size_t clients = 0;          // currently connected
+};
+
+/// @brief Minimal MQTT 3.1.1 broker on the loopback interface, for integration tests and benchmarks.
+/// It accepts QoS 0, 1 and 2 publishes, keeps retained messages, forwards to subscribers (at QoS 0),
+/// publishes wills, and records every publish. Faults can be injected: a delay on all responses, an extra
+/// delay on publish acknowledgements, swallowed acknowledgements, refused connects and dropped connections.
+/// The broker runs an EventLoop on its own thread; the other methods can be called from any thread.
+class BrokerStub {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    BrokerStub() = default;
+    ~BrokerStub();
+    BrokerStub(const BrokerStub&) = delete;
+    BrokerStub(BrokerStub&&) = delete;
+    BrokerStub& operator=(const BrokerStub&) = delete;
+    BrokerStub& operator=(BrokerStub&&) = delete;
+
+    bool begin(int port = 0);
+    void end();
+    int port() const { return _port; }
+
+    void clearPublishes();
+    void disconnectAll();
+    void disconnectAfter(uint64_t publishes);
+    void setAckDelay(std::chrono::microseconds delay) { _ackDelayMicros = delay.count(); }
+    void setConnackCode(uint8_t code) { _connackCode = code; }
+    void setDropAcks(bool drop) { _dropAcks = drop; }
+    void setRecording(bool record) { _recording = record; }
+    void setResponseDelay(std::chrono::microseconds delay) { _responseDelayMicros = delay.count(); }
+
+    std::vector<BrokerPublish> publishes() const;
+    bool retained(const std::string& topic, std::string* payload = nullptr) const;
+    BrokerStatistics statistics() const;
+    bool waitForConnects(uint64_t count, std::chrono::milliseconds timeout) const;
+    bool waitForPublishes(uint64_t count, std::chrono::milliseconds timeout) const;
+
+    static bool matches(const std::string& topicFilter, const std::string& topic);
+
+private:
+    struct Will {
+        std::string topic;
+        std::string payload;
+        int qos = 0;
+        bool retain = false;
+    };
+
+    struct Client {
+        int socket = -1;
+        uint64_t serial = 0;
+        bool connected = false;
+        bool closing = false;    // close once the output is written
+        uint32_t events = 0x001; // EPOLLIN
+        std::string clientId;
+        std::string input;
+        std::string output;
+        bool hasWill = false;
+        Will will;
+        std::vector<std::string> subscriptions;
+    };
+
+    struct Delayed {
+        uint64_t serial;
+        std::string packet;
+        bool thenClose;
+    };
+
+    EventLoop _loop;
+    std::thread _thread;
+    volatile bool _running = false;
+    int _listener = -1;
+    int _wake = -1;
+    int _timer = -1;
+    int _port = 0;
+    uint64_t _nextSerial = 1;
+    std::unordered_map<int, Client> _clients;
+    std::multimap<Clock::time_point, Delayed> _delayed;
+    std::vector<int> _unwritten;
+
+    std::atomic<int64_t> _responseDelayMicros{0};
+    std::atomic<int64_t> _ackDelayMicros{0};
+    std::atomic<uint8_t> _connackCode{0};
+    std::atomic<bool> _dropAcks{false};
+    std::atomic<bool> _recording{true};
+    std::atomic<uint64_t> _publishesUntilDrop{0};
+
+    std::mutex _commandMutex;
+    std::vector<std::function<void()>> _commands;
+
+    mutable std::mutex _recordMutex;
+    mutable std::condition_variable _recorded;
+    std::vector<BrokerPublish> _publishes;
+    std::unordered_map<std::string, std::string> _retained;
+    BrokerStatistics _statistics;
+
+    void accept();
+    void armTimer();
+    void close(int socket);
+    void execute(std::function<void()> command);
+    void flushDue();
+    void flushWrites();
+    void handle(int socket, uint32_t events);
+    bool handleConnect(Client& client, const std::string& body);
+    bool handlePacket(Client& client, uint8_t header, const std::string& body);
+    bool handlePublish(Client& client, uint8_t header, const std::string& body);
+    void handleSubscribe(Client& client, const std::string& body);
+    void publish(const std::string& clientId, const std::string& topic, const std::string& payload, int qos, bool retain);
+    void reply(Client& client, std::string packet, int64_t delayMicros, bool thenClose = false);
+    void write(int socket);
+
+    static std::string packet(uint8_t header, const std::string& body);
+    static bool readString(const std::string& body, size_t& position, std::string* value);
+};
+
+#endif
@@ -0,0 +1,128 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+// Edge replay: feeds edge traces (recorded with edgeTrace=failures|all) through SensorData at full speed,
+// and reports how the frames decode now against how they decoded when recorded.
+// Usage: DhtEdgeReplay [-n repeats] [-b threads] [-v] <trace file>...
+// With -b, regular frames are decoded in batches by BulkDecoder (0 threads is one per core); the others still
+// go through SensorData. Reports go to stderr. SensorData's own logging goes to stdout, which is discarded unless -v is given.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "BulkDecoder.h"
+#include "EdgeRecorder.h"
+
+namespace {
+    constexpr int STATES = 4;
+    const char* stateNames[STATES] = {"reading", "timeout", "read error", "done"};
+
+    struct Tally {
+        long frames = 0;
+        long changed = 0;
+        long anomalies = 0;
+        long recorded[STATES] = {};
+        long replayed[STATES] = {};
+    };
+
+    constexpr size_t BATCH_FRAMES = 65536;
+
+    void usage(const char* program) {
+        fprintf(stderr, "Usage: %s [-n repeats] [-b threads] [-v] <trace file>...\n", program);
+    }
+
+    void count(Tally& tally, const SensorState recordedState, const SensorState replayedState, const int anomalies) {
+        const auto recorded = static_cast<int>(recordedState) % STATES;
+        const auto replayed = static_cast<int>(replayedState) % STATES;
+        tally.frames++;
+        tally.recorded[recorded]++;
+        tally.replayed[replayed]++;
+        if (recorded != replayed) tally.changed++;
+        if (anomalies > 0) tally.anomalies++;
+    }
+
+    // regular frames have no anomalies by definition
+    void decode(const BulkDecoder& decoder, PulseBatch& batch, const std::vector<SensorState>& recorded,
+                std::vector<DecodedFrame>& decoded, Tally& tally) {
+        decoder.decode(batch, decoded.data());
+        for (size_t i = 0; i < batch.size(); i++) count(tally, recorded[i], decoded[i].state, 0);
+        batch.clear();
+    }
+}
+
+int main(const int argc, const char* argv[]) {
+    int repeats = 1;
+    bool verbose = false;
+    bool bulk = false;
+    unsigned int threads = 0;
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; first++) {
+        if (strcmp(argv[first], "-v") == 0) {
+            verbose = true;
+        } else if (strcmp(argv[first], "-n") == 0 && first + 1 < argc) {
+            repeats = atoi(argv[++first]);
+        } else if (strcmp(argv[first], "-b") == 0 && first + 1 < argc) {
+            bulk = true;
+            threads = static_cast<unsigned int>(atoi(argv[++first]));
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (first >= argc || repeats < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!verbose && freopen("/dev/null", "w", stdout) == nullptr) {
+        fprintf(stderr, "Could not discard stdout\n");
+    }
+
+    SensorData sensorData;
+    Tally tally;
+    const BulkDecoder decoder(threads);
+    PulseBatch batch(bulk ? BATCH_FRAMES : 0);
+    std::vector<SensorState> recordedStates(batch.capacity());
+    std::vector<DecodedFrame> decoded(batch.capacity());
+    const auto started = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < repeats; pass++) {
+        for (int i = first; i < argc; i++) {
+            const long frames = EdgeRecorder::forEachFrame(argv[i], [&](const EdgeFrame& frame) {
+                if (bulk) {
+                    if (batch.isFull()) decode(decoder, batch, recordedStates, decoded, tally);
+                    const size_t index = batch.size();
+                    if (batch.add(frame)) {
+                        recordedStates[index] = frame.state;
+                        return;
+                    }
+                }
+                EdgeRecorder::replay(frame, &sensorData);
+                count(tally, frame.state, sensorData.getState(), sensorData.getAnomalyCount());
+            });
+            if (frames < 0) return 2;
+        }
+    }
+    if (batch.size() > 0) decode(decoder, batch, recordedStates, decoded, tally);
+    const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    fprintf(stderr, "Replayed %ld frames in %.3f s (%.0f frames/s)\n", tally.frames, seconds,
+            seconds > 0 ? static_cast<double>(tally.frames) / seconds : 0.0);
+    if (bulk) fprintf(stderr, "Bulk decoding: %s kernel, %u threads\n", BulkDecoder::kernel(), decoder.threads());
+    fprintf(stderr, "%-12s %10s %10s\n", "state", "recorded", "replayed");
+    for (int state = 0; state < STATES; state++) {
+        fprintf(stderr, "%-12s %10ld %10ld\n", stateNames[state], tally.recorded[state], tally.replayed[state]);
+    }
+    fprintf(stderr, "Frames with anomalies: %ld\n", tally.anomalies);
+    fprintf(stderr, "Frames decoding differently than recorded: %ld\n", tally.changed);
+    return 0;
+}
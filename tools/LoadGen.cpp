@@ -0,0 +1,46 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+// Load generator: simulates a fleet of devices against a (local) broker. Usage: DhtLoadGen <config file>
+// The config file has the usual broker settings, plus the load* entries (see app/dht.conf.demo).
+// Reports go to stderr. The per-message logging of Homie goes to stdout, which is discarded unless loadVerbose=1.
+
+#include <csignal>
+#include <cstdio>
+#include "Config.h"
+#include "LoadGenerator.h"
+
+volatile bool keepGoing = true;
+
+void signalHandler(sig_atomic_t) {
+    keepGoing = false;
+}
+
+int main(const int argc, const char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <config file>\n", argv[0]);
+        return 1;
+    }
+    Config config;
+    config.begin(argv[1], "load");
+    bool verbose = false;
+    config.setIfExists("loadVerbose", &verbose);
+    if (!verbose && freopen("/dev/null", "w", stdout) == nullptr) {
+        fprintf(stderr, "Could not discard stdout\n");
+    }
+    (void)signal(SIGINT, signalHandler);
+    (void)signal(SIGTERM, signalHandler);
+    (void)signal(SIGPIPE, SIG_IGN);
+    LoadGenerator generator(argv[1], &keepGoing);
+    if (!generator.begin()) return 2;
+    generator.run();
+    return 0;
+}
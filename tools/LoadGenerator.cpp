@@ -0,0 +1,236 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#include "LoadGenerator.h"
+#include <sys/resource.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <utility>
+
+LoadGenerator::LoadGenerator(std::string baseConfig, volatile bool* keepGoing) : 
+    _baseConfig(std::move(baseConfig)), _keepGoing(keepGoing) {}
+
+LoadGenerator::~LoadGenerator() {
+    for (int i = 0; i < static_cast<int>(_fleet.size()); i++) stopDevice(i);
+}
+
+bool LoadGenerator::begin() {
+    if (!_config.begin(_baseConfig, "load")) return false;
+    _config.setIfExists("loadDevices", &_devices);
+    _config.setIfExists("loadThreads", &_threads);
+    int intervalMillis = static_cast<int>(_interval.count());
+    _config.setIfExists("loadIntervalMillis", &intervalMillis);
+    _interval = std::chrono::milliseconds(intervalMillis > 0 ? intervalMillis : 1);
+    _config.setIfExists("loadDurationSeconds", &_durationSeconds);
+    _config.setIfExists("loadReportSeconds", &_reportSeconds);
+    _config.setIfExists("loadStormSeconds", &_stormSeconds);
+    _config.setIfExists("loadStormPercentage", &_stormPercentage);
+    _metadataMode = parseMetadataMode(_config.getEntry("loadMetadata", "full"));
+    _devicePrefix = _config.getEntry("loadDevicePrefix", _devicePrefix);
+    if (_devices < 1 || _threads < 1) {
+        fprintf(stderr, "loadDevices and loadThreads must be positive\n");
+        return false;
+    }
+    if (_threads > _devices) _threads = _devices;
+    _baseline = resources();
+    _fleet.resize(_devices);
+    return true;
+}
+
+std::string LoadGenerator::deviceName(const std::string& prefix, const int index) {
+    char buffer[16];
+    (void)snprintf(buffer, sizeof(buffer), "%05d", index);
+    return prefix + "-" + buffer;
+}
+
+/// @brief Deterministic, evenly spread choice of the devices that drop out in a reconnect storm
+bool LoadGenerator::inStorm(const int index, const uint64_t epoch, const int percentage) {
+    const uint64_t hash = (static_cast<uint64_t>(index) * 2654435761U + epoch * 40503U) % 100U;
+    return hash < static_cast<uint64_t>(percentage);
+}
+
+MetadataMode LoadGenerator::parseMetadataMode(const std::string& mode) {
+    if (mode == "sync") return MetadataMode::Sync;
+    if (mode == "none") return MetadataMode::None;
+    return MetadataMode::Full;
+}
+
+void LoadGenerator::report(const char* label, const double seconds, const uint64_t measurements, const LatencyHistogram& latency) const {
+    const auto now = resources();
+    int connected = 0;
+    {
+        std::lock_guard<std::mutex> lock(_lifecycleMutex);
+        for (const auto& device : _fleet) {
+            if (device.mqtt && device.mqtt->isConnected()) connected++;
+        }
+    }
+    fprintf(stderr, "%s %.0fs: %d/%d connected, %.1f measurements/s, %llu failed, %llu reconnected\n",
+            label, seconds, connected, _devices, seconds > 0 ? static_cast<double>(measurements) / seconds : 0.0,
+            static_cast<unsigned long long>(_failures.load()), static_cast<unsigned long long>(_reconnects.load()));
+    fprintf(stderr, "  ack latency us (%llu acks): p50 %lld, p90 %lld, p99 %lld, p99.9 %lld, max %lld, mean %.0f\n",
+            static_cast<unsigned long long>(latency.count()),
+            static_cast<long long>(latency.percentile(50)), static_cast<long long>(latency.percentile(90)),
+            static_cast<long long>(latency.percentile(99)), static_cast<long long>(latency.percentile(99.9)),
+            static_cast<long long>(latency.max()), latency.mean());
+    fprintf(stderr, "  per device: %.1f kB resident, %.4f%% CPU; %d threads in total\n",
+            static_cast<double>(now.residentKilobytes - _baseline.residentKilobytes) / _devices,
+            100.0 * (now.cpuSeconds - _baseline.cpuSeconds) / std::max(seconds, 1.0) / _devices,
+            now.threads);
+}
+
+LoadGenerator::Resources LoadGenerator::resources() {
+    Resources result;
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        fields >> key;
+        if (key == "VmRSS:") fields >> result.residentKilobytes;
+        else if (key == "Threads:") fields >> result.threads;
+    }
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        result.cpuSeconds = static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+                            static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+    return result;
+}
+
+void LoadGenerator::run() {
+    const auto start = Clock::now();
+    _running = true;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < _threads; i++) {
+        workers.emplace_back(&LoadGenerator::worker, this, _devices * i / _threads, _devices * (i + 1) / _threads);
+    }
+    auto nextReport = start + std::chrono::seconds(_reportSeconds);
+    auto nextStorm = start + std::chrono::seconds(_stormSeconds);
+    const auto end = start + std::chrono::seconds(_durationSeconds);
+    uint64_t reportedMeasurements = 0;
+    auto lastReport = start;
+    while (*_keepGoing && Clock::now() < end) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        const auto now = Clock::now();
+        if (_stormSeconds > 0 && now >= nextStorm) {
+            _stormEpoch++;
+            nextStorm += std::chrono::seconds(_stormSeconds);
+        }
+        if (_reportSeconds > 0 && now >= nextReport) {
+            const auto measurements = _measurements.load();
+            report("interval", std::chrono::duration<double>(now - lastReport).count(), measurements - reportedMeasurements, _intervalLatency);
+            _intervalLatency.reset();
+            reportedMeasurements = measurements;
+            lastReport = now;
+            nextReport += std::chrono::seconds(_reportSeconds);
+        }
+    }
+    _running = false;
+    for (auto& worker : workers) worker.join();
+    report("total", std::chrono::duration<double>(Clock::now() - start).count(), _measurements.load(), _totalLatency);
+}
+
+void LoadGenerator::startDevice(const int index) {
+    auto& device = _fleet[index];
+    std::string deviceConfig = _baseConfig;
+    // Config::begin reads the file if it exists, else treats the string as content. Later entries win.
+    if (std::ifstream file(_baseConfig); file.is_open()) {
+        std::ostringstream content;
+        content << file.rdbuf();
+        deviceConfig = content.str();
+    }
+    deviceConfig += "\ndevice=" + deviceName(_devicePrefix, index) + "\n";
+    if (_metadataMode == MetadataMode::Sync) deviceConfig += "metadataSync=1\n";
+    {
+        // mosquitto_lib_init and _cleanup (called by Mqtt) are not thread safe
+        std::lock_guard<std::mutex> lock(_lifecycleMutex);
+        device.config = std::make_unique<Config>();
+        device.config->begin(deviceConfig);
+        device.mqtt = std::make_unique<queuing::Mqtt>(device.config.get(), _keepGoing);
+        device.homie = std::make_unique<Homie>(device.mqtt.get(), device.config.get());
+    }
+    device.mqtt->setLatencyObserver([this](const int64_t latencyMicros) {
+        _intervalLatency.record(latencyMicros);
+        _totalLatency.record(latencyMicros);
+    });
+    // the CONNACK has to be in before publishing, or the first publish starts a second connect
+    if (!device.homie->begin() || !device.mqtt->waitForConnection()) return;
+    if (_metadataMode != MetadataMode::None) device.homie->sendMetadata();
+}
+
+void LoadGenerator::stopDevice(const int index) {
+    auto& device = _fleet[index];
+    std::lock_guard<std::mutex> lock(_lifecycleMutex);
+    device.homie.reset();
+    device.mqtt.reset();
+    device.config.reset();
+}
+
+/// @brief A slow sine wave per device, so the values look alive without costing anything
+Measurement LoadGenerator::syntheticMeasurement(const int index, const int64_t sequence, const int64_t timestamp) {
+    const double phase = static_cast<double>(sequence) / 60.0 + index;
+    Measurement measurement;
+    measurement.temperature = static_cast<float>(20.0 + 3.0 * std::sin(phase));
+    measurement.humidity = static_cast<float>(50.0 + 10.0 * std::cos(phase));
+    measurement.sampleCount = 5;
+    measurement.timestamp = timestamp;
+    return measurement;
+}
+
+/// @brief Drive devices [first, last): connect them, publish at the configured cadence (spread over the interval), 
+/// and drop and reconnect the chosen ones when a storm starts.
+void LoadGenerator::worker(const int first, const int last) {
+    for (int i = first; i < last && _running; i++) startDevice(i);
+    const auto start = Clock::now();
+    for (int i = first; i < last; i++) {
+        _fleet[i].nextDue = start + _interval * i / _devices;
+    }
+    uint64_t epoch = _stormEpoch;
+    while (_running && *_keepGoing) {
+        if (const uint64_t currentEpoch = _stormEpoch; currentEpoch != epoch) {
+            epoch = currentEpoch;
+            // drop them all first, then reconnect them all: that's what makes it a storm
+            std::vector<int> victims;
+            for (int i = first; i < last; i++) {
+                if (inStorm(i, epoch, _stormPercentage)) victims.push_back(i);
+            }
+            for (const int i : victims) stopDevice(i);
+            for (const int i : victims) {
+                startDevice(i);
+                _reconnects++;
+            }
+        }
+        auto now = Clock::now();
+        auto wakeUp = now + std::chrono::milliseconds(50);
+        for (int i = first; i < last; i++) {
+            auto& device = _fleet[i];
+            if (now >= device.nextDue) {
+                const auto timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+                if (device.homie->sendMeasurement(syntheticMeasurement(i, device.sequence++, timestamp))) {
+                    _measurements++;
+                } else {
+                    _failures++;
+                }
+                device.nextDue += _interval;
+                // don't try to catch up if we fell behind; that would only hide the problem
+                now = Clock::now();
+                if (device.nextDue < now) device.nextDue = now + _interval;
+            }
+            if (device.nextDue < wakeUp) wakeUp = device.nextDue;
+        }
+        std::this_thread::sleep_until(wakeUp);
+    }
+}
@@ -0,0 +1,97 @@
+// Copyright 2023 Rik Essenius
+// 
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+// 
+//       http://www.apache.org/licenses/LICENSE-2.0
+// 
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+#ifndef LOAD_GENERATOR_H
+#define LOAD_GENERATOR_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Config.h"
+#include "Homie.h"
+#include "LatencyHistogram.h"
+#include "Measurement.h"
+#include "Mqtt.h"
+
+/// @brief What a virtual device does with its metadata after connecting
+enum class MetadataMode { Full, Sync, None };
+
+/// @brief Simulates a fleet of devices, each with its own Mqtt connection and Homie sender, against one broker.
+/// Reports publish throughput, acknowledgement latency percentiles (QoS 1/2 only) and the resources used per device.
+class LoadGenerator {
+public:
+    LoadGenerator(std::string baseConfig, volatile bool* keepGoing);
+    ~LoadGenerator();
+    LoadGenerator(const LoadGenerator&) = delete;
+    LoadGenerator(LoadGenerator&&) = delete;
+    LoadGenerator& operator=(const LoadGenerator&) = delete;
+    LoadGenerator& operator=(LoadGenerator&&) = delete;
+    bool begin();
+    void run();
+
+    static std::string deviceName(const std::string& prefix, int index);
+    static MetadataMode parseMetadataMode(const std::string& mode);
+    static bool inStorm(int index, uint64_t epoch, int percentage);
+    static Measurement syntheticMeasurement(int index, int64_t sequence, int64_t timestamp);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct VirtualDevice {
+        // declaration order matters: Homie uses Mqtt, and both use the Config
+        std::unique_ptr<Config> config;
+        std::unique_ptr<queuing::Mqtt> mqtt;
+        std::unique_ptr<Homie> homie;
+        Clock::time_point nextDue;
+        int64_t sequence = 0;
+    };
+
+    struct Resources {
+        long residentKilobytes = 0;
+        double cpuSeconds = 0;
+        int threads = 0;
+    };
+
+    std::string _baseConfig;
+    volatile bool* _keepGoing;
+    Config _config;
+    int _devices = 100;
+    int _threads = 4;
+    std::chrono::milliseconds _interval{10000};
+    int _durationSeconds = 60;
+    int _reportSeconds = 10;
+    int _stormSeconds = 0;
+    int _stormPercentage = 10;
+    MetadataMode _metadataMode = MetadataMode::Full;
+    std::string _devicePrefix = "load";
+
+    std::vector<VirtualDevice> _fleet;
+    mutable std::mutex _lifecycleMutex;
+    std::atomic<bool> _running{false};
+    std::atomic<uint64_t> _stormEpoch{0};
+    std::atomic<uint64_t> _measurements{0};
+    std::atomic<uint64_t> _failures{0};
+    std::atomic<uint64_t> _reconnects{0};
+    LatencyHistogram _intervalLatency;
+    LatencyHistogram _totalLatency;
+    Resources _baseline;
+
+    void report(const char* label, double seconds, uint64_t measurements, const LatencyHistogram& latency) const;
+    static Resources resources();
+    void startDevice(int index);
+    void stopDevice(int index);
+    void worker(int first, int last);
+};
+
+#endif
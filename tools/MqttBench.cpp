@@ -0,0 +1,110 @@
+// Copyright 2023 Rik Essenius
+//
+//   Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//   except in compliance with the License. You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software distributed under the License
+//   is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and limitations under the License.
+
+// MQTT benchmark: publishes through Mqtt to the in-process broker stub, so the numbers don't depend on
+// a network or an external broker. Reports publish throughput and acknowledgement latency.
+// Usage: DhtMqttBench [-n messages] [-q qos] [-s payload bytes] [-a ack delay us] [-v]
+// Reports go to stderr. Mqtt's own logging goes to stdout, which is discarded unless -v is given.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include "BrokerStub.h"
+#include "Config.h"
+#include "Mqtt.h"
+
+namespace {
+    void usage(const char* program) {
+        fprintf(stderr, "Usage: %s [-n messages] [-q qos] [-s payload bytes] [-a ack delay us] [-v]\n", program);
+    }
+}
+
+volatile bool keepGoing = true;
+
+int main(const int argc, const char* argv[]) {
+    long messages = 10000;
+    int qos = 1;
+    long payloadBytes = 16;
+    long ackDelayMicros = 0;
+    bool verbose = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+        } else if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+            messages = atol(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-q") == 0) {
+            qos = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-s") == 0) {
+            payloadBytes = atol(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-a") == 0) {
+            ackDelayMicros = atol(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (messages < 1 || qos < 0 || qos > 2 || payloadBytes < 0 || ackDelayMicros < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!verbose && freopen("/dev/null", "w", stdout) == nullptr) {
+        fprintf(stderr, "Could not discard stdout\n");
+    }
+
+    BrokerStub broker;
+    // only counting, so memory doesn't grow with the number of messages
+    broker.setRecording(false);
+    broker.setAckDelay(std::chrono::microseconds(ackDelayMicros));
+    if (!broker.begin()) return 2;
+    Config config;
+    config.begin("device=bench\nbroker=127.0.0.1\nport=" + std::to_string(broker.port()) +
+                 "\nqosMeasurement=" + std::to_string(qos) + "\nmaxInflight=100\n");
+    queuing::Mqtt mqtt(&config, &keepGoing);
+    if (!mqtt.begin() || !mqtt.waitForConnection()) {
+        fprintf(stderr, "Could not connect to the broker stub\n");
+        return 2;
+    }
+
+    const std::string payload(static_cast<size_t>(payloadBytes), 'x');
+    const auto started = std::chrono::steady_clock::now();
+    long full = 0;
+    for (long i = 0; i < messages; i++) {
+        // a full in-flight window is back pressure: wait for acknowledgements
+        while (!mqtt.publish("bench/climate/temperature", payload)) {
+            full++;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+    const auto published = std::chrono::steady_clock::now();
+    const bool arrived = broker.waitForPublishes(static_cast<uint64_t>(messages), std::chrono::seconds(30));
+    while (qos > 0 && mqtt.publishStatistics().inflight > 0 &&
+           std::chrono::steady_clock::now() - published < std::chrono::seconds(30)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const auto done = std::chrono::steady_clock::now();
+
+    const auto statistics = mqtt.publishStatistics();
+    const auto seconds = std::chrono::duration<double>(done - started).count();
+    fprintf(stderr, "%ld messages of %ld bytes at QoS %d: %.3f s (%.0f messages/s)%s\n", messages, payloadBytes, qos,
+            seconds, seconds > 0 ? static_cast<double>(messages) / seconds : 0.0, arrived ? "" : ", NOT ALL ARRIVED");
+    fprintf(stderr, "Publish calls took %.3f s; in-flight window full %ld times\n",
+            std::chrono::duration<double>(published - started).count(), full);
+    if (qos > 0 && statistics.acknowledged > 0) {
+        fprintf(stderr, "Acknowledged %llu; latency mean %.0f us, max %lld us\n",
+                static_cast<unsigned long long>(statistics.acknowledged),
+                static_cast<double>(statistics.totalLatencyMicros) / static_cast<double>(statistics.acknowledged),
+                static_cast<long long>(statistics.maxLatencyMicros));
+    }
+    return arrived ? 0 : 3;
+}